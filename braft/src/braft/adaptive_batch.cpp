@@ -0,0 +1,69 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/adaptive_batch.h"
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <brpc/reloadable_flags.h>         // BRPC_VALIDATE_GFLAG
+
+namespace braft {
+
+DEFINE_bool(raft_adaptive_batch, false,
+            "Adjust the batches of the apply queue and the disk thread by"
+            " the observed latency toward raft_batch_latency_target_us"
+            " instead of cutting them at the fixed limits");
+BRPC_VALIDATE_GFLAG(raft_adaptive_batch, ::brpc::PassValidate);
+
+DEFINE_int32(raft_batch_latency_target_us, 2000,
+             "Latency of a batch targeted by raft_adaptive_batch");
+BRPC_VALIDATE_GFLAG(raft_batch_latency_target_us, brpc::PositiveInteger);
+
+AdaptiveBatchLimit::AdaptiveBatchLimit(size_t max_count, size_t max_bytes)
+    : _min_count(std::max(max_count / 4, (size_t)1))
+    , _cap_count(std::max(max_count, (size_t)1) * 16)
+    , _min_bytes(std::max(max_bytes / 4, (size_t)1))
+    , _cap_bytes(std::max(max_bytes, (size_t)1) * 16)
+    , _max_count(std::max(max_count, (size_t)1))
+    , _max_bytes(std::max(max_bytes, (size_t)1))
+    , _latency_us(0)
+{}
+
+void AdaptiveBatchLimit::on_batch_done(int64_t latency_us, size_t count,
+                                       size_t bytes) {
+    const int64_t target_us = FLAGS_raft_batch_latency_target_us;
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Smoothed so that a single slow batch doesn't collapse the limits
+    int64_t latency = _latency_us.load(butil::memory_order_relaxed);
+    latency = latency == 0 ? latency_us : (latency * 7 + latency_us) / 8;
+    _latency_us.store(latency, butil::memory_order_relaxed);
+    size_t max_count = _max_count.load(butil::memory_order_relaxed);
+    size_t max_bytes = _max_bytes.load(butil::memory_order_relaxed);
+    if (latency > target_us) {
+        max_count = std::max(max_count * 3 / 4, _min_count);
+        max_bytes = std::max(max_bytes * 3 / 4, _min_bytes);
+    } else if (count >= max_count || bytes >= max_bytes) {
+        // Cut by the limits rather than by the load
+        max_count = std::min(max_count + std::max(max_count / 8, (size_t)1),
+                             _cap_count);
+        max_bytes = std::min(max_bytes + std::max(max_bytes / 8, (size_t)1),
+                             _cap_bytes);
+    } else {
+        return;
+    }
+    _max_count.store(max_count, butil::memory_order_relaxed);
+    _max_bytes.store(max_bytes, butil::memory_order_relaxed);
+}
+
+}  //  namespace braft
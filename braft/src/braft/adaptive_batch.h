@@ -0,0 +1,68 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_ADAPTIVE_BATCH_H
+#define BRAFT_ADAPTIVE_BATCH_H
+
+#include <stddef.h>
+#include <gflags/gflags_declare.h>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+#include "braft/util.h"                          // raft_mutex_t
+
+namespace braft {
+
+DECLARE_bool(raft_adaptive_batch);
+
+// Limits of the batches taken from a queue, adjusted by the latency of the
+// finished batches toward raft_batch_latency_target_us.
+//
+// Batches are never delayed to be filled, so they stay small under light
+// load whatever the limits are. Under heavy load the batches are cut by the
+// limits, which grow while the smoothed latency is below the target, as
+// larger batches are more efficient, and shrink once it's above.
+// The limits stay within [initial / 4, initial * 16].
+class AdaptiveBatchLimit {
+public:
+    AdaptiveBatchLimit(size_t max_count, size_t max_bytes);
+
+    size_t max_count() const {
+        return _max_count.load(butil::memory_order_relaxed);
+    }
+    size_t max_bytes() const {
+        return _max_bytes.load(butil::memory_order_relaxed);
+    }
+    int64_t latency_us() const {
+        return _latency_us.load(butil::memory_order_relaxed);
+    }
+
+    // Called when a batch of |count| items and |bytes| took |latency_us|
+    void on_batch_done(int64_t latency_us, size_t count, size_t bytes);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveBatchLimit);
+
+    raft_mutex_t _mutex;
+    size_t _min_count;
+    size_t _cap_count;
+    size_t _min_bytes;
+    size_t _cap_bytes;
+    butil::atomic<size_t> _max_count;
+    butil::atomic<size_t> _max_bytes;
+    butil::atomic<int64_t> _latency_us;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_ADAPTIVE_BATCH_H
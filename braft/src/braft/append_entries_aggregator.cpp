@@ -0,0 +1,346 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/append_entries_aggregator.h"
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <bvar/bvar.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>                    // bthread_timer_add
+#include <butil/time.h>
+#include <brpc/errno.pb.h>                       // brpc::ENOMETHOD
+#include <brpc/reloadable_flags.h>               // BRPC_VALIDATE_GFLAG
+
+namespace braft {
+
+DEFINE_int32(raft_heartbeat_coalesce_window_ms, 5,
+             "Heartbeats to the same endpoint added within this window are"
+             " sent in one RPC with raft_coalesce_heartbeats");
+BRPC_VALIDATE_GFLAG(raft_heartbeat_coalesce_window_ms, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_append_entries_coalesce_window_us, 500,
+             "AppendEntries requests to the same endpoint added within this"
+             " window are sent in one RPC with raft_batch_append_entries");
+BRPC_VALIDATE_GFLAG(raft_append_entries_coalesce_window_us,
+                    brpc::NonNegativeInteger);
+
+DECLARE_int32(raft_rpc_channel_connect_timeout_ms);
+DECLARE_int32(raft_max_body_size);
+
+// Peers which have been sent nothing for this long are freed
+static const int64_t PEER_IDLE_MS = 60 * 1000;
+static const int64_t SWEEP_INTERVAL_MS = 1000;
+
+static bvar::Adder<int64_t> g_coalesced_heartbeat_rpc(
+        "raft_coalesced_heartbeat_rpc_count");
+static bvar::CounterRecorder g_coalesced_heartbeat_batch(
+        "raft_coalesced_heartbeat_batch_counter");
+static bvar::Adder<int64_t> g_batch_append_entries_rpc(
+        "raft_batch_append_entries_rpc_count");
+static bvar::CounterRecorder g_batch_append_entries_batch(
+        "raft_batch_append_entries_batch_counter");
+
+class AppendEntriesAggregator::BatchDone : public google::protobuf::Closure {
+public:
+    BatchDone(AppendEntriesAggregator* aggregator, Queue* queue)
+        : _aggregator(aggregator), _queue(queue) {}
+
+    void Run();
+
+    google::protobuf::RepeatedPtrField<AppendEntriesRequest>* requests() {
+        return _queue->kind == HEARTBEAT ? heartbeat_request.mutable_requests()
+                                         : entries_request.mutable_requests();
+    }
+
+    brpc::Controller cntl;
+    BatchHeartbeatRequest heartbeat_request;
+    BatchHeartbeatResponse heartbeat_response;
+    BatchAppendEntriesRequest entries_request;
+    BatchAppendEntriesResponse entries_response;
+    std::vector<Item*> items;
+
+private:
+    AppendEntriesAggregator* _aggregator;
+    Queue* _queue;
+};
+
+void AppendEntriesAggregator::BatchDone::Run() {
+    if (cntl.ErrorCode() == brpc::ENOMETHOD) {
+        _aggregator->mark_unsupported(_queue);
+    }
+    const bool heartbeat = _queue->kind == HEARTBEAT;
+    google::protobuf::RepeatedPtrField<AppendEntriesResponse>* responses =
+            heartbeat ? heartbeat_response.mutable_responses()
+                      : entries_response.mutable_responses();
+    const google::protobuf::RepeatedField<int32_t>& error_codes =
+            heartbeat ? heartbeat_response.error_codes()
+                      : entries_response.error_codes();
+    // The canceled requests have been done already
+    std::vector<bool> canceled(items.size(), false);
+    {
+        BAIDU_SCOPED_LOCK(_aggregator->_mutex);
+        for (size_t i = 0; i < items.size(); ++i) {
+            canceled[i] = _aggregator->_items.erase(items[i]->id) == 0;
+        }
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        Item* item = items[i];
+        if (canceled[i]) {
+            delete item;
+            continue;
+        }
+        // Give the request back for the logs of the replicator
+        item->request->Swap(requests()->Mutable(i));
+        if (cntl.Failed()) {
+            item->cntl->SetFailed(cntl.ErrorCode(), "%s", cntl.ErrorText().c_str());
+        } else if ((int)i >= responses->size() || (int)i >= error_codes.size()) {
+            item->cntl->SetFailed(brpc::ERESPONSE, "Missing the response of"
+                                  " request %d in a batch of %d", (int)i,
+                                  (int)items.size());
+        } else if (error_codes.Get(i) != 0) {
+            item->cntl->SetFailed(error_codes.Get(i), "Fail to handle request"
+                                  " in batch_%s", heartbeat ? "heartbeat"
+                                                            : "append_entries");
+        } else {
+            item->response->Swap(responses->Mutable(i));
+        }
+        item->done->Run();
+        delete item;
+    }
+    _aggregator->release_peer(_queue->peer);
+    delete this;
+}
+
+AppendEntriesAggregator* AppendEntriesAggregator::get_instance() {
+    static AppendEntriesAggregator* instance = new AppendEntriesAggregator;
+    return instance;
+}
+
+AppendEntriesAggregator::Peer* AppendEntriesAggregator::get_peer(
+        const butil::EndPoint& addr) {
+    std::map<butil::EndPoint, Peer*>::iterator it = _peers.find(addr);
+    if (it != _peers.end()) {
+        return it->second;
+    }
+    Peer* peer = new Peer;
+    peer->addr = addr;
+    for (int kind = HEARTBEAT; kind <= APPEND_ENTRIES; ++kind) {
+        peer->queues[kind].peer = peer;
+        peer->queues[kind].kind = (Kind)kind;
+    }
+    _peers[addr] = peer;
+    return peer;
+}
+
+void AppendEntriesAggregator::sweep_idle_peers(int64_t now_ms) {
+    _last_sweep_ms = now_ms;
+    std::map<butil::EndPoint, Peer*>::iterator it = _peers.begin();
+    while (it != _peers.end()) {
+        Peer* peer = it->second;
+        // The pending requests hold the peer by the flush scheduled
+        if (peer->nref == 0 && now_ms - peer->last_active_ms >= PEER_IDLE_MS) {
+            _peers.erase(it++);
+            delete peer;
+        } else {
+            ++it;
+        }
+    }
+}
+
+void AppendEntriesAggregator::release_peer(Peer* peer) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    CHECK_GT(peer->nref, 0);
+    --peer->nref;
+}
+
+bool AppendEntriesAggregator::supported(const butil::EndPoint& addr, Kind kind) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<butil::EndPoint, Peer*>::const_iterator it = _peers.find(addr);
+    return it == _peers.end() || it->second->queues[kind].supported;
+}
+
+void AppendEntriesAggregator::mark_unsupported(Queue* queue) {
+    LOG(WARNING) << "Peer " << queue->peer->addr << " doesn't support batch_"
+                 << (queue->kind == HEARTBEAT ? "heartbeat" : "append_entries")
+                 << ", send the requests alone";
+    BAIDU_SCOPED_LOCK(_mutex);
+    queue->supported = false;
+}
+
+uint64_t AppendEntriesAggregator::add(const butil::EndPoint& addr, Kind kind,
+                                      brpc::Controller* cntl,
+                                      AppendEntriesRequest* request,
+                                      AppendEntriesResponse* response,
+                                      google::protobuf::Closure* done) {
+    Item* item = new Item;
+    item->sent = false;
+    item->cntl = cntl;
+    item->request = request;
+    item->response = response;
+    item->done = done;
+    Queue* queue = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const int64_t now_ms = butil::monotonic_time_ms();
+        if (now_ms - _last_sweep_ms >= SWEEP_INTERVAL_MS) {
+            sweep_idle_peers(now_ms);
+        }
+        Peer* peer = get_peer(addr);
+        peer->last_active_ms = now_ms;
+        queue = &peer->queues[kind];
+        item->id = ++_next_id;
+        item->queue = queue;
+        _items[item->id] = item;
+        queue->pending.push_back(item);
+        queue->pending_bytes += cntl->request_attachment().length();
+        if (queue->pending_bytes < FLAGS_raft_max_body_size) {
+            if (queue->flush_scheduled) {
+                return item->id;
+            }
+            queue->flush_scheduled = true;
+            // Released by the flush
+            ++queue->peer->nref;
+            bthread_timer_t timer;
+            const timespec due_time = kind == HEARTBEAT
+                    ? butil::milliseconds_from_now(
+                            FLAGS_raft_heartbeat_coalesce_window_ms)
+                    : butil::microseconds_from_now(
+                            FLAGS_raft_append_entries_coalesce_window_us);
+            if (bthread_timer_add(&timer, due_time, on_flush_timer, queue) == 0) {
+                return item->id;
+            }
+            LOG(ERROR) << "Fail to add timer, flush the requests to " << addr;
+        } else {
+            ++queue->peer->nref;
+        }
+    }
+    const uint64_t id = item->id;
+    // The batch is large enough, the timer scheduled if any finds nothing
+    // or the requests added later
+    on_flush_timer(queue);
+    return id;
+}
+
+void AppendEntriesAggregator::cancel(uint64_t id) {
+    Item* item = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<uint64_t, Item*>::iterator it = _items.find(id);
+        if (it == _items.end()) {
+            return;
+        }
+        item = it->second;
+        _items.erase(it);
+        if (item->sent) {
+            // The batch still refers to the item and deletes it
+            item = new Item(*item);
+        } else {
+            Queue* queue = item->queue;
+            queue->pending.erase(std::find(queue->pending.begin(),
+                                           queue->pending.end(), item));
+            queue->pending_bytes -= item->cntl->request_attachment().length();
+        }
+    }
+    item->cntl->SetFailed(ECANCELED, "Canceled");
+    // Like brpc::StartCancel, the caller may hold the lock the closure takes
+    run_closure_in_bthread(item->done);
+    delete item;
+}
+
+void AppendEntriesAggregator::on_flush_timer(void* arg) {
+    // Don't block the timer thread
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, run_flush, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        run_flush(arg);
+    }
+}
+
+void* AppendEntriesAggregator::run_flush(void* arg) {
+    get_instance()->flush((Queue*)arg);
+    return NULL;
+}
+
+void AppendEntriesAggregator::flush(Queue* queue) {
+    Peer* peer = queue->peer;
+    BatchDone* batch = new BatchDone(this, queue);
+    // Fail all the requests together within the shortest timeout
+    int64_t timeout_ms = -1;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        batch->items.swap(queue->pending);
+        queue->pending_bytes = 0;
+        queue->flush_scheduled = false;
+        if (!peer->channel_inited) {
+            brpc::ChannelOptions options;
+            options.connect_timeout_ms = FLAGS_raft_rpc_channel_connect_timeout_ms;
+            options.timeout_ms = -1;
+            if (peer->channel.Init(peer->addr, &options) != 0) {
+                LOG(ERROR) << "Fail to init channel to " << peer->addr;
+            } else {
+                peer->channel_inited = true;
+            }
+        }
+        if (batch->items.empty()) {
+            --peer->nref;
+        }
+        // Under the lock, as the items can be canceled once they are sent
+        for (size_t i = 0; i < batch->items.size(); ++i) {
+            Item* item = batch->items[i];
+            item->sent = true;
+            const int64_t t = item->cntl->timeout_ms();
+            if (t > 0 && (timeout_ms < 0 || t < timeout_ms)) {
+                timeout_ms = t;
+            }
+            batch->requests()->Add()->Swap(item->request);
+            if (queue->kind == APPEND_ENTRIES) {
+                // Shares the blocks, the controller keeps its attachment for
+                // the metrics of the replicator
+                const butil::IOBuf& attachment = item->cntl->request_attachment();
+                batch->entries_request.add_attachment_sizes(attachment.length());
+                batch->cntl.request_attachment().append(attachment);
+            }
+        }
+    }
+    if (batch->items.empty()) {
+        // The peer may be freed from now on
+        delete batch;
+        return;
+    }
+    // The reference goes with the batch
+    batch->cntl.set_timeout_ms(timeout_ms);
+    if (queue->kind == HEARTBEAT) {
+        g_coalesced_heartbeat_rpc << 1;
+        g_coalesced_heartbeat_batch << batch->items.size();
+    } else {
+        g_batch_append_entries_rpc << 1;
+        g_batch_append_entries_batch << batch->items.size();
+    }
+    if (!peer->channel_inited) {
+        batch->cntl.SetFailed(EINVAL, "Fail to init channel to %s",
+                              butil::endpoint2str(peer->addr).c_str());
+        return batch->Run();
+    }
+    RaftService_Stub stub(&peer->channel);
+    if (queue->kind == HEARTBEAT) {
+        stub.batch_heartbeat(&batch->cntl, &batch->heartbeat_request,
+                             &batch->heartbeat_response, batch);
+    } else {
+        stub.batch_append_entries(&batch->cntl, &batch->entries_request,
+                                  &batch->entries_response, batch);
+    }
+}
+
+}  //  namespace braft
@@ -0,0 +1,133 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_APPEND_ENTRIES_AGGREGATOR_H
+#define BRAFT_APPEND_ENTRIES_AGGREGATOR_H
+
+#include <map>
+#include <vector>
+#include <butil/endpoint.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include "braft/raft.pb.h"
+#include "braft/util.h"                          // raft_mutex_t
+
+namespace braft {
+
+// Coalesces the AppendEntries RPCs of all the raft groups of the process sent
+// to the same endpoint.
+//
+// Heartbeats added within raft_heartbeat_coalesce_window_ms are sent together
+// in one batch_heartbeat RPC, and requests carrying entries added within
+// raft_append_entries_coalesce_window_us in one batch_append_entries RPC,
+// with the attachments of the requests concatenated. Once the RPC returns,
+// each request gets its own response or error in its controller, and its
+// closure runs as if it was sent alone, so the replicators handle the terms,
+// leases and acknowledged indexes of their groups as usual. A request can be
+// canceled by the id returned by add(), which fails it with ECANCELED at once
+// whether its batch is sent or not. The state kept for an endpoint is freed
+// once nothing has been sent to it for a while.
+class AppendEntriesAggregator {
+public:
+    enum Kind {
+        HEARTBEAT = 0,
+        APPEND_ENTRIES = 1,
+    };
+
+    static AppendEntriesAggregator* get_instance();
+
+    // Whether the peer at |addr| might accept the batch RPC of |kind|. Peers
+    // which don't know it are remembered and the requests are sent alone,
+    // until the peer is freed as idle and tried again.
+    bool supported(const butil::EndPoint& addr, Kind kind);
+
+    // Send |request| to |addr| with the other requests of |kind|, the
+    // request attachment of |cntl| goes along. |done| runs in another
+    // bthread once |response| is filled or |cntl| is failed, and the
+    // ownership of the arguments goes with it.
+    // Returns the id of the request, which is never 0
+    uint64_t add(const butil::EndPoint& addr, Kind kind, brpc::Controller* cntl,
+                 AppendEntriesRequest* request, AppendEntriesResponse* response,
+                 google::protobuf::Closure* done);
+
+    // Fail the request of |id| with ECANCELED, nothing happens if its closure
+    // has run or is running
+    void cancel(uint64_t id);
+
+private:
+    struct Queue;
+
+    struct Item {
+        uint64_t id;
+        Queue* queue;
+        // Taken into a batch RPC
+        bool sent;
+        brpc::Controller* cntl;
+        AppendEntriesRequest* request;
+        AppendEntriesResponse* response;
+        google::protobuf::Closure* done;
+    };
+
+    struct Peer;
+
+    // The requests of one kind waiting to be sent to a peer
+    struct Queue {
+        Queue() : peer(NULL), kind(HEARTBEAT), pending_bytes(0)
+                , flush_scheduled(false), supported(true) {}
+        Peer* peer;
+        Kind kind;
+        std::vector<Item*> pending;
+        int64_t pending_bytes;
+        bool flush_scheduled;
+        bool supported;
+    };
+
+    // The requests to the same endpoint
+    struct Peer {
+        Peer() : nref(0), last_active_ms(0), channel_inited(false) {}
+        butil::EndPoint addr;
+        Queue queues[2];
+        // Held by the flushes scheduled and the batches in flight, the peer
+        // isn't freed until it's 0
+        int nref;
+        int64_t last_active_ms;
+        bool channel_inited;
+        brpc::Channel channel;
+    };
+
+    class BatchDone;
+
+    AppendEntriesAggregator() : _next_id(0), _last_sweep_ms(0) {}
+    DISALLOW_COPY_AND_ASSIGN(AppendEntriesAggregator);
+
+    Peer* get_peer(const butil::EndPoint& addr);
+    // Free the peers idle for a while, with _mutex held
+    void sweep_idle_peers(int64_t now_ms);
+    void release_peer(Peer* peer);
+    void flush(Queue* queue);
+    void mark_unsupported(Queue* queue);
+    static void on_flush_timer(void* arg);
+    static void* run_flush(void* arg);
+
+    raft_mutex_t _mutex;
+    std::map<butil::EndPoint, Peer*> _peers;
+    // The requests whose closure hasn't run yet
+    std::map<uint64_t, Item*> _items;
+    uint64_t _next_id;
+    int64_t _last_sweep_ms;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_APPEND_ENTRIES_AGGREGATOR_H
@@ -0,0 +1,301 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/entry_codec.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <butil/logging.h>
+#include <butil/iobuf.h>
+#include <bvar/bvar.h>
+#include "braft/util.h"                          // crc32
+
+namespace braft {
+
+static bvar::Adder<int64_t> g_entry_checksum_mismatch(
+        "raft_entry_checksum_mismatch_count");
+
+static void append_varint(uint64_t value, std::string* out) {
+    while (value >= 0x80) {
+        out->push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out->push_back((char)value);
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+void CompactEntriesEncoder::add(int64_t term, int type, int64_t data_len,
+                                bool has_data_checksum, uint32_t data_checksum) {
+    append_varint(zigzag_encode(term - _last_term), &_headers);
+    append_varint(((uint64_t)type << 1) | (has_data_checksum ? 1 : 0), &_headers);
+    append_varint(data_len, &_headers);
+    if (has_data_checksum) {
+        _checksums.push_back(data_checksum);
+    }
+    _last_term = term;
+    ++_count;
+}
+
+void CompactEntriesEncoder::finish(AppendEntriesRequest* request,
+                                   butil::IOBuf* attachment) {
+    butil::IOBuf buf;
+    buf.append(_headers);
+    buf.append(*attachment);
+    attachment->swap(buf);
+    request->set_compact_entries_count(_count);
+    for (size_t i = 0; i < _checksums.size(); ++i) {
+        request->add_compact_data_checksums(_checksums[i]);
+    }
+}
+
+// Read the headers of the entries in the compact format at the front of
+// |attachment|, 3 values per entry. Returns the size of the headers, -1 if
+// they are malformed or don't match the checksums of |request|
+static ssize_t read_compact_headers(const AppendEntriesRequest& request,
+                                    const butil::IOBuf& attachment,
+                                    std::vector<uint64_t>* headers) {
+    if (request.compact_entries_count() < 0) {
+        LOG(WARNING) << "Invalid compact_entries_count="
+                     << request.compact_entries_count();
+        return -1;
+    }
+    // Each value takes at least one byte
+    if ((int64_t)request.compact_entries_count() * 3 > (int64_t)attachment.size()) {
+        LOG(WARNING) << "Too short attachment=" << attachment.size()
+                     << " for compact_entries_count="
+                     << request.compact_entries_count();
+        return -1;
+    }
+    headers->reserve(request.compact_entries_count() * 3);
+    butil::IOBufAsZeroCopyInputStream wrapper(attachment);
+    google::protobuf::io::CodedInputStream in(&wrapper);
+    int nchecksums = 0;
+    for (int i = 0; i < request.compact_entries_count() * 3; ++i) {
+        google::protobuf::uint64 value = 0;
+        if (!in.ReadVarint64(&value)) {
+            LOG(WARNING) << "Fail to read the header of entry " << i / 3;
+            return -1;
+        }
+        if (i % 3 == 1 && (value & 1)) {
+            ++nchecksums;
+        }
+        headers->push_back(value);
+    }
+    if (nchecksums != request.compact_data_checksums_size()) {
+        LOG(WARNING) << "Mismatched compact_data_checksums_size="
+                     << request.compact_data_checksums_size()
+                     << " expected=" << nchecksums;
+        return -1;
+    }
+    return in.CurrentPosition();
+}
+
+int parse_compact_entries(const AppendEntriesRequest& request,
+                          butil::IOBuf* attachment,
+                          std::vector<LogEntry*>* entries) {
+    const size_t first = entries->size();
+    std::vector<uint64_t> headers;
+    const ssize_t headers_size =
+            read_compact_headers(request, *attachment, &headers);
+    if (headers_size < 0) {
+        return -1;
+    }
+    attachment->pop_front(headers_size);
+    int64_t term = request.prev_log_term();
+    int64_t index = request.prev_log_index();
+    int nconf = 0;
+    int nchecksums = 0;
+    bool ok = true;
+    for (size_t i = 0; i < headers.size(); i += 3) {
+        term += zigzag_decode(headers[i]);
+        const int type = (int)(headers[i + 1] >> 1);
+        const bool has_checksum = headers[i + 1] & 1;
+        const uint64_t data_len = headers[i + 2];
+        ++index;
+        if (data_len > attachment->length()) {
+            LOG(WARNING) << "Data of entry " << index << " is truncated";
+            ok = false;
+            break;
+        }
+        const uint32_t checksum = has_checksum
+                ? request.compact_data_checksums(nchecksums++) : 0;
+        if (type == ENTRY_TYPE_UNKNOWN) {
+            attachment->pop_front(data_len);
+            continue;
+        }
+        LogEntry* entry = new LogEntry();
+        entry->AddRef();
+        entry->id.term = term;
+        entry->id.index = index;
+        entry->type = (EntryType)type;
+        if (has_checksum) {
+            entry->data_checksum = checksum;
+            entry->has_data_checksum = true;
+        }
+        if (type == ENTRY_TYPE_CONFIGURATION) {
+            if (nconf >= request.compact_configurations_size()) {
+                LOG(WARNING) << "Missing the meta of configuration " << index;
+                entry->Release();
+                ok = false;
+                break;
+            }
+            const EntryMeta& meta = request.compact_configurations(nconf++);
+            entry->peers = new std::vector<PeerId>;
+            for (int j = 0; j < meta.peers_size(); ++j) {
+                entry->peers->push_back(meta.peers(j));
+            }
+            if (meta.old_peers_size() > 0) {
+                entry->old_peers = new std::vector<PeerId>;
+                for (int j = 0; j < meta.old_peers_size(); ++j) {
+                    entry->old_peers->push_back(meta.old_peers(j));
+                }
+            }
+        }
+        attachment->cutn(&entry->data, data_len);
+        entries->push_back(entry);
+    }
+    if (ok) {
+        return 0;
+    }
+    for (size_t i = first; i < entries->size(); ++i) {
+        (*entries)[i]->Release();
+    }
+    entries->resize(first);
+    return -1;
+}
+
+static bool verify_data_checksum(int64_t index, const butil::IOBuf& data,
+                                 uint32_t expected) {
+    const uint32_t actual = crc32(data);
+    if (actual != expected) {
+        LOG(ERROR) << "Found corrupted data of entry " << index
+                   << " data_len=" << data.length() << " checksum=" << actual
+                   << " expected=" << expected;
+        g_entry_checksum_mismatch << 1;
+        return false;
+    }
+    return true;
+}
+
+int verify_entries_checksum(const AppendEntriesRequest& request,
+                            const butil::IOBuf& attachment) {
+    // Only the references of the blocks are copied
+    butil::IOBuf buf(attachment);
+    butil::IOBuf data;
+    int64_t index = request.prev_log_index();
+    if (!request.has_compact_entries_count()) {
+        for (int i = 0; i < request.entries_size(); ++i) {
+            const EntryMeta& meta = request.entries(i);
+            ++index;
+            if (!meta.has_data_len()) {
+                continue;
+            }
+            data.clear();
+            if (buf.cutn(&data, meta.data_len()) != (size_t)meta.data_len()) {
+                LOG(WARNING) << "Data of entry " << index << " is truncated";
+                return -1;
+            }
+            if (meta.has_data_checksum()
+                    && !verify_data_checksum(index, data, meta.data_checksum())) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (request.compact_data_checksums_size() == 0) {
+        return 0;
+    }
+    std::vector<uint64_t> headers;
+    const ssize_t headers_size = read_compact_headers(request, buf, &headers);
+    if (headers_size < 0) {
+        return -1;
+    }
+    buf.pop_front(headers_size);
+    int nchecksums = 0;
+    for (size_t i = 0; i < headers.size(); i += 3) {
+        ++index;
+        const uint64_t data_len = headers[i + 2];
+        data.clear();
+        if (buf.cutn(&data, data_len) != data_len) {
+            LOG(WARNING) << "Data of entry " << index << " is truncated";
+            return -1;
+        }
+        if ((headers[i + 1] & 1)
+                && !verify_data_checksum(index, data,
+                        request.compact_data_checksums(nchecksums++))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int strip_entries_data(const AppendEntriesRequest& request,
+                       butil::IOBuf* attachment) {
+    if (!request.has_compact_entries_count()) {
+        attachment->clear();
+        return 0;
+    }
+    std::vector<uint64_t> headers;
+    const ssize_t headers_size =
+            read_compact_headers(request, *attachment, &headers);
+    if (headers_size < 0) {
+        return -1;
+    }
+    attachment->pop_back(attachment->length() - headers_size);
+    return 0;
+}
+
+scoped_refptr<EncodedEntries> EncodedEntriesCache::get(int64_t term,
+                                                       int64_t first_index,
+                                                       bool compact) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Newer ones are at the back
+    for (size_t i = _entries.size(); i > 0; --i) {
+        const EncodedEntries* e = _entries[i - 1].get();
+        if (e->term == term && e->first_index == first_index
+                && e->compact == compact) {
+            return _entries[i - 1];
+        }
+    }
+    return NULL;
+}
+
+void EncodedEntriesCache::put(EncodedEntries* entries, size_t max_num) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const EncodedEntries* e = _entries[i].get();
+        if (e->term == entries->term && e->first_index == entries->first_index
+                && e->compact == entries->compact) {
+            _entries.erase(_entries.begin() + i);
+            break;
+        }
+    }
+    _entries.push_back(entries);
+    while (_entries.size() > max_num) {
+        _entries.pop_front();
+    }
+}
+
+void EncodedEntriesCache::clear() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _entries.clear();
+}
+
+}  //  namespace braft
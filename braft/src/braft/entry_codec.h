@@ -0,0 +1,138 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_ENTRY_CODEC_H
+#define BRAFT_ENTRY_CODEC_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <butil/iobuf.h>
+#include <butil/memory/ref_counted.h>
+#include "braft/raft.pb.h"
+#include "braft/log_entry.h"                     // LogEntry
+#include "braft/util.h"                          // raft_mutex_t
+
+namespace braft {
+
+// Compact format of the entries of AppendEntriesRequest.
+//
+// Instead of one EntryMeta per entry, the headers of the entries are packed
+// at the front of the attachment, followed by the data of the entries:
+//
+//   | header_1 | ... | header_n | data_1 | ... | data_n |
+//   header: varint(zigzag(term - term of the previous entry))
+//           varint(type << 1 | has_data_checksum) varint(data_len)
+//
+// where n is request.compact_entries_count() and the term of the entry
+// before the first one is request.prev_log_term(). The EntryMeta of the
+// configuration entries are in request.compact_configurations(), in order.
+// The data checksums of the entries which have one are in
+// request.compact_data_checksums(), in order.
+// Followers declare support of the format with
+// AppendEntriesResponse.compact_entries, the leader falls back to EntryMeta
+// for the others.
+
+// Number of the entries carried by |request| in either format
+inline int append_entries_count(const AppendEntriesRequest& request) {
+    return request.has_compact_entries_count()
+            ? request.compact_entries_count() : request.entries_size();
+}
+
+class CompactEntriesEncoder {
+public:
+    explicit CompactEntriesEncoder(int64_t prev_log_term)
+        : _last_term(prev_log_term), _count(0) {}
+
+    // Add the header of an entry, configurations should add their
+    // EntryMeta to compact_configurations of the request as well
+    void add(int64_t term, int type, int64_t data_len,
+             bool has_data_checksum, uint32_t data_checksum);
+
+    int count() const { return _count; }
+
+    // Put the headers in front of |attachment| which holds the data of the
+    // added entries, and set the count in |request|
+    void finish(AppendEntriesRequest* request, butil::IOBuf* attachment);
+
+private:
+    int64_t _last_term;
+    int _count;
+    std::string _headers;
+    // Checksums of the added entries which have one
+    std::vector<uint32_t> _checksums;
+};
+
+// Parse the entries of |request| in the compact format out of |attachment|,
+// the entries are appended to |entries| with a reference for the caller.
+// Returns 0 on success, -1 if the request is malformed
+int parse_compact_entries(const AppendEntriesRequest& request,
+                          butil::IOBuf* attachment,
+                          std::vector<LogEntry*>* entries);
+
+// Verify the data checksums carried by |request| in either format against
+// |attachment|, without modifying it. Entries without a checksum pass.
+// Returns 0 if all of them match, -1 otherwise
+int verify_entries_checksum(const AppendEntriesRequest& request,
+                            const butil::IOBuf& attachment);
+
+// Drop the data of the entries from |attachment|, keeping the headers of the
+// compact format, so that the follower fetches the data from a relay.
+// Returns 0 on success, -1 if the request is malformed
+int strip_entries_data(const AppendEntriesRequest& request,
+                       butil::IOBuf* attachment);
+
+// Entries of an AppendEntriesRequest encoded by a replicator of the leader,
+// which are reused by the other replicators sending the same range
+struct EncodedEntries : public butil::RefCountedThreadSafe<EncodedEntries> {
+    EncodedEntries()
+        : term(0), first_index(0), count(0), compact(false), full(false) {}
+    // Term of the leader
+    int64_t term;
+    int64_t first_index;
+    int count;
+    bool compact;
+    // Stopped by the limits of the request rather than the end of the log
+    bool full;
+    // Only the fields of the entries are set
+    AppendEntriesRequest request;
+    butil::IOBuf attachment;
+};
+
+// The most recently encoded entries of a leader, shared by its replicators
+class EncodedEntriesCache {
+public:
+    EncodedEntriesCache() {}
+
+    // Returns the entries encoded in |term| from |first_index| in the given
+    // format, NULL if missing
+    scoped_refptr<EncodedEntries> get(int64_t term, int64_t first_index,
+                                      bool compact);
+
+    // Add |entries|, replacing the ones with the same key. The oldest are
+    // dropped to keep at most |max_num|
+    void put(EncodedEntries* entries, size_t max_num);
+
+    void clear();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EncodedEntriesCache);
+
+    raft_mutex_t _mutex;
+    std::deque<scoped_refptr<EncodedEntries> > _entries;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_ENTRY_CODEC_H
@@ -18,26 +18,37 @@
 
 #include "braft/log.h"
 
+#include <sys/mman.h>                                // mmap
+#include <sched.h>                                   // sched_yield
+#include <limits>
+#include <fcntl.h>                                   // fallocate
 #include <gflags/gflags.h>
 #include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
 #include <butil/file_util.h>                         // butil::CreateDirectory
 #include <butil/string_printf.h>                     // butil::string_appendf
+#include <butil/string_splitter.h>                   // butil::StringSplitter
 #include <butil/time.h>
 #include <butil/raw_pack.h>                          // butil::RawPacker
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
 #include <brpc/reloadable_flags.h>             // 
+#include <brpc/options.pb.h>                   // brpc::CompressType
+#include <brpc/policy/gzip_compress.h>         // brpc::policy::GzipCompress
+#include <brpc/policy/snappy_compress.h>       // brpc::policy::SnappyCompress
 
 #include "braft/local_storage.pb.h"
 #include "braft/log_entry.h"
 #include "braft/protobuf_file.h"
 #include "braft/util.h"
 #include "braft/fsync.h"
+#include "braft/uring_writer.h"
 
 //#define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020ld"
 //#define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020ld_%020ld"
 #define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020" PRId64
 #define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020" PRId64 "_%020" PRId64
 #define BRAFT_SEGMENT_META_FILE  "log_meta"
+#define BRAFT_SEGMENT_RECYCLED_PATTERN "log_recycled_%020" PRId64
+#define BRAFT_SEGMENT_INDEX_PATTERN "index_%020" PRId64 "_%020" PRId64
 
 namespace braft {
 
@@ -55,7 +66,55 @@ BRPC_VALIDATE_GFLAG(raft_sync_segments, ::brpc::PassValidate);
 DEFINE_bool(raft_recover_log_from_corrupt, false, "recover log by truncating corrupted log");
 BRPC_VALIDATE_GFLAG(raft_recover_log_from_corrupt, ::brpc::PassValidate);
 
+DEFINE_bool(raft_log_io_uring, false,
+            "append log entries through io_uring, the disk thread moves on to "
+            "the next batch without waiting for the writes and syncs");
+
+DEFINE_bool(raft_mmap_closed_segments, false,
+            "read closed segments through mmap, entries reference the mapped "
+            "pages without copying");
+BRPC_VALIDATE_GFLAG(raft_mmap_closed_segments, ::brpc::PassValidate);
+
+DEFINE_bool(raft_verify_mmap_read_checksum, true,
+            "verify data checksum of entries read from mapped segments");
+BRPC_VALIDATE_GFLAG(raft_verify_mmap_read_checksum, ::brpc::PassValidate);
+
+DEFINE_bool(raft_preallocate_segments, false,
+            "preallocate open segments to raft_max_segment_size and reuse the "
+            "files of retired segments, so that syncs rarely update file "
+            "metadata");
+BRPC_VALIDATE_GFLAG(raft_preallocate_segments, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_recycled_segments, 4,
+             "max number of retired segment files kept for reuse by each log "
+             "storage when raft_preallocate_segments is set");
+BRPC_VALIDATE_GFLAG(raft_max_recycled_segments, ::brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_segment_index, true,
+            "write an offset index file when a segment is closed, and load "
+            "closed segments from it instead of scanning the entries");
+BRPC_VALIDATE_GFLAG(raft_segment_index, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_segment_loaders, 8,
+             "max number of bthreads loading the closed segments of one log "
+             "storage concurrently in init");
+BRPC_VALIDATE_GFLAG(raft_max_segment_loaders, brpc::PositiveInteger);
+
+DEFINE_int32(raft_log_compress_min_bytes, 256,
+             "data of entries smaller than this is not compressed even if "
+             "the log storage has a codec");
+BRPC_VALIDATE_GFLAG(raft_log_compress_min_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_log_readahead_bytes, 1024 * 1024,
+             "bytes after a range read of a segment hinted to the kernel to "
+             "read ahead, 0 disables readahead");
+BRPC_VALIDATE_GFLAG(raft_log_readahead_bytes, brpc::NonNegativeInteger);
+
+// Alignment of the offset, length and memory of O_DIRECT writes
+const static size_t DIRECT_IO_BLOCK_SIZE = 4096;
+
 static bvar::LatencyRecorder g_open_segment_latency("raft_open_segment");
+static bvar::LatencyRecorder g_load_segment_latency("raft_load_segment");
 static bvar::LatencyRecorder g_segment_append_entry_latency("raft_segment_append_entry");
 static bvar::LatencyRecorder g_sync_segment_latency("raft_sync_segment");
 
@@ -67,9 +126,433 @@ int ftruncate_uninterrupted(int fd, off_t length) {
     return rc;
 }
 
+// Private read-only view of a closed segment. IOBufs returned by mmap reads
+// reference the mapped pages directly: the whole mapping is one user-data
+// block of IOBuf shared by all of them, so the pages stay valid after the
+// Segment is gone and are unmapped with the last reference to the block.
+class SegmentMapping {
+public:
+    static SegmentMapping* create(int fd, size_t size, const std::string& path) {
+        // The block deleter only gets the address of the data, the size to
+        // unmap is kept in a header page right before it
+        const size_t page_size = getpagesize();
+        char* head = (char*)::mmap(NULL, page_size + size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (head == MAP_FAILED) {
+            PLOG(WARNING) << "Fail to reserve the mapping of " << path
+                          << " size=" << size;
+            return NULL;
+        }
+        char* base = head + page_size;
+        if (::mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                   fd, 0) == MAP_FAILED) {
+            PLOG(WARNING) << "Fail to mmap " << path << " size=" << size;
+            ::munmap(head, page_size + size);
+            return NULL;
+        }
+        *(size_t*)head = size;
+        SegmentMapping* mapping = new SegmentMapping(base, size);
+        if (mapping->_block.append_user_data(base, size, unmap_block) != 0) {
+            LOG(WARNING) << "Fail to wrap the mapping of " << path
+                         << " size=" << size;
+            ::munmap(head, page_size + size);
+            delete mapping;
+            return NULL;
+        }
+        return mapping;
+    }
+
+    void add_ref() {
+        _nref.fetch_add(1, butil::memory_order_relaxed);
+    }
+
+    void release() {
+        if (_nref.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            // The pages go with the last IOBuf referencing them
+            delete this;
+        }
+    }
+
+    const char* data() const { return _base; }
+    size_t size() const { return _size; }
+
+    // Append [offset, offset + len) of the mapping to |buf| without copying
+    int append_to(butil::IOBuf* buf, size_t offset, size_t len) {
+        if (len == 0) {
+            return 0;
+        }
+        if (_block.append_to(buf, len, offset) != len) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // Copy the pages from |offset| to the end into private memory, so that
+    // outstanding IOBufs still see the original data after the file is
+    // truncated.
+    void detach_from(size_t offset) {
+        const size_t page_size = getpagesize();
+        for (size_t off = offset / page_size * page_size; off < _size;
+                off += page_size) {
+            volatile char* p = _base + off;
+            *p = *p;
+        }
+    }
+
+private:
+    SegmentMapping(char* base, size_t size)
+        : _base(base), _size(size), _nref(1) {}
+
+    static void unmap_block(void* data) {
+        const size_t page_size = getpagesize();
+        char* head = (char*)data - page_size;
+        ::munmap(head, page_size + *(size_t*)head);
+    }
+
+    char* _base;
+    size_t _size;
+    butil::atomic<int> _nref;
+    // The only block of the mapping, shared by the IOBufs of the readers
+    butil::IOBuf _block;
+};
+
+SegmentMetaIndex::SegmentMetaIndex()
+    : _size(0), _nrun(0), _seq(0) {
+    // The first entry starts at the beginning of the segment
+    _offsets.reserve(0);
+    _offsets.at(0).store(0, butil::memory_order_relaxed);
+}
+
+SegmentMetaIndex::~SegmentMetaIndex() {}
+
+void SegmentMetaIndex::append(int64_t term, int64_t end) {
+    CHECK_LE(end, (int64_t)std::numeric_limits<uint32_t>::max())
+        << "Too large segment";
+    const size_t n = _size.load(butil::memory_order_relaxed);
+    const size_t nrun = _nrun.load(butil::memory_order_relaxed);
+    if (nrun == 0 || _runs.at(nrun - 1).term.load(butil::memory_order_relaxed)
+                            != term) {
+        _runs.reserve(nrun);
+        TermRun& run = _runs.at(nrun);
+        run.first.store(n, butil::memory_order_relaxed);
+        run.term.store(term, butil::memory_order_relaxed);
+        _nrun.store(nrun + 1, butil::memory_order_release);
+    }
+    _offsets.reserve(n + 1);
+    _offsets.at(n + 1).store(end, butil::memory_order_relaxed);
+    _size.store(n + 1, butil::memory_order_release);
+}
+
+void SegmentMetaIndex::truncate(size_t n) {
+    if (n >= _size.load(butil::memory_order_relaxed)) {
+        return;
+    }
+    _seq.store(_seq.load(butil::memory_order_relaxed) + 1,
+               butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_release);
+    _size.store(n, butil::memory_order_relaxed);
+    size_t nrun = _nrun.load(butil::memory_order_relaxed);
+    while (nrun > 0 && _runs.at(nrun - 1).first.load(butil::memory_order_relaxed)
+                            >= n) {
+        --nrun;
+    }
+    _nrun.store(nrun, butil::memory_order_relaxed);
+    _seq.store(_seq.load(butil::memory_order_relaxed) + 1,
+               butil::memory_order_release);
+}
+
+int64_t SegmentMetaIndex::_term_at(size_t i, size_t nrun) const {
+    // The last run starting at or before |i|
+    size_t lo = 0;
+    size_t hi = nrun;
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (_runs.at(mid).first.load(butil::memory_order_relaxed) <= i) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return _runs.at(lo).term.load(butil::memory_order_relaxed);
+}
+
+int SegmentMetaIndex::get(size_t i, int64_t* offset, size_t* length,
+                          int64_t* term) const {
+    while (true) {
+        const uint64_t seq = _seq.load(butil::memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        if (i >= _size.load(butil::memory_order_acquire)) {
+            return -1;
+        }
+        const int64_t begin = _offsets.at(i).load(butil::memory_order_relaxed);
+        const int64_t end = _offsets.at(i + 1).load(butil::memory_order_relaxed);
+        const int64_t t = _term_at(i, _nrun.load(butil::memory_order_acquire));
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        if (_seq.load(butil::memory_order_relaxed) == seq) {
+            *offset = begin;
+            *length = end - begin;
+            *term = t;
+            return 0;
+        }
+    }
+}
+
+int64_t SegmentMetaIndex::offset(size_t i) const {
+    return _offsets.at(i).load(butil::memory_order_relaxed);
+}
+
+void SegmentMetaIndex::run(size_t k, size_t* first, int64_t* term) const {
+    *first = _runs.at(k).first.load(butil::memory_order_relaxed);
+    *term = _runs.at(k).term.load(butil::memory_order_relaxed);
+}
+
+void SegmentMetaIndex::swap(SegmentMetaIndex& rhs) {
+    _offsets.swap(rhs._offsets);
+    _runs.swap(rhs._runs);
+    size_t size = _size.load(butil::memory_order_relaxed);
+    _size.store(rhs._size.load(butil::memory_order_relaxed),
+                butil::memory_order_release);
+    rhs._size.store(size, butil::memory_order_relaxed);
+    size_t nrun = _nrun.load(butil::memory_order_relaxed);
+    _nrun.store(rhs._nrun.load(butil::memory_order_relaxed),
+                butil::memory_order_release);
+    rhs._nrun.store(nrun, butil::memory_order_relaxed);
+}
+
+size_t SegmentMetaIndex::memory_usage() const {
+    return _offsets.capacity() * sizeof(uint32_t)
+            + _runs.capacity() * sizeof(TermRun);
+}
+
+// write zeros to [begin, end) of |fd|
+static int zero_range(int fd, int64_t begin, int64_t end) {
+    const size_t block_size = 1024 * 1024;
+    std::vector<char> zeros(std::min((int64_t)block_size,
+                                     std::max(end - begin, (int64_t)1)), 0);
+    for (int64_t off = begin; off < end; ) {
+        const size_t len = std::min((int64_t)zeros.size(), end - off);
+        const ssize_t n = ::pwrite(fd, &zeros[0], len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+// find the end of the last non-zero byte in [begin, end) of |fd|, which is
+// |begin| if the range is all zeros
+static int find_nonzero_end(int fd, int64_t begin, int64_t end,
+                            int64_t* nonzero_end) {
+    const size_t block_size = 1024 * 1024;
+    std::vector<char> buf(block_size);
+    *nonzero_end = begin;
+    for (int64_t off = begin; off < end; ) {
+        const size_t len = std::min((int64_t)block_size, end - off);
+        const ssize_t n = ::pread(fd, &buf[0], len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (ssize_t i = n - 1; i >= 0; --i) {
+            if (buf[i] != 0) {
+                *nonzero_end = off + i + 1;
+                break;
+            }
+        }
+        off += n;
+    }
+    return 0;
+}
+
+// Files of retired segments kept for reuse by new open segments. A retired
+// file is zeroed and synced in background before it's put in the pool, so
+// the blocks are already allocated and written when it's reused, and the end
+// of the log in it is found at the first zero header.
+class SegmentFilePool : public butil::RefCountedThreadSafe<SegmentFilePool> {
+public:
+    explicit SegmentFilePool(const std::string& path)
+        : _path(path), _nrecycling(0), _next_id(0) {}
+
+    // Pick up the recycled files left in the log directory
+    void load() {
+        butil::DirReaderPosix dir_reader(_path.c_str());
+        if (!dir_reader.IsValid()) {
+            return;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (dir_reader.Next()) {
+            int64_t id = 0;
+            if (sscanf(dir_reader.name(), BRAFT_SEGMENT_RECYCLED_PATTERN, &id) != 1) {
+                continue;
+            }
+            std::string file_path(_path);
+            file_path.append("/");
+            file_path.append(dir_reader.name());
+            if (!FLAGS_raft_preallocate_segments) {
+                ::unlink(file_path.c_str());
+                LOG(INFO) << "unlink recycled segment, path: " << file_path;
+                continue;
+            }
+            _files.push_back(file_path);
+            _next_id = std::max(_next_id, id + 1);
+        }
+    }
+
+    // Open |file_path| as a new open segment, reuse a recycled file if there
+    // is one and preallocate the file to raft_max_segment_size.
+    // Returns the fd, -1 on error
+    int open(const std::string& file_path, bool* preallocated) {
+        *preallocated = false;
+        if (!FLAGS_raft_preallocate_segments) {
+            return ::open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        std::string recycled;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (!_files.empty()) {
+                recycled = _files.back();
+                _files.pop_back();
+            }
+        }
+        int fd = -1;
+        if (!recycled.empty()) {
+            if (::rename(recycled.c_str(), file_path.c_str()) == 0) {
+                fd = ::open(file_path.c_str(), O_RDWR);
+                LOG_IF(INFO, fd >= 0) << "Reuse recycled segment `" << recycled
+                                      << "' as `" << file_path << '\'';
+            } else {
+                PLOG(WARNING) << "Fail to rename `" << recycled << "' to `"
+                              << file_path << '\'';
+                ::unlink(recycled.c_str());
+            }
+        }
+        if (fd < 0) {
+            fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd < 0) {
+            return -1;
+        }
+        if (::fallocate(fd, 0, 0, FLAGS_raft_max_segment_size) != 0) {
+            // Not fatal, the file just grows write by write
+            PLOG(WARNING) << "Fail to preallocate " << file_path;
+            if (recycled.empty()) {
+                ftruncate_uninterrupted(fd, 0);
+                return fd;
+            }
+        }
+        *preallocated = true;
+        return fd;
+    }
+
+    // Take over the retired segment file |file_path|, which is zeroed and
+    // put in the pool in background.
+    // Returns 0 on success, -1 if the pool is full and the caller should
+    // unlink the file
+    int recycle(const std::string& file_path) {
+        if (!FLAGS_raft_preallocate_segments) {
+            return -1;
+        }
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if ((int)_files.size() + _nrecycling >= FLAGS_raft_max_recycled_segments) {
+                return -1;
+            }
+            ++_nrecycling;
+        }
+        RecycleArg* arg = new RecycleArg;
+        arg->pool = this;
+        arg->file_path = file_path;
+        bthread_t tid;
+        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                     run_recycle, arg) != 0) {
+            run_recycle(arg);
+        }
+        return 0;
+    }
+
+private:
+friend class butil::RefCountedThreadSafe<SegmentFilePool>;
+    ~SegmentFilePool() {}
+
+    struct RecycleArg {
+        scoped_refptr<SegmentFilePool> pool;
+        std::string file_path;
+    };
+
+    static void* run_recycle(void* arg) {
+        RecycleArg* ra = (RecycleArg*)arg;
+        ra->pool->do_recycle(ra->file_path);
+        delete ra;
+        return NULL;
+    }
+
+    void do_recycle(const std::string& file_path) {
+        butil::Timer timer;
+        timer.start();
+        std::string new_path;
+        const int rc = zero_file(file_path);
+        if (rc == 0) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            new_path = _path;
+            butil::string_appendf(&new_path, "/" BRAFT_SEGMENT_RECYCLED_PATTERN,
+                                  _next_id++);
+        }
+        if (rc != 0 || ::rename(file_path.c_str(), new_path.c_str()) != 0) {
+            PLOG(WARNING) << "Fail to recycle " << file_path;
+            ::unlink(file_path.c_str());
+            new_path.clear();
+        }
+        timer.stop();
+        BRAFT_VLOG << "recycle " << file_path << " to " << new_path
+                   << " time: " << timer.u_elapsed();
+        BAIDU_SCOPED_LOCK(_mutex);
+        --_nrecycling;
+        if (!new_path.empty()) {
+            _files.push_back(new_path);
+        }
+    }
+
+    static int zero_file(const std::string& file_path) {
+        int fd = ::open(file_path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st_buf;
+        int rc = fstat(fd, &st_buf);
+        if (rc == 0) {
+            const int64_t size = std::max((int64_t)st_buf.st_size,
+                                          (int64_t)FLAGS_raft_max_segment_size);
+            rc = zero_range(fd, 0, size);
+        }
+        if (rc == 0) {
+            rc = raft_fsync(fd);
+        }
+        ::close(fd);
+        return rc;
+    }
+
+    std::string _path;
+    raft_mutex_t _mutex;
+    std::vector<std::string> _files;
+    int _nrecycling;
+    int64_t _next_id;
+};
+
 enum CheckSumType {
     CHECKSUM_MURMURHASH32 = 0,
-    CHECKSUM_CRC32 = 1,   
+    CHECKSUM_CRC32 = 1,     // CRC32C (Castagnoli)
 };
 
 enum RaftSyncPolicy {
@@ -80,7 +563,8 @@ enum RaftSyncPolicy {
 
 // Format of Header, all fields are in network order
 // | -------------------- term (64bits) -------------------------  |
-// | entry-type (8bits) | checksum_type (8bits) | reserved(16bits) |
+// | entry-type (8bits) | checksum_type (8bits) |
+// | compress_type (8bits) | reserved(8bits)                       |
 // | ------------------ data len (32bits) -----------------------  |
 // | data_checksum (32bits) | header checksum (32bits)             |
 
@@ -90,6 +574,7 @@ struct Segment::EntryHeader {
     int64_t term;
     int type;
     int checksum_type;
+    int compress_type;
     uint32_t data_len;
     uint32_t data_checksum;
 };
@@ -97,11 +582,43 @@ struct Segment::EntryHeader {
 std::ostream& operator<<(std::ostream& os, const Segment::EntryHeader& h) {
     os << "{term=" << h.term << ", type=" << h.type << ", data_len="
        << h.data_len << ", checksum_type=" << h.checksum_type
+       << ", compress_type=" << h.compress_type
        << ", data_checksum=" << h.data_checksum << '}';
     return os;
 }
 
-int Segment::create() {
+// Data of entries is stored compressed with the codecs of brpc, the data
+// checksum covers the stored bytes
+static bool compress_data(int compress_type, const butil::IOBuf& in,
+                          butil::IOBuf* out) {
+    switch (compress_type) {
+    case brpc::COMPRESS_TYPE_SNAPPY:
+        return brpc::policy::SnappyCompress(in, out);
+    case brpc::COMPRESS_TYPE_GZIP:
+        return brpc::policy::GzipCompress(in, out, NULL);
+    case brpc::COMPRESS_TYPE_ZLIB:
+        return brpc::policy::ZlibCompress(in, out, NULL);
+    default:
+        return false;
+    }
+}
+
+static bool decompress_data(int compress_type, const butil::IOBuf& in,
+                            butil::IOBuf* out) {
+    switch (compress_type) {
+    case brpc::COMPRESS_TYPE_SNAPPY:
+        return brpc::policy::SnappyDecompress(in, out);
+    case brpc::COMPRESS_TYPE_GZIP:
+        return brpc::policy::GzipDecompress(in, out);
+    case brpc::COMPRESS_TYPE_ZLIB:
+        return brpc::policy::ZlibDecompress(in, out);
+    default:
+        LOG(ERROR) << "Unknown compress_type=" << compress_type;
+        return false;
+    }
+}
+
+int Segment::create(SegmentFilePool* pool) {
     if (!_is_open) {
         CHECK(false) << "Create on a closed segment at first_index=" 
                      << _first_index << " in " << _path;
@@ -110,15 +627,36 @@ int Segment::create() {
 
     std::string path(_path);
     butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
-    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (pool) {
+        _fd = pool->open(path, &_preallocated);
+    } else {
+        _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
     if (_fd >= 0) {
         butil::make_close_on_exec(_fd);
+        if (_direct_io) {
+            _open_direct(path);
+        }
     }
     LOG_IF(INFO, _fd >= 0) << "Created new segment `" << path 
                            << "' with fd=" << _fd ;
     return _fd >= 0 ? 0 : -1;
 }
 
+Segment::~Segment() {
+    if (_mapping) {
+        _mapping->release();
+        _mapping = NULL;
+    }
+    _close_direct();
+    free(_direct_buf);
+    _direct_buf = NULL;
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
 inline bool verify_checksum(int checksum_type,
                             const char* data, size_t len, uint32_t value) {
     switch (checksum_type) {
@@ -171,16 +709,56 @@ inline uint32_t get_checksum(int checksum_type, const butil::IOBuf& data) {
     }
 }
 
-int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
-                         size_t size_hint) const {
-    butil::IOPortal buf;
-    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
-    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
-    if (n != (ssize_t)to_read) {
-        return n < 0 ? -1 : 1;
+// A valid header never consists of zeros as the header checksum of zeros is
+// not zero for any checksum type
+static bool is_zero_header(const char* p) {
+    for (size_t i = 0; i < ENTRY_HEADER_SIZE; ++i) {
+        if (p[i] != 0) {
+            return false;
+        }
     }
-    char header_buf[ENTRY_HEADER_SIZE];
-    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    return true;
+}
+
+// Format of the offset index of a closed segment, fixed-size fields are in
+// network order, varints are little-endian base 128
+// | magic (32bits) | version (32bits)                               |
+// | ---------------- first_index (64bits) ------------------------- |
+// | ---------------- last_index (64bits) -------------------------- |
+// | ---------------- segment size (64bits) ------------------------ |
+// | term run count (32bits) | configuration count (32bits)          |
+// | offset delta (varint) of each entry, the first one is 0          |
+// | entry count (varint), term (varint) of each term run            |
+// | index delta (varint) of each configuration entry                |
+// | checksum (32bits), crc32c of all the above                      |
+
+const static uint32_t SEGMENT_INDEX_MAGIC = 0x42524958;  // "BRIX"
+const static uint32_t SEGMENT_INDEX_VERSION = 1;
+const static size_t SEGMENT_INDEX_HEADER_SIZE = 40;
+
+static void append_varint(std::string* buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf->push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    buf->push_back((char)value);
+}
+
+static bool parse_varint(const char** p, const char* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        const uint8_t byte = (uint8_t)*(*p)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+int Segment::_parse_entry_header(const char* p, off_t offset,
+                                 EntryHeader* head) const {
     int64_t term = 0;
     uint32_t meta_field;
     uint32_t data_len = 0;
@@ -191,21 +769,43 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
                   .unpack32(data_len)
                   .unpack32(data_checksum)
                   .unpack32(header_checksum);
-    EntryHeader tmp;
-    tmp.term = term;
-    tmp.type = meta_field >> 24;
-    tmp.checksum_type = (meta_field << 8) >> 24;
-    tmp.data_len = data_len;
-    tmp.data_checksum = data_checksum;
-    if (!verify_checksum(tmp.checksum_type, 
+    head->term = term;
+    head->type = meta_field >> 24;
+    head->checksum_type = (meta_field << 8) >> 24;
+    head->compress_type = (meta_field << 16) >> 24;
+    head->data_len = data_len;
+    head->data_checksum = data_checksum;
+    if (!verify_checksum(head->checksum_type, 
                         p, ENTRY_HEADER_SIZE - 4, header_checksum)) {
         LOG(ERROR) << "Found corrupted header at offset=" << offset
-                   << ", header=" << tmp << ", path: " << _path;
+                   << ", header=" << *head << ", path: " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
+                         size_t size_hint) const {
+    butil::IOPortal buf;
+    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
+    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
+    if (n != (ssize_t)to_read) {
+        return n < 0 ? -1 : 1;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    if (is_zero_header(p)) {
+        // Nothing was written here in a preallocated file
+        return 1;
+    }
+    EntryHeader tmp;
+    if (_parse_entry_header(p, offset, &tmp) != 0) {
         return -1;
     }
     if (head != NULL) {
         *head = tmp;
     }
+    const uint32_t data_len = tmp.data_len;
     if (data != NULL) {
         if (buf.length() < ENTRY_HEADER_SIZE + data_len) {
             const size_t to_read = ENTRY_HEADER_SIZE + data_len - buf.length();
@@ -231,32 +831,86 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
     return 0;
 }
 
-int Segment::_get_meta(int64_t index, LogMeta* meta) const {
+SegmentMapping* Segment::_get_mapping() const {
+    if (!FLAGS_raft_mmap_closed_segments) {
+        return NULL;
+    }
     BAIDU_SCOPED_LOCK(_mutex);
-    if (index > _last_index.load(butil::memory_order_relaxed) 
-                    || index < _first_index) {
-        // out of range
-        BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
-                  << " _first_index=" << _first_index;
+    // Only closed segments are immutable
+    if (_is_open || _fd < 0 || _bytes <= 0) {
+        return NULL;
+    }
+    if (!_mapping) {
+        if (_recycled) {
+            return NULL;
+        }
+        _mapping = SegmentMapping::create(_fd, _bytes, _path);
+        if (!_mapping) {
+            return NULL;
+        }
+        _ever_mapped = true;
+    }
+    _mapping->add_ref();
+    return _mapping;
+}
+
+int Segment::_load_entry_from_mapping(SegmentMapping* mapping, const LogMeta& meta,
+                                      bool check_data, EntryHeader* head,
+                                      butil::IOBuf* data) const {
+    if ((size_t)meta.offset + meta.length > mapping->size()
+            || meta.length < ENTRY_HEADER_SIZE) {
+        LOG(ERROR) << "Invalid entry at offset=" << meta.offset
+                   << " length=" << meta.length
+                   << " mapped_size=" << mapping->size() << " path: " << _path;
         return -1;
-    } else if (_last_index == _first_index - 1) {
+    }
+    const char* p = mapping->data() + meta.offset;
+    if (_parse_entry_header(p, meta.offset, head) != 0) {
+        return -1;
+    }
+    if (ENTRY_HEADER_SIZE + head->data_len != meta.length) {
+        LOG(ERROR) << "Found mismatched entry length at offset=" << meta.offset
+                   << " header=" << *head << " length=" << meta.length
+                   << " path: " << _path;
+        return -1;
+    }
+    if (check_data &&
+            !verify_checksum(head->checksum_type, p + ENTRY_HEADER_SIZE,
+                             head->data_len, head->data_checksum)) {
+        LOG(ERROR) << "Found corrupted data at offset=" 
+                   << meta.offset + ENTRY_HEADER_SIZE
+                   << " header=" << *head
+                   << " path: " << _path;
+        return -1;
+    }
+    return mapping->append_to(data, meta.offset + ENTRY_HEADER_SIZE,
+                              head->data_len);
+}
+
+int Segment::_get_meta(int64_t index, LogMeta* meta) const {
+    int64_t offset = 0;
+    if (index < _first_index
+            || _meta_index.get(index - _first_index, &offset,
+                               &meta->length, &meta->term) != 0) {
+        // out of range
         BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
-                  << " _first_index=" << _first_index;
-        // empty
+                  << " _first_index=" << _first_index << " index=" << index;
         return -1;
     }
-    int64_t meta_index = index - _first_index;
-    int64_t entry_cursor = _offset_and_term[meta_index].first;
-    int64_t next_cursor = (index < _last_index.load(butil::memory_order_relaxed))
-                          ? _offset_and_term[meta_index + 1].first : _bytes;
-    DCHECK_LT(entry_cursor, next_cursor);
-    meta->offset = entry_cursor;
-    meta->term = _offset_and_term[meta_index].second;
-    meta->length = next_cursor - entry_cursor;
+    meta->offset = offset;
     return 0;
 }
 
 int Segment::load(ConfigurationManager* configuration_manager) {
+    std::vector<ConfigurationEntry> conf_entries;
+    const int ret = load(&conf_entries);
+    for (size_t i = 0; i < conf_entries.size(); ++i) {
+        configuration_manager->add(conf_entries[i]);
+    }
+    return ret;
+}
+
+int Segment::load(std::vector<ConfigurationEntry>* conf_entries) {
     int ret = 0;
 
     std::string path(_path);
@@ -285,14 +939,56 @@ int Segment::load(ConfigurationManager* configuration_manager) {
 
     // load entry index
     int64_t file_size = st_buf.st_size;
+    if (!_is_open && FLAGS_raft_segment_index
+            && _load_index(file_size, conf_entries) == 0) {
+        _bytes = file_size;
+        return 0;
+    }
+    // The file of an open segment is preallocated if it still has zeroed
+    // room at the end, a crash leaves the last writes torn in the middle of
+    // the file rather than a short file
+    bool preallocated = false;
+    if (_is_open && FLAGS_raft_preallocate_segments
+            && file_size >= (int64_t)ENTRY_HEADER_SIZE) {
+        char tail[ENTRY_HEADER_SIZE];
+        preallocated = (::pread(_fd, tail, ENTRY_HEADER_SIZE,
+                                file_size - ENTRY_HEADER_SIZE)
+                                        == (ssize_t)ENTRY_HEADER_SIZE
+                        && is_zero_header(tail));
+    }
     int64_t entry_off = 0;
     int64_t actual_last_index = _first_index - 1;
     bool is_entry_corrupted = false;
     for (int64_t i = _first_index; entry_off < file_size; i++) {
         EntryHeader header;
-        const int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
+        int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
+        if (rc < 0 && preallocated) {
+            // Partially written header at the tail, handled like a short file
+            LOG(WARNING) << "The header at the tail was not completely written"
+                         << ", path: " << _path << " entry_off: " << entry_off;
+            rc = 1;
+        }
         if (rc > 0) {
-            // The last log was not completely written, which should be truncated
+            // The last log was not completely written, which should be truncated.
+            // Since a preallocated file doesn't tell the size of the last
+            // entry, verify its data as well.
+            const size_t nentries = _meta_index.size();
+            if (_is_open && nentries > 0) {
+                const int64_t last_off = _meta_index.offset(nentries - 1);
+                butil::IOBuf data;
+                if (_load_entry(last_off, NULL, &data, entry_off - last_off) != 0) {
+                    LOG(WARNING) << "The last entry was not completely written"
+                                 << ", path: " << _path
+                                 << " entry_off: " << last_off;
+                    _meta_index.truncate(nentries - 1);
+                    if (!_conf_indexes.empty()
+                            && _conf_indexes.back() == actual_last_index) {
+                        _conf_indexes.pop_back();
+                    }
+                    --actual_last_index;
+                    entry_off = last_off;
+                }
+            }
             break;
         }
         if (rc < 0) {
@@ -319,8 +1015,8 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             entry->id.term = header.term;
             butil::Status status = parse_configuration_meta(data, entry);
             if (status.ok()) {
-                ConfigurationEntry conf_entry(*entry);
-                configuration_manager->add(conf_entry); 
+                conf_entries->push_back(ConfigurationEntry(*entry));
+                _conf_indexes.push_back(i);
             } else {
                 LOG(ERROR) << "fail to parse configuration meta, path: " << _path
                     << " entry_off " << entry_off;
@@ -328,7 +1024,7 @@ int Segment::load(ConfigurationManager* configuration_manager) {
                 break;
             }
         }
-        _offset_and_term.push_back(std::make_pair(entry_off, header.term));
+        _meta_index.append(header.term, entry_off + skip_len);
         ++actual_last_index;
         entry_off += skip_len;
     }
@@ -362,8 +1058,24 @@ int Segment::load(ConfigurationManager* configuration_manager) {
         _last_index = actual_last_index;
     }
 
-    // truncate last uncompleted entry
-    if (entry_off != file_size) {
+    if (entry_off != file_size && preallocated) {
+        // Keep the preallocated file, only the leftovers of the uncompleted
+        // writes are zeroed so that they are never loaded as entries after
+        // new ones are appended
+        int64_t nonzero_end = entry_off;
+        ret = find_nonzero_end(_fd, entry_off, file_size, &nonzero_end);
+        if (ret == 0 && nonzero_end > entry_off) {
+            LOG(INFO) << "zero last uncompleted write entry, path: " << _path
+                << " first_index: " << _first_index << " offset: " << entry_off
+                << " end: " << nonzero_end;
+            ret = zero_range(_fd, entry_off, nonzero_end);
+            if (ret == 0) {
+                ret = raft_fsync(_fd);
+            }
+        }
+        _preallocated = true;
+    } else if (entry_off != file_size) {
+        // truncate last uncompleted entry
         LOG(INFO) << "truncate last uncompleted write entry, path: " << _path
             << " first_index: " << _first_index << " old_size: " << file_size << " new_size: " << entry_off;
         ret = ftruncate_uninterrupted(_fd, entry_off);
@@ -373,21 +1085,13 @@ int Segment::load(ConfigurationManager* configuration_manager) {
     ::lseek(_fd, entry_off, SEEK_SET);
 
     _bytes = entry_off;
+    if (ret == 0 && _is_open && _direct_io) {
+        _open_direct(path);
+    }
     return ret;
 }
 
-int Segment::append(const LogEntry* entry) {
-
-    if (BAIDU_UNLIKELY(!entry || !_is_open)) {
-        return EINVAL;
-    } else if (entry->id.index != 
-                    _last_index.load(butil::memory_order_consume) + 1) {
-        CHECK(false) << "entry->index=" << entry->id.index
-                  << " _last_index=" << _last_index
-                  << " _first_index=" << _first_index;
-        return ERANGE;
-    }
-
+int Segment::_serialize_entry(const LogEntry* entry, butil::IOBuf* buf) const {
     butil::IOBuf data;
     switch (entry->type) {
     case ENTRY_TYPE_DATA:
@@ -410,35 +1114,182 @@ int Segment::append(const LogEntry* entry) {
                    << ", path: " << _path;
         return -1;
     }
+    int compress_type = brpc::COMPRESS_TYPE_NONE;
+    if (entry->type == ENTRY_TYPE_DATA
+            && _compress_type != brpc::COMPRESS_TYPE_NONE
+            && data.length() >= (size_t)FLAGS_raft_log_compress_min_bytes) {
+        butil::IOBuf compressed;
+        // Keep the data as is if it doesn't shrink
+        if (compress_data(_compress_type, data, &compressed)
+                && compressed.length() < data.length()) {
+            data.swap(compressed);
+            compress_type = _compress_type;
+        }
+    }
     CHECK_LE(data.length(), 1ul << 56ul);
     char header_buf[ENTRY_HEADER_SIZE];
-    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16);
+    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16)
+                                | (compress_type << 8);
+    // The stored bytes are the same as entry->data for uncompressed data
+    // entries, so the checksum carried by the entry is reused
+    const uint32_t data_checksum =
+            (entry->type == ENTRY_TYPE_DATA && entry->has_data_checksum
+                && compress_type == brpc::COMPRESS_TYPE_NONE
+                && _checksum_type == CHECKSUM_CRC32)
+            ? entry->data_checksum : get_checksum(_checksum_type, data);
     RawPacker packer(header_buf);
     packer.pack64(entry->id.term)
           .pack32(meta_field)
           .pack32((uint32_t)data.length())
-          .pack32(get_checksum(_checksum_type, data));
+          .pack32(data_checksum);
     packer.pack32(get_checksum(
                   _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-    butil::IOBuf header;
-    header.append(header_buf, ENTRY_HEADER_SIZE);
-    const size_t to_write = header.length() + data.length();
-    butil::IOBuf* pieces[2] = { &header, &data };
-    size_t start = 0;
-    ssize_t written = 0;
-    while (written < (ssize_t)to_write) {
-        const ssize_t n = butil::IOBuf::cut_multiple_into_file_descriptor(
-                _fd, pieces + start, ARRAY_SIZE(pieces) - start);
+    buf->append(header_buf, ENTRY_HEADER_SIZE);
+    // Reference the blocks of data instead of copying them
+    buf->append(butil::IOBuf::Movable(data));
+    return 0;
+}
+
+void Segment::_open_direct(const std::string& path) {
+    _direct_fd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+    if (_direct_fd < 0) {
+        PLOG(WARNING) << "Fail to open " << path
+                      << " with O_DIRECT, write through page cache";
+        return;
+    }
+    butil::make_close_on_exec(_direct_fd);
+    if (_load_direct_tail() != 0) {
+        _close_direct();
+    }
+}
+
+void Segment::_close_direct() {
+    if (_direct_fd >= 0) {
+        ::close(_direct_fd);
+        _direct_fd = -1;
+    }
+}
+
+int Segment::_load_direct_tail() {
+    const size_t tail_len = _bytes % DIRECT_IO_BLOCK_SIZE;
+    if (!_direct_buf) {
+        _direct_buf_size = DIRECT_IO_BLOCK_SIZE;
+        if (posix_memalign((void**)&_direct_buf, DIRECT_IO_BLOCK_SIZE,
+                           _direct_buf_size) != 0) {
+            LOG(ERROR) << "Fail to allocate direct io buffer, path: " << _path;
+            _direct_buf = NULL;
+            _direct_buf_size = 0;
+            return -1;
+        }
+    }
+    if (tail_len == 0) {
+        return 0;
+    }
+    butil::IOPortal buf;
+    const ssize_t n = file_pread(&buf, _fd, _bytes - tail_len, tail_len);
+    if (n != (ssize_t)tail_len) {
+        PLOG(ERROR) << "Fail to read the last block, path: " << _path;
+        return -1;
+    }
+    buf.copy_to(_direct_buf, tail_len);
+    return 0;
+}
+
+// The data is appended to the partial block at the end of the file kept in
+// _direct_buf, and whole blocks are written with the tail padded by zeros.
+// The rewritten part of the last block is the same as on disk, so a torn
+// write doesn't break the entries already there, and Segment::load stops at
+// the zero padding.
+int Segment::_write_direct(butil::IOBuf* buf, off_t offset) {
+    CHECK_EQ(offset, _bytes);
+    const size_t tail_len = offset % DIRECT_IO_BLOCK_SIZE;
+    const size_t len = tail_len + buf->length();
+    const size_t aligned_len = (len + DIRECT_IO_BLOCK_SIZE - 1)
+                               / DIRECT_IO_BLOCK_SIZE * DIRECT_IO_BLOCK_SIZE;
+    if (aligned_len > _direct_buf_size) {
+        char* new_buf = NULL;
+        if (posix_memalign((void**)&new_buf, DIRECT_IO_BLOCK_SIZE,
+                           aligned_len) != 0) {
+            LOG(ERROR) << "Fail to allocate direct io buffer, path: " << _path;
+            return -1;
+        }
+        memcpy(new_buf, _direct_buf, tail_len);
+        free(_direct_buf);
+        _direct_buf = new_buf;
+        _direct_buf_size = aligned_len;
+    }
+    buf->cutn(_direct_buf + tail_len, buf->length());
+    memset(_direct_buf + len, 0, aligned_len - len);
+    const off_t block_off = offset - tail_len;
+    size_t written = 0;
+    while (written < aligned_len) {
+        const ssize_t n = ::pwrite(_direct_fd, _direct_buf + written,
+                                   aligned_len - written, block_off + written);
         if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to write to fd=" << _direct_fd
+                        << ", path: " << _path;
+            return -1;
+        }
+        written += n;
+    }
+    // Keep the new partial block at the front for the next write
+    if (len % DIRECT_IO_BLOCK_SIZE != 0 && aligned_len > DIRECT_IO_BLOCK_SIZE) {
+        memmove(_direct_buf, _direct_buf + aligned_len - DIRECT_IO_BLOCK_SIZE,
+                DIRECT_IO_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+int Segment::_write_to_fd(butil::IOBuf* buf, off_t offset) {
+    if (_direct_fd >= 0) {
+        return _write_direct(buf, offset);
+    }
+    // IOBuf cuts its blocks into the fd with pwritev, so all the headers and
+    // payloads of |buf| reach the kernel in as few syscalls as possible
+    while (!buf->empty()) {
+        const ssize_t n = buf->pcut_into_file_descriptor(_fd, offset, buf->length());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             LOG(ERROR) << "Fail to write to fd=" << _fd 
                        << ", path: " << _path << berror();
             return -1;
         }
-        written += n;
-        for (;start < ARRAY_SIZE(pieces) && pieces[start]->empty(); ++start) {}
+        offset += n;
+    }
+    return 0;
+}
+
+int Segment::append(const LogEntry* entry) {
+
+    _wait_deferred();
+    if (BAIDU_UNLIKELY(!entry || !_is_open)) {
+        return EINVAL;
+    } else if (entry->id.index != 
+                    _last_index.load(butil::memory_order_consume) + 1) {
+        CHECK(false) << "entry->index=" << entry->id.index
+                  << " _last_index=" << _last_index
+                  << " _first_index=" << _first_index;
+        return ERANGE;
+    }
+
+    butil::IOBuf buf;
+    if (_serialize_entry(entry, &buf) != 0) {
+        return -1;
+    }
+    const size_t to_write = buf.length();
+    if (_write_to_fd(&buf, _bytes) != 0) {
+        return -1;
     }
     BAIDU_SCOPED_LOCK(_mutex);
-    _offset_and_term.push_back(std::make_pair(_bytes, entry->id.term));
+    _meta_index.append(entry->id.term, _bytes + to_write);
+    if (entry->type == ENTRY_TYPE_CONFIGURATION) {
+        _conf_indexes.push_back(entry->id.index);
+    }
     _last_index.fetch_add(1, butil::memory_order_relaxed);
     _bytes += to_write;
     _unsynced_bytes += to_write;
@@ -446,57 +1297,361 @@ int Segment::append(const LogEntry* entry) {
     return 0;
 }
 
+int Segment::_serialize_entries(const std::vector<LogEntry*>& entries, size_t start,
+                                int64_t first_index, int64_t offset,
+                                butil::IOBuf* buf, 
+                                std::vector<std::pair<int64_t, int64_t> >* metas) const {
+    if (BAIDU_UNLIKELY(start >= entries.size() || !_is_open)) {
+        return -1;
+    }
+    metas->reserve(entries.size() - start);
+    for (size_t i = start; i < entries.size(); ++i) {
+        const LogEntry* entry = entries[i];
+        // Same rule as SegmentLogStorage::open_segment: the segment is rolled
+        // over once its size exceeds raft_max_segment_size, the rest of the
+        // batch goes to the next segment
+        if (i != start && 
+                offset + (int64_t)buf->length() > FLAGS_raft_max_segment_size) {
+            break;
+        }
+        if (BAIDU_UNLIKELY(entry->id.index != 
+                           first_index + (int64_t)metas->size())) {
+            CHECK(false) << "entry->index=" << entry->id.index
+                         << " expected_index=" << first_index + metas->size()
+                         << " _first_index=" << _first_index;
+            break;
+        }
+        const int64_t entry_offset = offset + buf->length();
+        if (_serialize_entry(entry, buf) != 0) {
+            break;
+        }
+        metas->push_back(std::make_pair(entry_offset, entry->id.term));
+    }
+    return metas->empty() ? -1 : (int)metas->size();
+}
+
+void Segment::_commit_entries(const std::vector<LogEntry*>& entries, size_t start,
+        const std::vector<std::pair<int64_t, int64_t> >& metas, size_t bytes) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = start; i < start + metas.size(); ++i) {
+        if (entries[i]->type == ENTRY_TYPE_CONFIGURATION) {
+            _conf_indexes.push_back(entries[i]->id.index);
+        }
+    }
+    for (size_t i = 0; i < metas.size(); ++i) {
+        const int64_t end = (i + 1 < metas.size()) ? metas[i + 1].first
+                                                    : _bytes + (int64_t)bytes;
+        _meta_index.append(metas[i].second, end);
+    }
+    _last_index.fetch_add(metas.size(), butil::memory_order_relaxed);
+    _bytes += bytes;
+    _unsynced_bytes += bytes;
+}
+
+int Segment::append(const std::vector<LogEntry*>& entries, size_t start) {
+    // Written after the deferred appends in flight
+    _wait_deferred();
+    butil::IOBuf buf;
+    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > metas;
+    if (_serialize_entries(entries, start,
+                           _last_index.load(butil::memory_order_consume) + 1,
+                           _bytes, &buf, &metas) < 0) {
+        return -1;
+    }
+    const size_t to_write = buf.length();
+    if (_write_to_fd(&buf, _bytes) != 0) {
+        return -1;
+    }
+    _commit_entries(entries, start, metas, to_write);
+    return metas.size();
+}
+
+struct Segment::DeferredAppend {
+    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > metas;
+    std::vector<int64_t> conf_indexes;
+    int64_t bytes;
+    bool done;
+    int error;
+};
+
+int Segment::append_deferred(const std::vector<LogEntry*>& entries, size_t start,
+                             butil::IOBuf* buf, off_t* offset,
+                             DeferredAppend** deferred) {
+    int64_t first_index = 0;
+    int64_t end = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_deferred_failed) {
+            return -1;
+        }
+        first_index = _last_index.load(butil::memory_order_relaxed) + 1
+                      + _deferred_entries;
+        end = _bytes + _deferred_bytes;
+    }
+    DeferredAppend* d = new DeferredAppend;
+    buf->clear();
+    if (_serialize_entries(entries, start, first_index, end, buf, &d->metas) < 0) {
+        delete d;
+        return -1;
+    }
+    if (start + d->metas.size() < entries.size()) {
+        delete d;
+        buf->clear();
+        return 0;
+    }
+    for (size_t i = start; i < entries.size(); ++i) {
+        if (entries[i]->type == ENTRY_TYPE_CONFIGURATION) {
+            d->conf_indexes.push_back(entries[i]->id.index);
+        }
+    }
+    d->bytes = buf->length();
+    d->done = false;
+    d->error = 0;
+    _deferred_event.add_count(1);
+    {
+        // Appends committed in the meantime move _bytes and _deferred_bytes
+        // by the same amount, the end of the segment stays where it was
+        BAIDU_SCOPED_LOCK(_mutex);
+        _deferred.push_back(d);
+        _deferred_bytes += d->bytes;
+        _deferred_entries += d->metas.size();
+        _unsynced_bytes += d->bytes;
+    }
+    *offset = end;
+    *deferred = d;
+    return d->metas.size();
+}
+
+int Segment::commit_deferred(DeferredAppend* deferred, int error) {
+    int ret = 0;
+    int ncommitted = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        deferred->done = true;
+        deferred->error = error;
+        // Published in the order of the offsets, an entry is never visible
+        // before the ones in front of it are written
+        while (!_deferred.empty() && _deferred.front()->done) {
+            DeferredAppend* d = _deferred.front();
+            _deferred.pop_front();
+            _deferred_bytes -= d->bytes;
+            _deferred_entries -= d->metas.size();
+            if (d->error != 0) {
+                _deferred_failed = true;
+            }
+            if (!_deferred_failed) {
+                _conf_indexes.insert(_conf_indexes.end(),
+                                     d->conf_indexes.begin(),
+                                     d->conf_indexes.end());
+                for (size_t i = 0; i < d->metas.size(); ++i) {
+                    const int64_t end = (i + 1 < d->metas.size())
+                            ? d->metas[i + 1].first : _bytes + d->bytes;
+                    _meta_index.append(d->metas[i].second, end);
+                }
+                _last_index.fetch_add(d->metas.size(), butil::memory_order_relaxed);
+                _bytes += d->bytes;
+            }
+            if (d != deferred) {
+                delete d;
+            }
+            ++ncommitted;
+        }
+        if (error != 0 || _deferred_failed) {
+            ret = -1;
+        }
+    }
+    if (ncommitted > 0) {
+        delete deferred;
+        _deferred_event.signal(ncommitted);
+    }
+    return ret;
+}
+
+bool Segment::should_sync(bool will_sync, bool has_conf) {
+    // Deferred appends are counted in _unsynced_bytes before they are
+    // committed
+    if (_last_index < _first_index && _unsynced_bytes == 0) {
+        return false;
+    }
+    if (!will_sync || !FLAGS_raft_sync) {
+        return false;
+    }
+    if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
+        && FLAGS_raft_sync_per_bytes > _unsynced_bytes
+        && !has_conf) {
+        return false;
+    }
+    _unsynced_bytes = 0;
+    return true;
+}
+
 int Segment::sync(bool will_sync, bool has_conf) {
-    if (_last_index < _first_index) {
-        return 0;
-    }
     //CHECK(_is_open);
-    if (will_sync) {
-        if (!FLAGS_raft_sync) {
-            return 0;
-        }
-        if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
-            && FLAGS_raft_sync_per_bytes > _unsynced_bytes
-            && !has_conf) {
-            return 0;
-        }
-        _unsynced_bytes = 0;
+    if (should_sync(will_sync, has_conf)) {
         return raft_fsync(_fd);
     }
     return 0;
 }
 
-LogEntry* Segment::get(const int64_t index) const {
+LogEntry* Segment::get(const int64_t index, bool check_data) const {
 
     LogMeta meta;
     if (_get_meta(index, &meta) != 0) {
         return NULL;
     }
 
-    bool ok = true;
-    LogEntry* entry = NULL;
-    do {
-        ConfigurationPBMeta configuration_meta;
+    EntryHeader header;
+    butil::IOBuf data;
+    SegmentMapping* mapping = _get_mapping();
+    int rc = 0;
+    if (mapping) {
+        rc = _load_entry_from_mapping(mapping, meta, check_data, &header, &data);
+        mapping->release();
+    } else {
+        rc = _load_entry(meta.offset, &header, &data, meta.length);
+    }
+    if (rc != 0) {
+        return NULL;
+    }
+    CHECK_EQ(meta.term, header.term);
+    return _make_entry(index, header, &data);
+}
+
+int Segment::_cut_entry(const LogMeta& meta, butil::IOBuf* buf,
+                        EntryHeader* head, butil::IOBuf* data) const {
+    if (buf->length() < meta.length || meta.length < ENTRY_HEADER_SIZE) {
+        return -1;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    const char* p = (const char*)buf->fetch(header_buf, ENTRY_HEADER_SIZE);
+    if (_parse_entry_header(p, meta.offset, head) != 0) {
+        return -1;
+    }
+    if (ENTRY_HEADER_SIZE + head->data_len != meta.length) {
+        LOG(ERROR) << "Found mismatched entry length at offset=" << meta.offset
+                   << " header=" << *head << " length=" << meta.length
+                   << " path: " << _path;
+        return -1;
+    }
+    buf->pop_front(ENTRY_HEADER_SIZE);
+    data->clear();
+    buf->cutn(data, head->data_len);
+    if (!verify_checksum(head->checksum_type, *data, head->data_checksum)) {
+        LOG(ERROR) << "Found corrupted data at offset="
+                   << meta.offset + ENTRY_HEADER_SIZE
+                   << " header=" << *head
+                   << " path: " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+int Segment::get_range(const int64_t first_index, const int64_t last_index,
+                       size_t max_bytes, std::vector<LogEntry*>* entries,
+                       size_t* bytes, bool check_data) const {
+    std::vector<LogMeta> metas;
+    size_t length = 0;
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        if (!metas.empty() && length >= max_bytes) {
+            break;
+        }
+        LogMeta meta;
+        if (_get_meta(index, &meta) != 0) {
+            break;
+        }
+        if (!metas.empty()
+                && metas.back().offset + (off_t)metas.back().length != meta.offset) {
+            // Truncated and appended again in the middle of the lookup
+            break;
+        }
+        length += meta.length;
+        metas.push_back(meta);
+    }
+    if (metas.empty()) {
+        return -1;
+    }
+
+    // Read all the entries at once, or take them from the mapping
+    const off_t start = metas.front().offset;
+    const size_t read_len = metas.back().offset + metas.back().length - start;
+    SegmentMapping* mapping = _get_mapping();
+    butil::IOPortal buf;
+    if (mapping == NULL) {
+        const ssize_t n = file_pread(&buf, _fd, start, read_len);
+        if (n != (ssize_t)read_len) {
+            PLOG_IF(ERROR, n < 0) << "Fail to read " << _path
+                                  << " offset=" << start << " length=" << read_len;
+            return -1;
+        }
+        if (FLAGS_raft_log_readahead_bytes > 0 && !_is_open) {
+            // Followers catching up read the following entries soon
+            const off_t end = start + read_len;
+            const off_t readahead = std::min((int64_t)FLAGS_raft_log_readahead_bytes,
+                                             _bytes - (int64_t)end);
+            if (readahead > 0) {
+                posix_fadvise(_fd, end, readahead, POSIX_FADV_WILLNEED);
+            }
+        }
+    }
+
+    int nentries = 0;
+    for (size_t i = 0; i < metas.size(); ++i) {
         EntryHeader header;
         butil::IOBuf data;
-        if (_load_entry(meta.offset, &header, &data, 
-                        meta.length) != 0) {
-            ok = false;
+        int rc = 0;
+        if (mapping) {
+            rc = _load_entry_from_mapping(mapping, metas[i], check_data,
+                                          &header, &data);
+        } else {
+            rc = _cut_entry(metas[i], &buf, &header, &data);
+        }
+        if (rc != 0) {
+            break;
+        }
+        CHECK_EQ(metas[i].term, header.term);
+        LogEntry* entry = _make_entry(first_index + i, header, &data);
+        if (entry == NULL) {
             break;
         }
-        CHECK_EQ(meta.term, header.term);
+        entries->push_back(entry);
+        *bytes += metas[i].length;
+        ++nentries;
+    }
+    if (mapping) {
+        mapping->release();
+    }
+    return nentries > 0 ? nentries : -1;
+}
+
+LogEntry* Segment::_make_entry(int64_t index, const EntryHeader& header,
+                               butil::IOBuf* data) const {
+    bool ok = true;
+    LogEntry* entry = NULL;
+    do {
         entry = new LogEntry();
         entry->AddRef();
         switch (header.type) {
         case ENTRY_TYPE_DATA:
-            entry->data.swap(data);
+            if (header.compress_type == brpc::COMPRESS_TYPE_NONE) {
+                entry->data.swap(*data);
+                if (header.checksum_type == CHECKSUM_CRC32) {
+                    // Carried to the followers catching up
+                    entry->data_checksum = header.data_checksum;
+                    entry->has_data_checksum = true;
+                }
+            } else if (!decompress_data(header.compress_type, *data,
+                                        &entry->data)) {
+                LOG(ERROR) << "Fail to decompress entry, index: " << index
+                           << " header: " << header << " path: " << _path;
+                ok = false;
+            }
             break;
         case ENTRY_TYPE_NO_OP:
-            CHECK(data.empty()) << "Data of NO_OP must be empty";
+            CHECK(data->empty()) << "Data of NO_OP must be empty";
             break;
         case ENTRY_TYPE_CONFIGURATION:
             {
-                butil::Status status = parse_configuration_meta(data, entry); 
+                butil::Status status = parse_configuration_meta(*data, entry); 
                 if (!status.ok()) {
                     LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
                                  << _path;
@@ -535,6 +1690,8 @@ int64_t Segment::get_term(const int64_t index) const {
 
 int Segment::close(bool will_sync) {
     CHECK(_is_open);
+    // Not truncated or synced before the deferred writes are done
+    _wait_deferred();
     
     std::string old_path(_path);
     butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
@@ -550,7 +1707,15 @@ int Segment::close(bool will_sync) {
               << " will_sync: " << will_sync 
               << " path: " << new_path;
     int ret = 0;
-    if (_last_index > _first_index) {
+    if (_preallocated || _direct_fd >= 0) {
+        // Closed segments are loaded and mapped up to the file size
+        ret = ftruncate_uninterrupted(_fd, _bytes);
+        PLOG_IF(ERROR, ret != 0) << "Fail to truncate " << old_path
+                                 << " to " << _bytes;
+        _preallocated = false;
+        _close_direct();
+    }
+    if (ret == 0 && _last_index > _first_index) {
         if (FLAGS_raft_sync_segments && will_sync) {
             ret = raft_fsync(_fd);
         }
@@ -563,11 +1728,258 @@ int Segment::close(bool will_sync) {
         LOG_IF(ERROR, rc != 0) << "Fail to rename `" << old_path
                                << "' to `" << new_path <<"\', "
                                << berror();
+        if (rc == 0 && FLAGS_raft_segment_index) {
+            // Not fatal, the segment is scanned on load without the index
+            _save_index();
+        }
         return rc;
     }
     return ret;
 }
 
+std::string Segment::_index_path() const {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_INDEX_PATTERN,
+                          _first_index, _last_index.load());
+    return path;
+}
+
+int Segment::_save_index() {
+    butil::Timer timer;
+    timer.start();
+    std::string body;
+    uint32_t nrun = 0;
+    uint32_t nconf = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const size_t nentries = _meta_index.size();
+        if (nentries == 0) {
+            return 0;
+        }
+        body.reserve(nentries * 2);
+        int64_t prev_offset = 0;
+        for (size_t i = 0; i < nentries; ++i) {
+            const int64_t offset = _meta_index.offset(i);
+            append_varint(&body, offset - prev_offset);
+            prev_offset = offset;
+        }
+        for (size_t k = 0; k < _meta_index.nrun(); ++k) {
+            size_t first = 0;
+            size_t next_first = nentries;
+            int64_t term = 0;
+            _meta_index.run(k, &first, &term);
+            if (k + 1 < _meta_index.nrun()) {
+                int64_t next_term = 0;
+                _meta_index.run(k + 1, &next_first, &next_term);
+            }
+            append_varint(&body, next_first - first);
+            append_varint(&body, term);
+            ++nrun;
+        }
+        int64_t prev_index = _first_index;
+        for (size_t i = 0; i < _conf_indexes.size(); ++i) {
+            append_varint(&body, _conf_indexes[i] - prev_index);
+            prev_index = _conf_indexes[i];
+        }
+        nconf = _conf_indexes.size();
+    }
+    char header_buf[SEGMENT_INDEX_HEADER_SIZE];
+    RawPacker(header_buf).pack32(SEGMENT_INDEX_MAGIC)
+                         .pack32(SEGMENT_INDEX_VERSION)
+                         .pack64(_first_index)
+                         .pack64(_last_index.load())
+                         .pack64(_bytes)
+                         .pack32(nrun)
+                         .pack32(nconf);
+    std::string content(header_buf, SEGMENT_INDEX_HEADER_SIZE);
+    content.append(body);
+    char checksum_buf[4];
+    RawPacker(checksum_buf).pack32(crc32(content.data(), content.size()));
+    content.append(checksum_buf, sizeof(checksum_buf));
+
+    // Write to a temporary file which is removed on restart if the process
+    // crashes halfway
+    const std::string index_path = _index_path();
+    std::string tmp_path(index_path);
+    tmp_path.append(".tmp");
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << tmp_path;
+        return -1;
+    }
+    butil::IOBuf buf;
+    buf.append(content);
+    const ssize_t n = file_pwrite(buf, fd, 0);
+    ::close(fd);
+    if (n != (ssize_t)content.size()
+            || ::rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to save index " << index_path;
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    timer.stop();
+    BRAFT_VLOG << "save index " << index_path << " size: " << content.size()
+               << " time: " << timer.u_elapsed();
+    return 0;
+}
+
+int Segment::_parse_index(const char* data, size_t len, int64_t file_size,
+                          SegmentMetaIndex* meta_index,
+                          std::vector<int64_t>* conf_indexes) const {
+    if (len < SEGMENT_INDEX_HEADER_SIZE + 4) {
+        return -1;
+    }
+    uint32_t checksum = 0;
+    RawUnpacker(data + len - 4).unpack32(checksum);
+    if (checksum != crc32(data, len - 4)) {
+        LOG(WARNING) << "Found corrupted index, path: " << _path
+                     << " first_index: " << _first_index;
+        return -1;
+    }
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    int64_t first_index = 0;
+    int64_t last_index = 0;
+    int64_t size = 0;
+    uint32_t nrun = 0;
+    uint32_t nconf = 0;
+    RawUnpacker(data).unpack32(magic)
+                     .unpack32(version)
+                     .unpack64((uint64_t&)first_index)
+                     .unpack64((uint64_t&)last_index)
+                     .unpack64((uint64_t&)size)
+                     .unpack32(nrun)
+                     .unpack32(nconf);
+    if (magic != SEGMENT_INDEX_MAGIC || version != SEGMENT_INDEX_VERSION
+            || first_index != _first_index
+            || last_index != _last_index.load(butil::memory_order_relaxed)
+            || last_index < first_index || size != file_size) {
+        LOG(WARNING) << "Found mismatched index, path: " << _path
+                     << " first_index: " << first_index
+                     << " last_index: " << last_index << " size: " << size
+                     << " file_size: " << file_size;
+        return -1;
+    }
+    const char* p = data + SEGMENT_INDEX_HEADER_SIZE;
+    const char* const end = data + len - 4;
+    const size_t count = last_index - first_index + 1;
+    std::vector<int64_t> offsets;
+    offsets.reserve(count + 1);
+    int64_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t delta = 0;
+        if (!parse_varint(&p, end, &delta)
+                || (i == 0 ? delta != 0 : delta < ENTRY_HEADER_SIZE)
+                || delta > (uint64_t)(file_size - offset)) {
+            return -1;
+        }
+        offset += delta;
+        offsets.push_back(offset);
+    }
+    if (offset + (int64_t)ENTRY_HEADER_SIZE > file_size) {
+        return -1;
+    }
+    offsets.push_back(file_size);
+    size_t filled = 0;
+    for (uint32_t i = 0; i < nrun; ++i) {
+        uint64_t run = 0;
+        uint64_t term = 0;
+        if (!parse_varint(&p, end, &run) || !parse_varint(&p, end, &term)
+                || run == 0 || run > count - filled) {
+            return -1;
+        }
+        for (uint64_t j = 0; j < run; ++j) {
+            meta_index->append(term, offsets[++filled]);
+        }
+    }
+    if (filled != count) {
+        return -1;
+    }
+    int64_t index = first_index;
+    for (uint32_t i = 0; i < nconf; ++i) {
+        uint64_t delta = 0;
+        if (!parse_varint(&p, end, &delta)
+                || delta > (uint64_t)(last_index - index)) {
+            return -1;
+        }
+        index += delta;
+        conf_indexes->push_back(index);
+    }
+    return p == end ? 0 : -1;
+}
+
+int Segment::_load_index(int64_t file_size,
+                         std::vector<ConfigurationEntry>* conf_entries) {
+    const std::string index_path = _index_path();
+    int fd = ::open(index_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PLOG_IF(WARNING, errno != ENOENT) << "Fail to open " << index_path;
+        return -1;
+    }
+    struct stat st_buf;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st_buf) == 0 && st_buf.st_size > 0) {
+        base = ::mmap(NULL, st_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap " << index_path;
+        return -1;
+    }
+    SegmentMetaIndex meta_index;
+    std::vector<int64_t> conf_indexes;
+    int rc = _parse_index((const char*)base, st_buf.st_size, file_size,
+                          &meta_index, &conf_indexes);
+    ::munmap(base, st_buf.st_size);
+
+    // The last entry is checked against the index to catch a segment which
+    // was rewritten without updating the index
+    const size_t nconf_entries = conf_entries->size();
+    if (rc == 0) {
+        EntryHeader header;
+        int64_t last_off = 0;
+        size_t last_length = 0;
+        int64_t last_term = 0;
+        meta_index.get(meta_index.size() - 1, &last_off, &last_length, &last_term);
+        if (_load_entry(last_off, &header, NULL, ENTRY_HEADER_SIZE) != 0
+                || header.term != last_term
+                || ENTRY_HEADER_SIZE + header.data_len != last_length) {
+            rc = -1;
+        }
+    }
+    for (size_t i = 0; rc == 0 && i < conf_indexes.size(); ++i) {
+        int64_t entry_off = 0;
+        size_t length = 0;
+        int64_t term = 0;
+        meta_index.get(conf_indexes[i] - _first_index, &entry_off, &length, &term);
+        EntryHeader header;
+        butil::IOBuf data;
+        if (_load_entry(entry_off, &header, &data, length) != 0
+                || header.type != ENTRY_TYPE_CONFIGURATION
+                || header.term != term) {
+            rc = -1;
+            break;
+        }
+        scoped_refptr<LogEntry> entry = new LogEntry();
+        entry->id.index = conf_indexes[i];
+        entry->id.term = header.term;
+        if (!parse_configuration_meta(data, entry).ok()) {
+            rc = -1;
+            break;
+        }
+        conf_entries->push_back(ConfigurationEntry(*entry));
+    }
+    if (rc != 0) {
+        LOG(WARNING) << "Ignore invalid index " << index_path
+                     << ", scan the segment instead";
+        conf_entries->resize(nconf_entries);
+        return -1;
+    }
+    _meta_index.swap(meta_index);
+    _conf_indexes.swap(conf_indexes);
+    return 0;
+}
+
 std::string Segment::file_name() {
     if (!_is_open) {
         return butil::string_printf(BRAFT_SEGMENT_CLOSED_PATTERN, _first_index, _last_index.load());
@@ -588,7 +2000,8 @@ static void* run_unlink(void* arg) {
     return NULL;
 }
 
-int Segment::unlink() {
+int Segment::unlink(SegmentFilePool* pool) {
+    _wait_deferred();
     int ret = 0;
     do {
         std::string path(_path);
@@ -600,6 +2013,10 @@ int Segment::unlink() {
                                 _first_index, _last_index.load());
         }
 
+        if (!_is_open && ::unlink(_index_path().c_str()) != 0 && errno != ENOENT) {
+            PLOG(WARNING) << "Fail to unlink index of " << path;
+        }
+
         std::string tmp_path(path);
         tmp_path.append(".tmp");
         ret = ::rename(path.c_str(), tmp_path.c_str());
@@ -608,6 +2025,21 @@ int Segment::unlink() {
             break;
         }
 
+        // Pages of a file which was ever mapped may be still referenced by
+        // entries even after the mapping is detached, they would see the
+        // zeros written by the pool, so it's unlinked as usual
+        bool recyclable = false;
+        if (pool) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            recyclable = !_ever_mapped;
+            // Not mapped by the readers from now on
+            _recycled = recyclable;
+        }
+        if (recyclable && pool->recycle(tmp_path) == 0) {
+            LOG(INFO) << "Recycled segment `" << path << '\'';
+            break;
+        }
+
         // start bthread to unlink
         // TODO unlink follow control
         std::string* file_path = new std::string(tmp_path);
@@ -623,6 +2055,7 @@ int Segment::unlink() {
 }
 
 int Segment::truncate(const int64_t last_index_kept) {
+    _wait_deferred();
     int64_t truncate_size = 0;
     int64_t first_truncate_in_offset = 0;
     std::unique_lock<raft_mutex_t> lck(_mutex);
@@ -630,12 +2063,20 @@ int Segment::truncate(const int64_t last_index_kept) {
         return 0;
     }
     first_truncate_in_offset = last_index_kept + 1 - _first_index;
-    truncate_size = _offset_and_term[first_truncate_in_offset].first;
+    truncate_size = _meta_index.offset(first_truncate_in_offset);
     BRAFT_VLOG << "Truncating " << _path << " first_index: " << _first_index
               << " last_index from " << _last_index << " to " << last_index_kept
               << " truncate size to " << truncate_size;
+    SegmentMapping* mapping = NULL;
+    std::swap(mapping, _mapping);
     lck.unlock();
 
+    if (mapping) {
+        // Entries read through the mapping may be still in use
+        mapping->detach_from(truncate_size);
+        mapping->release();
+    }
+
     // Truncate on a full segment need to rename back to inprogess segment again,
     // because the node may crash before truncate.
     if (!_is_open) {
@@ -643,6 +2084,13 @@ int Segment::truncate(const int64_t last_index_kept) {
         butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
                              _first_index, _last_index.load());
 
+        // The index is written again when the segment is closed
+        const std::string index_path = _index_path();
+        if (::unlink(index_path.c_str()) != 0 && errno != ENOENT) {
+            PLOG(ERROR) << "Fail to unlink " << index_path;
+            return -1;
+        }
+
         std::string new_path(_path);
         butil::string_appendf(&new_path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
                              _first_index);
@@ -673,12 +2121,28 @@ int Segment::truncate(const int64_t last_index_kept) {
 
     lck.lock();
     // update memory var
-    _offset_and_term.resize(first_truncate_in_offset);
+    _meta_index.truncate(first_truncate_in_offset);
+    while (!_conf_indexes.empty() && _conf_indexes.back() > last_index_kept) {
+        _conf_indexes.pop_back();
+    }
     _last_index.store(last_index_kept, butil::memory_order_relaxed);
     _bytes = truncate_size;
+    _preallocated = false;
+    if (_direct_fd >= 0) {
+        // The partial block at the end of the file has changed
+        if (_load_direct_tail() != 0) {
+            _close_direct();
+        }
+    } else if (_direct_io) {
+        std::string path(_path);
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+        _open_direct(path);
+    }
     return ret;
 }
 
+SegmentLogStorage::~SegmentLogStorage() {}
+
 int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
     if (FLAGS_raft_max_segment_size < 0) {
         LOG(FATAL) << "FLAGS_raft_max_segment_size " << FLAGS_raft_max_segment_size  
@@ -693,13 +2157,26 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         return -1;
     }
 
-    if (butil::crc32c::IsFastCrc32Supported()) {
+    if (FLAGS_raft_log_io_uring) {
+        _uring = UringWriter::get_instance();
+        LOG_IF(WARNING, _uring == NULL) << "io_uring is not available, "
+                                           "append log entries synchronously";
+    }
+
+    if (_preferred_checksum_type >= 0) {
+        _checksum_type = _preferred_checksum_type;
+        LOG(INFO) << "Use checksum_type=" << _checksum_type
+                  << " of appending entries specified by uri, path: " << _path;
+    } else if (butil::crc32c::IsFastCrc32Supported()) {
         _checksum_type = CHECKSUM_CRC32;
         LOG_ONCE(INFO) << "Use crc32c as the checksum type of appending entries";
     } else {
         _checksum_type = CHECKSUM_MURMURHASH32;
         LOG_ONCE(INFO) << "Use murmurhash32 as the checksum type of appending entries";
     }
+    LOG_IF(INFO, _compress_type != brpc::COMPRESS_TYPE_NONE)
+            << "Use compress_type=" << _compress_type
+            << " of appending entries specified by uri, path: " << _path;
 
     int ret = 0;
     bool is_empty = false;
@@ -721,6 +2198,9 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         if (ret != 0) {
             break;
         }
+
+        _file_pool = new SegmentFilePool(_path);
+        _file_pool->load();
     } while (0);
 
     if (is_empty) {
@@ -736,6 +2216,25 @@ int64_t SegmentLogStorage::last_log_index() {
 }
 
 int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) {
+    std::vector<scoped_refptr<Segment> > segments;
+    bool has_conf = false;
+    const int appended = append_to_segments(entries, metric, &segments, &has_conf);
+    if (segments.empty()) {
+        return appended;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    segments.back()->sync(_enable_sync, has_conf);
+    if (FLAGS_raft_trace_append_entry_latency && metric) {
+        const int64_t delta_time_us = butil::cpuwide_time_us() - now;
+        metric->sync_segment_time_us += delta_time_us;
+        g_sync_segment_latency << delta_time_us; 
+    }
+    return appended;
+}
+
+int SegmentLogStorage::append_to_segments(
+        const std::vector<LogEntry*>& entries, IOMetric* metric,
+        std::vector<scoped_refptr<Segment> >* segments, bool* has_conf) {
     if (entries.empty()) {
         return 0;
     }
@@ -745,13 +2244,11 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOM
                    << " path: " << _path;
         return -1;
     }
-    scoped_refptr<Segment> last_segment = NULL;
     int64_t now = 0;
     int64_t delta_time_us = 0;
-    bool has_conf = false;
-    for (size_t i = 0; i < entries.size(); i++) {
+    size_t appended = 0;
+    while (appended < entries.size()) {
         now = butil::cpuwide_time_us();
-        LogEntry* entry = entries[i];
         
         scoped_refptr<Segment> segment = open_segment();
         if (FLAGS_raft_trace_append_entry_latency && metric) {
@@ -760,31 +2257,189 @@ int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOM
             g_open_segment_latency << delta_time_us;
         }
         if (NULL == segment) {
-            return i;
+            return appended;
         }
-        int ret = segment->append(entry);
-        if (0 != ret) {
-            return i;
+        // Entries which fit in the open segment are written at once, the
+        // remaining ones go to the next segment in the following round
+        const int nappended = segment->append(entries, appended);
+        if (nappended <= 0) {
+            return appended;
         }
-        if (entry->type == ENTRY_TYPE_CONFIGURATION) {
-            has_conf = true;
+        for (int i = 0; i < nappended; ++i) {
+            if (entries[appended + i]->type == ENTRY_TYPE_CONFIGURATION) {
+                *has_conf = true;
+            }
         }
         if (FLAGS_raft_trace_append_entry_latency && metric) {
             delta_time_us = butil::cpuwide_time_us() - now;
             metric->append_entry_time_us += delta_time_us;
             g_segment_append_entry_latency << delta_time_us;
         }
-        _last_log_index.fetch_add(1, butil::memory_order_release);
-        last_segment = segment;
+        _last_log_index.fetch_add(nappended, butil::memory_order_release);
+        appended += nappended;
+        segments->push_back(segment);
+    }
+    return appended;
+}
+
+int SegmentLogStorage::append_entries_nosync(const std::vector<LogEntry*>& entries,
+                                             IOMetric* metric) {
+    std::vector<scoped_refptr<Segment> > segments;
+    bool has_conf = false;
+    const int appended = append_to_segments(entries, metric, &segments, &has_conf);
+    if (segments.empty()) {
+        return appended;
+    }
+    // Decided here as the sync policy is tracked by the appending thread.
+    // Segments rolled over in this batch are synced as well, like
+    // append_entries_async() does
+    std::vector<scoped_refptr<Segment> > to_sync;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const bool sync = (i + 1 == segments.size())
+                ? segments[i]->should_sync(_enable_sync, has_conf)
+                : (_enable_sync && FLAGS_raft_sync);
+        if (sync) {
+            to_sync.push_back(segments[i]);
+        }
+    }
+    if (!to_sync.empty()) {
+        BAIDU_SCOPED_LOCK(_unsynced_mutex);
+        for (size_t i = 0; i < to_sync.size(); ++i) {
+            if (_unsynced_segments.empty()
+                    || _unsynced_segments.back() != to_sync[i]) {
+                _unsynced_segments.push_back(to_sync[i]);
+            }
+        }
+    }
+    return appended;
+}
+
+int SegmentLogStorage::sync_appended_entries() {
+    std::vector<scoped_refptr<Segment> > segments;
+    {
+        BAIDU_SCOPED_LOCK(_unsynced_mutex);
+        segments.swap(_unsynced_segments);
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    for (size_t i = 0; i < segments.size(); ++i) {
+        // fsync() doesn't race with the writes of the appending thread, and
+        // the fd of a segment closed in the meantime is still open
+        if (raft_fsync(segments[i]->fd()) != 0) {
+            PLOG(ERROR) << "Fail to sync segment, path: " << _path;
+            return errno;
+        }
+    }
+    if (!segments.empty()) {
+        g_sync_segment_latency << butil::cpuwide_time_us() - now;
+    }
+    return 0;
+}
+
+// Write of one batch to the open segment, which is referenced to keep its fd
+// open until the entries are committed
+class SegmentAppendRequest : public UringRequest {
+public:
+    SegmentAppendRequest(AppendEntriesCallback* callback, const std::string& path)
+        : nappended(0), deferred(NULL), _callback(callback), _path(path) {}
+
+    void on_complete(int error) {
+        LOG_IF(ERROR, error != 0) << "Fail to write entries through io_uring"
+                                  << ", path: " << _path << ", " << berror(error);
+        const int rc = segment->commit_deferred(deferred, error);
+        _callback->on_stable(rc == 0 ? nappended : 0);
+        delete this;
+    }
+
+    // Fallback when the request can't be submitted
+    void run_in_place() {
+        int error = 0;
+        for (size_t i = 0; i < writes.size() && error == 0; ++i) {
+            UringWrite& w = writes[i];
+            off_t offset = w.offset;
+            while (!w.data.empty()) {
+                const ssize_t n = w.data.pcut_into_file_descriptor(
+                                            w.fd, offset, w.data.length());
+                if (n < 0 && errno != EINTR) {
+                    error = errno;
+                    break;
+                }
+                offset += std::max(n, (ssize_t)0);
+            }
+            if (error == 0 && w.sync && raft_fsync(w.fd) != 0) {
+                error = errno;
+            }
+        }
+        on_complete(error);
+    }
+
+    int nappended;
+    scoped_refptr<Segment> segment;
+    Segment::DeferredAppend* deferred;
+
+private:
+    AppendEntriesCallback* _callback;
+    std::string _path;
+};
+
+void SegmentLogStorage::append_entries_async(const std::vector<LogEntry*>& entries,
+                                             IOMetric* metric,
+                                             AppendEntriesCallback* callback) {
+    // Deferred writes go through fd() which isn't opened with O_DIRECT
+    if (_uring == NULL || _direct_io || entries.empty()) {
+        return LogStorage::append_entries_async(entries, metric, callback);
+    }
+    if (_last_log_index.load(butil::memory_order_relaxed) + 1
+            != entries.front()->id.index) {
+        LOG(FATAL) << "There's gap between appending entries and _last_log_index"
+                   << " path: " << _path;
+        return callback->on_stable(0);
+    }
+    int64_t now = butil::cpuwide_time_us();
+    int64_t delta_time_us = 0;
+    scoped_refptr<Segment> segment = open_segment();
+    if (FLAGS_raft_trace_append_entry_latency && metric) {
+        delta_time_us = butil::cpuwide_time_us() - now;
+        metric->open_segment_time_us += delta_time_us;
+        g_open_segment_latency << delta_time_us;
+    }
+    if (NULL == segment) {
+        return callback->on_stable(0);
     }
+    UringWrite w;
+    w.fd = segment->fd();
+    Segment::DeferredAppend* deferred = NULL;
     now = butil::cpuwide_time_us();
-    last_segment->sync(_enable_sync, has_conf);
+    const int nappended = segment->append_deferred(
+                                entries, 0, &w.data, &w.offset, &deferred);
+    if (nappended < 0) {
+        return callback->on_stable(0);
+    }
+    if (nappended == 0) {
+        // The batch spans segments, which are rolled over and synced in
+        // place, after the deferred writes in flight are done
+        return LogStorage::append_entries_async(entries, metric, callback);
+    }
     if (FLAGS_raft_trace_append_entry_latency && metric) {
         delta_time_us = butil::cpuwide_time_us() - now;
-        metric->sync_segment_time_us += delta_time_us;
-        g_sync_segment_latency << delta_time_us; 
+        metric->append_entry_time_us += delta_time_us;
+        g_segment_append_entry_latency << delta_time_us;
+    }
+    bool has_conf = false;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i]->type == ENTRY_TYPE_CONFIGURATION) {
+            has_conf = true;
+        }
+    }
+    _last_log_index.fetch_add(nappended, butil::memory_order_release);
+    w.sync = segment->should_sync(_enable_sync, has_conf);
+    SegmentAppendRequest* req = new SegmentAppendRequest(callback, _path);
+    req->nappended = nappended;
+    req->segment = segment;
+    req->deferred = deferred;
+    req->writes.push_back(w);
+    if (_uring->submit(req) != 0) {
+        req->run_in_place();
     }
-    return entries.size();
 }
 
 int SegmentLogStorage::append_entry(const LogEntry* entry) {
@@ -809,7 +2464,28 @@ LogEntry* SegmentLogStorage::get_entry(const int64_t index) {
     if (get_segment(index, &ptr) != 0) {
         return NULL;
     }
-    return ptr->get(index);
+    return ptr->get(index, FLAGS_raft_verify_mmap_read_checksum);
+}
+
+int SegmentLogStorage::get_entries(const int64_t first_index,
+                                   const int64_t last_index, size_t max_bytes,
+                                   std::vector<LogEntry*>* entries) {
+    size_t bytes = 0;
+    int64_t index = first_index;
+    while (index <= last_index && (index == first_index || bytes < max_bytes)) {
+        scoped_refptr<Segment> ptr;
+        if (get_segment(index, &ptr) != 0) {
+            break;
+        }
+        const int n = ptr->get_range(index, last_index, max_bytes - bytes,
+                                     entries, &bytes,
+                                     FLAGS_raft_verify_mmap_read_checksum);
+        if (n <= 0) {
+            break;
+        }
+        index += n;
+    }
+    return index - first_index;
 }
 
 int64_t SegmentLogStorage::get_term(const int64_t index) {
@@ -871,7 +2547,7 @@ int SegmentLogStorage::truncate_prefix(const int64_t first_index_kept) {
     std::vector<scoped_refptr<Segment> > popped;
     pop_segments(first_index_kept, &popped);
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        popped[i]->unlink(_file_pool.get());
         popped[i] = NULL;
     }
     return 0;
@@ -943,7 +2619,7 @@ int SegmentLogStorage::truncate_suffix(const int64_t last_index_kept) {
     // The truncate suffix order is crucial to satisfy log matching property of raft
     // log must be truncated from back to front.
     for (size_t i = 0; i < popped.size(); ++i) {
-        ret = popped[i]->unlink();
+        ret = popped[i]->unlink(_file_pool.get());
         if (ret != 0) {
             return ret;
         }
@@ -990,7 +2666,7 @@ int SegmentLogStorage::reset(const int64_t next_log_index) {
         return -1;
     }
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        popped[i]->unlink(_file_pool.get());
         popped[i] = NULL;
     }
     return 0;
@@ -1007,7 +2683,8 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     // restore segment meta
     while (dir_reader.Next()) {
         // unlink unneed segments and unfinished unlinked segments
-        if ((is_empty && 0 == strncmp(dir_reader.name(), "log_", strlen("log_"))) ||
+        if ((is_empty && (0 == strncmp(dir_reader.name(), "log_", strlen("log_")) ||
+                          0 == strncmp(dir_reader.name(), "index_", strlen("index_")))) ||
             (0 == strncmp(dir_reader.name() + (strlen(dir_reader.name()) - strlen(".tmp")),
                           ".tmp", strlen(".tmp")))) {
             std::string segment_path(_path);
@@ -1029,7 +2706,9 @@ int SegmentLogStorage::list_segments(bool is_empty) {
             LOG(INFO) << "restore closed segment, path: " << _path
                       << " first_index: " << first_index
                       << " last_index: " << last_index;
-            Segment* segment = new Segment(_path, first_index, last_index, _checksum_type);
+            Segment* segment = new Segment(_path, first_index, last_index,
+                                           _checksum_type, _compress_type,
+                                           _direct_io);
             _segments[first_index] = segment;
             continue;
         }
@@ -1040,7 +2719,8 @@ int SegmentLogStorage::list_segments(bool is_empty) {
             BRAFT_VLOG << "restore open segment, path: " << _path
                 << " first_index: " << first_index;
             if (!_open_segment) {
-                _open_segment = new Segment(_path, first_index, _checksum_type);
+                _open_segment = new Segment(_path, first_index, _checksum_type,
+                                            _compress_type, _direct_io);
                 continue;
             } else {
                 LOG(WARNING) << "open segment conflict, path: " << _path
@@ -1105,21 +2785,82 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     return 0;
 }
 
-int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
-    int ret = 0;
+// Closed segments of one log storage, which are taken in log order by the
+// bthreads loading them
+struct LoadSegmentsContext {
+    std::string path;
+    std::vector<Segment*> segments;
+    std::vector<int> results;
+    std::vector<std::vector<ConfigurationEntry> > conf_entries;
+    butil::atomic<size_t> next;
+    butil::atomic<bool> failed;
+};
 
-    // closed segments
-    SegmentMap::iterator it;
-    for (it = _segments.begin(); it != _segments.end(); ++it) {
-        Segment* segment = it->second.get();
-        LOG(INFO) << "load closed segment, path: " << _path
+static void* run_load_segments(void* arg) {
+    LoadSegmentsContext* ctx = (LoadSegmentsContext*)arg;
+    while (!ctx->failed.load(butil::memory_order_relaxed)) {
+        const size_t i = ctx->next.fetch_add(1, butil::memory_order_relaxed);
+        if (i >= ctx->segments.size()) {
+            break;
+        }
+        Segment* segment = ctx->segments[i];
+        LOG(INFO) << "load closed segment, path: " << ctx->path
             << " first_index: " << segment->first_index()
             << " last_index: " << segment->last_index();
-        ret = segment->load(configuration_manager);
-        if (ret != 0) {
-            return ret;
-        } 
-        _last_log_index.store(segment->last_index(), butil::memory_order_release);
+        butil::Timer timer;
+        timer.start();
+        ctx->results[i] = segment->load(&ctx->conf_entries[i]);
+        timer.stop();
+        g_load_segment_latency << timer.u_elapsed();
+        BRAFT_VLOG << "loaded closed segment, path: " << ctx->path
+                   << " first_index: " << segment->first_index()
+                   << " time: " << timer.u_elapsed();
+        if (ctx->results[i] != 0) {
+            ctx->failed.store(true, butil::memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
+    int ret = 0;
+
+    // closed segments, loaded concurrently and merged in log order
+    LoadSegmentsContext ctx;
+    ctx.path = _path;
+    for (SegmentMap::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        ctx.segments.push_back(it->second.get());
+    }
+    // Segments which are not loaded after a failure are left as -1
+    ctx.results.assign(ctx.segments.size(), -1);
+    ctx.conf_entries.resize(ctx.segments.size());
+    ctx.next.store(0, butil::memory_order_relaxed);
+    ctx.failed.store(false, butil::memory_order_relaxed);
+    const size_t nloaders = std::min(ctx.segments.size(),
+                                     (size_t)FLAGS_raft_max_segment_loaders);
+    std::vector<bthread_t> tids;
+    for (size_t i = 1; i < nloaders; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                     run_load_segments, &ctx) == 0) {
+            tids.push_back(tid);
+        }
+    }
+    // The caller loads segments as well, so that it doesn't depend on the
+    // bthreads being started
+    run_load_segments(&ctx);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    for (size_t i = 0; i < ctx.segments.size(); ++i) {
+        if (ctx.results[i] != 0) {
+            return ctx.results[i];
+        }
+        for (size_t j = 0; j < ctx.conf_entries[i].size(); ++j) {
+            configuration_manager->add(ctx.conf_entries[i][j]);
+        }
+        _last_log_index.store(ctx.segments[i]->last_index(),
+                              butil::memory_order_release);
     }
 
     // open segment
@@ -1194,8 +2935,10 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
     {
         BAIDU_SCOPED_LOCK(_mutex);
         if (!_open_segment) {
-            _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-            if (_open_segment->create() != 0) {
+            _open_segment = new Segment(_path, last_log_index() + 1,
+                                        _checksum_type, _compress_type,
+                                        _direct_io);
+            if (_open_segment->create(_file_pool.get()) != 0) {
                 _open_segment = NULL;
                 return NULL;
             }
@@ -1209,8 +2952,10 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
         if (prev_open_segment) {
             if (prev_open_segment->close(_enable_sync) == 0) {
                 BAIDU_SCOPED_LOCK(_mutex);
-                _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                if (_open_segment->create() == 0) {
+                _open_segment = new Segment(_path, last_log_index() + 1,
+                                            _checksum_type, _compress_type,
+                                            _direct_io);
+                if (_open_segment->create(_file_pool.get()) == 0) {
                     // success
                     break;
                 }
@@ -1283,13 +3028,74 @@ void SegmentLogStorage::sync() {
     }
 }
 
+// ${path}[?checksum=crc32c|murmurhash32][&compress=snappy|gzip|zlib|none]
+//        [&direct_io=true|false]
+static int parse_segment_log_uri(const std::string& uri, std::string* path,
+                                 int* checksum_type, int* compress_type,
+                                 bool* direct_io) {
+    *checksum_type = -1;
+    *compress_type = brpc::COMPRESS_TYPE_NONE;
+    *direct_io = false;
+    const size_t pos = uri.find('?');
+    path->assign(uri, 0, pos);
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    for (butil::StringSplitter sp(uri.c_str() + pos + 1, '&'); sp; ++sp) {
+        const butil::StringPiece param(sp.field(), sp.length());
+        if (param == "checksum=crc32c" || param == "checksum=crc32") {
+            *checksum_type = CHECKSUM_CRC32;
+        } else if (param == "checksum=murmurhash32") {
+            *checksum_type = CHECKSUM_MURMURHASH32;
+        } else if (param == "compress=snappy") {
+            *compress_type = brpc::COMPRESS_TYPE_SNAPPY;
+        } else if (param == "compress=gzip") {
+            *compress_type = brpc::COMPRESS_TYPE_GZIP;
+        } else if (param == "compress=zlib") {
+            *compress_type = brpc::COMPRESS_TYPE_ZLIB;
+        } else if (param == "compress=none") {
+            *compress_type = brpc::COMPRESS_TYPE_NONE;
+        } else if (param == "direct_io=true") {
+            *direct_io = true;
+        } else if (param == "direct_io=false") {
+            *direct_io = false;
+        } else {
+            LOG(ERROR) << "Unknown parameter `" << param
+                       << "' of log storage uri=" << uri;
+            return -1;
+        }
+    }
+    return 0;
+}
+
 LogStorage* SegmentLogStorage::new_instance(const std::string& uri) const {
-    return new SegmentLogStorage(uri);
+    std::string path;
+    int checksum_type = -1;
+    int compress_type = brpc::COMPRESS_TYPE_NONE;
+    bool direct_io = false;
+    if (parse_segment_log_uri(uri, &path, &checksum_type, &compress_type,
+                              &direct_io) != 0) {
+        return NULL;
+    }
+    SegmentLogStorage* storage = new SegmentLogStorage(path);
+    storage->_preferred_checksum_type = checksum_type;
+    storage->_compress_type = compress_type;
+    storage->_direct_io = direct_io;
+    return storage;
 }
 
 butil::Status SegmentLogStorage::gc_instance(const std::string& uri) const {
     butil::Status status;
-    if (gc_dir(uri) != 0) {
+    std::string path;
+    int checksum_type = -1;
+    int compress_type = brpc::COMPRESS_TYPE_NONE;
+    bool direct_io = false;
+    if (parse_segment_log_uri(uri, &path, &checksum_type, &compress_type,
+                              &direct_io) != 0) {
+        status.set_error(EINVAL, "Invalid log storage uri %s", uri.c_str());
+        return status;
+    }
+    if (gc_dir(path) != 0) {
         LOG(WARNING) << "Failed to gc log storage from path " << _path;
         status.set_error(EINVAL, "Failed to gc log storage from path %s", 
                          uri.c_str());
@@ -20,48 +20,230 @@
 #define BRAFT_LOG_H
 
 #include <vector>
+#include <deque>
 #include <map>
 #include <butil/memory/ref_counted.h>
 #include <butil/atomicops.h>
 #include <butil/iobuf.h>
 #include <butil/logging.h>
+#include <bthread/countdown_event.h>
 #include "braft/log_entry.h"
 #include "braft/storage.h"
 #include "braft/util.h"
 
 namespace braft {
 
+class SegmentMapping;
+class SegmentFilePool;
+class UringWriter;
+
+// Positions and terms of the entries of a segment: offsets relative to the
+// beginning of the segment in 32 bits, and the positions where the term
+// changes. The arrays grow in buckets of doubling sizes which are never
+// moved, so readers look them up without any lock while the writer, which
+// is serialized by Segment::_mutex, keeps appending. truncate() is the only
+// operation making published entries invalid, readers retry if it happens
+// in the middle of a lookup.
+class SegmentMetaIndex {
+public:
+    SegmentMetaIndex();
+    ~SegmentMetaIndex();
+
+    // number of the entries
+    size_t size() const {
+        return _size.load(butil::memory_order_acquire);
+    }
+
+    // append an entry of |term| ending at |end|, right after the last entry
+    void append(int64_t term, int64_t end);
+
+    // keep the first |n| entries
+    void truncate(size_t n);
+
+    // get the |i|-th entry, return -1 if it doesn't exist
+    int get(size_t i, int64_t* offset, size_t* length, int64_t* term) const;
+
+    // the following are for the writer only
+
+    // offset of the |i|-th entry, offset(size()) is the end of the last one
+    int64_t offset(size_t i) const;
+
+    // number of the runs of entries of the same term
+    size_t nrun() const {
+        return _nrun.load(butil::memory_order_relaxed);
+    }
+
+    // first entry and term of the |k|-th run
+    void run(size_t k, size_t* first, int64_t* term) const;
+
+    void swap(SegmentMetaIndex& rhs);
+
+    size_t memory_usage() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SegmentMetaIndex);
+
+    // Array of which elements never move, the |i|-th element is in the
+    // bucket of 2^k * FIRST_BUCKET_SIZE elements
+    template <typename T>
+    class BucketArray {
+    public:
+        BucketArray() {
+            for (size_t k = 0; k < MAX_BUCKETS; ++k) {
+                _buckets[k].store(NULL, butil::memory_order_relaxed);
+            }
+        }
+        ~BucketArray() {
+            for (size_t k = 0; k < MAX_BUCKETS; ++k) {
+                delete [] _buckets[k].load(butil::memory_order_relaxed);
+            }
+        }
+        T& at(size_t i) const {
+            size_t k = 0;
+            size_t off = 0;
+            locate(i, &k, &off);
+            return _buckets[k].load(butil::memory_order_acquire)[off];
+        }
+        // make sure the |i|-th element exists, called by the writer
+        void reserve(size_t i) {
+            size_t k = 0;
+            size_t off = 0;
+            locate(i, &k, &off);
+            if (_buckets[k].load(butil::memory_order_relaxed) == NULL) {
+                _buckets[k].store(new T[FIRST_BUCKET_SIZE << k],
+                                  butil::memory_order_release);
+            }
+        }
+        size_t capacity() const {
+            size_t n = 0;
+            for (size_t k = 0; k < MAX_BUCKETS
+                    && _buckets[k].load(butil::memory_order_relaxed); ++k) {
+                n += FIRST_BUCKET_SIZE << k;
+            }
+            return n;
+        }
+        void swap(BucketArray& rhs) {
+            for (size_t k = 0; k < MAX_BUCKETS; ++k) {
+                T* p = _buckets[k].load(butil::memory_order_relaxed);
+                _buckets[k].store(rhs._buckets[k].load(butil::memory_order_relaxed),
+                                  butil::memory_order_relaxed);
+                rhs._buckets[k].store(p, butil::memory_order_relaxed);
+            }
+        }
+    private:
+        DISALLOW_COPY_AND_ASSIGN(BucketArray);
+        static const size_t FIRST_BUCKET_SIZE = 64;
+        static const size_t MAX_BUCKETS = 40;
+        static void locate(size_t i, size_t* k, size_t* off) {
+            const size_t p = i + FIRST_BUCKET_SIZE;
+            // FIRST_BUCKET_SIZE is 2^6
+            *k = 63 - __builtin_clzll(p) - 6;
+            *off = p - (FIRST_BUCKET_SIZE << *k);
+        }
+        butil::atomic<T*> _buckets[MAX_BUCKETS];
+    };
+
+    struct TermRun {
+        butil::atomic<uint32_t> first;
+        butil::atomic<int64_t> term;
+    };
+
+    int64_t _term_at(size_t i, size_t nrun) const;
+
+    // _offsets has size() + 1 elements, the last one is the end of the
+    // last entry
+    BucketArray<butil::atomic<uint32_t> > _offsets;
+    BucketArray<TermRun> _runs;
+    butil::atomic<size_t> _size;
+    butil::atomic<size_t> _nrun;
+    // odd while truncate() is in progress
+    butil::atomic<uint64_t> _seq;
+};
+
 class BAIDU_CACHELINE_ALIGNMENT Segment 
         : public butil::RefCountedThreadSafe<Segment> {
 public:
-    Segment(const std::string& path, const int64_t first_index, int checksum_type)
+    Segment(const std::string& path, const int64_t first_index, int checksum_type,
+            int compress_type = 0, bool direct_io = false)
         : _path(path), _bytes(0), _unsynced_bytes(0),
         _fd(-1), _is_open(true),
         _first_index(first_index), _last_index(first_index - 1),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _compress_type(compress_type),
+        _deferred_bytes(0), _deferred_entries(0), _deferred_failed(false),
+        _deferred_event(0),
+        _mapping(NULL), _ever_mapped(false), _recycled(false),
+        _preallocated(false), _direct_io(direct_io),
+        _direct_fd(-1), _direct_buf(NULL), _direct_buf_size(0)
     {}
     Segment(const std::string& path, const int64_t first_index, const int64_t last_index,
-            int checksum_type)
+            int checksum_type, int compress_type = 0, bool direct_io = false)
         : _path(path), _bytes(0), _unsynced_bytes(0),
         _fd(-1), _is_open(false),
         _first_index(first_index), _last_index(last_index),
-        _checksum_type(checksum_type)
+        _checksum_type(checksum_type), _compress_type(compress_type),
+        _deferred_bytes(0), _deferred_entries(0), _deferred_failed(false),
+        _deferred_event(0),
+        _mapping(NULL), _ever_mapped(false), _recycled(false),
+        _preallocated(false), _direct_io(direct_io),
+        _direct_fd(-1), _direct_buf(NULL), _direct_buf_size(0)
     {}
 
     struct EntryHeader;
 
-    // create open segment
-    int create();
+    // create open segment, the file is taken from |pool| if it's not NULL
+    int create(SegmentFilePool* pool = NULL);
 
     // load open or closed segment
     // open fd, load index, truncate uncompleted entry
     int load(ConfigurationManager* configuration_manager);
 
+    // same as above, but the configuration entries are appended to
+    // |conf_entries| in log order instead of being added to a manager, so
+    // that segments can be loaded concurrently
+    int load(std::vector<ConfigurationEntry>* conf_entries);
+
     // serialize entry, and append to open segment
     int append(const LogEntry* entry);
 
-    // get entry by index
-    LogEntry* get(const int64_t index) const;
+    // serialize entries[start, ...) and append them to open segment with a
+    // single vectored write, stop before the segment grows over
+    // raft_max_segment_size.
+    // Return the number of appended entries, -1 on error.
+    int append(const std::vector<LogEntry*>& entries, size_t start);
+
+    // Entries serialized by append_deferred() and not committed yet
+    struct DeferredAppend;
+
+    // serialize entries[start, ...) like append() and reserve their place
+    // after the other deferred appends, but leave the write to the caller,
+    // who must write |buf| at |offset| of fd() and call commit_deferred()
+    // with |*deferred| once it's done. Nothing is reserved unless all the
+    // entries fit in this segment.
+    // Return the number of serialized entries, 0 if they don't fit, -1 on
+    // error.
+    int append_deferred(const std::vector<LogEntry*>& entries, size_t start,
+                        butil::IOBuf* buf, off_t* offset,
+                        DeferredAppend** deferred);
+
+    // make the entries of |deferred| visible once all the deferred appends
+    // before it are committed as well, |error| is the result of the write.
+    // Return 0 on success, -1 if the entries are lost for this or a previous
+    // failed write.
+    int commit_deferred(DeferredAppend* deferred, int error);
+
+    // get entry by index. |check_data| tells whether the data read through
+    // mmap is verified against its checksum, pread always verifies it.
+    LogEntry* get(const int64_t index, bool check_data = true) const;
+
+    // get entries in [first_index, last_index] of this segment with one read,
+    // stopping once they take more than |max_bytes| on disk (at least one
+    // entry is returned). Entries are appended to |entries| with a reference
+    // added, and their bytes on disk are added to |bytes|. |check_data| is
+    // the same as get().
+    // Return the number of got entries, -1 on error.
+    int get_range(const int64_t first_index, const int64_t last_index,
+                  size_t max_bytes, std::vector<LogEntry*>* entries,
+                  size_t* bytes, bool check_data = true) const;
 
     // get entry's term by index
     int64_t get_term(const int64_t index) const;
@@ -72,8 +254,12 @@ public:
     // sync open segment
     int sync(bool will_sync, bool has_conf = false);
 
-    // unlink segment
-    int unlink();
+    // check sync policy, return true if the unsynced data should be synced now
+    bool should_sync(bool will_sync, bool has_conf = false);
+
+    // unlink segment, the file is handed over to |pool| for reuse if it's
+    // not NULL
+    int unlink(SegmentFilePool* pool = NULL);
 
     // truncate segment to last_index_kept
     int truncate(const int64_t last_index_kept);
@@ -82,8 +268,14 @@ public:
         return _is_open;
     }
 
+    // size of the segment including the deferred appends in flight
     int64_t bytes() const {
-        return _bytes;
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _bytes + _deferred_bytes;
+    }
+
+    int fd() const {
+        return _fd;
     }
 
     int64_t first_index() const {
@@ -97,12 +289,7 @@ public:
     std::string file_name();
 private:
 friend class butil::RefCountedThreadSafe<Segment>;
-    ~Segment() {
-        if (_fd >= 0) {
-            ::close(_fd);
-            _fd = -1;
-        }
-    }
+    ~Segment();
 
     struct LogMeta {
         off_t offset;
@@ -113,10 +300,73 @@ friend class butil::RefCountedThreadSafe<Segment>;
     int _load_entry(off_t offset, EntryHeader *head, butil::IOBuf *body, 
                     size_t size_hint) const;
 
+    int _parse_entry_header(const char* p, off_t offset, EntryHeader* head) const;
+
+    // Map closed segment on demand, return the referenced mapping or NULL
+    // if the segment can't be read through mmap
+    SegmentMapping* _get_mapping() const;
+
+    int _load_entry_from_mapping(SegmentMapping* mapping, const LogMeta& meta,
+                                 bool check_data, EntryHeader* head,
+                                 butil::IOBuf* body) const;
+
     int _get_meta(int64_t index, LogMeta* meta) const;
 
+    // cut the entry described by |meta| from the front of |buf|
+    int _cut_entry(const LogMeta& meta, butil::IOBuf* buf, EntryHeader* head,
+                   butil::IOBuf* body) const;
+
+    // build the entry at |index| from its header and body on disk
+    LogEntry* _make_entry(int64_t index, const EntryHeader& header,
+                          butil::IOBuf* body) const;
+
+    int _serialize_entry(const LogEntry* entry, butil::IOBuf* buf) const;
+
+    // serialize entries[start, ...) which begin with |first_index| at
+    // |offset| of the file
+    int _serialize_entries(const std::vector<LogEntry*>& entries, size_t start,
+                           int64_t first_index, int64_t offset,
+                           butil::IOBuf* buf,
+                           std::vector<std::pair<int64_t, int64_t> >* metas) const;
+
+    void _commit_entries(const std::vector<LogEntry*>& entries, size_t start,
+                         const std::vector<std::pair<int64_t, int64_t> >& metas,
+                         size_t bytes);
+
+    // wait until the deferred appends in flight are committed
+    void _wait_deferred() {
+        _deferred_event.wait();
+    }
+
+    int _write_to_fd(butil::IOBuf* buf, off_t offset);
+
+    // open |path| with O_DIRECT for the writes of open segment, fall back to
+    // the page cache if the file system doesn't support it
+    void _open_direct(const std::string& path);
+
+    void _close_direct();
+
+    // read the partial block at the end of the file into _direct_buf
+    int _load_direct_tail();
+
+    int _write_direct(butil::IOBuf* buf, off_t offset);
+
     int _truncate_meta_and_get_last(int64_t last);
 
+    std::string _index_path() const;
+
+    // write the offset index file of closed segment
+    int _save_index();
+
+    // load _meta_index and configuration entries from the offset index file,
+    // return 0 on success, -1 if the index is missing or doesn't match the
+    // segment of |file_size|
+    int _load_index(int64_t file_size, std::vector<ConfigurationEntry>* conf_entries);
+
+    int _parse_index(const char* data, size_t len, int64_t file_size,
+                     SegmentMetaIndex* meta_index,
+                     std::vector<int64_t>* conf_indexes) const;
+
     std::string _path;
     int64_t _bytes;
     int64_t _unsynced_bytes;
@@ -126,7 +376,35 @@ friend class butil::RefCountedThreadSafe<Segment>;
     const int64_t _first_index;
     butil::atomic<int64_t> _last_index;
     int _checksum_type;
-    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term;
+    // codec of the data of appended entries, brpc::CompressType
+    int _compress_type;
+    SegmentMetaIndex _meta_index;
+    // indexes of configuration entries
+    std::vector<int64_t> _conf_indexes;
+    // deferred appends in the order of their offsets, guarded by _mutex
+    std::deque<DeferredAppend*> _deferred;
+    int64_t _deferred_bytes;
+    int64_t _deferred_entries;
+    // a deferred write failed, the appends after it are dropped
+    bool _deferred_failed;
+    bthread::CountdownEvent _deferred_event;
+    // read-only mapping of closed segment, guarded by _mutex
+    mutable SegmentMapping* _mapping;
+    // the file was mapped once, its pages may be still referenced after the
+    // mapping is released, guarded by _mutex
+    mutable bool _ever_mapped;
+    // the file is handed over to SegmentFilePool and never mapped again,
+    // guarded by _mutex
+    bool _recycled;
+    // file of open segment is larger than _bytes, the tail is zeroed
+    bool _preallocated;
+    // write open segment through _direct_fd opened with O_DIRECT
+    bool _direct_io;
+    int _direct_fd;
+    // aligned staging buffer of direct writes, starts with the partial block
+    // at the end of the file
+    char* _direct_buf;
+    size_t _direct_buf_size;
 };
 
 // LogStorage use segmented append-only file, all data in disk, all index in memory.
@@ -145,17 +423,25 @@ public:
         , _first_log_index(1)
         , _last_log_index(0)
         , _checksum_type(0)
+        , _preferred_checksum_type(-1)
+        , _compress_type(0)
+        , _direct_io(false)
         , _enable_sync(enable_sync)
+        , _uring(NULL)
     {} 
 
     SegmentLogStorage()
         : _first_log_index(1)
         , _last_log_index(0)
         , _checksum_type(0)
+        , _preferred_checksum_type(-1)
+        , _compress_type(0)
+        , _direct_io(false)
         , _enable_sync(true)
+        , _uring(NULL)
     {}
 
-    virtual ~SegmentLogStorage() {}
+    virtual ~SegmentLogStorage();
 
     // init logstorage, check consistency and integrity
     virtual int init(ConfigurationManager* configuration_manager);
@@ -174,12 +460,29 @@ public:
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index);
 
+    // get logentries in [first_index, last_index] with one read per segment
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // append entry to log
     int append_entry(const LogEntry* entry);
 
     // append entries to log and update IOMetric, return success append number
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric);
 
+    // append entries to log through io_uring if raft_log_io_uring is set,
+    // |callback| is called after the writes and syncs complete
+    virtual void append_entries_async(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric,
+                                      AppendEntriesCallback* callback);
+
+    // append entries to log, the segments to be synced are recorded and
+    // synced by sync_appended_entries()
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric);
+
+    virtual int sync_appended_entries();
+
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept);
 
@@ -202,6 +505,12 @@ public:
     void sync();
 private:
     scoped_refptr<Segment> open_segment();
+    // Write |entries| to the open segments without syncing, the written
+    // segments are appended to |segments|
+    int append_to_segments(const std::vector<LogEntry*>& entries,
+                           IOMetric* metric,
+                           std::vector<scoped_refptr<Segment> >* segments,
+                           bool* has_conf);
     int save_meta(const int64_t log_index);
     int load_meta();
     int list_segments(bool is_empty);
@@ -223,7 +532,18 @@ private:
     SegmentMap _segments;
     scoped_refptr<Segment> _open_segment;
     int _checksum_type;
+    // set by "checksum" of the uri, -1 to choose by CPU features
+    int _preferred_checksum_type;
+    // set by "compress" of the uri, brpc::CompressType
+    int _compress_type;
+    // set by "direct_io" of the uri
+    bool _direct_io;
     bool _enable_sync;
+    UringWriter* _uring;
+    scoped_refptr<SegmentFilePool> _file_pool;
+    // Segments appended by append_entries_nosync() and not synced yet
+    raft_mutex_t _unsynced_mutex;
+    std::vector<scoped_refptr<Segment> > _unsynced_segments;
 };
 
 }  //  namespace braft
@@ -0,0 +1,214 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/log_buffer.h"
+
+#include <algorithm>
+#include <butil/logging.h>
+#include <bvar/bvar.h>
+
+namespace braft {
+
+const static size_t MIN_RING_CAPACITY = 1024;
+
+static bvar::Adder<int64_t> g_memory_log_bytes("raft_memory_log_bytes");
+static bvar::Adder<int64_t> g_memory_log_count("raft_memory_log_count");
+
+MemoryLogBuffer::Ring::Ring(size_t capacity)
+    : mask(capacity - 1)
+    , slots(new butil::atomic<LogEntry*>[capacity]) {
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].store(NULL, butil::memory_order_relaxed);
+    }
+}
+
+MemoryLogBuffer::Ring::~Ring() {
+    delete [] slots;
+}
+
+MemoryLogBuffer::ReadGuard::ReadGuard(const MemoryLogBuffer* buf) {
+    while (true) {
+        const uint64_t epoch = buf->_epoch.load(butil::memory_order_seq_cst);
+        _counter = &buf->_readers[epoch & 1];
+        _counter->n.fetch_add(1, butil::memory_order_seq_cst);
+        // The writer might have advanced before the registration was seen
+        if (buf->_epoch.load(butil::memory_order_seq_cst) == epoch) {
+            return;
+        }
+        _counter->n.fetch_sub(1, butil::memory_order_release);
+    }
+}
+
+MemoryLogBuffer::ReadGuard::~ReadGuard() {
+    _counter->n.fetch_sub(1, butil::memory_order_release);
+}
+
+MemoryLogBuffer::MemoryLogBuffer()
+    : _ring(new Ring(MIN_RING_CAPACITY))
+    , _first_index(1)
+    , _last_index(0)
+    , _bytes(0)
+    , _epoch(0) {
+    _readers[0].n.store(0, butil::memory_order_relaxed);
+    _readers[1].n.store(0, butil::memory_order_relaxed);
+}
+
+MemoryLogBuffer::~MemoryLogBuffer() {
+    std::vector<LogEntry*> released;
+    clear(&released);
+    for (int i = 0; i < 2; ++i) {
+        released.insert(released.end(), _retired[i].begin(), _retired[i].end());
+        for (size_t j = 0; j < _retired_rings[i].size(); ++j) {
+            delete _retired_rings[i][j];
+        }
+    }
+    for (size_t i = 0; i < released.size(); ++i) {
+        released[i]->Release();
+    }
+    delete _ring.load(butil::memory_order_relaxed);
+}
+
+LogEntry* MemoryLogBuffer::_slot_entry(int64_t index) const {
+    if (index < _first_index.load(butil::memory_order_acquire)
+            || index > _last_index.load(butil::memory_order_acquire)) {
+        return NULL;
+    }
+    const Ring* ring = _ring.load(butil::memory_order_acquire);
+    LogEntry* entry = ring->slots[index & ring->mask].load(
+                                butil::memory_order_acquire);
+    // The slot might have been reused by another index in the meantime
+    if (entry == NULL || entry->id.index != index) {
+        return NULL;
+    }
+    return entry;
+}
+
+LogEntry* MemoryLogBuffer::get(int64_t index) const {
+    ReadGuard guard(this);
+    LogEntry* entry = _slot_entry(index);
+    if (entry) {
+        entry->AddRef();
+    }
+    return entry;
+}
+
+int64_t MemoryLogBuffer::get_term(int64_t index) const {
+    ReadGuard guard(this);
+    LogEntry* entry = _slot_entry(index);
+    return entry ? entry->id.term : 0;
+}
+
+LogEntry* MemoryLogBuffer::at(int64_t index) const {
+    if (index < first_index() || index > last_index()) {
+        return NULL;
+    }
+    const Ring* ring = _ring.load(butil::memory_order_relaxed);
+    return ring->slots[index & ring->mask].load(butil::memory_order_relaxed);
+}
+
+void MemoryLogBuffer::push_back(LogEntry* entry) {
+    const int64_t index = entry->id.index;
+    Ring* ring = _ring.load(butil::memory_order_relaxed);
+    if (empty()) {
+        _first_index.store(index, butil::memory_order_release);
+    } else {
+        CHECK_EQ(index, last_index() + 1);
+        if (size() > ring->mask) {
+            // Full, copy the entries into a larger ring while the readers
+            // may still look up the old one
+            Ring* new_ring = new Ring((ring->mask + 1) * 2);
+            for (int64_t i = first_index(); i <= last_index(); ++i) {
+                new_ring->slots[i & new_ring->mask].store(
+                        ring->slots[i & ring->mask].load(butil::memory_order_relaxed),
+                        butil::memory_order_relaxed);
+            }
+            _ring.store(new_ring, butil::memory_order_release);
+            _retired_rings[_epoch.load(butil::memory_order_relaxed) & 1]
+                    .push_back(ring);
+            ring = new_ring;
+        }
+    }
+    ring->slots[index & ring->mask].store(entry, butil::memory_order_release);
+    _last_index.store(index, butil::memory_order_release);
+    _add_bytes(entry, 1);
+}
+
+void MemoryLogBuffer::_add_bytes(LogEntry* entry, int sign) {
+    const int64_t size = entry_bytes(entry);
+    _bytes.store(bytes() + sign * size, butil::memory_order_relaxed);
+    g_memory_log_bytes << sign * size;
+    g_memory_log_count << sign;
+}
+
+void MemoryLogBuffer::_retire(LogEntry* entry) {
+    _add_bytes(entry, -1);
+    _retired[_epoch.load(butil::memory_order_relaxed) & 1].push_back(entry);
+}
+
+void MemoryLogBuffer::pop_front(size_t n, std::vector<LogEntry*>* released) {
+    n = std::min(n, size());
+    if (n == 0) {
+        return;
+    }
+    const Ring* ring = _ring.load(butil::memory_order_relaxed);
+    const int64_t first = first_index();
+    _first_index.store(first + n, butil::memory_order_release);
+    for (int64_t i = first; i < first + (int64_t)n; ++i) {
+        _retire(ring->slots[i & ring->mask].exchange(
+                        NULL, butil::memory_order_relaxed));
+    }
+    _try_advance(released);
+}
+
+void MemoryLogBuffer::pop_back(size_t n, std::vector<LogEntry*>* released) {
+    n = std::min(n, size());
+    if (n == 0) {
+        return;
+    }
+    const Ring* ring = _ring.load(butil::memory_order_relaxed);
+    const int64_t last = last_index();
+    _last_index.store(last - n, butil::memory_order_release);
+    for (int64_t i = last; i > last - (int64_t)n; --i) {
+        _retire(ring->slots[i & ring->mask].exchange(
+                        NULL, butil::memory_order_relaxed));
+    }
+    _try_advance(released);
+}
+
+void MemoryLogBuffer::clear(std::vector<LogEntry*>* released) {
+    if (!empty()) {
+        return pop_front(size(), released);
+    }
+    _try_advance(released);
+}
+
+void MemoryLogBuffer::_try_advance(std::vector<LogEntry*>* released) {
+    const uint64_t epoch = _epoch.load(butil::memory_order_relaxed);
+    // Readers of the previous epoch registered at the other parity
+    const int older = (epoch + 1) & 1;
+    if (_readers[older].n.load(butil::memory_order_seq_cst) != 0) {
+        return;
+    }
+    // Nothing retired in the previous epoch can be seen any more: the readers
+    // of the current and the following epochs started after it was removed
+    released->insert(released->end(), _retired[older].begin(), _retired[older].end());
+    _retired[older].clear();
+    for (size_t i = 0; i < _retired_rings[older].size(); ++i) {
+        delete _retired_rings[older][i];
+    }
+    _retired_rings[older].clear();
+    _epoch.store(epoch + 1, butil::memory_order_seq_cst);
+}
+
+}  //  namespace braft
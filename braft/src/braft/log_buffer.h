@@ -0,0 +1,131 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LOG_BUFFER_H
+#define BRAFT_LOG_BUFFER_H
+
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/macros.h>                        // BAIDU_CACHELINE_ALIGNMENT
+#include "braft/log_entry.h"                     // LogEntry
+
+namespace braft {
+
+// Consecutive log entries in memory, kept in a ring indexed by log index.
+//
+// There's only one writer at a time, which is serialized by the caller, and
+// any number of readers calling get()/get_term() without any lock. Entries
+// removed by the writer are not released until all the readers which might
+// have seen them are done: readers register in the current epoch, and the
+// entries retired in an epoch are released once the writer has advanced
+// two epochs, which it only does when no reader is left in the older one.
+class MemoryLogBuffer {
+public:
+    MemoryLogBuffer();
+    ~MemoryLogBuffer();
+
+    // Get the entry at |index| with a reference added, NULL if it's not in
+    // the buffer. Lock-free.
+    LogEntry* get(int64_t index) const;
+
+    // Get the term of the entry at |index|, 0 if it's not in the buffer.
+    // Lock-free.
+    int64_t get_term(int64_t index) const;
+
+    // The following are for the writer only
+
+    bool empty() const {
+        return last_index() < first_index();
+    }
+    size_t size() const {
+        return empty() ? 0 : last_index() - first_index() + 1;
+    }
+    int64_t first_index() const {
+        return _first_index.load(butil::memory_order_relaxed);
+    }
+    int64_t last_index() const {
+        return _last_index.load(butil::memory_order_relaxed);
+    }
+    LogEntry* front() const { return at(first_index()); }
+    // Bytes of the entries in the buffer, readable by anyone
+    int64_t bytes() const {
+        return _bytes.load(butil::memory_order_relaxed);
+    }
+    LogEntry* back() const { return at(last_index()); }
+
+    // Bytes taken by |entry| when it's in the buffer
+    static int64_t entry_bytes(const LogEntry* entry) {
+        return sizeof(LogEntry) + entry->data.length();
+    }
+
+    // Get the entry at |index| without adding a reference, NULL if it's not
+    // in the buffer
+    LogEntry* at(int64_t index) const;
+
+    // Append |entry| right after the last entry, the reference of the caller
+    // is taken over
+    void push_back(LogEntry* entry);
+
+    // Remove the first or the last |n| entries, or all of them. Removed
+    // entries are released later, the entries which become safe to release
+    // are appended to |released| and the caller should release them,
+    // preferably out of its lock. clear() on an empty buffer still collects
+    // the entries which are safe to release.
+    void pop_front(size_t n, std::vector<LogEntry*>* released);
+    void pop_back(size_t n, std::vector<LogEntry*>* released);
+    void clear(std::vector<LogEntry*>* released);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MemoryLogBuffer);
+
+    struct Ring {
+        explicit Ring(size_t capacity);
+        ~Ring();
+        size_t mask;
+        butil::atomic<LogEntry*>* slots;
+    };
+
+    struct BAIDU_CACHELINE_ALIGNMENT ReaderCounter {
+        butil::atomic<int64_t> n;
+    };
+
+    // Registered as a reader of the current epoch in the scope
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const MemoryLogBuffer* buf);
+        ~ReadGuard();
+    private:
+        ReaderCounter* _counter;
+    };
+
+    LogEntry* _slot_entry(int64_t index) const;
+    void _add_bytes(LogEntry* entry, int sign);
+    void _retire(LogEntry* entry);
+    void _try_advance(std::vector<LogEntry*>* released);
+
+    butil::atomic<Ring*> _ring;
+    butil::atomic<int64_t> _first_index;
+    butil::atomic<int64_t> _last_index;
+    butil::atomic<int64_t> _bytes;
+
+    butil::atomic<uint64_t> _epoch;
+    mutable ReaderCounter _readers[2];
+    // Entries and rings retired in the epochs of the same parity
+    std::vector<LogEntry*> _retired[2];
+    std::vector<Ring*> _retired_rings[2];
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_BUFFER_H
@@ -0,0 +1,136 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/log_cache.h"
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>         // BRPC_VALIDATE_GFLAG
+
+namespace braft {
+
+DEFINE_int32(raft_log_cache_max_bytes, 8 * 1024 * 1024,
+             "Max bytes of the entries read from log storage cached by each"
+             " raft node, 0 disables the cache");
+BRPC_VALIDATE_GFLAG(raft_log_cache_max_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_log_cache_shards, 16,
+             "Number of shards of the cache of the entries read from log storage");
+
+static bvar::Adder<int64_t> g_log_cache_hit("raft_log_cache_hit_count");
+static bvar::Adder<int64_t> g_log_cache_miss("raft_log_cache_miss_count");
+static bvar::Adder<int64_t> g_log_cache_bytes("raft_log_cache_bytes");
+
+LogEntryCache::LogEntryCache()
+    : _version(0)
+    , _nshards(std::max(FLAGS_raft_log_cache_shards, 1))
+    , _max_shard_bytes(FLAGS_raft_log_cache_max_bytes / _nshards)
+    , _shards(new Shard[_nshards])
+{}
+
+LogEntryCache::~LogEntryCache() {
+    clear();
+    delete [] _shards;
+}
+
+void LogEntryCache::remove(Shard* shard, std::map<int64_t, Node*>::iterator it) {
+    Node* node = it->second;
+    node->RemoveFromList();
+    shard->bytes -= node->size;
+    g_log_cache_bytes << -(int64_t)node->size;
+    node->entry->Release();
+    shard->nodes.erase(it);
+    delete node;
+}
+
+LogEntry* LogEntryCache::get(int64_t index) {
+    if (_max_shard_bytes == 0) {
+        return NULL;
+    }
+    Shard* shard = shard_of(index);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    std::map<int64_t, Node*>::iterator it = shard->nodes.find(index);
+    if (it == shard->nodes.end()) {
+        g_log_cache_miss << 1;
+        return NULL;
+    }
+    g_log_cache_hit << 1;
+    Node* node = it->second;
+    node->RemoveFromList();
+    shard->lru.Append(node);
+    node->entry->AddRef();
+    return node->entry;
+}
+
+void LogEntryCache::put(LogEntry* entry, int64_t version) {
+    const size_t size = sizeof(LogEntry) + entry->data.length();
+    if (size > _max_shard_bytes) {
+        return;
+    }
+    Shard* shard = shard_of(entry->id.index);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    if (_version.load(butil::memory_order_relaxed) != version) {
+        // The entry might have been truncated after it was read
+        return;
+    }
+    std::map<int64_t, Node*>::iterator it = shard->nodes.find(entry->id.index);
+    if (it != shard->nodes.end()) {
+        remove(shard, it);
+    }
+    while (shard->bytes + size > _max_shard_bytes) {
+        // Evict the least recently used
+        Node* victim = shard->lru.head()->value();
+        remove(shard, shard->nodes.find(victim->entry->id.index));
+    }
+    Node* node = new Node;
+    node->entry = entry;
+    node->size = size;
+    entry->AddRef();
+    shard->nodes[entry->id.index] = node;
+    shard->lru.Append(node);
+    shard->bytes += size;
+    g_log_cache_bytes << (int64_t)size;
+}
+
+void LogEntryCache::truncate_prefix(int64_t first_index_kept) {
+    for (size_t i = 0; i < _nshards; ++i) {
+        Shard* shard = &_shards[i];
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        while (!shard->nodes.empty()
+                && shard->nodes.begin()->first < first_index_kept) {
+            remove(shard, shard->nodes.begin());
+        }
+    }
+}
+
+void LogEntryCache::truncate_suffix(int64_t last_index_kept) {
+    // Entries being read before now are not added any more
+    _version.fetch_add(1, butil::memory_order_release);
+    for (size_t i = 0; i < _nshards; ++i) {
+        Shard* shard = &_shards[i];
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        std::map<int64_t, Node*>::iterator it =
+                shard->nodes.upper_bound(last_index_kept);
+        while (it != shard->nodes.end()) {
+            remove(shard, it++);
+        }
+    }
+}
+
+void LogEntryCache::clear() {
+    truncate_suffix(0);
+}
+
+}  //  namespace braft
@@ -0,0 +1,87 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_LOG_CACHE_H
+#define BRAFT_LOG_CACHE_H
+
+#include <map>
+#include <butil/atomicops.h>
+#include <butil/containers/linked_list.h>       // butil::LinkedList
+#include "braft/log_entry.h"                     // LogEntry
+#include "braft/util.h"                          // raft_mutex_t
+
+namespace braft {
+
+// Cache of the entries read from LogStorage, so that followers catching up
+// the same range don't read the entries from disk again and again.
+// Entries are evicted in LRU order once the cached bytes exceed
+// max_bytes, which is divided among the shards.
+class LogEntryCache {
+public:
+    LogEntryCache();
+    ~LogEntryCache();
+
+    // Version of the cached entries, changed once they are invalidated
+    int64_t version() const {
+        return _version.load(butil::memory_order_acquire);
+    }
+
+    // Returns the entry at |index| with a reference added, NULL if missing
+    LogEntry* get(int64_t index);
+
+    // Add |entry| read at |version|, which is ignored if the cache has been
+    // invalidated since then
+    void put(LogEntry* entry, int64_t version);
+
+    // Drop the entries in [1, first_index_kept)
+    void truncate_prefix(int64_t first_index_kept);
+
+    // Drop the entries in (last_index_kept, infinity)
+    void truncate_suffix(int64_t last_index_kept);
+
+    // Drop all the entries
+    void clear();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntryCache);
+
+    struct Node : public butil::LinkNode<Node> {
+        LogEntry* entry;
+        size_t size;
+    };
+
+    struct Shard {
+        Shard() : bytes(0) {}
+        raft_mutex_t mutex;
+        std::map<int64_t, Node*> nodes;
+        // The least recently used node is at the head
+        butil::LinkedList<Node> lru;
+        size_t bytes;
+    };
+
+    static void remove(Shard* shard, std::map<int64_t, Node*>::iterator it);
+
+    Shard* shard_of(int64_t index) {
+        return &_shards[index % _nshards];
+    }
+
+    butil::atomic<int64_t> _version;
+    size_t _nshards;
+    size_t _max_shard_bytes;
+    Shard* _shards;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_CACHE_H
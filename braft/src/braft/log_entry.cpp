@@ -21,7 +21,9 @@ namespace braft {
 
 bvar::Adder<int64_t> g_nentries("raft_num_log_entries");
 
-LogEntry::LogEntry(): type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL) {
+LogEntry::LogEntry()
+    : type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL)
+    , data_checksum(0), has_data_checksum(false) {
     g_nentries << 1;
 }
 
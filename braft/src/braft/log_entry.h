@@ -42,6 +42,10 @@ public:
     std::vector<PeerId>* peers; // peers
     std::vector<PeerId>* old_peers; // peers
     butil::IOBuf data;
+    // crc32c of |data|, computed once where the entry is created and carried
+    // to the followers and the log storage, valid if has_data_checksum
+    uint32_t data_checksum;
+    bool has_data_checksum;
 
     LogEntry();
 
@@ -30,6 +30,19 @@ namespace braft {
 DEFINE_int32(raft_leader_batch, 256, "max leader io batch");
 BRPC_VALIDATE_GFLAG(raft_leader_batch, ::brpc::PositiveInteger);
 
+DEFINE_int32(raft_max_append_buffer_size, 256 * 1024, 
+             "Flush buffer to LogStorage if the buffer size reaches the limit");
+
+DEFINE_int64(raft_max_memory_log_bytes, 0,
+             "Max bytes of the log entries kept in memory by each raft node."
+             " Beyond it the entries on disk are evicted even if they are not"
+             " applied yet, and new tasks are rejected with EBUSY if the entries"
+             " not on disk still exceed it. 0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_max_memory_log_bytes, brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_memory_log_evicted
+            ("raft_memory_log_evicted_count");
+
 static bvar::Adder<int64_t> g_read_entry_from_storage
             ("raft_read_entry_from_storage_count");
 static bvar::PerSecond<bvar::Adder<int64_t> > g_read_entry_from_storage_second
@@ -50,6 +63,20 @@ static bvar::Adder<int64_t> g_storage_append_entries_concurrency(
 static bvar::CounterRecorder g_storage_flush_batch_counter(
                                         "raft_storage_flush_batch_counter");
 
+DEFINE_bool(raft_pipeline_log_sync, false,
+            "Sync the appended logs in another bthread while the disk thread"
+            " writes the following batches, which takes the place of io_uring."
+            " Closures are still run in order after the logs are synced");
+BRPC_VALIDATE_GFLAG(raft_pipeline_log_sync, ::brpc::PassValidate);
+
+static bvar::CounterRecorder g_storage_sync_batch_counter(
+                                        "raft_storage_sync_batch_counter");
+
+static bvar::IntRecorder g_storage_batch_count_limit(
+                                        "raft_storage_batch_count_limit");
+static bvar::IntRecorder g_storage_batch_bytes_limit(
+                                        "raft_storage_batch_bytes_limit");
+
 
 void LogManager::StableClosure::update_metric(IOMetric* m) {
     metric.open_segment_time_us = m->open_segment_time_us;
@@ -69,8 +96,13 @@ LogManager::LogManager()
     , _stopped(false)
     , _has_error(false)
     , _next_wait_id(0)
+    , _bytes_not_on_disk(0)
+    , _stable_index(0)
     , _first_log_index(0)
     , _last_log_index(0)
+    , _draining_batches(false)
+    , _inflight_event(0)
+    , _disk_batch_limit(FLAGS_raft_leader_batch, FLAGS_raft_max_append_buffer_size)
 {
     CHECK_EQ(0, start_disk_thread());
 }
@@ -96,21 +128,26 @@ int LogManager::init(const LogManagerOptions &options) {
     // Term will be 0 if the node has no logs, and we will correct the value
     // after snapshot load finish.
     _disk_id.term = _log_storage->get_term(_last_log_index);
+    _submitted_id = _disk_id;
+    _stable_index = _last_log_index;
     _fsm_caller = options.fsm_caller;
     return 0;
 }
 
 LogManager::~LogManager() {
     stop_disk_thread();
-    for (size_t i = 0; i < _logs_in_memory.size(); ++i) {
-        _logs_in_memory[i]->Release();
-    }
-    _logs_in_memory.clear();
 }
 
 int LogManager::start_disk_thread() {
     bthread::ExecutionQueueOptions queue_options;
     queue_options.bthread_attr = BTHREAD_ATTR_NORMAL;
+    const int rc = bthread::execution_queue_start(&_sync_queue,
+                                   &queue_options,
+                                   sync_thread,
+                                   this);
+    if (rc != 0) {
+        return rc;
+    }
     return bthread::execution_queue_start(&_disk_queue,
                                    &queue_options,
                                    disk_thread,
@@ -119,30 +156,43 @@ int LogManager::start_disk_thread() {
 
 int LogManager::stop_disk_thread() {
     bthread::execution_queue_stop(_disk_queue);
-    return bthread::execution_queue_join(_disk_queue);
+    const int rc = bthread::execution_queue_join(_disk_queue);
+    // The disk thread has waited for the batches being synced
+    bthread::execution_queue_stop(_sync_queue);
+    bthread::execution_queue_join(_sync_queue);
+    return rc;
 }
 
 void LogManager::clear_memory_logs(const LogId& id) {
-    LogEntry* entries_to_clear[256];
+    const size_t max_entries_to_clear = 256;
+    std::vector<LogEntry*> entries_to_release;
     size_t nentries = 0;
     do {
         nentries = 0;
         {
             BAIDU_SCOPED_LOCK(_mutex);
-            while (!_logs_in_memory.empty() 
-                    && nentries < ARRAY_SIZE(entries_to_clear)) {
-                LogEntry* entry = _logs_in_memory.front();
+            const int64_t first_index = _logs_in_memory.first_index();
+            while (nentries < _logs_in_memory.size()
+                    && nentries < max_entries_to_clear) {
+                LogEntry* entry = _logs_in_memory.at(first_index + nentries);
                 if (entry->id > id) {
                     break;
                 }
-                entries_to_clear[nentries++] = entry;
-                _logs_in_memory.pop_front();
+                ++nentries;
             }
+            // Entries not applied yet are read from storage later
+            const int64_t nevicted = first_index + (int64_t)nentries - 1
+                                     - std::max(_applied_id.index, first_index - 1);
+            if (nevicted > 0) {
+                g_memory_log_evicted << nevicted;
+            }
+            _logs_in_memory.pop_front(nentries, &entries_to_release);
         }  // out of _mutex
-        for (size_t i = 0; i < nentries; ++i) {
-            entries_to_clear[i]->Release();
+        for (size_t i = 0; i < entries_to_release.size(); ++i) {
+            entries_to_release[i]->Release();
         }
-    } while (nentries == ARRAY_SIZE(entries_to_clear));
+        entries_to_release.clear();
+    } while (nentries == max_entries_to_clear);
 }
 
 int64_t LogManager::first_log_index() {
@@ -250,24 +300,15 @@ private:
 
 int LogManager::truncate_prefix(const int64_t first_index_kept,
                                 std::unique_lock<raft_mutex_t>& lck) {
-    std::deque<LogEntry*> saved_logs_in_memory;
-    // As the duration between two snapshot (which leads to truncate_prefix at
-    // last) is likely to be a long period, _logs_in_memory is likely to
-    // contain a large amount of logs to release, which holds the mutex so that
-    // all the replicator/application are blocked.
-    // FIXME(chenzhangyi01): to resolve this issue, we have to build a data
-    // structure which is able to pop_front/pop_back N elements into another
-    // container in O(1) time, one solution is a segmented double-linked list
-    // along with a bounded queue as the indexer, of which the payoff is that
-    // _logs_in_memory has to be bounded.
-    while (!_logs_in_memory.empty()) {
-        LogEntry* entry = _logs_in_memory.front();
-        if (entry->id.index < first_index_kept) {
-            saved_logs_in_memory.push_back(entry);
-            _logs_in_memory.pop_front();
-        } else {
-            break;
-        }
+    std::vector<LogEntry*> saved_logs_in_memory;
+    // Entries in _logs_in_memory are consecutive, the popped ones are
+    // released out of the mutex
+    if (!_logs_in_memory.empty()
+            && _logs_in_memory.first_index() < first_index_kept) {
+        unsafe_sub_bytes_not_on_disk(_logs_in_memory.first_index(),
+                                     first_index_kept - 1);
+        _logs_in_memory.pop_front(first_index_kept - _logs_in_memory.first_index(),
+                                  &saved_logs_in_memory);
     }
     CHECK_GE(first_index_kept, _first_log_index);
     _first_log_index = first_index_kept;
@@ -276,6 +317,7 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
         _last_log_index = first_index_kept - 1;
     }
     _config_manager->truncate_prefix(first_index_kept);
+    _entry_cache.truncate_prefix(first_index_kept);
     TruncatePrefixClosure* c = new TruncatePrefixClosure(first_index_kept);
     const int rc = bthread::execution_queue_execute(_disk_queue, c);
     lck.unlock();
@@ -288,12 +330,15 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
 int LogManager::reset(const int64_t next_log_index,
                       std::unique_lock<raft_mutex_t>& lck) {
     CHECK(lck.owns_lock());
-    std::deque<LogEntry*> saved_logs_in_memory;
-    saved_logs_in_memory.swap(_logs_in_memory);
+    std::vector<LogEntry*> saved_logs_in_memory;
+    _logs_in_memory.clear(&saved_logs_in_memory);
+    _bytes_not_on_disk.store(0, butil::memory_order_relaxed);
+    _stable_index = next_log_index - 1;
     _first_log_index = next_log_index;
     _last_log_index = next_log_index - 1;
     _config_manager->truncate_prefix(_first_log_index);
     _config_manager->truncate_suffix(_last_log_index);
+    _entry_cache.clear();
     ResetClosure* c = new ResetClosure(next_log_index);
     const int ret = bthread::execution_queue_execute(_disk_queue, c);
     lck.unlock();
@@ -312,20 +357,27 @@ void LogManager::unsafe_truncate_suffix(const int64_t last_index_kept) {
         return;
     }
 
-    while (!_logs_in_memory.empty()) {
-        LogEntry* entry = _logs_in_memory.back();
-        if (entry->id.index > last_index_kept) {
-            entry->Release();
-            _logs_in_memory.pop_back();
-        } else {
-            break;
-        }
+    std::vector<LogEntry*> entries_to_release;
+    if (!_logs_in_memory.empty()
+            && _logs_in_memory.last_index() > last_index_kept) {
+        unsafe_sub_bytes_not_on_disk(last_index_kept + 1,
+                                     _logs_in_memory.last_index());
+        _logs_in_memory.pop_back(
+                _logs_in_memory.last_index() - std::max(last_index_kept,
+                        _logs_in_memory.first_index() - 1),
+                &entries_to_release);
+    }
+    for (size_t i = 0; i < entries_to_release.size(); ++i) {
+        entries_to_release[i]->Release();
     }
+    // The entries appended after last_index_kept are not on disk
+    _stable_index = std::min(_stable_index, last_index_kept);
     _last_log_index = last_index_kept;
     const int64_t last_term_kept = unsafe_get_term(last_index_kept);
     CHECK(last_index_kept == 0 || last_term_kept != 0)
         << "last_index_kept=" << last_index_kept;
     _config_manager->truncate_suffix(last_index_kept);
+    _entry_cache.truncate_suffix(last_index_kept);
     TruncateSuffixClosure* tsc = new
             TruncateSuffixClosure(last_index_kept, last_term_kept);
     CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, tsc));
@@ -437,7 +489,14 @@ void LogManager::append_entries(
 
     if (!entries->empty()) {
         done->_first_log_index = entries->front()->id.index;
-        _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+        int64_t nbytes = 0;
+        for (size_t i = 0; i < entries->size(); ++i) {
+            nbytes += MemoryLogBuffer::entry_bytes((*entries)[i]);
+            _logs_in_memory.push_back((*entries)[i]);
+        }
+        _bytes_not_on_disk.store(
+                _bytes_not_on_disk.load(butil::memory_order_relaxed) + nbytes,
+                butil::memory_order_relaxed);
     }
 
     done->_entries.swap(*entries);
@@ -446,49 +505,155 @@ void LogManager::append_entries(
     wakeup_all_waiter(lck);
 }
 
-void LogManager::append_to_storage(std::vector<LogEntry*>* to_append, 
-                                   LogId* last_id, IOMetric* metric) {
-    if (!_has_error.load(butil::memory_order_relaxed)) {
-        size_t written_size = 0;
-        for (size_t i = 0; i < to_append->size(); ++i) {
-            written_size += (*to_append)[i]->data.size();
+class AppendBatch : public AppendEntriesCallback {
+public:
+    explicit AppendBatch(LogManager* lm)
+        : nappended(0), submitted(false), stable(false), written_size(0)
+        , _lm(lm) {}
+
+    void on_stable(int n) {
+        nappended = n;
+        _lm->on_batch_stable(this);
+    }
+
+    std::vector<LogEntry*> entries;
+    std::vector<LogManager::StableClosure*> closures;
+    IOMetric metric;
+    int nappended;
+    bool submitted;
+    bool stable;
+    size_t written_size;
+    butil::Timer timer;
+private:
+    LogManager* _lm;
+};
+
+void LogManager::append_to_storage(AppendBatch* batch, LogId* last_id) {
+    {
+        // Registered before submitting, as the callback may be run in place
+        BAIDU_SCOPED_LOCK(_inflight_mutex);
+        _inflight_batches.push_back(batch);
+    }
+    _inflight_event.add_count(1);
+    if (_has_error.load(butil::memory_order_relaxed)) {
+        return batch->on_stable(0);
+    }
+    for (size_t i = 0; i < batch->entries.size(); ++i) {
+        batch->written_size += batch->entries[i]->data.size();
+    }
+    *last_id = batch->entries.back()->id;
+    batch->submitted = true;
+    batch->timer.start();
+    g_storage_append_entries_concurrency << 1;
+    if (FLAGS_raft_pipeline_log_sync) {
+        // Synced by the sync thread while the following batches are written
+        batch->nappended = _log_storage->append_entries_nosync(
+                                    batch->entries, &batch->metric);
+        if (bthread::execution_queue_execute(_sync_queue, batch) != 0) {
+            const int rc = _log_storage->sync_appended_entries();
+            batch->on_stable(rc == 0 ? std::max(batch->nappended, 0) : 0);
         }
-        butil::Timer timer;
-        timer.start();
-        g_storage_append_entries_concurrency << 1;
-        int nappent = _log_storage->append_entries(*to_append, metric);
+        return;
+    }
+    _log_storage->append_entries_async(batch->entries, &batch->metric, batch);
+}
+
+int LogManager::sync_thread(void* meta,
+                            bthread::TaskIterator<AppendBatch*>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    LogManager* log_manager = static_cast<LogManager*>(meta);
+    std::vector<AppendBatch*> batches;
+    for (; iter; ++iter) {
+        batches.push_back(*iter);
+    }
+    // Batches are written before being queued, so they're all covered
+    const int rc = log_manager->_log_storage->sync_appended_entries();
+    g_storage_sync_batch_counter << batches.size();
+    for (size_t i = 0; i < batches.size(); ++i) {
+        AppendBatch* batch = batches[i];
+        batch->on_stable(rc == 0 ? std::max(batch->nappended, 0) : 0);
+    }
+    return 0;
+}
+
+void LogManager::on_batch_stable(AppendBatch* batch) {
+    std::unique_lock<raft_mutex_t> lck(_inflight_mutex);
+    batch->stable = true;
+    if (_draining_batches) {
+        // The draining thread will run it in order
+        return;
+    }
+    _draining_batches = true;
+    int nfinished = 0;
+    while (!_inflight_batches.empty() && _inflight_batches.front()->stable) {
+        AppendBatch* front = _inflight_batches.front();
+        _inflight_batches.pop_front();
+        lck.unlock();
+        finish_batch(front);
+        ++nfinished;
+        lck.lock();
+    }
+    _draining_batches = false;
+    lck.unlock();
+    // LogManager may be destroyed right after the signal
+    _inflight_event.signal(nfinished);
+}
+
+void LogManager::finish_batch(AppendBatch* batch) {
+    if (batch->submitted) {
+        batch->timer.stop();
         g_storage_append_entries_concurrency << -1;
-        timer.stop();
-        if (nappent != (int)to_append->size()) {
+        if (batch->nappended != (int)batch->entries.size()) {
             // FIXME
             LOG(ERROR) << "Fail to append_entries, "
-                       << "nappent=" << nappent 
-                       << ", to_append=" << to_append->size();
+                       << "nappent=" << batch->nappended
+                       << ", to_append=" << batch->entries.size();
             report_error(EIO, "Fail to append entries");
         }
-        if (nappent > 0) { 
-            *last_id = (*to_append)[nappent - 1]->id;
+        if (batch->nappended > 0) {
+            // Maybe not in the disk thread when LogStorage completes the
+            // batch. That's fine as _disk_id is only written here with
+            // _mutex held, and the disk thread waits for the batches in
+            // flight before truncating or resetting the storage
+            set_disk_id(batch->entries[batch->nappended - 1]->id);
         }
-        g_storage_append_entries_latency << timer.u_elapsed();
-        if (written_size) {
-            g_nomralized_append_entries_latency << timer.u_elapsed() * 1024 / written_size;
+        _disk_batch_limit.on_batch_done(batch->timer.u_elapsed(),
+                                        batch->closures.size(),
+                                        batch->written_size);
+        g_storage_append_entries_latency << batch->timer.u_elapsed();
+        if (batch->written_size) {
+            g_nomralized_append_entries_latency << 
+                    batch->timer.u_elapsed() * 1024 / batch->written_size;
         }
     }
-    for (size_t j = 0; j < to_append->size(); ++j) {
-        (*to_append)[j]->Release();
+    for (size_t i = 0; i < batch->entries.size(); ++i) {
+        batch->entries[i]->Release();
+    }
+    for (size_t i = 0; i < batch->closures.size(); ++i) {
+        StableClosure* done = batch->closures[i];
+        done->_entries.clear();
+        if (_has_error.load(butil::memory_order_relaxed)) {
+            done->status().set_error(EIO, "Corrupted LogStorage");
+        }
+        done->update_metric(&batch->metric);
+        done->Run();
     }
-    to_append->clear();
+    delete batch;
 }
 
-DEFINE_int32(raft_max_append_buffer_size, 256 * 1024, 
-             "Flush buffer to LogStorage if the buffer size reaches the limit");
+void LogManager::wait_for_inflight_batches() {
+    _inflight_event.wait();
+}
 
 class AppendBatcher {
 public:
-    AppendBatcher(LogManager::StableClosure* storage[], size_t cap, LogId* last_id, 
-                 LogManager* lm)
+    AppendBatcher(LogManager::StableClosure* storage[], size_t cap,
+                  size_t max_bytes, LogId* last_id, LogManager* lm)
         : _storage(storage)
         , _cap(cap)
+        , _max_bytes(max_bytes)
         , _size(0)
         , _buffer_size(0)
         , _last_id(last_id)
@@ -500,26 +665,18 @@ public:
 
     void flush() {
         if (_size > 0) {
-            IOMetric metric;
-            _lm->append_to_storage(&_to_append, _last_id, &metric);
+            AppendBatch* batch = new AppendBatch(_lm);
+            batch->entries.swap(_to_append);
+            batch->closures.assign(_storage, _storage + _size);
             g_storage_flush_batch_counter << _size;
-            for (size_t i = 0; i < _size; ++i) {
-                _storage[i]->_entries.clear();
-                if (_lm->_has_error.load(butil::memory_order_relaxed)) {
-                    _storage[i]->status().set_error(
-                            EIO, "Corrupted LogStorage");
-                }
-                _storage[i]->update_metric(&metric);
-                _storage[i]->Run();
-            }
-            _to_append.clear();
+            _lm->append_to_storage(batch, _last_id);
+            _to_append.reserve(1024);
         }
         _size = 0;
         _buffer_size = 0;
     }
     void append(LogManager::StableClosure* done) {
-        if (_size == _cap || 
-                _buffer_size >= (size_t)FLAGS_raft_max_append_buffer_size) {
+        if (_size == _cap || _buffer_size >= _max_bytes) {
             flush();
         }
         _storage[_size++] = done;
@@ -533,6 +690,7 @@ public:
 private:
     LogManager::StableClosure** _storage;
     size_t _cap;
+    size_t _max_bytes;
     size_t _size;
     size_t _buffer_size;
     std::vector<LogEntry*> _to_append;
@@ -542,15 +700,24 @@ private:
 
 int LogManager::disk_thread(void* meta,
                             bthread::TaskIterator<StableClosure*>& iter) {
+    LogManager* log_manager = static_cast<LogManager*>(meta);
     if (iter.is_queue_stopped()) {
+        log_manager->wait_for_inflight_batches();
         return 0;
     }
 
-    LogManager* log_manager = static_cast<LogManager*>(meta);
     // FIXME(chenzhangyi01): it's buggy
-    LogId last_id = log_manager->_disk_id;
-    StableClosure* storage[256];
-    AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, log_manager);
+    LogId& last_id = log_manager->_submitted_id;
+    size_t max_count = FLAGS_raft_leader_batch;
+    size_t max_bytes = FLAGS_raft_max_append_buffer_size;
+    if (FLAGS_raft_adaptive_batch) {
+        max_count = log_manager->_disk_batch_limit.max_count();
+        max_bytes = log_manager->_disk_batch_limit.max_bytes();
+        g_storage_batch_count_limit << max_count;
+        g_storage_batch_bytes_limit << max_bytes;
+    }
+    DEFINE_SMALL_ARRAY(StableClosure*, storage, max_count, 256);
+    AppendBatcher ab(storage, max_count, max_bytes, &last_id, log_manager);
     
     for (; iter; ++iter) {
                 // ^^^ Must iterate to the end to release to corresponding
@@ -562,6 +729,8 @@ int LogManager::disk_thread(void* meta,
             ab.append(done);
         } else {
             ab.flush();
+            // Operations below see the storage after all the appends
+            log_manager->wait_for_inflight_batches();
             int ret = 0;
             do {
                 LastLogIdClosure* llic =
@@ -615,7 +784,7 @@ int LogManager::disk_thread(void* meta,
     }
     CHECK(!iter) << "Must iterate to the end";
     ab.flush();
-    log_manager->set_disk_id(last_id);
+    // _disk_id is updated by the batches once they are stable
     return 0;
 }
 
@@ -688,16 +857,7 @@ void LogManager::clear_bufferred_logs() {
 }
 
 LogEntry* LogManager::get_entry_from_memory(const int64_t index) {
-    LogEntry* entry = NULL;
-    if (!_logs_in_memory.empty()) {
-        int64_t first_index = _logs_in_memory.front()->id.index;
-        int64_t last_index = _logs_in_memory.back()->id.index;
-        CHECK_EQ(last_index - first_index + 1, static_cast<int64_t>(_logs_in_memory.size()));
-        if (index >= first_index && index <= last_index) {
-            entry = _logs_in_memory[index - first_index];
-        }
-    }
-    return entry;
+    return _logs_in_memory.at(index);
 }
 
 int64_t LogManager::unsafe_get_term(const int64_t index) {
@@ -731,6 +891,11 @@ int64_t LogManager::get_term(const int64_t index) {
     if (index == 0) {
         return 0;
     }
+    // Entries in memory are looked up without _mutex
+    const int64_t term = _logs_in_memory.get_term(index);
+    if (term != 0) {
+        return term;
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
     // check virtual first log
     if (index == _virtual_first_log_id.index) {
@@ -757,6 +922,11 @@ int64_t LogManager::get_term(const int64_t index) {
 }
 
 LogEntry* LogManager::get_entry(const int64_t index) {
+    // Entries in memory are looked up without _mutex
+    LogEntry* entry = _logs_in_memory.get(index);
+    if (entry) {
+        return entry;
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
 
     // out of range, direct return NULL
@@ -764,20 +934,80 @@ LogEntry* LogManager::get_entry(const int64_t index) {
         return NULL;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    entry = get_entry_from_memory(index);
     if (entry) {
         entry->AddRef();
         return entry;
     }
+    // Taken with _mutex held, so that an entry truncated after the range
+    // check above is never cached
+    const int64_t cache_version = _entry_cache.version();
     lck.unlock();
+    entry = _entry_cache.get(index);
+    if (entry) {
+        return entry;
+    }
     g_read_entry_from_storage << 1;
     entry = _log_storage->get_entry(index);
     if (!entry) {
         report_error(EIO, "Corrupted entry at index=%" PRId64, index);
+        return NULL;
     }
+    _entry_cache.put(entry, cache_version);
     return entry;
 }
 
+int LogManager::get_entries(const int64_t first_index, int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    if (first_index > _last_log_index || first_index < _first_log_index) {
+        return 0;
+    }
+    last_index = std::min(last_index, _last_log_index);
+    size_t bytes = 0;
+    int64_t index = first_index;
+    if (get_entry_from_memory(first_index)) {
+        for (; index <= last_index && (index == first_index || bytes < max_bytes);
+                ++index) {
+            LogEntry* entry = get_entry_from_memory(index);
+            entry->AddRef();
+            bytes += entry->data.length();
+            entries->push_back(entry);
+        }
+        return index - first_index;
+    }
+    // Logs in memory are read next time
+    if (!_logs_in_memory.empty()) {
+        last_index = std::min(last_index, _logs_in_memory.front()->id.index - 1);
+    }
+    const int64_t cache_version = _entry_cache.version();
+    lck.unlock();
+    for (; index <= last_index && (index == first_index || bytes < max_bytes);
+            ++index) {
+        LogEntry* entry = _entry_cache.get(index);
+        if (entry == NULL) {
+            break;
+        }
+        bytes += entry->data.length();
+        entries->push_back(entry);
+    }
+    if (index <= last_index && (index == first_index || bytes < max_bytes)) {
+        const size_t nentries = entries->size();
+        g_read_entry_from_storage << 1;
+        const int n = _log_storage->get_entries(
+                index, last_index, max_bytes - bytes, entries);
+        if (n == 0 && index == first_index) {
+            report_error(EIO, "Corrupted entry at index=%" PRId64, index);
+            return 0;
+        }
+        for (size_t i = nentries; i < entries->size(); ++i) {
+            _entry_cache.put((*entries)[i], cache_version);
+        }
+        index += n;
+    }
+    return index - first_index;
+}
+
 void LogManager::get_configuration(const int64_t index, ConfigurationEntry* conf) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _config_manager->get(index, conf);
@@ -804,7 +1034,11 @@ void LogManager::set_disk_id(const LogId& disk_id) {
         return;
     }
     _disk_id = disk_id;
-    LogId clear_id = std::min(_disk_id, _applied_id);
+    if (disk_id.index > _stable_index) {
+        unsafe_sub_bytes_not_on_disk(_stable_index + 1, disk_id.index);
+        _stable_index = disk_id.index;
+    }
+    LogId clear_id = memory_logs_to_clear();
     lck.unlock();
     return clear_memory_logs(clear_id);
 }
@@ -815,11 +1049,41 @@ void LogManager::set_applied_id(const LogId& applied_id) {
         return;
     }
     _applied_id = applied_id;
-    LogId clear_id = std::min(_disk_id, _applied_id);
+    LogId clear_id = memory_logs_to_clear();
     lck.unlock();
     return clear_memory_logs(clear_id);
 }
 
+LogId LogManager::memory_logs_to_clear() {
+    const int64_t max_bytes = FLAGS_raft_max_memory_log_bytes;
+    if (max_bytes > 0 && _logs_in_memory.bytes() > max_bytes) {
+        return _disk_id;
+    }
+    return std::min(_disk_id, _applied_id);
+}
+
+void LogManager::unsafe_sub_bytes_not_on_disk(int64_t first_index,
+                                              int64_t last_index) {
+    first_index = std::max(first_index,
+                           std::max(_stable_index + 1, _logs_in_memory.first_index()));
+    last_index = std::min(last_index, _logs_in_memory.last_index());
+    int64_t nbytes = 0;
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        nbytes += MemoryLogBuffer::entry_bytes(_logs_in_memory.at(index));
+    }
+    if (nbytes > 0) {
+        _bytes_not_on_disk.store(
+                _bytes_not_on_disk.load(butil::memory_order_relaxed) - nbytes,
+                butil::memory_order_relaxed);
+    }
+}
+
+bool LogManager::memory_log_full() const {
+    const int64_t max_bytes = FLAGS_raft_max_memory_log_bytes;
+    return max_bytes > 0
+            && _bytes_not_on_disk.load(butil::memory_order_relaxed) > max_bytes;
+}
+
 void LogManager::shutdown() {
     std::unique_lock<raft_mutex_t> lck(_mutex);
     _stopped = true;
@@ -919,6 +1183,7 @@ void LogManager::describe(std::ostream& os, bool use_html) {
     os << "storage: [" << first_index << ", " << last_index << ']' << newline;
     os << "disk_index: " << _disk_id.index << newline;
     os << "known_applied_index: " << _applied_id.index << newline;
+    os << "memory_log_bytes: " << _logs_in_memory.bytes() << newline;
     os << "last_log_id: " << last_log_id() << newline;
 }
 
@@ -931,6 +1196,7 @@ void LogManager::get_status(LogManagerStatus* status) {
     status->last_index = _log_storage->last_log_index();
     status->disk_index = _disk_id.index;
     status->known_applied_index = _applied_id.index;
+    status->memory_log_bytes = _logs_in_memory.bytes();
 }
 
 void LogManager::report_error(int error_code, const char* fmt, ...) {
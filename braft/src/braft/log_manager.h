@@ -22,17 +22,22 @@
 #include <butil/containers/flat_map.h>           // butil::FlatMap
 #include <deque>                                // std::deque
 #include <bthread/execution_queue.h>            // bthread::ExecutionQueueId
+#include <bthread/countdown_event.h>            // bthread::CountdownEvent
 
 #include "braft/raft.h"                          // Closure
 #include "braft/util.h"                          // raft_mutex_t
 #include "braft/log_entry.h"                     // LogEntry
 #include "braft/configuration_manager.h"         // ConfigurationManager
 #include "braft/storage.h"                       // Storage
+#include "braft/log_cache.h"                     // LogEntryCache
+#include "braft/log_buffer.h"                    // MemoryLogBuffer
+#include "braft/adaptive_batch.h"                // AdaptiveBatchLimit
 
 namespace braft {
 
 class LogStorage;
 class FSMCaller;
+class AppendBatch;
 
 struct LogManagerOptions {
     LogManagerOptions();
@@ -44,11 +49,13 @@ struct LogManagerOptions {
 struct LogManagerStatus {
     LogManagerStatus()
         : first_index(1), last_index(0), disk_index(0), known_applied_index(0)
+        , memory_log_bytes(0)
     {}
     int64_t first_index;
     int64_t last_index;
     int64_t disk_index;
     int64_t known_applied_index;
+    int64_t memory_log_bytes;
 };
 
 class SnapshotMeta;
@@ -67,6 +74,7 @@ public:
     private:
     friend class LogManager;
     friend class AppendBatcher;
+    friend class AppendBatch;
         std::vector<LogEntry*> _entries;
     };
 
@@ -94,6 +102,14 @@ public:
     //  success return ptr, fail return null
     LogEntry* get_entry(const int64_t index);
 
+    // Get the logs in [first_index, last_index], stopping once the data of
+    // the got logs reaches |max_bytes|. The logs are appended to |entries|
+    // with a reference added, the caller should release them.
+    // Returns:
+    //  the number of got logs, which is 0 if |first_index| doesn't exist
+    int get_entries(const int64_t first_index, const int64_t last_index,
+                    size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // Get the log term at |index|
     // Returns:
     //  success return term > 0, fail return 0
@@ -135,6 +151,10 @@ public:
     // can be droped from memory logs
     void set_applied_id(const LogId& applied_id);
 
+    // Whether the logs not on disk yet exceed raft_max_memory_log_bytes, new
+    // user logs should be rejected until the disk catches up
+    bool memory_log_full() const;
+
     // Check the consistency between log and snapshot, which must satisfy ANY
     // one of the following condition
     //   - Log starts from 1. OR
@@ -151,16 +171,35 @@ public:
 
 private:
 friend class AppendBatcher;
+friend class AppendBatch;
     struct WaitMeta {
         int (*on_new_log)(void *arg, int error_code);
         void* arg;
         int error_code;
     };
 
-    void append_to_storage(std::vector<LogEntry*>* to_append, LogId* last_id, IOMetric* metric);
+    // Submit |batch| to LogStorage, its closures are run in order after the
+    // entries are stable, which may be after this function returns
+    void append_to_storage(AppendBatch* batch, LogId* last_id);
+
+    // Called when the entries of |batch| are stable, run the closures of all
+    // the leading stable batches in order
+    void on_batch_stable(AppendBatch* batch);
+
+    // Called by on_batch_stable() without _inflight_mutex, never by two
+    // threads at a time
+    void finish_batch(AppendBatch* batch);
+
+    // Wait until all the submitted batches are stable
+    void wait_for_inflight_batches();
 
     static int disk_thread(void* meta,
                            bthread::TaskIterator<StableClosure*>& iter);
+
+    // Sync the batches written by the disk thread with
+    // raft_pipeline_log_sync, one sync covers all the pending batches
+    static int sync_thread(void* meta,
+                           bthread::TaskIterator<AppendBatch*>& iter);
     
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     // Returns:
@@ -171,9 +210,14 @@ friend class AppendBatcher;
     int reset(const int64_t next_log_index,
               std::unique_lock<raft_mutex_t>& lck);
 
-    // Must be called in the disk thread, otherwise the
-    // behavior is undefined
+    // Must be called by finish_batch(), which runs in the disk thread or in
+    // the thread completing a batch. Batches are finished one at a time and
+    // in log order by on_batch_stable(), so |disk_id| never goes backwards,
+    // otherwise the behavior is undefined
     void set_disk_id(const LogId& disk_id);
+    // Remove the bytes of the entries in [first_index, last_index] which are
+    // in memory from _bytes_not_on_disk
+    void unsafe_sub_bytes_not_on_disk(int64_t first_index, int64_t last_index);
 
     LogEntry* get_entry_from_memory(const int64_t index);
 
@@ -187,6 +231,11 @@ friend class AppendBatcher;
     // Clear the logs in memory whose id <= the given |id|
     void clear_memory_logs(const LogId& id);
 
+    // The id up to which the logs in memory can be cleared, which are the
+    // ones both on disk and applied, or just on disk once over the budget.
+    // Called with _mutex held
+    LogId memory_logs_to_clear();
+
     int64_t unsafe_get_term(const int64_t index);
 
     // Start a independent thread to append log to LogStorage
@@ -212,8 +261,15 @@ friend class AppendBatcher;
 
     LogId _disk_id;
     LogId _applied_id;
-    // TODO(chenzhangyi01): replace deque with a thread-safe data structure
-    std::deque<LogEntry* /*FIXME*/> _logs_in_memory;
+    // Modified with _mutex held, get_entry() and get_term() look it up
+    // without _mutex
+    MemoryLogBuffer _logs_in_memory;
+    // Bytes of the entries in _logs_in_memory after _stable_index, which are
+    // not on disk yet. Modified with _mutex held, read without it
+    butil::atomic<int64_t> _bytes_not_on_disk;
+    int64_t _stable_index;
+    // Entries read from _log_storage after they left _logs_in_memory
+    LogEntryCache _entry_cache;
     int64_t _first_log_index;
     int64_t _last_log_index;
     // the last snapshot's log_id
@@ -226,6 +282,18 @@ friend class AppendBatcher;
     LogId _virtual_first_log_id;
 
     bthread::ExecutionQueueId<StableClosure*> _disk_queue;
+    bthread::ExecutionQueueId<AppendBatch*> _sync_queue;
+
+    // Batches submitted to LogStorage but not finished yet, in log order
+    raft_mutex_t _inflight_mutex;
+    std::deque<AppendBatch*> _inflight_batches;
+    bool _draining_batches;
+    bthread::CountdownEvent _inflight_event;
+    // Limits of the batches of the disk thread with raft_adaptive_batch
+    AdaptiveBatchLimit _disk_batch_limit;
+    // The last log id submitted by the disk thread, which is ahead of
+    // _disk_id while batches are in flight
+    LogId _submitted_id;
 };
 
 }  //  namespace braft
@@ -0,0 +1,890 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/merged_log.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <butil/logging.h>
+#include <butil/file_util.h>                         // butil::CreateDirectory
+#include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
+#include <butil/string_printf.h>                     // butil::string_appendf
+#include <butil/raw_pack.h>                          // butil::RawPacker
+#include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+
+#include "braft/fsync.h"
+
+#define BRAFT_MERGED_LOG_PATTERN "merged_log_%020" PRId64
+
+namespace braft {
+
+using ::butil::RawPacker;
+using ::butil::RawUnpacker;
+
+DECLARE_bool(raft_recover_log_from_corrupt);
+
+DEFINE_int32(raft_merged_log_file_size, 64 * 1024 * 1024 /*64M*/,
+             "Max size of one file of merged log");
+BRPC_VALIDATE_GFLAG(raft_merged_log_file_size, brpc::PositiveInteger);
+
+static bvar::LatencyRecorder g_merged_log_write_latency("raft_merged_log_write");
+static bvar::CounterRecorder g_merged_log_write_batch_counter(
+                                    "raft_merged_log_write_batch_counter");
+
+enum MergedLogRecordType {
+    MERGED_RECORD_APPEND = 1,
+    MERGED_RECORD_TRUNCATE_PREFIX = 2,
+    MERGED_RECORD_TRUNCATE_SUFFIX = 3,
+    MERGED_RECORD_RESET = 4,
+    MERGED_RECORD_DROP = 5,
+};
+
+// Format of record header, all fields are in network order
+// | record-type (8bits) | entry-type (8bits) | reserved (16bits)     |
+// | group len (32bits)                                              |
+// | ---------------------- index (64bits) ------------------------- |
+// | ---------------------- term (64bits) -------------------------- |
+// | data len (32bits) | data checksum (32bits)                      |
+// | header checksum (32bits), crc32c of the above and the group     |
+// followed by the group and the data.
+// |index| is the entry index of APPEND, first_index_kept of
+// TRUNCATE_PREFIX, last_index_kept of TRUNCATE_SUFFIX and next_log_index
+// of RESET.
+
+const static size_t MERGED_RECORD_HEADER_SIZE = 36;
+
+struct MergedLogRecord {
+    int type;
+    int entry_type;
+    std::string group;
+    int64_t index;
+    int64_t term;
+    butil::IOBuf data;
+};
+
+static void append_record(butil::IOBuf* buf, int type, const std::string& group,
+                          int64_t index, int64_t term, int entry_type,
+                          const butil::IOBuf& data) {
+    char header_buf[MERGED_RECORD_HEADER_SIZE];
+    const uint32_t meta_field = (type << 24) | (entry_type << 16);
+    RawPacker packer(header_buf);
+    packer.pack32(meta_field)
+          .pack32(group.size())
+          .pack64(index)
+          .pack64(term)
+          .pack32(data.length())
+          .pack32(crc32(data));
+    uint32_t header_checksum = crc32(header_buf, MERGED_RECORD_HEADER_SIZE - 4);
+    header_checksum = crc32c_extend(header_checksum, group.data(), group.size());
+    packer.pack32(header_checksum);
+    buf->append(header_buf, MERGED_RECORD_HEADER_SIZE);
+    buf->append(group);
+    buf->append(data);
+}
+
+// Parse the record at the front of |buf|.
+// Returns 0 on success, 1 if |buf| doesn't hold a complete record, -1 if
+// the record is corrupted
+static int cut_record(butil::IOBuf* buf, MergedLogRecord* record, size_t* length) {
+    if (buf->length() < MERGED_RECORD_HEADER_SIZE) {
+        return 1;
+    }
+    char header_buf[MERGED_RECORD_HEADER_SIZE];
+    const char* p = (const char*)buf->fetch(header_buf, MERGED_RECORD_HEADER_SIZE);
+    uint32_t meta_field = 0;
+    uint32_t group_len = 0;
+    uint32_t data_len = 0;
+    uint32_t data_checksum = 0;
+    uint32_t header_checksum = 0;
+    RawUnpacker(p).unpack32(meta_field)
+                  .unpack32(group_len)
+                  .unpack64((uint64_t&)record->index)
+                  .unpack64((uint64_t&)record->term)
+                  .unpack32(data_len)
+                  .unpack32(data_checksum)
+                  .unpack32(header_checksum);
+    if (buf->length() < MERGED_RECORD_HEADER_SIZE + group_len + data_len) {
+        return 1;
+    }
+    const uint32_t checksum = crc32(p, MERGED_RECORD_HEADER_SIZE - 4);
+    buf->pop_front(MERGED_RECORD_HEADER_SIZE);
+    record->group.resize(group_len);
+    if (group_len > 0) {
+        buf->cutn(&record->group[0], group_len);
+    }
+    if (crc32c_extend(checksum, record->group.data(), group_len) != header_checksum) {
+        return -1;
+    }
+    record->data.clear();
+    buf->cutn(&record->data, data_len);
+    if (crc32(record->data) != data_checksum) {
+        return -1;
+    }
+    record->type = meta_field >> 24;
+    record->entry_type = (meta_field << 8) >> 24;
+    *length = MERGED_RECORD_HEADER_SIZE + group_len + data_len;
+    return 0;
+}
+
+// A file of merged log, the fd is closed after the file is removed and all
+// the readers are done
+class MergedLogFile : public butil::RefCountedThreadSafe<MergedLogFile> {
+public:
+    MergedLogFile(const std::string& path, int fd) : _path(path), _fd(fd) {}
+
+    int fd() const { return _fd; }
+    const std::string& path() const { return _path; }
+
+private:
+friend class butil::RefCountedThreadSafe<MergedLogFile>;
+    ~MergedLogFile() {
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
+        }
+    }
+
+    std::string _path;
+    int _fd;
+};
+
+// MergedLogManager
+//
+// To manage all MergedLogImpl of all the raft instances, instances on the
+// same disk share a MergedLogImpl whose KEY is merged_path.
+class MergedLogManager {
+public:
+    static MergedLogManager* GetInstance() {
+        return Singleton<MergedLogManager>::get();
+    }
+
+    scoped_refptr<MergedLogImpl> register_merged_log(const std::string& path) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        scoped_refptr<MergedLogImpl>& impl = _logs[path];
+        if (impl == NULL) {
+            impl = new MergedLogImpl(path);
+        }
+        return impl;
+    }
+
+private:
+    MergedLogManager() {};
+    ~MergedLogManager() {};
+    DISALLOW_COPY_AND_ASSIGN(MergedLogManager);
+    friend struct DefaultSingletonTraits<MergedLogManager>;
+
+    raft_mutex_t _mutex;
+    std::map<std::string, scoped_refptr<MergedLogImpl> > _logs;
+};
+
+#define global_merged_log_manager MergedLogManager::GetInstance()
+
+// MergedLogGroup
+void MergedLogGroup::append(int64_t index, const MergedLogLocation& location,
+                            const ConfigurationEntry* conf_entry) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (index <= last_index.load(butil::memory_order_relaxed)) {
+        // Entries are overwritten without a truncate record only if the
+        // process crashed before it was written
+        while (!_locations.empty()
+                && last_index.load(butil::memory_order_relaxed) >= index) {
+            _locations.pop_back();
+            last_index.fetch_sub(1, butil::memory_order_relaxed);
+        }
+        while (!_conf_entries.empty() && _conf_entries.back().id.index >= index) {
+            _conf_entries.pop_back();
+        }
+    }
+    if (_locations.empty()) {
+        first_index.store(index, butil::memory_order_release);
+    }
+    _locations.push_back(location);
+    if (conf_entry) {
+        _conf_entries.push_back(*conf_entry);
+    }
+    last_index.store(index, butil::memory_order_release);
+}
+
+void MergedLogGroup::clear(int64_t next_log_index, int64_t file_id) {
+    _locations.clear();
+    _conf_entries.clear();
+    first_index.store(next_log_index, butil::memory_order_release);
+    last_index.store(next_log_index - 1, butil::memory_order_release);
+    _state_file_id = file_id;
+}
+
+void MergedLogGroup::truncate_prefix(int64_t first_index_kept, int64_t file_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (first_index_kept > last_index.load(butil::memory_order_relaxed)) {
+        return clear(first_index_kept, file_id);
+    }
+    while (first_index.load(butil::memory_order_relaxed) < first_index_kept) {
+        _locations.pop_front();
+        first_index.fetch_add(1, butil::memory_order_release);
+    }
+    while (!_conf_entries.empty()
+            && _conf_entries.front().id.index < first_index_kept) {
+        _conf_entries.pop_front();
+    }
+}
+
+void MergedLogGroup::truncate_suffix(int64_t last_index_kept, int64_t file_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (last_index_kept < first_index.load(butil::memory_order_relaxed)) {
+        return clear(last_index_kept + 1, file_id);
+    }
+    while (last_index.load(butil::memory_order_relaxed) > last_index_kept) {
+        _locations.pop_back();
+        last_index.fetch_sub(1, butil::memory_order_release);
+    }
+    while (!_conf_entries.empty()
+            && _conf_entries.back().id.index > last_index_kept) {
+        _conf_entries.pop_back();
+    }
+}
+
+void MergedLogGroup::reset(int64_t next_log_index, int64_t file_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    clear(next_log_index, file_id);
+}
+
+int MergedLogGroup::get_location(int64_t index, MergedLogLocation* location) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int64_t first = first_index.load(butil::memory_order_relaxed);
+    if (index < first || index > last_index.load(butil::memory_order_relaxed)) {
+        return -1;
+    }
+    *location = _locations[index - first];
+    return 0;
+}
+
+int64_t MergedLogGroup::pinned_file_id() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _locations.empty() ? _state_file_id : _locations.front().file_id;
+}
+
+void MergedLogGroup::take_conf_entries(std::vector<ConfigurationEntry>* conf_entries) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    conf_entries->assign(_conf_entries.begin(), _conf_entries.end());
+    _conf_entries.clear();
+}
+
+// MergedLogImpl
+MergedLogImpl::MergedLogImpl(const std::string& path)
+    : _is_inited(false), _path(path), _file_id(0), _file_size(0) {}
+
+MergedLogImpl::~MergedLogImpl() {
+    if (_is_inited) {
+        bthread::execution_queue_stop(_queue_id);
+        bthread::execution_queue_join(_queue_id);
+    }
+}
+
+int MergedLogImpl::init() {
+    // Groups on the same path may init at the same time, the replay is done
+    // by the first one
+    BAIDU_SCOPED_LOCK(_init_mutex);
+    if (_is_inited) {
+        return 0;
+    }
+    butil::FilePath dir_path(_path);
+    butil::File::Error e;
+    if (!butil::CreateDirectoryAndGetError(
+                dir_path, &e, FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
+        return -1;
+    }
+
+    butil::DirReaderPosix dir_reader(_path.c_str());
+    if (!dir_reader.IsValid()) {
+        LOG(WARNING) << "directory reader failed, maybe NOEXIST or PERMISSION."
+                     << " path: " << _path;
+        return -1;
+    }
+    std::vector<int64_t> file_ids;
+    while (dir_reader.Next()) {
+        int64_t file_id = 0;
+        if (sscanf(dir_reader.name(), BRAFT_MERGED_LOG_PATTERN, &file_id) == 1) {
+            file_ids.push_back(file_id);
+        }
+    }
+    std::sort(file_ids.begin(), file_ids.end());
+    butil::Timer timer;
+    timer.start();
+    for (size_t i = 0; i < file_ids.size(); ++i) {
+        if (replay_file(file_ids[i], i + 1 == file_ids.size()) != 0) {
+            return -1;
+        }
+    }
+    timer.stop();
+    LOG(INFO) << "Replayed merged log, path: " << _path
+              << " files: " << file_ids.size() << " groups: " << _groups.size()
+              << " time: " << timer.u_elapsed();
+
+    // Always append to a new file, so that a torn write before restart
+    // never sits in the middle of a file
+    if (open_file(file_ids.empty() ? 1 : file_ids.back() + 1) != 0) {
+        return -1;
+    }
+
+    bthread::ExecutionQueueOptions execq_opt;
+    execq_opt.bthread_attr = BTHREAD_ATTR_NORMAL;
+    if (bthread::execution_queue_start(&_queue_id,
+                                       &execq_opt,
+                                       MergedLogImpl::run,
+                                       this) != 0) {
+        LOG(ERROR) << "Fail to start execution_queue, path: " << _path;
+        return -1;
+    }
+    _is_inited = true;
+    return 0;
+}
+
+int MergedLogImpl::open_file(int64_t file_id) {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_MERGED_LOG_PATTERN, file_id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to create " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    scoped_refptr<MergedLogFile> file = new MergedLogFile(path, fd);
+    BAIDU_SCOPED_LOCK(_mutex);
+    _files[file_id] = file;
+    _file_id = file_id;
+    _file_size = 0;
+    _file = file;
+    LOG(INFO) << "Created merged log file `" << path << "' with fd=" << fd;
+    return 0;
+}
+
+int MergedLogImpl::replay_file(int64_t file_id, bool is_last) {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_MERGED_LOG_PATTERN, file_id);
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    scoped_refptr<MergedLogFile> file = new MergedLogFile(path, fd);
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) != 0) {
+        PLOG(ERROR) << "Fail to get the stat of " << path;
+        return -1;
+    }
+    butil::IOPortal buf;
+    if (file_pread(&buf, fd, 0, st_buf.st_size) != st_buf.st_size) {
+        PLOG(ERROR) << "Fail to read " << path;
+        return -1;
+    }
+    int64_t offset = 0;
+    int rc = 0;
+    MergedLogRecord record;
+    size_t length = 0;
+    while ((rc = cut_record(&buf, &record, &length)) == 0) {
+        scoped_refptr<MergedLogGroup>& group = _groups[record.group];
+        if (group == NULL) {
+            group = new MergedLogGroup;
+        }
+        switch (record.type) {
+        case MERGED_RECORD_APPEND:
+            {
+                MergedLogLocation location;
+                location.file_id = file_id;
+                location.offset = offset;
+                location.term = record.term;
+                location.length = length;
+                if (record.entry_type != ENTRY_TYPE_CONFIGURATION) {
+                    group->append(record.index, location, NULL);
+                    break;
+                }
+                scoped_refptr<LogEntry> entry = new LogEntry();
+                entry->id.index = record.index;
+                entry->id.term = record.term;
+                if (!parse_configuration_meta(record.data, entry).ok()) {
+                    LOG(ERROR) << "Fail to parse configuration meta, path: "
+                               << path << " offset: " << offset;
+                    return -1;
+                }
+                ConfigurationEntry conf_entry(*entry);
+                group->append(record.index, location, &conf_entry);
+            }
+            break;
+        case MERGED_RECORD_TRUNCATE_PREFIX:
+            group->truncate_prefix(record.index, file_id);
+            break;
+        case MERGED_RECORD_TRUNCATE_SUFFIX:
+            group->truncate_suffix(record.index, file_id);
+            break;
+        case MERGED_RECORD_RESET:
+            group->reset(record.index, file_id);
+            break;
+        case MERGED_RECORD_DROP:
+            _groups.erase(record.group);
+            break;
+        default:
+            LOG(ERROR) << "Unknown record type=" << record.type
+                       << ", path: " << path << " offset: " << offset;
+            return -1;
+        }
+        offset += length;
+    }
+    if (offset != st_buf.st_size) {
+        // Only the last file may end with a record which was not completely
+        // written
+        if (!is_last || (rc < 0 && !FLAGS_raft_recover_log_from_corrupt)) {
+            LOG(ERROR) << "Found corrupted record, path: " << path
+                       << " offset: " << offset << " size: " << st_buf.st_size;
+            return -1;
+        }
+        LOG(WARNING) << "Truncate uncompleted record, path: " << path
+                     << " offset: " << offset << " size: " << st_buf.st_size;
+        if (ftruncate(fd, offset) != 0) {
+            PLOG(ERROR) << "Fail to truncate " << path;
+            return -1;
+        }
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    _files[file_id] = file;
+    return 0;
+}
+
+scoped_refptr<MergedLogGroup> MergedLogImpl::open_group(const std::string& group) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    scoped_refptr<MergedLogGroup>& log_group = _groups[group];
+    if (log_group == NULL) {
+        log_group = new MergedLogGroup;
+    }
+    return log_group;
+}
+
+int MergedLogImpl::drop_group(const std::string& group) {
+    butil::IOBuf records;
+    append_record(&records, MERGED_RECORD_DROP, group, 0, 0, 0, butil::IOBuf());
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (write(&records, &file_id, &offset) != 0) {
+        return -1;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _groups.erase(group);
+    }
+    gc();
+    return 0;
+}
+
+int MergedLogImpl::write(butil::IOBuf* records, int64_t* file_id, int64_t* offset) {
+    SynchronizedClosure done;
+    WriteTask task;
+    task.records = records;
+    task.file_id = file_id;
+    task.offset = offset;
+    task.done = &done;
+    if (bthread::execution_queue_execute(_queue_id, task) != 0) {
+        LOG(ERROR) << "Fail to put task into queue, path: " << _path;
+        return -1;
+    }
+    done.wait();
+    if (!done.status().ok()) {
+        LOG(ERROR) << "Fail to write merged log, path: " << _path
+                   << ", " << done.status();
+        return -1;
+    }
+    return 0;
+}
+
+void MergedLogImpl::flush(butil::IOBuf* batch, SynchronizedClosure* dones[],
+                          size_t size) {
+    g_merged_log_write_batch_counter << size;
+    butil::Timer timer;
+    timer.start();
+    const int64_t length = batch->length();
+    int64_t offset = _file_size;
+    int rc = 0;
+    while (!batch->empty()) {
+        const ssize_t n = batch->pcut_into_file_descriptor(
+                                _file->fd(), offset, batch->length());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = errno;
+            break;
+        }
+        offset += n;
+    }
+    if (rc == 0 && FLAGS_raft_sync && raft_fsync(_file->fd()) != 0) {
+        rc = errno;
+    }
+    timer.stop();
+    g_merged_log_write_latency << timer.u_elapsed();
+    if (rc == 0) {
+        _file_size += length;
+    } else {
+        // The next batch overwrites what was partially written
+        batch->clear();
+        PLOG(ERROR) << "Fail to write " << _file->path();
+    }
+    for (size_t i = 0; i < size; ++i) {
+        if (rc != 0) {
+            dones[i]->status().set_error(EIO, "Fail to write %s, %s",
+                                         _file->path().c_str(), berror(rc));
+        }
+        dones[i]->Run();
+    }
+}
+
+int MergedLogImpl::run(void* meta, bthread::TaskIterator<WriteTask>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    MergedLogImpl* impl = (MergedLogImpl*)meta;
+    std::vector<SynchronizedClosure*> dones;
+    butil::IOBuf batch;
+    for (; iter; ++iter) {
+        // Roll over to the next file before it grows too large
+        if (impl->_file_size + (int64_t)batch.length() > 0
+                && impl->_file_size + (int64_t)batch.length()
+                        + (int64_t)iter->records->length()
+                        > FLAGS_raft_merged_log_file_size) {
+            if (!dones.empty()) {
+                impl->flush(&batch, &dones[0], dones.size());
+                dones.clear();
+            }
+            if (impl->open_file(impl->_file_id + 1) != 0) {
+                iter->done->status().set_error(EIO, "Fail to create file");
+                iter->done->Run();
+                continue;
+            }
+        }
+        *iter->file_id = impl->_file_id;
+        *iter->offset = impl->_file_size + batch.length();
+        batch.append(butil::IOBuf::Movable(*iter->records));
+        dones.push_back(iter->done);
+    }
+    if (!dones.empty()) {
+        impl->flush(&batch, &dones[0], dones.size());
+    }
+    return 0;
+}
+
+scoped_refptr<MergedLogFile> MergedLogImpl::get_file(int64_t file_id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    FileMap::const_iterator it = _files.find(file_id);
+    if (it == _files.end()) {
+        return NULL;
+    }
+    return it->second;
+}
+
+void MergedLogImpl::gc() {
+    std::vector<scoped_refptr<MergedLogGroup> > groups;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        groups.reserve(_groups.size());
+        for (GroupMap::const_iterator it = _groups.begin(); it != _groups.end(); ++it) {
+            groups.push_back(it->second);
+        }
+    }
+    // The pinned file of a group never goes back, so files older than all
+    // the pinned ones are never needed again
+    int64_t min_file_id = INT64_MAX;
+    for (size_t i = 0; i < groups.size(); ++i) {
+        const int64_t file_id = groups[i]->pinned_file_id();
+        if (file_id >= 0) {
+            min_file_id = std::min(min_file_id, file_id);
+        }
+    }
+    std::vector<scoped_refptr<MergedLogFile> > removed;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (!_files.empty() && _files.begin()->first < min_file_id
+                && _files.begin()->second != _file) {
+            removed.push_back(_files.begin()->second);
+            _files.erase(_files.begin());
+        }
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        // Readers holding the file still see the data until they are done
+        if (::unlink(removed[i]->path().c_str()) != 0) {
+            PLOG(WARNING) << "Fail to unlink " << removed[i]->path();
+        } else {
+            LOG(INFO) << "Unlinked merged log file `" << removed[i]->path() << '\'';
+        }
+    }
+}
+
+// MergedLogStorage
+MergedLogStorage::MergedLogStorage(const std::string& path, const std::string& group)
+    : _group_name(group) {
+    _impl = global_merged_log_manager->register_merged_log(path);
+}
+
+MergedLogStorage::~MergedLogStorage() {}
+
+int MergedLogStorage::init(ConfigurationManager* configuration_manager) {
+    if (_impl == NULL || _impl->init() != 0) {
+        LOG(ERROR) << "Fail to init merged log of group " << _group_name;
+        return -1;
+    }
+    _group = _impl->open_group(_group_name);
+    std::vector<ConfigurationEntry> conf_entries;
+    _group->take_conf_entries(&conf_entries);
+    for (size_t i = 0; i < conf_entries.size(); ++i) {
+        configuration_manager->add(conf_entries[i]);
+    }
+    LOG(INFO) << "Restored group " << _group_name << " from merged log "
+              << _impl->path() << " first_log_index: " << first_log_index()
+              << " last_log_index: " << last_log_index();
+    return 0;
+}
+
+int64_t MergedLogStorage::first_log_index() {
+    return _group->first_index.load(butil::memory_order_acquire);
+}
+
+int64_t MergedLogStorage::last_log_index() {
+    return _group->last_index.load(butil::memory_order_acquire);
+}
+
+LogEntry* MergedLogStorage::get_entry(const int64_t index) {
+    MergedLogLocation location;
+    if (_group->get_location(index, &location) != 0) {
+        return NULL;
+    }
+    scoped_refptr<MergedLogFile> file = _impl->get_file(location.file_id);
+    if (file == NULL) {
+        LOG(ERROR) << "Fail to find file " << location.file_id
+                   << " of group " << _group_name << " index: " << index;
+        return NULL;
+    }
+    butil::IOPortal buf;
+    if (file_pread(&buf, file->fd(), location.offset, location.length)
+            != (ssize_t)location.length) {
+        PLOG(ERROR) << "Fail to read " << file->path()
+                    << " offset: " << location.offset;
+        return NULL;
+    }
+    MergedLogRecord record;
+    size_t length = 0;
+    if (cut_record(&buf, &record, &length) != 0
+            || record.type != MERGED_RECORD_APPEND || record.index != index
+            || record.term != location.term || record.group != _group_name) {
+        LOG(ERROR) << "Found corrupted record in " << file->path()
+                   << " offset: " << location.offset << " group: " << _group_name
+                   << " index: " << index;
+        return NULL;
+    }
+    LogEntry* entry = new LogEntry();
+    entry->AddRef();
+    entry->id.index = index;
+    entry->id.term = record.term;
+    entry->type = (EntryType)record.entry_type;
+    switch (record.entry_type) {
+    case ENTRY_TYPE_DATA:
+        entry->data.swap(record.data);
+        break;
+    case ENTRY_TYPE_NO_OP:
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        if (!parse_configuration_meta(record.data, entry).ok()) {
+            LOG(WARNING) << "Fail to parse ConfigurationPBMeta, group: "
+                         << _group_name << " index: " << index;
+            entry->Release();
+            return NULL;
+        }
+        break;
+    default:
+        LOG(ERROR) << "Unknown entry type=" << record.entry_type
+                   << ", group: " << _group_name << " index: " << index;
+        entry->Release();
+        return NULL;
+    }
+    return entry;
+}
+
+int64_t MergedLogStorage::get_term(const int64_t index) {
+    MergedLogLocation location;
+    if (_group->get_location(index, &location) != 0) {
+        return 0;
+    }
+    return location.term;
+}
+
+int MergedLogStorage::append_entry(const LogEntry* entry) {
+    std::vector<LogEntry*> entries(1, const_cast<LogEntry*>(entry));
+    return append_entries(entries, NULL) == 1 ? 0 : EIO;
+}
+
+int MergedLogStorage::append_entries(const std::vector<LogEntry*>& entries,
+                                     IOMetric* metric) {
+    if (entries.empty()) {
+        return 0;
+    }
+    if (last_log_index() + 1 != entries.front()->id.index) {
+        LOG(FATAL) << "There's gap between appending entries and last_log_index"
+                   << " group: " << _group_name;
+        return -1;
+    }
+    butil::IOBuf records;
+    std::vector<size_t> offsets;
+    offsets.reserve(entries.size() + 1);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const LogEntry* entry = entries[i];
+        butil::IOBuf data;
+        switch (entry->type) {
+        case ENTRY_TYPE_DATA:
+            data.append(entry->data);
+            break;
+        case ENTRY_TYPE_NO_OP:
+            break;
+        case ENTRY_TYPE_CONFIGURATION:
+            if (!serialize_configuration_meta(entry, data).ok()) {
+                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, group: "
+                           << _group_name;
+                return -1;
+            }
+            break;
+        default:
+            LOG(FATAL) << "unknow entry type: " << entry->type
+                       << ", group: " << _group_name;
+            return -1;
+        }
+        offsets.push_back(records.length());
+        append_record(&records, MERGED_RECORD_APPEND, _group_name,
+                      entry->id.index, entry->id.term, entry->type, data);
+    }
+    offsets.push_back(records.length());
+    const int64_t start_us = butil::cpuwide_time_us();
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (_impl->write(&records, &file_id, &offset) != 0) {
+        return -1;
+    }
+    if (metric) {
+        metric->append_entry_time_us += butil::cpuwide_time_us() - start_us;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        MergedLogLocation location;
+        location.file_id = file_id;
+        location.offset = offset + offsets[i];
+        location.term = entries[i]->id.term;
+        location.length = offsets[i + 1] - offsets[i];
+        _group->append(entries[i]->id.index, location, NULL);
+    }
+    return entries.size();
+}
+
+int MergedLogStorage::truncate_prefix(const int64_t first_index_kept) {
+    if (first_log_index() >= first_index_kept) {
+        return 0;
+    }
+    butil::IOBuf records;
+    append_record(&records, MERGED_RECORD_TRUNCATE_PREFIX, _group_name,
+                  first_index_kept, 0, 0, butil::IOBuf());
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (_impl->write(&records, &file_id, &offset) != 0) {
+        return -1;
+    }
+    _group->truncate_prefix(first_index_kept, file_id);
+    _impl->gc();
+    return 0;
+}
+
+int MergedLogStorage::truncate_suffix(const int64_t last_index_kept) {
+    butil::IOBuf records;
+    append_record(&records, MERGED_RECORD_TRUNCATE_SUFFIX, _group_name,
+                  last_index_kept, 0, 0, butil::IOBuf());
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (_impl->write(&records, &file_id, &offset) != 0) {
+        return -1;
+    }
+    _group->truncate_suffix(last_index_kept, file_id);
+    return 0;
+}
+
+int MergedLogStorage::reset(const int64_t next_log_index) {
+    if (next_log_index <= 0) {
+        LOG(ERROR) << "Invalid next_log_index=" << next_log_index
+                   << " group: " << _group_name;
+        return EINVAL;
+    }
+    butil::IOBuf records;
+    append_record(&records, MERGED_RECORD_RESET, _group_name,
+                  next_log_index, 0, 0, butil::IOBuf());
+    int64_t file_id = 0;
+    int64_t offset = 0;
+    if (_impl->write(&records, &file_id, &offset) != 0) {
+        return -1;
+    }
+    _group->reset(next_log_index, file_id);
+    _impl->gc();
+    return 0;
+}
+
+// ${merged_path}?group=${group}
+int MergedLogStorage::parse_merged_uri(const std::string& uri, std::string* path,
+                                       std::string* group) {
+    const size_t pos = uri.find("?group=");
+    if (pos == std::string::npos || pos + 7 == uri.size()) {
+        LOG(ERROR) << "Missing group in merged log uri=" << uri;
+        return -1;
+    }
+    path->assign(uri, 0, pos);
+    group->assign(uri, pos + 7, std::string::npos);
+    return 0;
+}
+
+LogStorage* MergedLogStorage::new_instance(const std::string& uri) const {
+    std::string path;
+    std::string group;
+    if (parse_merged_uri(uri, &path, &group) != 0) {
+        return NULL;
+    }
+    return new MergedLogStorage(path, group);
+}
+
+butil::Status MergedLogStorage::gc_instance(const std::string& uri) const {
+    butil::Status status;
+    std::string path;
+    std::string group;
+    if (parse_merged_uri(uri, &path, &group) != 0) {
+        status.set_error(EINVAL, "Invalid merged log uri %s", uri.c_str());
+        return status;
+    }
+    scoped_refptr<MergedLogImpl> impl =
+            global_merged_log_manager->register_merged_log(path);
+    if (impl->init() != 0 || impl->drop_group(group) != 0) {
+        LOG(WARNING) << "Group " << group << " failed to gc merged log, path: "
+                     << path;
+        status.set_error(EIO, "Group %s failed to gc merged log in path: %s",
+                         group.c_str(), path.c_str());
+        return status;
+    }
+    LOG(INFO) << "Group " << group << " succeed to gc merged log, path: " << path;
+    return status;
+}
+
+}  //  namespace braft
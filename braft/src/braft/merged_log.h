@@ -0,0 +1,198 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRAFT_MERGED_LOG_H
+#define BRAFT_MERGED_LOG_H
+
+#include <deque>
+#include <map>
+#include <butil/memory/ref_counted.h>
+#include <butil/atomicops.h>
+#include <butil/iobuf.h>
+#include <bthread/execution_queue.h>
+#include "braft/log_entry.h"
+#include "braft/storage.h"
+#include "braft/util.h"
+
+namespace braft {
+
+class MergedLogFile;
+class MergedLogGroup;
+class MergedLogImpl;
+
+// Manage log of ONLY ONE raft instance, the entries are stored in a merged
+// log shared by A BATCH of raft instances on the same disk, so that their
+// appends are written and synced together.
+//
+// uri = local-merged://{merged_path}?group={group}
+class MergedLogStorage : public LogStorage {
+public:
+    MergedLogStorage(const std::string& path, const std::string& group);
+    MergedLogStorage() {}
+    virtual ~MergedLogStorage();
+
+    // init log storage, restore the entries of this group from merged log
+    virtual int init(ConfigurationManager* configuration_manager);
+
+    // first log index in log
+    virtual int64_t first_log_index();
+
+    // last log index in log
+    virtual int64_t last_log_index();
+
+    // get logentry by index
+    virtual LogEntry* get_entry(const int64_t index);
+
+    // get logentry's term by index
+    virtual int64_t get_term(const int64_t index);
+
+    // append entry to log
+    virtual int append_entry(const LogEntry* entry);
+
+    // append entries to log, return success append number
+    virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric);
+
+    // delete logs from storage's head, [1, first_index_kept) will be discarded
+    virtual int truncate_prefix(const int64_t first_index_kept);
+
+    // delete uncommitted logs from storage's tail, (last_index_kept, infinity) will be discarded
+    virtual int truncate_suffix(const int64_t last_index_kept);
+
+    virtual int reset(const int64_t next_log_index);
+
+    LogStorage* new_instance(const std::string& uri) const;
+
+    // drop the entries of the group from merged log
+    butil::Status gc_instance(const std::string& uri) const;
+
+private:
+    static int parse_merged_uri(const std::string& uri, std::string* path,
+                                std::string* group);
+
+    std::string _group_name;
+    scoped_refptr<MergedLogImpl> _impl;
+    scoped_refptr<MergedLogGroup> _group;
+};
+
+// Position of an entry in merged log
+struct MergedLogLocation {
+    int64_t file_id;
+    int64_t offset;
+    int64_t term;
+    uint32_t length;
+};
+
+// Entries of one raft instance in merged log, restored by replaying the
+// records of the instance in order
+class MergedLogGroup : public butil::RefCountedThreadSafe<MergedLogGroup> {
+public:
+    MergedLogGroup()
+        : first_index(1), last_index(0), _state_file_id(-1) {}
+
+    void append(int64_t index, const MergedLogLocation& location,
+                const ConfigurationEntry* conf_entry);
+    void truncate_prefix(int64_t first_index_kept, int64_t file_id);
+    void truncate_suffix(int64_t last_index_kept, int64_t file_id);
+    void reset(int64_t next_log_index, int64_t file_id);
+
+    int get_location(int64_t index, MergedLogLocation* location);
+
+    // Id of the oldest file needed to restore this group, -1 if none
+    int64_t pinned_file_id();
+
+    // Hand over the configuration entries restored from merged log
+    void take_conf_entries(std::vector<ConfigurationEntry>* conf_entries);
+
+    butil::atomic<int64_t> first_index;
+    butil::atomic<int64_t> last_index;
+
+private:
+friend class butil::RefCountedThreadSafe<MergedLogGroup>;
+    ~MergedLogGroup() {}
+
+    void clear(int64_t next_log_index, int64_t file_id);
+
+    raft_mutex_t _mutex;
+    std::deque<MergedLogLocation> _locations;
+    // file of the last record which left the group empty
+    int64_t _state_file_id;
+    std::deque<ConfigurationEntry> _conf_entries;
+};
+
+// Merged log of A BATCH of raft instances who share the same merged_path.
+// Records of all instances are appended to merged_log_{file_id} files in
+// turn, and the appends submitted together are written with one write and
+// synced with one fsync. Files are removed when no instance needs them.
+class MergedLogImpl : public butil::RefCountedThreadSafe<MergedLogImpl> {
+public:
+    explicit MergedLogImpl(const std::string& path);
+
+    // replay merged log, and start the execution queue of writes
+    int init();
+
+    // get or create the entries of |group|
+    scoped_refptr<MergedLogGroup> open_group(const std::string& group);
+
+    // forget |group| in merged log
+    int drop_group(const std::string& group);
+
+    // write |records| into merged log with other writes submitted at the
+    // same time, and get the position of them
+    int write(butil::IOBuf* records, int64_t* file_id, int64_t* offset);
+
+    scoped_refptr<MergedLogFile> get_file(int64_t file_id);
+
+    // remove the files which are not needed by any group
+    void gc();
+
+    const std::string& path() const { return _path; }
+
+private:
+friend class butil::RefCountedThreadSafe<MergedLogImpl>;
+    ~MergedLogImpl();
+
+    struct WriteTask {
+        butil::IOBuf* records;
+        int64_t* file_id;
+        int64_t* offset;
+        SynchronizedClosure* done;
+    };
+
+    static int run(void* meta, bthread::TaskIterator<WriteTask>& iter);
+
+    void flush(butil::IOBuf* batch, SynchronizedClosure* dones[], size_t size);
+
+    int open_file(int64_t file_id);
+
+    int replay_file(int64_t file_id, bool is_last);
+
+    typedef std::map<std::string, scoped_refptr<MergedLogGroup> > GroupMap;
+    typedef std::map<int64_t, scoped_refptr<MergedLogFile> > FileMap;
+
+    raft_mutex_t _init_mutex;
+    raft_mutex_t _mutex;
+    bool _is_inited;
+    std::string _path;
+    GroupMap _groups;
+    FileMap _files;
+    bthread::ExecutionQueueId<WriteTask> _queue_id;
+    // file being appended, only accessed in the execution queue after init
+    int64_t _file_id;
+    int64_t _file_size;
+    scoped_refptr<MergedLogFile> _file;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_MERGED_LOG_H
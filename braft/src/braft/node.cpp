@@ -16,6 +16,7 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 //          Xiong,Kai(xiongkai@baidu.com)
 
+#include <limits>
 #include <bthread/unstable.h>
 #include <brpc/errno.pb.h>
 #include <brpc/controller.h>
@@ -32,6 +33,7 @@
 #include "braft/builtin_service_impl.h"
 #include "braft/node_manager.h"
 #include "braft/snapshot_executor.h"
+#include "braft/entry_codec.h"
 #include "braft/errno.pb.h"
 
 namespace braft {
@@ -66,10 +68,25 @@ DEFINE_int32(raft_rpc_channel_connect_timeout_ms, 200,
 BRPC_VALIDATE_GFLAG(raft_rpc_channel_connect_timeout_ms, brpc::PositiveInteger);
 
 DECLARE_bool(raft_enable_leader_lease);
+DECLARE_int32(raft_max_entries_size);
 
 DEFINE_bool(raft_enable_witness_to_leader, false, 
             "enable witness temporarily to become leader when leader down accidently");
 
+DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
+                                   " in a single batch");
+BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
+
+DEFINE_int32(raft_apply_batch_max_bytes, 1024 * 1024,
+             "Max bytes of the data of the tasks applied in a single batch");
+BRPC_VALIDATE_GFLAG(raft_apply_batch_max_bytes, ::brpc::PositiveInteger);
+
+DEFINE_bool(raft_entry_checksum, false,
+            "Compute crc32c of the data of each task in apply(), which is"
+            " verified by followers before appending and reused as the data"
+            " checksum of log segments");
+BRPC_VALIDATE_GFLAG(raft_entry_checksum, ::brpc::PassValidate);
+
 #ifndef UNIT_TEST
 static bvar::Adder<int64_t> g_num_nodes("raft_node_count");
 #else
@@ -80,6 +97,19 @@ bvar::Adder<int64_t> g_num_nodes("raft_node_count");
 static bvar::CounterRecorder g_apply_tasks_batch_counter(
         "raft_apply_tasks_batch_counter");
 
+static bvar::Adder<int64_t> g_apply_tasks_busy(
+        "raft_apply_tasks_rejected_by_memory_log_count");
+
+static bvar::IntRecorder g_apply_batch_count_limit(
+        "raft_apply_batch_count_limit");
+static bvar::IntRecorder g_apply_batch_bytes_limit(
+        "raft_apply_batch_bytes_limit");
+
+static bvar::Adder<int64_t> g_relayed_entries_fetched_bytes(
+        "raft_relayed_entries_fetched_bytes");
+static bvar::Adder<int64_t> g_relayed_entries_served_bytes(
+        "raft_relayed_entries_served_bytes");
+
 int SnapshotTimer::adjust_timeout_ms(int timeout_ms) {
     if (!_first_schedule) {
         return timeout_ms;
@@ -160,7 +190,9 @@ NodeImpl::NodeImpl(const GroupId& group_id, const PeerId& peer_id)
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
     , _node_readonly(false)
-    , _majority_nodes_readonly(false) {
+    , _majority_nodes_readonly(false)
+    , _apply_batch_limit(FLAGS_raft_apply_batch,
+                         FLAGS_raft_apply_batch_max_bytes) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
     AddRef();
     g_num_nodes << 1;
@@ -186,7 +218,9 @@ NodeImpl::NodeImpl()
     , _append_entries_cache(NULL)
     , _append_entries_cache_version(0)
     , _node_readonly(false)
-    , _majority_nodes_readonly(false) {
+    , _majority_nodes_readonly(false)
+    , _apply_batch_limit(FLAGS_raft_apply_batch,
+                         FLAGS_raft_apply_batch_max_bytes) {
     butil::string_printf(&_v_group_id, "%s_%d", _group_id.c_str(), _server_id.idx);
     AddRef();
     g_num_nodes << 1;
@@ -662,27 +696,32 @@ int NodeImpl::init(const NodeOptions& options) {
     return 0;
 }
 
-DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
-                                   " in a single batch");
-BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
-
 int NodeImpl::execute_applying_tasks(
         void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter) {
     if (iter.is_queue_stopped()) {
         return 0;
     }
-    // TODO: the batch size should limited by both task size and the total log
-    // size
-    const size_t batch_size = FLAGS_raft_apply_batch;
+    NodeImpl* m = (NodeImpl*)meta;
+    // Batches are limited by both the number of tasks and the total bytes
+    size_t batch_size = FLAGS_raft_apply_batch;
+    size_t max_bytes = FLAGS_raft_apply_batch_max_bytes;
+    if (FLAGS_raft_adaptive_batch) {
+        batch_size = m->_apply_batch_limit.max_count();
+        max_bytes = m->_apply_batch_limit.max_bytes();
+        g_apply_batch_count_limit << batch_size;
+        g_apply_batch_bytes_limit << max_bytes;
+    }
     DEFINE_SMALL_ARRAY(LogEntryAndClosure, tasks, batch_size, 256);
     size_t cur_size = 0;
-    NodeImpl* m = (NodeImpl*)meta;
+    size_t cur_bytes = 0;
     for (; iter; ++iter) {
-        if (cur_size == batch_size) {
+        if (cur_size == batch_size || cur_bytes >= max_bytes) {
             m->apply(tasks, cur_size);
             cur_size = 0;
+            cur_bytes = 0;
         }
         tasks[cur_size++] = *iter;
+        cur_bytes += (*iter).entry->data.length();
     }
     if (cur_size > 0) {
         m->apply(tasks, cur_size);
@@ -694,6 +733,11 @@ void NodeImpl::apply(const Task& task) {
     LogEntry* entry = new LogEntry;
     entry->AddRef();
     entry->data.swap(*task.data);
+    if (FLAGS_raft_entry_checksum) {
+        // Out of the apply queue, so that the callers compute in parallel
+        entry->data_checksum = crc32(entry->data);
+        entry->has_data_checksum = true;
+    }
     LogEntryAndClosure m;
     m.entry = entry;
     m.done = task.done;
@@ -1089,6 +1133,120 @@ void NodeImpl::handle_election_timeout() {
     // Don't touch any thing of *this ever after
 }
 
+int NodeImpl::fetch_relayed_entries(brpc::Controller* cntl,
+                                    const AppendEntriesRequest* request) {
+    const int count = append_entries_count(*request);
+    PeerId relay;
+    if (count == 0 || relay.parse(request->relay_peer_id()) != 0) {
+        cntl->SetFailed(EINVAL, "Invalid relay_peer_id=%s with %d entries",
+                        request->relay_peer_id().c_str(), count);
+        return -1;
+    }
+    scoped_refptr<RelayChannel> relay_channel;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        // Stale or unexpected requests are rejected later without the data,
+        // don't fetch for them
+        if (!is_active_state(_state) || request->term() < _current_term) {
+            return 1;
+        }
+        if (_relay_channel == NULL || _relay_channel->peer_id != relay) {
+            // The relay should answer well within a heartbeat, the leader
+            // sends the entries itself once the fetch fails
+            brpc::ChannelOptions options;
+            options.connect_timeout_ms = FLAGS_raft_rpc_channel_connect_timeout_ms;
+            options.timeout_ms = std::max(
+                    heartbeat_timeout(_options.election_timeout_ms) / 2, 1);
+            scoped_refptr<RelayChannel> new_channel(new RelayChannel);
+            new_channel->peer_id = relay;
+            if (new_channel->channel.Init(relay.addr, &options) != 0) {
+                cntl->SetFailed(EHOSTDOWN, "Fail to init channel to relay %s",
+                                request->relay_peer_id().c_str());
+                return -1;
+            }
+            _relay_channel = new_channel;
+        }
+        relay_channel = _relay_channel;
+    }
+    FetchEntriesRequest fetch_request;
+    fetch_request.set_group_id(_group_id);
+    fetch_request.set_server_id(_server_id.to_string());
+    fetch_request.set_peer_id(request->relay_peer_id());
+    fetch_request.set_first_index(request->prev_log_index() + 1);
+    fetch_request.set_last_index(request->prev_log_index() + count);
+    fetch_request.set_last_term(request->relay_last_log_term());
+    FetchEntriesResponse fetch_response;
+    brpc::Controller fetch_cntl;
+    RaftService_Stub stub(&relay_channel->channel);
+    stub.fetch_entries(&fetch_cntl, &fetch_request, &fetch_response, NULL);
+    if (fetch_cntl.Failed()) {
+        LOG(WARNING) << "node " << _group_id << ":" << _server_id
+                     << " fail to fetch entries in [" << fetch_request.first_index()
+                     << ", " << fetch_request.last_index() << "] from relay "
+                     << relay << ", " << fetch_cntl.ErrorText();
+        cntl->SetFailed(fetch_cntl.ErrorCode(), "Fail to fetch entries from"
+                        " relay %s, %s", request->relay_peer_id().c_str(),
+                        fetch_cntl.ErrorText().c_str());
+        return -1;
+    }
+    g_relayed_entries_fetched_bytes << fetch_cntl.response_attachment().length();
+    // The data goes after the headers in the compact format
+    cntl->request_attachment().append(fetch_cntl.response_attachment());
+    return 0;
+}
+
+void NodeImpl::handle_fetch_entries_request(brpc::Controller* controller,
+                                            const FetchEntriesRequest* request,
+                                            FetchEntriesResponse* response,
+                                            google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    if (is_witness()) {
+        controller->SetFailed(EPERM, "Witness doesn't have the data of entries");
+        return;
+    }
+    const int64_t first_index = request->first_index();
+    const int64_t last_index = request->last_index();
+    if (first_index <= 0 || last_index < first_index
+            || last_index - first_index >= FLAGS_raft_max_entries_size) {
+        controller->SetFailed(EINVAL, "Invalid range [%" PRId64 ", %" PRId64 "]",
+                              first_index, last_index);
+        return;
+    }
+    // The entries before the one with the same index and term are the same
+    // as the leader's. Check the term again after reading in case the log
+    // was truncated in the meantime
+    if (_log_manager->get_term(last_index) != request->last_term()) {
+        controller->SetFailed(ENOENT, "Entry at index=%" PRId64 " term=%" PRId64
+                              " doesn't exist", last_index, request->last_term());
+        return;
+    }
+    butil::IOBuf data;
+    std::vector<LogEntry*> entries;
+    for (int64_t index = first_index; index <= last_index; ) {
+        entries.clear();
+        // Read in ranges, a range stops where the logs in memory begin
+        const int n = _log_manager->get_entries(
+                index, last_index, std::numeric_limits<size_t>::max(), &entries);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            data.append(entries[i]->data);
+            entries[i]->Release();
+        }
+        if (n == 0) {
+            controller->SetFailed(ENOENT, "Entry at index=%" PRId64
+                                  " doesn't exist", index);
+            return;
+        }
+        index += n;
+    }
+    if (_log_manager->get_term(last_index) != request->last_term()) {
+        controller->SetFailed(ENOENT, "Entry at index=%" PRId64 " term=%" PRId64
+                              " doesn't exist", last_index, request->last_term());
+        return;
+    }
+    g_relayed_entries_served_bytes << data.length();
+    controller->response_attachment().swap(data);
+}
+
 void NodeImpl::handle_timeout_now_request(brpc::Controller* controller,
                                           const TimeoutNowRequest* request,
                                           TimeoutNowResponse* response,
@@ -1980,18 +2138,26 @@ public:
 private:
     LeaderStableClosure(const NodeId& node_id,
                         size_t nentries,
-                        BallotBox* ballot_box);
+                        BallotBox* ballot_box,
+                        AdaptiveBatchLimit* batch_limit = NULL,
+                        size_t nbytes = 0);
     ~LeaderStableClosure() {}
 friend class NodeImpl;
     NodeId _node_id;
     size_t _nentries;
     BallotBox* _ballot_box;
+    // Fed with the latency of the applied batch, NULL for configurations
+    AdaptiveBatchLimit* _batch_limit;
+    size_t _nbytes;
 };
 
 LeaderStableClosure::LeaderStableClosure(const NodeId& node_id,
                                          size_t nentries,
-                                         BallotBox* ballot_box)
+                                         BallotBox* ballot_box,
+                                         AdaptiveBatchLimit* batch_limit,
+                                         size_t nbytes)
     : _node_id(node_id), _nentries(nentries), _ballot_box(ballot_box)
+    , _batch_limit(batch_limit), _nbytes(nbytes)
 {
 }
 
@@ -2003,6 +2169,10 @@ void LeaderStableClosure::Run() {
                     _first_log_index, _first_log_index + _nentries - 1, _node_id.peer_id);
         }
         int64_t now = butil::cpuwide_time_us();
+        if (_batch_limit) {
+            _batch_limit->on_batch_done(now - metric.start_time_us,
+                                        _nentries, _nbytes);
+        }
         if (FLAGS_raft_trace_append_entry_latency && 
             now - metric.start_time_us > (int64_t)FLAGS_raft_append_entry_high_lat_us) {
             LOG(WARNING) << "leader append entry latency us " << (now - metric.start_time_us) 
@@ -2028,10 +2198,16 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
     entries.reserve(size);
     std::unique_lock<raft_mutex_t> lck(_mutex);
     bool reject_new_user_logs = (_node_readonly || _majority_nodes_readonly);
-    if (_state != STATE_LEADER || reject_new_user_logs) {
+    // Back-pressure when the logs not on disk yet take too much memory
+    bool memory_log_full = _log_manager->memory_log_full();
+    if (_state != STATE_LEADER || reject_new_user_logs || memory_log_full) {
         butil::Status st;
         if (_state == STATE_LEADER && reject_new_user_logs) {
             st.set_error(EREADONLY, "readonly mode reject new user logs");
+        } else if (_state == STATE_LEADER) {
+            g_apply_tasks_busy << size;
+            st.set_error(EBUSY, "too many bytes of logs in memory, retry after"
+                                " the disk catches up");
         } else if (_state != STATE_TRANSFERRING) {
             st.set_error(EPERM, "is not leader");
         } else {
@@ -2048,6 +2224,7 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
         }
         return;
     }
+    size_t nbytes = 0;
     for (size_t i = 0; i < size; ++i) {
         if (tasks[i].expected_term != -1 && tasks[i].expected_term != _current_term) {
             BRAFT_VLOG << "node " << _group_id << ":" << _server_id
@@ -2063,6 +2240,7 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
             continue;
         }
         entries.push_back(tasks[i].entry);
+        nbytes += tasks[i].entry->data.length();
         entries.back()->id.term = _current_term;
         entries.back()->type = ENTRY_TYPE_DATA;
         _ballot_box->append_pending_task(_conf.conf,
@@ -2073,7 +2251,9 @@ void NodeImpl::apply(LogEntryAndClosure tasks[], size_t size) {
                                new LeaderStableClosure(
                                         NodeId(_group_id, _server_id),
                                         entries.size(),
-                                        _ballot_box));
+                                        _ballot_box,
+                                        &_apply_batch_limit,
+                                        nbytes));
     // update _conf.first
     _log_manager->check_and_set_configuration(&_conf);
 }
@@ -2355,7 +2535,7 @@ private:
                 std::min(_request->committed_index(),
                          // ^^^ committed_index is likely less than the
                          // last_log_index
-                         _request->prev_log_index() + _request->entries_size()
+                         _request->prev_log_index() + append_entries_count(*_request)
                          // ^^^ The logs after the appended entries are
                          // untrustable so we can't commit them even if their
                          // indexes are less than request->committed_index()
@@ -2371,7 +2551,7 @@ private:
                          << metric
                          << " node " << _node->node_id()
                          << " log_index [" << _request->prev_log_index() + 1 
-                         << ", " << _request->prev_log_index() + _request->entries_size() - 1
+                         << ", " << _request->prev_log_index() + append_entries_count(*_request) - 1
                          << "]";
         }
     }
@@ -2389,13 +2569,36 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
                                              AppendEntriesResponse* response,
                                              google::protobuf::Closure* done,
                                              bool from_append_entries_cache) {
-    std::vector<LogEntry*> entries;
-    entries.reserve(request->entries_size());
     brpc::ClosureGuard done_guard(done);
+    const int count = append_entries_count(*request);
+    if (count < 0) {
+        cntl->SetFailed(brpc::EREQUEST, "Invalid entries count=%d", count);
+        return;
+    }
+    // The count isn't checked against the attachment yet, don't allocate
+    // more than a leader sends at once up front
+    std::vector<LogEntry*> entries;
+    entries.reserve(std::min(count, FLAGS_raft_max_entries_size));
+    // Fetch and verify the data before taking the lock, the requests from the
+    // cache have been completed when they arrived
+    int fetch_rc = 0;
+    if (!from_append_entries_cache && request->has_relay_peer_id()) {
+        fetch_rc = fetch_relayed_entries(cntl, request);
+        if (fetch_rc < 0) {
+            return;
+        }
+    }
+    if (!from_append_entries_cache && fetch_rc == 0 &&
+            verify_entries_checksum(*request, cntl->request_attachment()) != 0) {
+        cntl->SetFailed(brpc::EREQUEST, "Fail to verify the checksum of entries");
+        return;
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
 
     // pre set term, to avoid get term in lock
     response->set_term(_current_term);
+    response->set_compact_entries(true);
+    response->set_relay_entries(true);
 
     if (!is_active_state(_state)) {
         const int64_t saved_current_term = _current_term;
@@ -2456,7 +2659,7 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
         _follower_lease.renew(_leader_id);
     }
 
-    if (request->entries_size() > 0 &&
+    if (append_entries_count(*request) > 0 &&
             (_snapshot_executor
                 && _snapshot_executor->is_installing_snapshot())) {
         LOG(WARNING) << "node " << _group_id << ":" << _server_id
@@ -2471,7 +2674,7 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
     if (local_prev_log_term != prev_log_term) {
         int64_t last_index = _log_manager->last_log_index();
         int64_t saved_term = request->term();
-        int     saved_entries_size = request->entries_size();
+        int     saved_entries_size = append_entries_count(*request);
         std::string rpc_server_id = request->server_id();
         if (!from_append_entries_cache &&
             handle_out_of_order_append_entries(
@@ -2505,13 +2708,13 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
                          << " prev_log_term " << request->prev_log_term()
                          << " local_prev_log_term " << local_prev_log_term
                          << " last_log_index " << last_index
-                         << " entries_size " << request->entries_size()
+                         << " entries_size " << append_entries_count(*request)
                          << " from_append_entries_cache: " << from_append_entries_cache;
         }
         return;
     }
 
-    if (request->entries_size() == 0) {
+    if (append_entries_count(*request) == 0) {
         response->set_success(true);
         response->set_term(_current_term);
         response->set_last_log_index(_log_manager->last_log_index());
@@ -2528,35 +2731,48 @@ void NodeImpl::handle_append_entries_request(brpc::Controller* cntl,
     butil::IOBuf data_buf;
     data_buf.swap(cntl->request_attachment());
     int64_t index = prev_log_index;
-    for (int i = 0; i < request->entries_size(); i++) {
-        index++;
-        const EntryMeta& entry = request->entries(i);
-        if (entry.type() != ENTRY_TYPE_UNKNOWN) {
-            LogEntry* log_entry = new LogEntry();
-            log_entry->AddRef();
-            log_entry->id.term = entry.term();
-            log_entry->id.index = index;
-            log_entry->type = (EntryType)entry.type();
-            if (entry.peers_size() > 0) {
-                log_entry->peers = new std::vector<PeerId>;
-                for (int i = 0; i < entry.peers_size(); i++) {
-                    log_entry->peers->push_back(entry.peers(i));
+    if (request->has_compact_entries_count()) {
+        if (parse_compact_entries(*request, &data_buf, &entries) != 0) {
+            lck.unlock();
+            cntl->SetFailed(brpc::EREQUEST, "Fail to parse compact entries");
+            return;
+        }
+        index += request->compact_entries_count();
+    } else {
+        for (int i = 0; i < request->entries_size(); i++) {
+            index++;
+            const EntryMeta& entry = request->entries(i);
+            if (entry.type() != ENTRY_TYPE_UNKNOWN) {
+                LogEntry* log_entry = new LogEntry();
+                log_entry->AddRef();
+                log_entry->id.term = entry.term();
+                log_entry->id.index = index;
+                log_entry->type = (EntryType)entry.type();
+                if (entry.has_data_checksum()) {
+                    log_entry->data_checksum = entry.data_checksum();
+                    log_entry->has_data_checksum = true;
                 }
-                CHECK_EQ(log_entry->type, ENTRY_TYPE_CONFIGURATION);
-                if (entry.old_peers_size() > 0) {
-                    log_entry->old_peers = new std::vector<PeerId>;
-                    for (int i = 0; i < entry.old_peers_size(); i++) {
-                        log_entry->old_peers->push_back(entry.old_peers(i));
+                if (entry.peers_size() > 0) {
+                    log_entry->peers = new std::vector<PeerId>;
+                    for (int i = 0; i < entry.peers_size(); i++) {
+                        log_entry->peers->push_back(entry.peers(i));
+                    }
+                    CHECK_EQ(log_entry->type, ENTRY_TYPE_CONFIGURATION);
+                    if (entry.old_peers_size() > 0) {
+                        log_entry->old_peers = new std::vector<PeerId>;
+                        for (int i = 0; i < entry.old_peers_size(); i++) {
+                            log_entry->old_peers->push_back(entry.old_peers(i));
+                        }
                     }
+                } else {
+                    CHECK_NE(entry.type(), ENTRY_TYPE_CONFIGURATION);
                 }
-            } else {
-                CHECK_NE(entry.type(), ENTRY_TYPE_CONFIGURATION);
-            }
-            if (entry.has_data_len()) {
-                int len = entry.data_len();
-                data_buf.cutn(&log_entry->data, len);
+                if (entry.has_data_len()) {
+                    int len = entry.data_len();
+                    data_buf.cutn(&log_entry->data, len);
+                }
+                entries.push_back(log_entry);
             }
-            entries.push_back(log_entry);
         }
     }
 
@@ -2912,7 +3128,7 @@ bool NodeImpl::handle_out_of_order_append_entries(brpc::Controller* cntl,
                                                   int64_t local_last_index) {
     if (!FLAGS_raft_enable_append_entries_cache ||
         local_last_index >= request->prev_log_index() ||
-        request->entries_size() == 0) {
+        append_entries_count(*request) == 0) {
         return false;
     }
     if (!_append_entries_cache) {
@@ -3025,7 +3241,7 @@ bool NodeImpl::AppendEntriesCache::store(AppendEntriesRpc* rpc) {
         std::map<int64_t, AppendEntriesRpc*>::iterator it =
             _rpc_map.lower_bound(rpc->request->prev_log_index());
         int64_t rpc_prev_index = rpc->request->prev_log_index();
-        int64_t rpc_last_index = rpc_prev_index + rpc->request->entries_size();
+        int64_t rpc_last_index = rpc_prev_index + append_entries_count(*rpc->request);
 
         // Some rpcs with the overlap log index alredy exist, means retransmission
         // happend, simplely clean all out of order requests, and store the new
@@ -3034,7 +3250,7 @@ bool NodeImpl::AppendEntriesCache::store(AppendEntriesRpc* rpc) {
             --it;
             AppendEntriesRpc* prev_rpc = it->second;
             if (prev_rpc->request->prev_log_index() +
-                prev_rpc->request->entries_size() > rpc_prev_index) {
+                append_entries_count(*prev_rpc->request) > rpc_prev_index) {
                 need_clear = true;
             }
             ++it;
@@ -3088,7 +3304,7 @@ void NodeImpl::AppendEntriesCache::process_runable_rpcs(int64_t local_last_index
         if (rpc->request->prev_log_index() > local_last_index) {
             break;
         }
-        local_last_index = rpc->request->prev_log_index() + rpc->request->entries_size();
+        local_last_index = rpc->request->prev_log_index() + append_entries_count(*rpc->request);
         _rpc_map.erase(it++);
         rpc->RemoveFromList();
         if (arg == NULL) {
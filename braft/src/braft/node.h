@@ -36,6 +36,7 @@
 #include "braft/closure_queue.h"
 #include "braft/configuration_manager.h"
 #include "braft/repeated_timer_task.h"
+#include "braft/adaptive_batch.h"
 
 namespace braft {
 
@@ -177,6 +178,13 @@ public:
                                     const TimeoutNowRequest* request,
                                     TimeoutNowResponse* response,
                                     google::protobuf::Closure* done);
+
+    // handle received FetchEntries from the follower this node relays the
+    // entries to
+    void handle_fetch_entries_request(brpc::Controller* controller,
+                                      const FetchEntriesRequest* request,
+                                      FetchEntriesResponse* response,
+                                      google::protobuf::Closure* done);
     // timer func
     void handle_election_timeout();
     void handle_vote_timeout();
@@ -311,6 +319,12 @@ friend class butil::RefCountedThreadSafe<NodeImpl>;
                                             AppendEntriesResponse* response,
                                             google::protobuf::Closure* done,
                                             int64_t local_last_index);
+    // Fill the data of the entries in |request| from its relay into the
+    // attachment of |cntl|. Returns 0 on success, 1 if nothing is fetched as
+    // the request is going to be rejected anyway, -1 with |cntl| failed on
+    // error.
+    int fetch_relayed_entries(brpc::Controller* cntl,
+                              const AppendEntriesRequest* request);
     void check_append_entries_cache(int64_t local_last_index);
     void clear_append_entries_cache();
     static void* handle_append_entries_from_cache(void* arg);
@@ -527,12 +541,23 @@ private:
     AppendEntriesCache* _append_entries_cache;
     int64_t _append_entries_cache_version;
 
+    // The channel to the relay of the latest relayed AppendEntries, shared
+    // by the fetches in flight
+    struct RelayChannel : public butil::RefCountedThreadSafe<RelayChannel> {
+        PeerId peer_id;
+        brpc::Channel channel;
+    };
+    scoped_refptr<RelayChannel> _relay_channel;
+
     // for readonly mode
     bool _node_readonly;
     bool _majority_nodes_readonly;
 
     LeaderLease _leader_lease;
     FollowerLease _follower_lease;
+
+    // Limits of the batches taken from _apply_queue with raft_adaptive_batch
+    AdaptiveBatchLimit _apply_batch_limit;
 };
 
 }
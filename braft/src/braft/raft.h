@@ -678,6 +678,8 @@ public:
     // |task.done|: If the data is successfully committed to the raft group. We
     //              will pass the ownership to StateMachine::on_apply.
     //              Otherwise we will specify the error and call it.
+    //              EBUSY is specified when the logs not on disk yet exceed
+    //              raft_max_memory_log_bytes, the task can be retried later.
     //
     void apply(const Task& task);
 
@@ -15,15 +15,30 @@
 // Authors: Wang,Yao(wangyao02@baidu.com)
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 
+#include <gflags/gflags.h>
 #include <butil/logging.h>
+#include <butil/atomicops.h>
+#include <butil/time.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>                    // bthread_timer_add
 #include <brpc/server.h>
+#include <brpc/errno.pb.h>                       // brpc::EREQUEST
+#include <brpc/reloadable_flags.h>               // BRPC_VALIDATE_GFLAG
 #include "braft/raft_service.h"
 #include "braft/raft.h"
 #include "braft/node.h"
 #include "braft/node_manager.h"
+#include "braft/entry_codec.h"
 
 namespace braft {
 
+DEFINE_int32(raft_batch_append_entries_max_wait_ms, 50,
+             "batch_append_entries is responded after this long even if some"
+             " of the requests in it are not done, which are answered with"
+             " EREQUESTPENDING");
+BRPC_VALIDATE_GFLAG(raft_batch_append_entries_max_wait_ms,
+                    brpc::PositiveInteger);
+
 RaftServiceImpl::~RaftServiceImpl() {
     global_node_manager->remove_address(_addr);
 }
@@ -166,4 +181,284 @@ void RaftServiceImpl::timeout_now(::google::protobuf::RpcController* controller,
     node->handle_timeout_now_request(cntl, request, response, done);
 }
 
+void RaftServiceImpl::fetch_entries(google::protobuf::RpcController* cntl_base,
+                                    const FetchEntriesRequest* request,
+                                    FetchEntriesResponse* response,
+                                    google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(cntl_base);
+
+    PeerId peer_id;
+    if (0 != peer_id.parse(request->peer_id())) {
+        cntl->SetFailed(EINVAL, "peer_id invalid");
+        return;
+    }
+
+    scoped_refptr<NodeImpl> node_ptr = 
+                        global_node_manager->get(request->group_id(), peer_id);
+    NodeImpl* node = node_ptr.get();
+    if (!node) {
+        cntl->SetFailed(ENOENT, "peer_id not exist");
+        return;
+    }
+
+    return node->handle_fetch_entries_request(cntl, request, response,
+                                              done_guard.release());
+}
+
+void RaftServiceImpl::batch_heartbeat(google::protobuf::RpcController* cntl_base,
+                                      const BatchHeartbeatRequest* request,
+                                      BatchHeartbeatResponse* response,
+                                      google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    // Heartbeats are handled synchronously, so one controller is reused
+    brpc::Controller sub_cntl;
+    for (int i = 0; i < request->requests_size(); ++i) {
+        const AppendEntriesRequest& sub_request = request->requests(i);
+        AppendEntriesResponse* sub_response = response->add_responses();
+        int error_code = 0;
+        if (append_entries_count(sub_request) != 0) {
+            error_code = EINVAL;
+        } else {
+            sub_cntl.Reset();
+            append_entries(&sub_cntl, &sub_request, sub_response, NULL);
+            error_code = sub_cntl.ErrorCode();
+        }
+        if (error_code != 0) {
+            // Keep the required fields set
+            sub_response->Clear();
+            sub_response->set_term(0);
+            sub_response->set_success(false);
+        }
+        response->add_error_codes(error_code);
+    }
+}
+
+// Responds to batch_append_entries once all the requests in it are done, the
+// followers may finish them asynchronously after the entries are persisted.
+// Not to hold up the other groups behind a slow one, the batch is responded
+// after raft_batch_append_entries_max_wait_ms anyway, answering the requests
+// not done yet with EREQUESTPENDING, which the leader doesn't take as a
+// failure of the follower. Each request is handled on its own copy, so it
+// can still finish safely after the batch is responded.
+class BatchAppendEntriesDone {
+public:
+    struct Sub {
+        Sub() : done(false) {}
+        brpc::Controller cntl;
+        AppendEntriesRequest request;
+        AppendEntriesResponse response;
+        bool done;
+    };
+
+    BatchAppendEntriesDone(BatchAppendEntriesResponse* response,
+                           google::protobuf::Closure* done, int n)
+        : _response(response), _done(done), _subs(n), _ndone(0)
+        , _responded(false), _timer(0), _nref(n + 1) {
+        for (int i = 0; i < n; ++i) {
+            _subs[i] = new Sub;
+        }
+    }
+
+    Sub* sub(int i) { return _subs[i]; }
+
+    // Called by the dispatcher once all the requests are dispatched
+    void start_timer() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_responded) {
+            return;
+        }
+        _nref.fetch_add(1, butil::memory_order_relaxed);
+        const timespec due_time = butil::milliseconds_from_now(
+                FLAGS_raft_batch_append_entries_max_wait_ms);
+        if (bthread_timer_add(&_timer, due_time, on_timer, this) != 0) {
+            LOG(ERROR) << "Fail to add timer, wait for all the requests";
+            _timer = 0;
+            _nref.fetch_sub(1, butil::memory_order_relaxed);
+        }
+    }
+
+    static void on_sub_done(BatchAppendEntriesDone* batch, int i) {
+        bool respond = false;
+        {
+            BAIDU_SCOPED_LOCK(batch->_mutex);
+            batch->_subs[i]->done = true;
+            ++batch->_ndone;
+            respond = !batch->_responded
+                    && batch->_ndone == (int)batch->_subs.size();
+            if (respond) {
+                batch->_responded = true;
+                batch->fill_response();
+            }
+        }
+        if (respond) {
+            batch->_done->Run();
+            bthread_timer_t timer = 0;
+            {
+                BAIDU_SCOPED_LOCK(batch->_mutex);
+                timer = batch->_timer;
+            }
+            // The timer which doesn't run any more drops its reference here
+            if (timer != 0 && bthread_timer_del(timer) == 0) {
+                batch->release();
+            }
+        }
+        batch->release();
+    }
+
+    void release() {
+        if (_nref.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+private:
+    ~BatchAppendEntriesDone() {
+        for (size_t i = 0; i < _subs.size(); ++i) {
+            delete _subs[i];
+        }
+    }
+
+    static void on_timer(void* arg) {
+        // Don't block the timer thread
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_timeout, arg) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_timeout(arg);
+        }
+    }
+
+    static void* run_timeout(void* arg) {
+        BatchAppendEntriesDone* batch = (BatchAppendEntriesDone*)arg;
+        bool respond = false;
+        {
+            BAIDU_SCOPED_LOCK(batch->_mutex);
+            if (!batch->_responded) {
+                respond = true;
+                batch->_responded = true;
+                batch->fill_response();
+            }
+        }
+        if (respond) {
+            batch->_done->Run();
+        }
+        batch->release();
+        return NULL;
+    }
+
+    // Called with _mutex held, the requests done won't be touched any more
+    void fill_response() {
+        for (size_t i = 0; i < _subs.size(); ++i) {
+            Sub* sub = _subs[i];
+            AppendEntriesResponse* sub_response = _response->add_responses();
+            int error_code = 0;
+            if (!sub->done) {
+                error_code = EREQUESTPENDING;
+            } else {
+                error_code = sub->cntl.ErrorCode();
+            }
+            if (error_code == 0) {
+                sub_response->Swap(&sub->response);
+            } else {
+                // Keep the required fields set
+                sub_response->set_term(0);
+                sub_response->set_success(false);
+            }
+            _response->add_error_codes(error_code);
+        }
+    }
+
+    BatchAppendEntriesResponse* _response;
+    google::protobuf::Closure* _done;
+    std::vector<Sub*> _subs;
+    raft_mutex_t _mutex;
+    int _ndone;
+    bool _responded;
+    bthread_timer_t _timer;
+    // Held by each of the requests, the dispatcher and the timer
+    butil::atomic<int> _nref;
+};
+
+struct RelayedAppendEntriesArg {
+    RaftServiceImpl* service;
+    BatchAppendEntriesDone::Sub* sub;
+    google::protobuf::Closure* done;
+};
+
+static void* run_relayed_append_entries(void* arg) {
+    RelayedAppendEntriesArg* a = (RelayedAppendEntriesArg*)arg;
+    a->service->append_entries(&a->sub->cntl, &a->sub->request,
+                               &a->sub->response, a->done);
+    delete a;
+    return NULL;
+}
+
+void RaftServiceImpl::batch_append_entries(
+        google::protobuf::RpcController* cntl_base,
+        const BatchAppendEntriesRequest* request,
+        BatchAppendEntriesResponse* response,
+        google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(cntl_base);
+
+    const int n = request->requests_size();
+    if (request->attachment_sizes_size() != n) {
+        cntl->SetFailed(brpc::EREQUEST, "%d attachment sizes for %d requests",
+                        request->attachment_sizes_size(), n);
+        return;
+    }
+    int64_t total_size = 0;
+    for (int i = 0; i < n; ++i) {
+        if (request->attachment_sizes(i) < 0) {
+            cntl->SetFailed(brpc::EREQUEST, "Invalid attachment size");
+            return;
+        }
+        total_size += request->attachment_sizes(i);
+    }
+    if (total_size != (int64_t)cntl->request_attachment().length()) {
+        cntl->SetFailed(brpc::EREQUEST, "attachment_size=%" PRId64
+                        " doesn't match the attachment of %" PRIu64 " bytes",
+                        total_size, (uint64_t)cntl->request_attachment().length());
+        return;
+    }
+
+    if (n == 0) {
+        return;
+    }
+    BatchAppendEntriesDone* batch =
+            new BatchAppendEntriesDone(response, done_guard.release(), n);
+    for (int i = 0; i < n; ++i) {
+        BatchAppendEntriesDone::Sub* sub = batch->sub(i);
+        sub->request.CopyFrom(request->requests(i));
+        cntl->request_attachment().cutn(&sub->cntl.request_attachment(),
+                                        request->attachment_sizes(i));
+    }
+    // All the requests are copied, the batch may be responded from now on
+    for (int i = 0; i < n; ++i) {
+        BatchAppendEntriesDone::Sub* sub = batch->sub(i);
+        google::protobuf::Closure* sub_done =
+                brpc::NewCallback(BatchAppendEntriesDone::on_sub_done, batch, i);
+        if (sub->request.has_relay_peer_id()) {
+            // The data is fetched from the relay synchronously, don't make
+            // the other groups wait for it
+            RelayedAppendEntriesArg* arg = new RelayedAppendEntriesArg;
+            arg->service = this;
+            arg->sub = sub;
+            arg->done = sub_done;
+            bthread_t tid;
+            if (bthread_start_background(&tid, NULL, run_relayed_append_entries,
+                                         arg) == 0) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to start bthread";
+            delete arg;
+        }
+        append_entries(&sub->cntl, &sub->request, &sub->response, sub_done);
+    }
+    batch->start_timer();
+    batch->release();
+}
+
 }
@@ -50,6 +50,18 @@ public:
                      const ::braft::TimeoutNowRequest* request,
                      ::braft::TimeoutNowResponse* response,
                      ::google::protobuf::Closure* done);
+    void batch_heartbeat(::google::protobuf::RpcController* controller,
+                         const ::braft::BatchHeartbeatRequest* request,
+                         ::braft::BatchHeartbeatResponse* response,
+                         ::google::protobuf::Closure* done);
+    void batch_append_entries(::google::protobuf::RpcController* controller,
+                              const ::braft::BatchAppendEntriesRequest* request,
+                              ::braft::BatchAppendEntriesResponse* response,
+                              ::google::protobuf::Closure* done);
+    void fetch_entries(::google::protobuf::RpcController* controller,
+                       const ::braft::FetchEntriesRequest* request,
+                       ::braft::FetchEntriesResponse* response,
+                       ::google::protobuf::Closure* done);
 private:
     butil::EndPoint _addr;
 };
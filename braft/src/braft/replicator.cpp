@@ -25,6 +25,7 @@
 #include "braft/node.h"                          // NodeImpl
 #include "braft/ballot_box.h"                    // BallotBox 
 #include "braft/log_entry.h"                     // LogEntry
+#include "braft/entry_codec.h"                   // CompactEntriesEncoder
 #include "braft/snapshot_throttle.h"             // SnapshotThrottle
 
 namespace braft {
@@ -38,6 +39,73 @@ DEFINE_int32(raft_max_parallel_append_entries_rpc_num, 1,
 BRPC_VALIDATE_GFLAG(raft_max_parallel_append_entries_rpc_num,
                     ::brpc::PositiveInteger);
 
+DEFINE_bool(raft_adaptive_append_entries_window, false,
+            "Size the AppendEntries requests in flight to each follower by the"
+            " measured RTT and the acknowledged bytes like a congestion window,"
+            " instead of raft_max_parallel_append_entries_rpc_num. Followers"
+            " should enable raft_enable_append_entries_cache to accept the"
+            " requests arriving out of order");
+BRPC_VALIDATE_GFLAG(raft_adaptive_append_entries_window, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_adaptive_append_entries_rpc_num, 16,
+             "The max number of parallel AppendEntries requests with"
+             " raft_adaptive_append_entries_window");
+BRPC_VALIDATE_GFLAG(raft_max_adaptive_append_entries_rpc_num,
+                    ::brpc::PositiveInteger);
+
+DEFINE_bool(raft_compact_append_entries, false,
+            "Pack the headers of the entries in AppendEntriesRequest into a"
+            " compact binary format instead of one EntryMeta per entry, for"
+            " the followers which support it");
+BRPC_VALIDATE_GFLAG(raft_compact_append_entries, ::brpc::PassValidate);
+
+DEFINE_int32(raft_max_shared_encoded_entries, 0,
+             "Max number of the recently encoded AppendEntries batches of a"
+             " leader reused by the replicators sending the same range, so that"
+             " the entries are read and encoded once for all the followers,"
+             " 0 disables the sharing");
+BRPC_VALIDATE_GFLAG(raft_max_shared_encoded_entries, ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_max_flying_append_entries_bytes, 0,
+              "Max bytes of the AppendEntries requests in flight to each"
+              " follower, at least one request is always allowed, 0 means no"
+              " limit");
+BRPC_VALIDATE_GFLAG(raft_max_flying_append_entries_bytes,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_catchup_lag_entries, 0,
+             "A follower lagging more than this many entries behind the leader"
+             " is catching up. If the followers answering the leader and not"
+             " catching up form the quorum, it has one AppendEntries request"
+             " in flight at most and shares"
+             " raft_catchup_max_bytes_per_second with the others catching up."
+             " 0 disables the throttling");
+BRPC_VALIDATE_GFLAG(raft_catchup_lag_entries, ::brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_catchup_max_bytes_per_second, 0,
+             "Max bytes per second of the AppendEntries sent by all the leaders"
+             " of the process to the throttled followers catching up, 0 means"
+             " no limit");
+BRPC_VALIDATE_GFLAG(raft_catchup_max_bytes_per_second,
+                    ::brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_coalesce_heartbeats, false,
+            "Send the heartbeats of all the raft groups to the same endpoint"
+            " in one batch_heartbeat RPC, for the peers which support it");
+BRPC_VALIDATE_GFLAG(raft_coalesce_heartbeats, ::brpc::PassValidate);
+
+DEFINE_bool(raft_batch_append_entries, false,
+            "Send the AppendEntries requests of all the raft groups to the same"
+            " endpoint in batch_append_entries RPCs, for the peers which"
+            " support it");
+BRPC_VALIDATE_GFLAG(raft_batch_append_entries, ::brpc::PassValidate);
+
+DEFINE_int32(raft_replication_fanout, 0,
+             "Replicate in a chain (1) or a tree with this fanout, where the"
+             " followers fetch the data of the entries from the ones before"
+             " them instead of the leader, 0 to replicate from the leader only");
+BRPC_VALIDATE_GFLAG(raft_replication_fanout, ::brpc::NonNegativeInteger);
+
 DEFINE_int32(raft_max_body_size, 512 * 1024,
              "The max byte size of AppendEntriesRequest");
 BRPC_VALIDATE_GFLAG(raft_max_body_size, ::brpc::PositiveInteger);
@@ -58,6 +126,231 @@ static bvar::LatencyRecorder g_normalized_send_entries_latency(
              "raft_send_entries_normalized");
 static bvar::CounterRecorder g_send_entries_batch_counter(
              "raft_send_entries_batch_counter");
+static bvar::IntRecorder g_append_entries_window(
+             "raft_append_entries_window");
+static bvar::Adder<int64_t> g_shared_encoded_entries(
+             "raft_shared_encoded_entries_count");
+static bvar::Adder<int64_t> g_catchup_replicators(
+             "raft_catchup_replicator_count");
+static bvar::Adder<int64_t> g_catchup_bytes("raft_catchup_bytes");
+static bvar::PerSecond<bvar::Adder<int64_t> > g_catchup_bytes_second(
+             "raft_catchup_bytes_second", &g_catchup_bytes);
+static bvar::Adder<int64_t> g_catchup_throttled(
+             "raft_catchup_throttled_count");
+
+static bvar::Adder<int64_t> g_relayed_entries("raft_relayed_entries_count");
+
+int64_t CatchupBandwidth::acquire(int64_t rate, int64_t now_us) {
+    if (rate <= 0) {
+        return 0;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_last_refill_us == 0) {
+        _tokens = rate;
+    } else if (now_us > _last_refill_us) {
+        // Burst for one second at most
+        _tokens = std::min(_tokens + (now_us - _last_refill_us) * rate / 1000000,
+                           rate);
+    }
+    _last_refill_us = std::max(_last_refill_us, now_us);
+    if (_tokens > 0) {
+        return 0;
+    }
+    return -_tokens * 1000 / rate + 1;
+}
+
+void CatchupBandwidth::consume(int64_t bytes) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _tokens -= bytes;
+}
+
+static CatchupBandwidth* catchup_bandwidth() {
+    static CatchupBandwidth* bandwidth = new CatchupBandwidth;
+    return bandwidth;
+}
+
+static int64_t acquire_catchup_bandwidth() {
+    return catchup_bandwidth()->acquire(FLAGS_raft_catchup_max_bytes_per_second,
+                                        butil::gettimeofday_us());
+}
+
+static void consume_catchup_bandwidth(int64_t bytes) {
+    g_catchup_bytes << bytes;
+    if (FLAGS_raft_catchup_max_bytes_per_second <= 0) {
+        return;
+    }
+    catchup_bandwidth()->consume(bytes);
+}
+
+void CatchupScheduler::add_replicator(bool healthy) {
+    _nreplicators.fetch_add(1, butil::memory_order_relaxed);
+    if (healthy) {
+        _nhealthy.fetch_add(1, butil::memory_order_relaxed);
+    }
+}
+
+void CatchupScheduler::remove_replicator(bool healthy) {
+    _nreplicators.fetch_sub(1, butil::memory_order_relaxed);
+    if (healthy) {
+        _nhealthy.fetch_sub(1, butil::memory_order_relaxed);
+    }
+}
+
+bool CatchupScheduler::can_throttle() const {
+    const int nreplicators = _nreplicators.load(butil::memory_order_relaxed);
+    const int nhealthy = _nhealthy.load(butil::memory_order_relaxed);
+    // Including the leader
+    const int quorum = (nreplicators + 1) / 2 + 1;
+    return nhealthy + 1 >= quorum;
+}
+
+AppendEntriesWindow::AppendEntriesWindow(int64_t min_window, int64_t max_window)
+    : _min_window(std::max(min_window, (int64_t)1))
+    , _max_window(std::max(max_window, _min_window))
+    , _window(_min_window)
+    , _min_rtt_us(0)
+{}
+
+void AppendEntriesWindow::on_acked(int64_t bytes, int64_t rtt_us) {
+    if (rtt_us <= 0) {
+        return;
+    }
+    // The minimum RTT drifts up slowly, in case the path gets longer
+    if (_min_rtt_us == 0 || rtt_us < _min_rtt_us) {
+        _min_rtt_us = rtt_us;
+    } else {
+        _min_rtt_us += (rtt_us - _min_rtt_us) / 64;
+    }
+    if (rtt_us <= _min_rtt_us * 2) {
+        _window = std::min(_window + bytes, _max_window);
+    } else {
+        _window = std::max(_window * 3 / 4, _min_window);
+    }
+}
+
+void AppendEntriesWindow::on_lost() {
+    _window = std::max(_window / 2, _min_window);
+}
+
+void ReplicationTopology::add_replicator(const PeerId& peer, ReplicatorId id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Follower& follower = _followers[peer];
+    follower.id = id;
+    follower.last_index = 0;
+    follower.can_relay = false;
+}
+
+void ReplicationTopology::remove_replicator(const PeerId& peer, ReplicatorId id) {
+    std::vector<ReplicatorId> ids;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<PeerId, Follower>::iterator it = _followers.find(peer);
+        // Replaced by a new replicator of the peer
+        if (it == _followers.end() || it->second.id != id) {
+            return;
+        }
+        take_waiters(&it->second, INT64_MAX, &ids);
+        _followers.erase(it);
+    }
+    wake_up(ids);
+}
+
+void ReplicationTopology::on_acked(const PeerId& peer, int64_t last_index,
+                                   bool can_relay) {
+    std::vector<ReplicatorId> ids;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<PeerId, Follower>::iterator it = _followers.find(peer);
+        if (it == _followers.end()) {
+            return;
+        }
+        Follower& follower = it->second;
+        follower.last_index = std::max(follower.last_index, last_index);
+        follower.can_relay = can_relay;
+        take_waiters(&follower, can_relay ? follower.last_index : INT64_MAX,
+                     &ids);
+    }
+    wake_up(ids);
+}
+
+void ReplicationTopology::on_unavailable(const PeerId& peer) {
+    std::vector<ReplicatorId> ids;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<PeerId, Follower>::iterator it = _followers.find(peer);
+        if (it == _followers.end() || !it->second.can_relay) {
+            return;
+        }
+        it->second.can_relay = false;
+        take_waiters(&it->second, INT64_MAX, &ids);
+    }
+    wake_up(ids);
+}
+
+int ReplicationTopology::find_relay(const PeerId& peer, int64_t index,
+                                    ReplicatorId id, PeerId* relay,
+                                    int64_t* relay_last_index) {
+    const int fanout = FLAGS_raft_replication_fanout;
+    if (fanout <= 0 || peer.is_witness()) {
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Witnesses don't have the data, leave them out of the numbering
+    std::vector<std::map<PeerId, Follower>::iterator> followers;
+    followers.reserve(_followers.size());
+    int64_t pos = 0;
+    for (std::map<PeerId, Follower>::iterator it = _followers.begin();
+            it != _followers.end(); ++it) {
+        if (!it->first.is_witness()) {
+            followers.push_back(it);
+            if (it->first == peer) {
+                pos = followers.size();
+            }
+        }
+    }
+    const int64_t parent = pos == 0 ? 0 : (pos - 1) / fanout;
+    if (parent == 0) {
+        return -1;
+    }
+    Follower& follower = followers[parent - 1]->second;
+    if (!follower.can_relay || follower.last_index < index - 1) {
+        // Failing or behind the peer, which would slow down the peer
+        return -1;
+    }
+    if (follower.last_index < index) {
+        follower.waiters[id] = index;
+        return EAGAIN;
+    }
+    *relay = followers[parent - 1]->first;
+    *relay_last_index = follower.last_index;
+    return 0;
+}
+
+void ReplicationTopology::take_waiters(Follower* follower, int64_t last_index,
+                                       std::vector<ReplicatorId>* ids) {
+    std::map<ReplicatorId, int64_t>::iterator it = follower->waiters.begin();
+    while (it != follower->waiters.end()) {
+        if (it->second <= last_index) {
+            ids->push_back(it->first);
+            follower->waiters.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ReplicationTopology::wake_up(const std::vector<ReplicatorId>& ids) {
+    for (size_t i = 0; i < ids.size(); ++i) {
+        // Not in the bthread of the caller which holds the lock of another
+        // replicator
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, Replicator::_continue_relaying,
+                                     (void*)ids[i]) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            Replicator::_continue_relaying((void*)ids[i]);
+        }
+    }
+}
 
 ReplicatorOptions::ReplicatorOptions()
     : dynamic_heartbeat_timeout_ms(NULL)
@@ -67,12 +360,27 @@ ReplicatorOptions::ReplicatorOptions()
     , term(0)
     , snapshot_storage(NULL)
     , replicator_status(NULL)
+    , encoded_entries_cache(NULL)
+    , catchup_scheduler(NULL)
+    , replication_topology(NULL)
 {
 }
 
 Replicator::Replicator() 
     : _next_index(0)
     , _flying_append_entries_size(0)
+    , _flying_append_entries_bytes(0)
+    , _append_entries_window(FLAGS_raft_max_body_size,
+                             (int64_t)FLAGS_raft_max_body_size
+                                * FLAGS_raft_max_adaptive_append_entries_rpc_num)
+    , _compact_entries(false)
+    , _relay_entries(false)
+    , _relaying(false)
+    , _waiting_relay(false)
+    , _relay_disabled_until_ms(0)
+    , _catching_up(false)
+    , _healthy(false)
+    , _waiting_bandwidth(false)
     , _consecutive_error_times(0)
     , _has_succeeded(false)
     , _timeout_now_index(0)
@@ -80,6 +388,7 @@ Replicator::Replicator()
     , _append_entries_counter(0)
     , _install_snapshot_counter(0)
     , _readonly_index(0)
+    , _batched_heartbeat_in_fly(0)
     , _wait_id(0)
     , _is_waiter_canceled(false)
     , _reader(NULL)
@@ -88,6 +397,7 @@ Replicator::Replicator()
     _install_snapshot_in_fly.value = 0;
     _heartbeat_in_fly.value = 0;
     _timeout_now_in_fly.value = 0;
+    _id.value = 0;
     memset(&_st, 0, sizeof(_st));
 }
 
@@ -104,6 +414,16 @@ Replicator::~Replicator() {
         _options.replicator_status->Release();
         _options.replicator_status = NULL;
     }
+    if (_options.catchup_scheduler) {
+        _options.catchup_scheduler->remove_replicator(_healthy);
+    }
+    if (_catching_up) {
+        g_catchup_replicators << -1;
+    }
+    if (_options.replication_topology) {
+        _options.replication_topology->remove_replicator(_options.peer_id,
+                                                         _id.value);
+    }
 }
 
 int Replicator::start(const ReplicatorOptions& options, ReplicatorId *id) {
@@ -128,6 +448,9 @@ int Replicator::start(const ReplicatorOptions& options, ReplicatorId *id) {
     options.node->AddRef();
     options.replicator_status->AddRef();
     r->_options = options;
+    if (options.catchup_scheduler) {
+        options.catchup_scheduler->add_replicator(false);
+    }
     r->_next_index = r->_options.log_manager->last_log_index() + 1;
     if (bthread_id_create(&r->_id, r, _on_error) != 0) {
         LOG(ERROR) << "Fail to create bthread_id"
@@ -135,6 +458,10 @@ int Replicator::start(const ReplicatorOptions& options, ReplicatorId *id) {
         delete r;
         return -1;
     }
+    if (options.replication_topology) {
+        options.replication_topology->add_replicator(options.peer_id,
+                                                     r->_id.value);
+    }
 
 
     bthread_id_lock(r->_id, NULL);
@@ -280,7 +607,7 @@ void Replicator::_on_heartbeat_returned(
         ReplicatorId id, brpc::Controller* cntl,
         AppendEntriesRequest* request, 
         AppendEntriesResponse* response,
-        int64_t rpc_send_time) {
+        int64_t rpc_send_time_us) {
     std::unique_ptr<brpc::Controller> cntl_guard(cntl);
     std::unique_ptr<AppendEntriesRequest>  req_guard(request);
     std::unique_ptr<AppendEntriesResponse> res_guard(response);
@@ -297,6 +624,11 @@ void Replicator::_on_heartbeat_returned(
        << r->_options.peer_id << " prev_log_index " << request->prev_log_index()
        << " prev_log_term " << request->prev_log_term();
                
+    if (cntl->ErrorCode() == EREQUESTPENDING) {
+        ss << " pending";
+        BRAFT_VLOG << ss.str();
+        return r->_on_rpc_pending(request);
+    }
     if (cntl->Failed()) {
         ss << " fail, sleep.";
         BRAFT_VLOG << ss.str();
@@ -307,11 +639,17 @@ void Replicator::_on_heartbeat_returned(
                         << " fail to issue RPC to " << r->_options.peer_id
                         << " _consecutive_error_times=" << r->_consecutive_error_times
                         << ", " << cntl->ErrorText();
+        if (r->_options.replication_topology) {
+            r->_options.replication_topology->on_unavailable(
+                    r->_options.peer_id);
+        }
+        r->_update_catchup_state();
         r->_start_heartbeat_timer(start_time_us);
         CHECK_EQ(0, bthread_id_unlock(dummy_id)) << "Fail to unlock " << dummy_id;
         return;
     }
     r->_consecutive_error_times = 0;
+    r->_update_catchup_state();
     if (response->term() > r->_options.term) {
         ss << " fail, greater term " << response->term()
            << " expect term " << r->_options.term;
@@ -333,9 +671,11 @@ void Replicator::_on_heartbeat_returned(
         return;
     }
 
+    r->_compact_entries = response->compact_entries();
+    r->_relay_entries = response->relay_entries();
     bool readonly = response->has_readonly() && response->readonly();
     BRAFT_VLOG << ss.str() << " readonly " << readonly;
-    r->_update_last_rpc_send_timestamp(rpc_send_time);
+    r->_update_last_rpc_send_timestamp(rpc_send_time_us / 1000);
     r->_start_heartbeat_timer(start_time_us);
     NodeImpl* node_impl = NULL;
     // Check if readonly config changed
@@ -359,7 +699,7 @@ void Replicator::_on_heartbeat_returned(
 void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                      AppendEntriesRequest* request, 
                      AppendEntriesResponse* response,
-                     int64_t rpc_send_time) {
+                     int64_t rpc_send_time_us) {
     std::unique_ptr<brpc::Controller> cntl_guard(cntl);
     std::unique_ptr<AppendEntriesRequest>  req_guard(request);
     std::unique_ptr<AppendEntriesResponse> res_guard(response);
@@ -374,9 +714,11 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
     ss << "node " << r->_options.group_id << ":" << r->_options.server_id 
        << " received AppendEntriesResponse from "
        << r->_options.peer_id << " prev_log_index " << request->prev_log_index()
-       << " prev_log_term " << request->prev_log_term() << " count " << request->entries_size();
+       << " prev_log_term " << request->prev_log_term()
+       << " count " << append_entries_count(*request);
 
     bool valid_rpc = false;
+    bool batched = false;
     int64_t rpc_first_index = request->prev_log_index() + 1;
     int64_t min_flying_index = r->_min_flying_index();
     CHECK_GT(min_flying_index, 0);
@@ -386,8 +728,10 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
         if (rpc_it->log_index > rpc_first_index) {
             break;
         }
-        if (rpc_it->call_id == cntl->call_id()) {
+        // Batched RPCs don't have call_id, which is not created for them
+        if (rpc_it->request == request) {
             valid_rpc = true;
+            batched = rpc_it->call_id.value == 0;
         }
     }
     if (!valid_rpc) {
@@ -407,11 +751,21 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                         << " fail to issue RPC to " << r->_options.peer_id
                         << " _consecutive_error_times=" << r->_consecutive_error_times
                         << ", " << cntl->ErrorText();
+        if (r->_options.replication_topology) {
+            r->_options.replication_topology->on_unavailable(
+                    r->_options.peer_id);
+        }
+        if (request->has_relay_peer_id()) {
+            // The relay might be the one failing
+            r->_relay_disabled_until_ms = butil::monotonic_time_ms()
+                    + FLAGS_raft_retry_replicate_interval_ms;
+        }
         // If the follower crashes, any RPC to the follower fails immediately,
         // so we need to block the follower for a while instead of looping until
         // it comes back or be removed
         // dummy_id is unlock in block
         r->_reset_next_index();
+        r->_update_catchup_state();
         return r->_block(start_time_us, cntl->ErrorCode());
     }
     r->_consecutive_error_times = 0;
@@ -438,7 +792,7 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
            << " local next_index " << r->_next_index 
            << " rpc prev_log_index " << request->prev_log_index();
         BRAFT_VLOG << ss.str();
-        r->_update_last_rpc_send_timestamp(rpc_send_time);
+        r->_update_last_rpc_send_timestamp(rpc_send_time_us / 1000);
         // prev_log_index and prev_log_term doesn't match
         r->_reset_next_index();
         if (response->last_log_index() + 1 < r->_next_index) {
@@ -477,19 +831,42 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
         CHECK_EQ(0, bthread_id_unlock(r->_id)) << "Fail to unlock " << r->_id;
         return;
     }
-    r->_update_last_rpc_send_timestamp(rpc_send_time);
-    const int entries_size = request->entries_size();
+    if (request->has_compact_entries_count() && !response->compact_entries()) {
+        // The peer doesn't know the compact format and took the request as a
+        // heartbeat, send the entries again with EntryMeta
+        LOG(WARNING) << "Group " << r->_options.group_id
+                     << " peer=" << r->_options.peer_id
+                     << " doesn't support compact entries";
+        r->_compact_entries = false;
+        r->_reset_next_index();
+        // dummy_id is unlock in _send_heartbeat
+        r->_send_empty_entries(false);
+        return;
+    }
+    r->_compact_entries = response->compact_entries();
+    r->_relay_entries = response->relay_entries();
+    r->_update_last_rpc_send_timestamp(rpc_send_time_us / 1000);
+    const int entries_size = append_entries_count(*request);
     const int64_t rpc_last_log_index = request->prev_log_index() + entries_size;
     BRAFT_VLOG_IF(entries_size > 0) << "Group " << r->_options.group_id
                                     << " replicated logs in [" 
                                     << min_flying_index << ", " 
                                     << rpc_last_log_index
                                     << "] to peer " << r->_options.peer_id;
+    // The controller of a batched RPC is never issued
+    const int64_t rpc_latency_us = batched
+            ? butil::monotonic_time_us() - rpc_send_time_us
+            : cntl->latency_us();
     if (entries_size > 0) {
         r->_options.ballot_box->commit_at(
                 min_flying_index, rpc_last_log_index,
                 r->_options.peer_id);
-        int64_t rpc_latency_us = cntl->latency_us();
+        if (r->_options.replication_topology) {
+            r->_options.replication_topology->on_acked(
+                    r->_options.peer_id, rpc_last_log_index,
+                    r->_relay_entries && !r->is_witness()
+                        && r->_readonly_index == 0);
+        }
         if (FLAGS_raft_trace_append_entry_latency && 
             rpc_latency_us > FLAGS_raft_append_entry_high_lat_us) {
             LOG(WARNING) << "append entry rpc latency us " << rpc_latency_us
@@ -501,19 +878,25 @@ void Replicator::_on_rpc_returned(ReplicatorId id, brpc::Controller* cntl,
                          << " request data size " 
                          <<  cntl->request_attachment().size();
         }
-        g_send_entries_latency << cntl->latency_us();
+        g_send_entries_latency << rpc_latency_us;
         if (cntl->request_attachment().size() > 0) {
             g_normalized_send_entries_latency << 
-                cntl->latency_us() * 1024 / cntl->request_attachment().size();
+                rpc_latency_us * 1024 / cntl->request_attachment().size();
         }
     }
     // A rpc is marked as success, means all request before it are success,
     // erase them sequentially.
+    int64_t acked_bytes = 0;
     while (!r->_append_entries_in_fly.empty() &&
            r->_append_entries_in_fly.front().log_index <= rpc_first_index) {
         r->_flying_append_entries_size -= r->_append_entries_in_fly.front().entries_size;
+        acked_bytes += r->_append_entries_in_fly.front().bytes;
         r->_append_entries_in_fly.pop_front();
     }
+    r->_flying_append_entries_bytes -= acked_bytes;
+    if (entries_size > 0) {
+        r->_on_entries_acked(acked_bytes, rpc_latency_us);
+    }
     r->_has_succeeded = true;
     r->_notify_on_caught_up(0, false);
     // dummy_id is unlock in _send_entries
@@ -564,7 +947,6 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         return _install_snapshot();
     }
     if (is_heartbeat) {
-        _heartbeat_in_fly = cntl->call_id();
         _heartbeat_counter++;
         // set RPC timeout for heartbeat, how long should timeout be is waiting to be optimized.
         cntl->set_timeout_ms(*_options.election_timeout_ms / 2);
@@ -574,7 +956,9 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
         _st.last_log_index = _next_index - 1;
         CHECK(_append_entries_in_fly.empty());
         CHECK_EQ(_flying_append_entries_size, 0);
-        _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index, 0, cntl->call_id()));
+        _append_entries_in_fly.push_back(
+                FlyingAppendEntriesRpc(_next_index, 0, 0, cntl->call_id(),
+                                       request.get()));
         _append_entries_counter++;
     }
 
@@ -587,30 +971,58 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
     google::protobuf::Closure* done = brpc::NewCallback(
                 is_heartbeat ? _on_heartbeat_returned : _on_rpc_returned, 
                 _id.value, cntl.get(), request.get(), response.get(),
-                butil::monotonic_time_ms());
+                butil::monotonic_time_us());
 
-    RaftService_Stub stub(&_sending_channel);
-    stub.append_entries(cntl.release(), request.release(), 
-                        response.release(), done);
+    if (is_heartbeat) {
+        const bool batched = _batched(AppendEntriesAggregator::HEARTBEAT);
+        _heartbeat_in_fly.value = batched ? 0 : cntl->call_id().value;
+        _batched_heartbeat_in_fly = _send_append_entries(
+                batched, AppendEntriesAggregator::HEARTBEAT, cntl.release(),
+                request.release(), response.release(), done);
+    } else {
+        RaftService_Stub stub(&_sending_channel);
+        stub.append_entries(cntl.release(), request.release(), 
+                            response.release(), done);
+    }
     CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
 }
 
-int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
+bool Replicator::_batched(AppendEntriesAggregator::Kind kind) const {
+    if (!(kind == AppendEntriesAggregator::HEARTBEAT
+                ? FLAGS_raft_coalesce_heartbeats
+                : FLAGS_raft_batch_append_entries)) {
+        return false;
+    }
+    return AppendEntriesAggregator::get_instance()->supported(
+            _options.peer_id.addr, kind);
+}
+
+uint64_t Replicator::_send_append_entries(bool batched,
+                                          AppendEntriesAggregator::Kind kind,
+                                          brpc::Controller* cntl,
+                                          AppendEntriesRequest* request,
+                                          AppendEntriesResponse* response,
+                                          google::protobuf::Closure* done) {
+    if (batched) {
+        return AppendEntriesAggregator::get_instance()->add(
+                _options.peer_id.addr, kind, cntl, request, response, done);
+    }
+    RaftService_Stub stub(&_sending_channel);
+    stub.append_entries(cntl, request, response, done);
+    return 0;
+}
+
+int Replicator::_prepare_entry(LogEntry* entry, EntryMeta* em, butil::IOBuf *data) {
     if (data->length() >= (size_t)FLAGS_raft_max_body_size) {
         return ERANGE;
     }
-    const int64_t log_index = _next_index + offset;
-    LogEntry *entry = _options.log_manager->get_entry(log_index);
-    if (entry == NULL) {
-        return ENOENT;
-    }
+    const int64_t log_index = entry->id.index;
     // When leader become readonly, no new user logs can submit. On the other side,
     // if any user log are accepted after this replicator become readonly, the leader
     // still have enough followers to commit logs, we can safely stop waiting new logs
     // until the replicator leave readonly mode.
     if (_readonly_index != 0 && log_index >= _readonly_index) {
         if (entry->type != ENTRY_TYPE_CONFIGURATION) {
-            entry->Release();
             return EREADONLY;
         }
         _readonly_index = log_index + 1;
@@ -632,16 +1044,187 @@ int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
     }
     if (!is_witness() || FLAGS_raft_enable_witness_to_leader) {
         em->set_data_len(entry->data.length());
+        if (entry->has_data_checksum) {
+            em->set_data_checksum(entry->data_checksum);
+        }
         data->append(entry->data);
     }
-    entry->Release();
     return 0;
 }
 
+bool Replicator::_can_send_more_entries() const {
+    if (_flying_append_entries_size >= FLAGS_raft_max_entries_size) {
+        return false;
+    }
+    if (!_append_entries_in_fly.empty()) {
+        if (FLAGS_raft_max_flying_append_entries_bytes > 0
+                && _flying_append_entries_bytes
+                        >= FLAGS_raft_max_flying_append_entries_bytes) {
+            return false;
+        }
+        if (_is_throttled()) {
+            return false;
+        }
+    }
+    if (!FLAGS_raft_adaptive_append_entries_window) {
+        return _append_entries_in_fly.size()
+                < (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num;
+    }
+    // At least one request is always allowed
+    return _append_entries_in_fly.empty()
+        || (_append_entries_in_fly.size()
+                < (size_t)FLAGS_raft_max_adaptive_append_entries_rpc_num
+            && _flying_append_entries_bytes < _append_entries_window.window());
+}
+
+void Replicator::_on_entries_acked(int64_t bytes, int64_t rtt_us) {
+    if (!FLAGS_raft_adaptive_append_entries_window || rtt_us <= 0) {
+        return;
+    }
+    _append_entries_window.on_acked(bytes, rtt_us);
+    g_append_entries_window << _append_entries_window.window();
+}
+
+bool Replicator::_update_catchup_state() {
+    const bool catching_up = FLAGS_raft_catchup_lag_entries > 0
+            && _options.log_manager->last_log_index() - _next_index + 1
+                    > FLAGS_raft_catchup_lag_entries;
+    // A follower which is down or failing counts neither
+    const bool healthy = !catching_up && _has_succeeded
+            && _consecutive_error_times == 0;
+    if (healthy != _healthy) {
+        if (_options.catchup_scheduler) {
+            _options.catchup_scheduler->remove_replicator(_healthy);
+            _options.catchup_scheduler->add_replicator(healthy);
+        }
+        _healthy = healthy;
+    }
+    if (catching_up != _catching_up) {
+        g_catchup_replicators << (catching_up ? 1 : -1);
+        _catching_up = catching_up;
+        LOG(INFO) << "Group " << _options.group_id
+                  << " peer=" << _options.peer_id
+                  << (catching_up ? " starts" : " stops") << " catching up"
+                  << ", next_index=" << _next_index;
+    }
+    return _is_throttled();
+}
+
+bool Replicator::_is_throttled() const {
+    return _catching_up && _options.catchup_scheduler != NULL
+        && _options.catchup_scheduler->can_throttle();
+}
+
+bool Replicator::_can_share_entries() const {
+    // Witnesses don't get the data, readonly peers stop at _readonly_index
+    // and relayed entries stop at the last one of the relay
+    return FLAGS_raft_max_shared_encoded_entries > 0
+        && _options.encoded_entries_cache != NULL
+        && !is_witness() && _readonly_index == 0 && !_relaying;
+}
+
+int Replicator::_fill_entries(int max_entries_size, bool compact,
+                              AppendEntriesRequest* request,
+                              butil::IOBuf* attachment, int* prepare_entry_rc) {
+    EntryMeta em;
+    CompactEntriesEncoder encoder(request->prev_log_term());
+    int nentries = 0;
+    // Get the entries in ranges, which are read from LogStorage with one
+    // read per segment
+    const int64_t last_index = _next_index + max_entries_size - 1;
+    std::vector<LogEntry*> entries;
+    int64_t index = _next_index;
+    while (*prepare_entry_rc == 0 && index <= last_index) {
+        const size_t body_size = attachment->length();
+        if (body_size >= (size_t)FLAGS_raft_max_body_size) {
+            break;
+        }
+        entries.clear();
+        if (_options.log_manager->get_entries(
+                    index, last_index, FLAGS_raft_max_body_size - body_size,
+                    &entries) == 0) {
+            *prepare_entry_rc = ENOENT;
+            break;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (*prepare_entry_rc == 0) {
+                *prepare_entry_rc = _prepare_entry(entries[i], &em, attachment);
+                if (*prepare_entry_rc == 0) {
+                    if (compact) {
+                        encoder.add(em.term(), em.type(), em.data_len(),
+                                    em.has_data_checksum(), em.data_checksum());
+                    }
+                    if (!compact) {
+                        request->add_entries()->Swap(&em);
+                    } else if (em.type() == ENTRY_TYPE_CONFIGURATION) {
+                        request->add_compact_configurations()->Swap(&em);
+                    } else {
+                        em.Clear();
+                    }
+                    ++nentries;
+                    ++index;
+                }
+            }
+            entries[i]->Release();
+        }
+    }
+    if (nentries == 0) {
+        return 0;
+    }
+    const bool full = nentries == max_entries_size
+                      || attachment->length() >= (size_t)FLAGS_raft_max_body_size;
+    if (compact) {
+        encoder.finish(request, attachment);
+    }
+    if (_can_share_entries() && *prepare_entry_rc != EREADONLY) {
+        scoped_refptr<EncodedEntries> shared = new EncodedEntries;
+        shared->term = _options.term;
+        shared->first_index = _next_index;
+        shared->count = nentries;
+        shared->compact = compact;
+        shared->full = full;
+        shared->request.mutable_entries()->CopyFrom(request->entries());
+        if (compact) {
+            shared->request.set_compact_entries_count(
+                    request->compact_entries_count());
+            shared->request.mutable_compact_configurations()->CopyFrom(
+                    request->compact_configurations());
+            shared->request.mutable_compact_data_checksums()->CopyFrom(
+                    request->compact_data_checksums());
+        }
+        // Only the references of the blocks are copied
+        shared->attachment = *attachment;
+        _options.encoded_entries_cache->put(
+                shared.get(), FLAGS_raft_max_shared_encoded_entries);
+    }
+    return nentries;
+}
+
+int Replicator::_fill_shared_entries(int max_entries_size, bool compact,
+                                     AppendEntriesRequest* request,
+                                     butil::IOBuf* attachment) {
+    if (!_can_share_entries()) {
+        return 0;
+    }
+    scoped_refptr<EncodedEntries> shared =
+            _options.encoded_entries_cache->get(_options.term, _next_index, compact);
+    if (shared == NULL || shared->count > max_entries_size) {
+        return 0;
+    }
+    // Don't send less than encoding the entries here would, unless the
+    // limits stopped the shared ones
+    if (!shared->full && shared->first_index + shared->count
+                            <= _options.log_manager->last_log_index()) {
+        return 0;
+    }
+    request->MergeFrom(shared->request);
+    attachment->append(shared->attachment);
+    g_shared_encoded_entries << shared->count;
+    return shared->count;
+}
+
 void Replicator::_send_entries() {
-    if (_flying_append_entries_size >= FLAGS_raft_max_entries_size ||
-        _append_entries_in_fly.size() >= (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num ||
-        _st.st == BLOCKING) {
+    if (!_can_send_more_entries() || _st.st == BLOCKING) {
         BRAFT_VLOG << "node " << _options.group_id << ":" << _options.server_id
             << " skip sending AppendEntriesRequest to " << _options.peer_id
             << ", too many requests in flying, or the replicator is in block,"
@@ -657,18 +1240,65 @@ void Replicator::_send_entries() {
         _reset_next_index();
         return _install_snapshot();
     }
-    EntryMeta em;
-    const int max_entries_size = FLAGS_raft_max_entries_size - _flying_append_entries_size;
-    int prepare_entry_rc = 0;
-    CHECK_GT(max_entries_size, 0);
-    for (int i = 0; i < max_entries_size; ++i) {
-        prepare_entry_rc = _prepare_entry(i, &em, &cntl->request_attachment());
-        if (prepare_entry_rc != 0) {
-            break;
+    const bool throttled = _update_catchup_state();
+    if (throttled && !_append_entries_in_fly.empty()) {
+        // Sent again once the requests in flight return
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
+    if (throttled) {
+        const int64_t wait_ms = acquire_catchup_bandwidth();
+        if (wait_ms > 0 && _wait_catchup_bandwidth(wait_ms)) {
+            g_catchup_throttled << 1;
+            _st.st = IDLE;
+            CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+            return;
         }
-        request->add_entries()->Swap(&em);
     }
-    if (request->entries_size() == 0) {
+    PeerId relay;
+    int64_t relay_last_index = 0;
+    int relay_rc = -1;
+    if (_options.replication_topology != NULL && _relay_entries
+            && butil::monotonic_time_ms() >= _relay_disabled_until_ms) {
+        relay_rc = _options.replication_topology->find_relay(
+                _options.peer_id, _next_index, _id.value, &relay,
+                &relay_last_index);
+    }
+    if (relay_rc == EAGAIN) {
+        // Woken up in _continue_relaying
+        _waiting_relay = true;
+        if (_flying_append_entries_size == 0) {
+            _st.st = IDLE;
+        }
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
+    const bool relayed = relay_rc == 0;
+    _relaying = relayed;
+    const bool compact = FLAGS_raft_compact_append_entries && _compact_entries;
+    int max_entries_size = FLAGS_raft_max_entries_size - _flying_append_entries_size;
+    int prepare_entry_rc = 0;
+    CHECK_GT(max_entries_size, 0);
+    if (relayed) {
+        max_entries_size = (int)std::min<int64_t>(
+                max_entries_size, relay_last_index - _next_index + 1);
+    }
+    int nentries = _fill_shared_entries(max_entries_size, compact, request.get(),
+                                        &cntl->request_attachment());
+    if (nentries == 0) {
+        nentries = _fill_entries(max_entries_size, compact, request.get(),
+                                 &cntl->request_attachment(), &prepare_entry_rc);
+    }
+    _relaying = false;
+    if (relayed && nentries > 0) {
+        // The follower fetches the data from the relay
+        CHECK_EQ(0, strip_entries_data(*request, &cntl->request_attachment()));
+        request->set_relay_peer_id(relay.to_string());
+        request->set_relay_last_log_term(
+                _options.log_manager->get_term(_next_index + nentries - 1));
+        g_relayed_entries << nentries;
+    }
+    if (nentries == 0) {
         // _id is unlock in _wait_more
         if (_next_index < _options.log_manager->first_log_index()) {
             _reset_next_index();
@@ -687,32 +1317,101 @@ void Replicator::_send_entries() {
         return _wait_more_entries();
     }
 
+    const bool batched = _batched(AppendEntriesAggregator::APPEND_ENTRIES);
+    brpc::CallId call_id = { 0 };
+    if (!batched) {
+        call_id = cntl->call_id();
+    }
     _append_entries_in_fly.push_back(FlyingAppendEntriesRpc(_next_index,
-                                     request->entries_size(), cntl->call_id()));
+                                     nentries,
+                                     cntl->request_attachment().length(),
+                                     call_id, request.get()));
     _append_entries_counter++;
-    _next_index += request->entries_size();
-    _flying_append_entries_size += request->entries_size();
+    _next_index += nentries;
+    _flying_append_entries_size += nentries;
+    _flying_append_entries_bytes += cntl->request_attachment().length();
+    if (throttled) {
+        consume_catchup_bandwidth(cntl->request_attachment().length());
+    }
     
-    g_send_entries_batch_counter << request->entries_size();
+    g_send_entries_batch_counter << nentries;
 
     BRAFT_VLOG << "node " << _options.group_id << ":" << _options.server_id
         << " send AppendEntriesRequest to " << _options.peer_id << " term " << _options.term
         << " last_committed_index " << request->committed_index()
         << " prev_log_index " << request->prev_log_index()
         << " prev_log_term " << request->prev_log_term()
-        << " next_index " << _next_index << " count " << request->entries_size();
+        << " next_index " << _next_index << " count " << nentries;
     _st.st = APPENDING_ENTRIES;
     _st.first_log_index = _min_flying_index();
     _st.last_log_index = _next_index - 1;
     google::protobuf::Closure* done = brpc::NewCallback(
                 _on_rpc_returned, _id.value, cntl.get(), 
-                request.get(), response.get(), butil::monotonic_time_ms());
-    RaftService_Stub stub(&_sending_channel);
-    stub.append_entries(cntl.release(), request.release(), 
-                        response.release(), done);
+                request.get(), response.get(), butil::monotonic_time_us());
+    _append_entries_in_fly.back().batch_item_id = _send_append_entries(
+            batched, AppendEntriesAggregator::APPEND_ENTRIES, cntl.release(),
+            request.release(), response.release(), done);
     _wait_more_entries();
 }
 
+void* Replicator::_continue_relaying(void* arg) {
+    Replicator* r = NULL;
+    bthread_id_t id = { (uint64_t)arg };
+    if (bthread_id_lock(id, (void**)&r) != 0) {
+        return NULL;
+    }
+    if (!r->_waiting_relay) {
+        // Reset by probing or installing snapshot in the meantime
+        bthread_id_unlock(id);
+        return NULL;
+    }
+    r->_waiting_relay = false;
+    // id is unlock in _send_entries
+    r->_send_entries();
+    return NULL;
+}
+
+bool Replicator::_wait_catchup_bandwidth(int64_t wait_ms) {
+    if (_waiting_bandwidth) {
+        return true;
+    }
+    bthread_timer_t timer;
+    const int rc = bthread_timer_add(&timer, butil::milliseconds_from_now(wait_ms),
+                                     _on_catchup_bandwidth_refilled,
+                                     (void*)_id.value);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to add timer, " << berror(rc);
+        return false;
+    }
+    _waiting_bandwidth = true;
+    return true;
+}
+
+void Replicator::_on_catchup_bandwidth_refilled(void* arg) {
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, _continue_throttled, arg) != 0) {
+        PLOG(ERROR) << "Fail to start bthread";
+        _continue_throttled(arg);
+    }
+}
+
+void* Replicator::_continue_throttled(void* arg) {
+    Replicator* r = NULL;
+    bthread_id_t id = { (uint64_t)arg };
+    if (bthread_id_lock(id, (void**)&r) != 0) {
+        return NULL;
+    }
+    if (!r->_waiting_bandwidth) {
+        // Reset by probing or installing snapshot in the meantime
+        bthread_id_unlock(id);
+        return NULL;
+    }
+    r->_waiting_bandwidth = false;
+    // id is unlock in _send_entries
+    r->_send_entries();
+    return NULL;
+}
+
 int Replicator::_continue_sending(void* arg, int error_code) {
     Replicator* r = NULL;
     bthread_id_t id = { (uint64_t)arg };
@@ -755,8 +1454,7 @@ int Replicator::_continue_sending(void* arg, int error_code) {
 }
 
 void Replicator::_wait_more_entries() {
-    if (_wait_id == 0 && FLAGS_raft_max_entries_size > _flying_append_entries_size &&
-        (size_t)FLAGS_raft_max_parallel_append_entries_rpc_num > _append_entries_in_fly.size()) {
+    if (_wait_id == 0 && _can_send_more_entries()) {
         _wait_id = _options.log_manager->wait(
                 _next_index - 1, _continue_sending, (void*)_id.value);
         _is_waiter_canceled = false;
@@ -995,6 +1693,8 @@ int Replicator::_on_error(bthread_id_t id, void* arg, int error_code) {
     if (error_code == ESTOP) {
         brpc::StartCancel(r->_install_snapshot_in_fly);
         brpc::StartCancel(r->_heartbeat_in_fly);
+        AppendEntriesAggregator::get_instance()->cancel(
+                r->_batched_heartbeat_in_fly);
         brpc::StartCancel(r->_timeout_now_in_fly);
         r->_cancel_append_entries_rpcs();
         bthread_timer_del(r->_heartbeat_timer);
@@ -1078,15 +1778,42 @@ void Replicator::_cancel_append_entries_rpcs() {
     for (std::deque<FlyingAppendEntriesRpc>::iterator rpc_it =
         _append_entries_in_fly.begin();
         rpc_it != _append_entries_in_fly.end(); ++rpc_it) {
-        brpc::StartCancel(rpc_it->call_id);
+        if (rpc_it->batch_item_id != 0) {
+            AppendEntriesAggregator::get_instance()->cancel(
+                    rpc_it->batch_item_id);
+        } else {
+            brpc::StartCancel(rpc_it->call_id);
+        }
     }
     _append_entries_in_fly.clear();
 }
 
+void Replicator::_on_rpc_pending(const AppendEntriesRequest* request) {
+    // The follower is still handling the request, it's acknowledged by the
+    // response of a request after it. If there's none, the entries are sent
+    // again at once, which the follower takes as the ones it already has
+    if (_append_entries_in_fly.back().request != request) {
+        CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
+        return;
+    }
+    const FlyingAppendEntriesRpc& rpc = _append_entries_in_fly.back();
+    _next_index -= rpc.entries_size;
+    _flying_append_entries_size -= rpc.entries_size;
+    _flying_append_entries_bytes -= rpc.bytes;
+    _append_entries_in_fly.pop_back();
+    // dummy_id is unlock in _send_entries
+    return _send_entries();
+}
+
 void Replicator::_reset_next_index() {
     _next_index -= _flying_append_entries_size;
     _flying_append_entries_size = 0;
+    _flying_append_entries_bytes = 0;
+    // Requests in flight are lost, like a congestion
+    _append_entries_window.on_lost();
     _cancel_append_entries_rpcs();
+    _waiting_relay = false;
+    _waiting_bandwidth = false;
     _is_waiter_canceled = true;
     if (_wait_id != 0) {
         _options.log_manager->remove_waiter(_wait_id);
@@ -1240,6 +1967,9 @@ int Replicator::_change_readonly_config(bool readonly) {
         LOG(INFO) << "node " << _options.group_id << ":" << _options.server_id
                   << " enable readonly for " << _options.peer_id
                   << ", readonly_index " << _readonly_index;
+        if (_options.replication_topology) {
+            _options.replication_topology->on_unavailable(_options.peer_id);
+        }
         CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
     } else {
         _readonly_index = 0;
@@ -1274,21 +2004,36 @@ void Replicator::_describe(std::ostream& os, bool use_html) {
     const PeerId peer_id = _options.peer_id;
     const int64_t next_index = _next_index;
     const int flying_append_entries_size = _flying_append_entries_size;
+    const int64_t append_entries_window = _append_entries_window.window();
     const bthread_id_t id = _id;
     const int consecutive_error_times = _consecutive_error_times;
     const int64_t heartbeat_counter = _heartbeat_counter;
     const int64_t append_entries_counter = _append_entries_counter;
     const int64_t install_snapshot_counter = _install_snapshot_counter;
     const int64_t readonly_index = _readonly_index;
+    const bool catching_up = _catching_up;
+    const bool throttled = _is_throttled();
+    const int64_t flying_append_entries_bytes = _flying_append_entries_bytes;
+    const bool waiting_relay = _waiting_relay;
     CHECK_EQ(0, bthread_id_unlock(_id));
     // Don't touch *this ever after
     const char* new_line = use_html ? "<br>" : "\r\n";
     os << "replicator_" << id << '@' << peer_id << ':';
     os << " next_index=" << next_index << ' ';
     os << " flying_append_entries_size=" << flying_append_entries_size << ' ';
+    os << " flying_append_entries_bytes=" << flying_append_entries_bytes << ' ';
+    if (FLAGS_raft_adaptive_append_entries_window) {
+        os << " append_entries_window=" << append_entries_window << ' ';
+    }
+    if (catching_up) {
+        os << (throttled ? " catching_up(throttled) " : " catching_up ");
+    }
     if (readonly_index != 0) {
         os << " readonly_index=" << readonly_index << ' ';
     }
+    if (waiting_relay) {
+        os << " waiting_relay ";
+    }
     switch (st.st) {
     case IDLE:
         os << "idle";
@@ -1371,6 +2116,9 @@ ReplicatorGroup::ReplicatorGroup()
 {
     _common_options.dynamic_heartbeat_timeout_ms = &_dynamic_timeout_ms;
     _common_options.election_timeout_ms = &_election_timeout_ms;
+    _common_options.encoded_entries_cache = &_encoded_entries_cache;
+    _common_options.catchup_scheduler = &_catchup_scheduler;
+    _common_options.replication_topology = &_replication_topology;
 }
 
 ReplicatorGroup::~ReplicatorGroup() {
@@ -1454,6 +2202,7 @@ int ReplicatorGroup::stop_all() {
     for (size_t i = 0; i < rids.size(); ++i) {
         Replicator::stop(rids[i]);
     }
+    _encoded_entries_cache.clear();
     return 0;
 }
 
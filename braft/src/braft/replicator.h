@@ -27,6 +27,8 @@
 #include "braft/configuration.h"                 // Configuration
 #include "braft/raft.pb.h"                       // AppendEntriesRequest
 #include "braft/log_manager.h"                   // LogManager
+#include "braft/entry_codec.h"                   // EncodedEntriesCache
+#include "braft/append_entries_aggregator.h"     // AppendEntriesAggregator
 
 namespace braft {
 
@@ -43,6 +45,133 @@ struct ReplicatorStatus : public butil::RefCountedThreadSafe<ReplicatorStatus> {
     ReplicatorStatus() : last_rpc_send_timestamp(0) {}
 };
 
+// Followers lagging far behind the leader, which are catching up, share the
+// bandwidth of the leader with the ones committing the new entries. They are
+// throttled only if the healthy followers, which are not catching up and
+// answer the leader, form the quorum with the leader.
+class CatchupScheduler {
+public:
+    CatchupScheduler() : _nreplicators(0), _nhealthy(0) {}
+
+    void add_replicator(bool healthy);
+    void remove_replicator(bool healthy);
+
+    // Whether the healthy followers form the quorum with the leader, so that
+    // the catching up ones can be throttled
+    bool can_throttle() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CatchupScheduler);
+
+    butil::atomic<int> _nreplicators;
+    butil::atomic<int> _nhealthy;
+};
+
+// Token bucket of the bandwidth to the throttled followers shared by all the
+// leaders in the process. A request is sent as long as there are tokens left
+// and its bytes are taken afterwards, which may run into debt.
+class CatchupBandwidth {
+public:
+    CatchupBandwidth() : _tokens(0), _last_refill_us(0) {}
+
+    // Returns 0 if another request can be sent at |now_us| with |rate| bytes
+    // per second, otherwise the milliseconds to wait for the tokens to refill
+    int64_t acquire(int64_t rate, int64_t now_us);
+    void consume(int64_t bytes);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CatchupBandwidth);
+
+    raft_mutex_t _mutex;
+    int64_t _tokens;
+    int64_t _last_refill_us;
+};
+
+// Window of the bytes of the AppendEntries in flight to a follower, adjusted
+// like a congestion window by the RTT of the responses.
+//
+// The window grows by the acknowledged bytes, which doubles it every RTT,
+// while the RTT stays within twice the smoothed minimum RTT, and shrinks by
+// a quarter once it's above, as a queue is building up along the path.
+// It's halved when the requests in flight are lost. The window stays within
+// [min_window, max_window].
+// Not thread-safe, it's protected by the lock of the Replicator.
+class AppendEntriesWindow {
+public:
+    AppendEntriesWindow(int64_t min_window, int64_t max_window);
+
+    int64_t window() const { return _window; }
+    int64_t min_rtt_us() const { return _min_rtt_us; }
+
+    // Called when a response acknowledged |bytes| in |rtt_us|
+    void on_acked(int64_t bytes, int64_t rtt_us);
+    // Called when the requests in flight are rolled back
+    void on_lost();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AppendEntriesWindow);
+
+    int64_t _min_window;
+    int64_t _max_window;
+    int64_t _window;
+    int64_t _min_rtt_us;
+};
+
+typedef uint64_t ReplicatorId;
+
+// Decides the follower relaying the entries to another one when the leader
+// replicates in a chain or a tree with raft_replication_fanout, so that the
+// leader sends the data of each entry to |fanout| followers only.
+//
+// The followers which store the data are ordered by PeerId and numbered from
+// 1 like a heap rooted at the leader: the relay of follower i is follower
+// (i - 1) / fanout, or none if it's the leader. A follower relays the entries
+// it has acknowledged, which its replicator reports here to wake up the
+// replicators waiting for them. Entries are sent directly by the leader when
+// the relay is behind or failing, so commit never depends on it.
+class ReplicationTopology {
+public:
+    ReplicationTopology() {}
+
+    void add_replicator(const PeerId& peer, ReplicatorId id);
+    void remove_replicator(const PeerId& peer, ReplicatorId id);
+
+    // |peer| has acknowledged the entries up to |last_index|, and can serve
+    // them to the others if |can_relay|
+    void on_acked(const PeerId& peer, int64_t last_index, bool can_relay);
+    // The RPCs to |peer| failed or it stops taking entries, don't relay by
+    // it until it acknowledges entries again
+    void on_unavailable(const PeerId& peer);
+
+    // Find the relay of the entries from |index| to |peer|:
+    //  - Returns 0 if the relay has them, which are up to |relay_last_index|
+    //  - Returns EAGAIN if the relay is about to have them, the replicator
+    //    |id| is woken up once it does or fails
+    //  - Returns -1 if the entries should be sent directly
+    int find_relay(const PeerId& peer, int64_t index, ReplicatorId id,
+                   PeerId* relay, int64_t* relay_last_index);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ReplicationTopology);
+
+    struct Follower {
+        Follower() : id(0), last_index(0), can_relay(false) {}
+        ReplicatorId id;
+        int64_t last_index;
+        bool can_relay;
+        // The replicators waiting for the entries, to the index they wait for
+        std::map<ReplicatorId, int64_t> waiters;
+    };
+
+    // Take the waiters of |follower| for the entries up to |last_index|
+    static void take_waiters(Follower* follower, int64_t last_index,
+                             std::vector<ReplicatorId>* ids);
+    static void wake_up(const std::vector<ReplicatorId>& ids);
+
+    raft_mutex_t _mutex;
+    std::map<PeerId, Follower> _followers;
+};
+
 struct ReplicatorOptions {
     ReplicatorOptions();
     int* dynamic_heartbeat_timeout_ms;
@@ -57,10 +186,11 @@ struct ReplicatorOptions {
     SnapshotStorage* snapshot_storage;
     SnapshotThrottle* snapshot_throttle;
     ReplicatorStatus* replicator_status;
+    EncodedEntriesCache* encoded_entries_cache;
+    CatchupScheduler* catchup_scheduler;
+    ReplicationTopology* replication_topology;
 };
 
-typedef uint64_t ReplicatorId;
-
 class CatchupClosure : public Closure {
 public:
     virtual void Run() = 0;
@@ -80,6 +210,7 @@ friend class Replicator;
 };
 
 class BAIDU_CACHELINE_ALIGNMENT Replicator {
+friend class ReplicationTopology;
 public:
     // Called by the leader, otherwise the behavior is undefined
     // Start to replicate the log to the given follower
@@ -150,10 +281,38 @@ private:
     Replicator();
     ~Replicator();
 
-    int _prepare_entry(int offset, EntryMeta* em, butil::IOBuf* data);
+    int _prepare_entry(LogEntry* entry, EntryMeta* em, butil::IOBuf* data);
+    // Encode the entries from _next_index into |request| and |attachment|,
+    // returns the number of them
+    int _fill_entries(int max_entries_size, bool compact,
+                      AppendEntriesRequest* request, butil::IOBuf* attachment,
+                      int* prepare_entry_rc);
+    // Same as _fill_entries with the entries encoded by another replicator,
+    // returns 0 if there are none to reuse
+    int _fill_shared_entries(int max_entries_size, bool compact,
+                             AppendEntriesRequest* request,
+                             butil::IOBuf* attachment);
+    bool _can_share_entries() const;
+    // Update whether the peer is catching up and whether it's healthy,
+    // returns true if its AppendEntries should be throttled
+    bool _update_catchup_state();
+    bool _is_throttled() const;
+    // Send the entries again once the catching up bandwidth refills in
+    // |wait_ms|, returns false if it can't wait
+    bool _wait_catchup_bandwidth(int64_t wait_ms);
     void _wait_more_entries();
     void _send_empty_entries(bool is_heartbeat);
     void _send_entries();
+    // Whether the requests of |kind| go through AppendEntriesAggregator
+    bool _batched(AppendEntriesAggregator::Kind kind) const;
+    // Send the request through AppendEntriesAggregator if |batched|, or alone
+    // otherwise. Returns the id of the batched request, 0 if it's sent alone
+    uint64_t _send_append_entries(bool batched,
+                                  AppendEntriesAggregator::Kind kind,
+                                  brpc::Controller* cntl,
+                                  AppendEntriesRequest* request,
+                                  AppendEntriesResponse* response,
+                                  google::protobuf::Closure* done);
     void _notify_on_caught_up(int error_code, bool);
     int _fill_common_fields(AppendEntriesRequest* request, int64_t prev_log_index,
                             bool is_heartbeat);
@@ -165,11 +324,20 @@ private:
     int _transfer_leadership(int64_t log_index);
     void _cancel_append_entries_rpcs();
     void _reset_next_index();
+    // Whether another AppendEntries can be sent with the ones in flight
+    bool _can_send_more_entries() const;
+    // Adjust the window of AppendEntries in flight once |bytes| are
+    // acknowledged by a response in |rtt_us|
+    void _on_entries_acked(int64_t bytes, int64_t rtt_us);
     int64_t _min_flying_index() {
         return _next_index - _flying_append_entries_size;
     }
     int _change_readonly_config(bool readonly);
 
+    // Called when the follower answers |request| before it's done, it
+    // doesn't tell that the follower is failing
+    void _on_rpc_pending(const AppendEntriesRequest* request);
+
     static void _on_rpc_returned(
                 ReplicatorId id, brpc::Controller* cntl,
                 AppendEntriesRequest* request, 
@@ -193,6 +361,9 @@ private:
 
     static int _on_error(bthread_id_t id, void* arg, int error_code);
     static int _continue_sending(void* arg, int error_code);
+    static void* _continue_relaying(void* arg);
+    static void _on_catchup_bandwidth_refilled(void* arg);
+    static void* _continue_throttled(void* arg);
     static void* _run_on_caught_up(void*);
     static void _on_catch_up_timedout(void*);
     static void _on_block_timedout(void *arg);
@@ -234,14 +405,44 @@ private:
     struct FlyingAppendEntriesRpc {
         int64_t log_index;
         int entries_size;
+        int64_t bytes;
+        // Invalid if the RPC is sent in a batch_append_entries
         brpc::CallId call_id;
-        FlyingAppendEntriesRpc(int64_t index, int size, brpc::CallId id)
-            : log_index(index), entries_size(size), call_id(id) {}
+        // Id in AppendEntriesAggregator if the RPC is sent in a
+        // batch_append_entries, 0 otherwise
+        uint64_t batch_item_id;
+        // Identifies the RPC when it returns
+        const AppendEntriesRequest* request;
+        FlyingAppendEntriesRpc(int64_t index, int size, int64_t nbytes,
+                               brpc::CallId id, const AppendEntriesRequest* req)
+            : log_index(index), entries_size(size), bytes(nbytes), call_id(id)
+            , batch_item_id(0), request(req) {}
     };
     
     brpc::Channel _sending_channel;
     int64_t _next_index;
     int64_t _flying_append_entries_size;
+    // Bytes of the AppendEntries in flight, limited by _append_entries_window
+    // with raft_adaptive_append_entries_window
+    int64_t _flying_append_entries_bytes;
+    AppendEntriesWindow _append_entries_window;
+    // Whether the peer accepts the entries in the compact format
+    bool _compact_entries;
+    // Whether the peer fetches the data of the entries from a relay
+    bool _relay_entries;
+    // Whether the entries being filled are relayed
+    bool _relaying;
+    // Waiting for the relay to acknowledge the entries at _next_index
+    bool _waiting_relay;
+    // The entries are sent directly for a while after a relayed RPC failed
+    int64_t _relay_disabled_until_ms;
+    // Lagging more than raft_catchup_lag_entries behind the leader
+    bool _catching_up;
+    // Answering the leader and not catching up, counted by the
+    // CatchupScheduler
+    bool _healthy;
+    // Waiting for the catching up bandwidth to send the entries
+    bool _waiting_bandwidth;
     int _consecutive_error_times;
     bool _has_succeeded;
     int64_t _timeout_now_index;
@@ -253,6 +454,8 @@ private:
     std::deque<FlyingAppendEntriesRpc> _append_entries_in_fly;
     brpc::CallId _install_snapshot_in_fly;
     brpc::CallId _heartbeat_in_fly;
+    // Id of the heartbeat in AppendEntriesAggregator
+    uint64_t _batched_heartbeat_in_fly;
     brpc::CallId _timeout_now_in_fly;
     LogManager::WaitId _wait_id;
     bool _is_waiter_canceled;
@@ -374,6 +577,9 @@ private:
     ReplicatorOptions _common_options;
     int _dynamic_timeout_ms;
     int _election_timeout_ms;
+    EncodedEntriesCache _encoded_entries_cache;
+    CatchupScheduler _catchup_scheduler;
+    ReplicationTopology _replication_topology;
 };
 
 }  //  namespace braft
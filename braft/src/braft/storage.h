@@ -121,6 +121,15 @@ inline int gc_dir(const std::string& path) {
     return 0; 
 }
 
+// Notified when the entries of an asynchronous append become stable
+class AppendEntriesCallback {
+public:
+    virtual ~AppendEntriesCallback() {}
+    // |nappended| leading entries of the batch were written and synced, it's
+    // less than the size of the batch on failure
+    virtual void on_stable(int nappended) = 0;
+};
+
 class LogStorage {
 public:
     virtual ~LogStorage() {}
@@ -140,12 +149,56 @@ public:
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index) = 0;
 
+    // get logentries in [first_index, last_index], stopping once the data of
+    // the got entries reaches |max_bytes| (at least one entry is got if it
+    // exists). Entries are appended to |entries| with a reference added.
+    // Return the number of got entries.
+    // The default implementation calls get_entry() one by one
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+        size_t bytes = 0;
+        int64_t index = first_index;
+        for (; index <= last_index && (index == first_index || bytes < max_bytes);
+                ++index) {
+            LogEntry* entry = get_entry(index);
+            if (entry == NULL) {
+                break;
+            }
+            bytes += entry->data.length();
+            entries->push_back(entry);
+        }
+        return index - first_index;
+    }
+
     // append entries to log
     virtual int append_entry(const LogEntry* entry) = 0;
 
     // append entries to log and update IOMetric, return append success number 
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) = 0;
 
+    // append entries to log without waiting for them to be stable, |callback|
+    // is called once they are, possibly in another thread. |entries| and
+    // |metric| must be kept alive until then.
+    // The default implementation calls append_entries() and |callback| in place
+    virtual void append_entries_async(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric,
+                                      AppendEntriesCallback* callback) {
+        callback->on_stable(append_entries(entries, metric));
+    }
+
+    // append entries to log like append_entries() but leave them unsynced,
+    // sync_appended_entries() makes all the entries appended so far stable.
+    // It's safe to call sync_appended_entries() from another thread while
+    // appending.
+    // The default implementation calls append_entries() which syncs in place
+    virtual int append_entries_nosync(const std::vector<LogEntry*>& entries,
+                                      IOMetric* metric) {
+        return append_entries(entries, metric);
+    }
+
+    // sync the entries appended by append_entries_nosync(), return 0 on success
+    virtual int sync_appended_entries() { return 0; }
+
     // delete logs from storage's head, [first_log_index, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept) = 0;
 
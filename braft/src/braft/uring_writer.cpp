@@ -0,0 +1,352 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "braft/uring_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/scoped_lock.h>
+#include <bthread/bthread.h>
+#include "braft/fsync.h"                         // raft_use_fsync_rather_than_fdatasync
+
+#ifdef BRAFT_WITH_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace braft {
+
+DEFINE_int32(raft_io_uring_entries, 1024,
+             "Number of submission queue entries of the io_uring shared by "
+             "log storages");
+
+UringWriter::UringWriter()
+    : _ring_fd(-1), _sq_entries(0), _cq_entries(0), _inflight(0)
+    , _sq_ring(NULL), _sq_ring_size(0), _sq_head(NULL), _sq_tail(NULL)
+    , _sq_mask(NULL), _sq_array(NULL), _sqes(NULL)
+    , _cq_ring(NULL), _cq_ring_size(0), _cq_head(NULL), _cq_tail(NULL)
+    , _cq_mask(NULL), _cqes(NULL) {
+}
+
+UringWriter* UringWriter::get_instance() {
+    static UringWriter* s_writer = []() -> UringWriter* {
+        UringWriter* writer = new UringWriter;
+        if (writer->init() != 0) {
+            delete writer;
+            return NULL;
+        }
+        return writer;
+    }();
+    return s_writer;
+}
+
+void* UringWriter::run_on_complete(void* arg) {
+    UringRequest* req = (UringRequest*)arg;
+    req->on_complete(req->_error.load(butil::memory_order_acquire));
+    return NULL;
+}
+
+void UringWriter::complete(UringRequest* req) {
+    // Don't run user code in the reaper or under the lock
+    bthread_t tid;
+    if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                 run_on_complete, req) != 0) {
+        run_on_complete(req);
+    }
+}
+
+void* UringWriter::run_reaper(void* arg) {
+    ((UringWriter*)arg)->reap();
+    return NULL;
+}
+
+#ifdef BRAFT_WITH_IO_URING
+
+// Up to UIO_MAXIOV iovecs are accepted by one IORING_OP_WRITEV
+static const size_t MAX_IOV_PER_SQE = 1024;
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+UringWriter::~UringWriter() {
+    if (_sqes) {
+        munmap(_sqes, _sq_entries * sizeof(io_uring_sqe));
+    }
+    if (_sq_ring) {
+        munmap(_sq_ring, _sq_ring_size);
+    }
+    if (_cq_ring) {
+        munmap(_cq_ring, _cq_ring_size);
+    }
+    if (_ring_fd >= 0) {
+        ::close(_ring_fd);
+    }
+}
+
+int UringWriter::init() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    _ring_fd = sys_io_uring_setup(FLAGS_raft_io_uring_entries, &params);
+    if (_ring_fd < 0) {
+        PLOG(WARNING) << "Fail to setup io_uring";
+        return -1;
+    }
+    _sq_entries = params.sq_entries;
+    _cq_entries = params.cq_entries;
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    void* sq_ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap submission queue of io_uring";
+        return -1;
+    }
+    _sq_ring = sq_ring;
+    char* sq = (char*)_sq_ring;
+    _sq_head = (unsigned*)(sq + params.sq_off.head);
+    _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    _sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    _sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      _ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap submission entries of io_uring";
+        return -1;
+    }
+    _sqes = (io_uring_sqe*)sqes;
+
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    void* cq_ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap completion queue of io_uring";
+        return -1;
+    }
+    _cq_ring = cq_ring;
+    char* cq = (char*)_cq_ring;
+    _cq_head = (unsigned*)(cq + params.cq_off.head);
+    _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    _cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (pthread_create(&_reaper, NULL, run_reaper, this) != 0) {
+        PLOG(WARNING) << "Fail to create io_uring reaper";
+        return -1;
+    }
+    LOG(INFO) << "Created io_uring with sq_entries=" << _sq_entries
+              << " cq_entries=" << _cq_entries;
+    return 0;
+}
+
+int UringWriter::submit(UringRequest* req) {
+    // Build all the iovecs at first, their addresses must be stable since
+    // they are referenced by the submission entries
+    std::vector<size_t> iov_begin;
+    iov_begin.reserve(req->writes.size() + 1);
+    req->_iov.clear();
+    unsigned nsqe = 0;
+    for (size_t i = 0; i < req->writes.size(); ++i) {
+        const UringWrite& w = req->writes[i];
+        iov_begin.push_back(req->_iov.size());
+        const size_t nblock = w.data.backing_block_num();
+        for (size_t j = 0; j < nblock; ++j) {
+            butil::StringPiece sp = w.data.backing_block(j);
+            struct iovec iov = { (void*)sp.data(), sp.size() };
+            req->_iov.push_back(iov);
+        }
+        nsqe += (nblock + MAX_IOV_PER_SQE - 1) / MAX_IOV_PER_SQE;
+        if (w.sync) {
+            ++nsqe;
+        }
+    }
+    iov_begin.push_back(req->_iov.size());
+    if (nsqe == 0 || nsqe > _sq_entries || nsqe > _cq_entries) {
+        LOG(WARNING) << "Can't submit request with " << nsqe << " entries"
+                     << " to io_uring with sq_entries=" << _sq_entries;
+        return -1;
+    }
+    req->_pending.store(nsqe, butil::memory_order_relaxed);
+    req->_error.store(0, butil::memory_order_relaxed);
+    req->_ops.clear();
+    req->_ops.reserve(nsqe);
+
+    std::unique_lock<bthread::Mutex> lck(_mutex);
+    // Bound the in-flight operations so that completions never overflow
+    while (_inflight + nsqe > _cq_entries) {
+        _cond.wait(lck);
+    }
+    const unsigned first_tail = *_sq_tail;
+    unsigned tail = first_tail;
+    for (size_t i = 0; i < req->writes.size(); ++i) {
+        const UringWrite& w = req->writes[i];
+        off_t offset = w.offset;
+        for (size_t pos = iov_begin[i]; pos < iov_begin[i + 1];) {
+            const size_t niov = std::min(MAX_IOV_PER_SQE, iov_begin[i + 1] - pos);
+            size_t nbytes = 0;
+            for (size_t k = pos; k < pos + niov; ++k) {
+                nbytes += req->_iov[k].iov_len;
+            }
+            const unsigned index = tail & *_sq_mask;
+            io_uring_sqe* sqe = &_sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = w.fd;
+            sqe->off = offset;
+            sqe->addr = (uint64_t)(uintptr_t)&req->_iov[pos];
+            sqe->len = niov;
+            const UringRequest::Op op = { req, nbytes };
+            req->_ops.push_back(op);
+            sqe->user_data = (uint64_t)(uintptr_t)&req->_ops.back();
+            pos += niov;
+            // A short write breaks the chain, so the following sync is
+            // cancelled and the failure is reported
+            if (pos < iov_begin[i + 1] || w.sync) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            _sq_array[index] = index;
+            ++tail;
+            offset += nbytes;
+        }
+        if (w.sync) {
+            const unsigned index = tail & *_sq_mask;
+            io_uring_sqe* sqe = &_sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = w.fd;
+            if (!FLAGS_raft_use_fsync_rather_than_fdatasync) {
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+            const UringRequest::Op op = { req, 0 };
+            req->_ops.push_back(op);
+            sqe->user_data = (uint64_t)(uintptr_t)&req->_ops.back();
+            _sq_array[index] = index;
+            ++tail;
+        }
+    }
+    __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+    _inflight += nsqe;
+
+    unsigned submitted = 0;
+    while (submitted < nsqe) {
+        const int rc = sys_io_uring_enter(_ring_fd, nsqe - submitted, 0, 0);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to submit to io_uring, submitted="
+                        << submitted << " nsqe=" << nsqe;
+            break;
+        }
+        submitted += rc;
+    }
+    if (submitted == nsqe) {
+        return 0;
+    }
+    // Only the reaper enters the ring besides the submitters holding the
+    // lock and it submits nothing, so the entries not consumed by the kernel
+    // are exactly the last ones of this request, take them back
+    const unsigned nleft = nsqe - submitted;
+    __atomic_store_n(_sq_tail, first_tail + submitted, __ATOMIC_RELEASE);
+    _inflight -= nleft;
+    if (submitted == 0) {
+        return -1;
+    }
+    lck.unlock();
+    int expected = 0;
+    req->_error.compare_exchange_strong(expected, EIO,
+                                        butil::memory_order_release);
+    // The submitted entries may be all completed already
+    if (req->_pending.fetch_sub(nleft, butil::memory_order_acq_rel) == (int)nleft) {
+        complete(req);
+    }
+    return 0;
+}
+
+void UringWriter::reap() {
+    std::vector<UringRequest*> completed;
+    while (true) {
+        const int rc = sys_io_uring_enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (rc < 0 && errno != EINTR) {
+            PLOG(ERROR) << "Fail to wait for completions of io_uring";
+        }
+        unsigned head = *_cq_head;
+        const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned nreaped = 0;
+        for (; head != tail; ++head, ++nreaped) {
+            const io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+            const UringRequest::Op* op =
+                    (const UringRequest::Op*)(uintptr_t)cqe->user_data;
+            UringRequest* req = op->req;
+            int error = 0;
+            if (cqe->res < 0) {
+                error = -cqe->res;
+            } else if ((size_t)cqe->res != op->nbytes) {
+                // Short write, no retry as following writes may be done
+                error = EIO;
+            }
+            if (error != 0) {
+                int expected = 0;
+                req->_error.compare_exchange_strong(
+                        expected, error, butil::memory_order_release);
+            }
+            if (req->_pending.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+                completed.push_back(req);
+            }
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        if (nreaped > 0) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _inflight -= nreaped;
+            _cond.notify_all();
+        }
+        for (size_t i = 0; i < completed.size(); ++i) {
+            complete(completed[i]);
+        }
+        completed.clear();
+    }
+}
+
+#else  // BRAFT_WITH_IO_URING
+
+UringWriter::~UringWriter() {}
+
+int UringWriter::init() {
+    LOG(WARNING) << "braft is built without io_uring";
+    return -1;
+}
+
+int UringWriter::submit(UringRequest* req) {
+    return -1;
+}
+
+void UringWriter::reap() {}
+
+#endif  // BRAFT_WITH_IO_URING
+
+}  //  namespace braft
@@ -0,0 +1,118 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRAFT_URING_WRITER_H
+#define  BRAFT_URING_WRITER_H
+
+#include <sys/uio.h>                             // iovec
+#include <vector>
+#include <butil/iobuf.h>                         // butil::IOBuf
+#include <butil/atomicops.h>                     // butil::atomic
+#include <bthread/mutex.h>                       // bthread::Mutex
+#include <bthread/condition_variable.h>          // bthread::ConditionVariable
+#include <pthread.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace braft {
+
+// One write of an UringRequest, |data| is written at |offset| of |fd| and
+// the fd is synced afterwards if |sync| is true.
+struct UringWrite {
+    UringWrite() : fd(-1), offset(0), sync(false) {}
+    int fd;
+    off_t offset;
+    butil::IOBuf data;
+    bool sync;
+};
+
+// A group of writes submitted to the kernel at once. Writes and syncs of the
+// same fd are linked, so the sync is started by the kernel right after the
+// writes without another round trip.
+class UringRequest {
+public:
+    UringRequest() : _pending(0), _error(0) {}
+    virtual ~UringRequest() {}
+
+    // Called in a background bthread once all the writes and syncs are done,
+    // |error| is 0 on success, an errno otherwise. EIO is reported if only a
+    // part of the request could be submitted to the kernel
+    virtual void on_complete(int error) = 0;
+
+    std::vector<UringWrite> writes;
+
+private:
+friend class UringWriter;
+    // One submission entry, referenced by its user_data
+    struct Op {
+        UringRequest* req;
+        size_t nbytes;
+    };
+    butil::atomic<int> _pending;
+    butil::atomic<int> _error;
+    std::vector<struct iovec> _iov;
+    std::vector<Op> _ops;
+};
+
+// Process-wide io_uring instance shared by all the log storages, completions
+// are reaped by a dedicated pthread.
+class UringWriter {
+public:
+    // Returns NULL if io_uring is not built in or not supported by the kernel
+    static UringWriter* get_instance();
+
+    // Submit all the writes of |req|, req->on_complete() is called later on
+    // success.
+    // Returns 0 on success, -1 if nothing is submitted and |req| is untouched
+    int submit(UringRequest* req);
+
+private:
+    UringWriter();
+    ~UringWriter();
+    int init();
+    static void* run_reaper(void* arg);
+    static void* run_on_complete(void* arg);
+    static void complete(UringRequest* req);
+    void reap();
+
+    int _ring_fd;
+    unsigned _sq_entries;
+    unsigned _cq_entries;
+    unsigned _inflight;
+    // submission queue
+    void* _sq_ring;
+    size_t _sq_ring_size;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    io_uring_sqe* _sqes;
+    // completion queue
+    void* _cq_ring;
+    size_t _cq_ring_size;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+    io_uring_cqe* _cqes;
+    pthread_t _reaper;
+    // Submitters run in bthreads, they must not block the worker pthreads
+    // while waiting for room in the completion queue
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_URING_WRITER_H
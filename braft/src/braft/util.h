@@ -206,8 +206,12 @@ inline uint32_t murmurhash32(const butil::IOBuf& buf) {
     return hash;
 }
 
+// Same as butil::crc32c::Extend, three interleaved crc32 streams combined
+// with PCLMULQDQ are used if the CPU supports SSE4.2 and PCLMUL
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t len);
+
 inline uint32_t crc32(const void* key, int len) {
-    return butil::crc32c::Value((const char*)key, len);
+    return crc32c_extend(0, (const char*)key, len);
 }
 
 inline uint32_t crc32(const butil::IOBuf& buf) {
@@ -216,7 +220,7 @@ inline uint32_t crc32(const butil::IOBuf& buf) {
     for (size_t i = 0; i < block_num; ++i) {
         butil::StringPiece sp = buf.backing_block(i);
         if (!sp.empty()) {
-            hash = butil::crc32c::Extend(hash, sp.data(), sp.size());
+            hash = crc32c_extend(hash, sp.data(), sp.size());
         }
     }
     return hash;
@@ -0,0 +1,44 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include "braft/adaptive_batch.h"
+
+namespace braft {
+DECLARE_int32(raft_batch_latency_target_us);
+}
+
+class AdaptiveBatchLimitTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_batch_latency_target_us = 2000;
+    }
+    void TearDown() {}
+};
+
+TEST_F(AdaptiveBatchLimitTest, grow_and_shrink) {
+    braft::AdaptiveBatchLimit limit(32, 1024);
+    ASSERT_EQ(32u, limit.max_count());
+    ASSERT_EQ(1024u, limit.max_bytes());
+
+    // Batches not cut by the limits don't change them
+    for (int i = 0; i < 100; ++i) {
+        limit.on_batch_done(100, 1, 10);
+    }
+    ASSERT_EQ(32u, limit.max_count());
+    ASSERT_EQ(1024u, limit.max_bytes());
+
+    // Full batches within the target grow the limits up to 16 times
+    for (int i = 0; i < 1000; ++i) {
+        limit.on_batch_done(100, limit.max_count(), 10);
+    }
+    ASSERT_EQ(32u * 16, limit.max_count());
+    ASSERT_EQ(1024u * 16, limit.max_bytes());
+
+    // Slow batches shrink the limits down to a quarter
+    for (int i = 0; i < 1000; ++i) {
+        limit.on_batch_done(10000, limit.max_count(), 10);
+    }
+    ASSERT_LT(2000, limit.latency_us());
+    ASSERT_EQ(8u, limit.max_count());
+    ASSERT_EQ(256u, limit.max_bytes());
+}
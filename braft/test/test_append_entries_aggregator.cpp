@@ -0,0 +1,179 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <brpc/server.h>
+#include <bthread/countdown_event.h>
+#include "braft/append_entries_aggregator.h"
+#include "braft/raft.h"
+
+namespace braft {
+DECLARE_int32(raft_heartbeat_coalesce_window_ms);
+DECLARE_int32(raft_append_entries_coalesce_window_us);
+}
+
+static void on_request_done(brpc::Controller* cntl,
+                            braft::AppendEntriesRequest* request,
+                            braft::AppendEntriesResponse* response,
+                            int* error_code, bthread::CountdownEvent* cond) {
+    *error_code = cntl->ErrorCode();
+    delete cntl;
+    delete request;
+    delete response;
+    cond->signal();
+}
+
+class AppendEntriesAggregatorTest : public testing::Test {
+protected:
+    void SetUp() {
+        _saved_heartbeat_window_ms = braft::FLAGS_raft_heartbeat_coalesce_window_ms;
+        _saved_entries_window_us = braft::FLAGS_raft_append_entries_coalesce_window_us;
+        ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:5006", &_addr));
+        ASSERT_EQ(0, braft::add_service(&_server, _addr));
+        ASSERT_EQ(0, _server.Start(_addr, NULL));
+    }
+    void TearDown() {
+        _server.Stop(0);
+        _server.Join();
+        braft::FLAGS_raft_heartbeat_coalesce_window_ms = _saved_heartbeat_window_ms;
+        braft::FLAGS_raft_append_entries_coalesce_window_us = _saved_entries_window_us;
+    }
+
+    // No node is on the server, the requests of valid peers fail with ENOENT
+    uint64_t add(braft::AppendEntriesAggregator::Kind kind, const char* peer_id,
+                 int nentries, int* error_code, bthread::CountdownEvent* cond) {
+        brpc::Controller* cntl = new brpc::Controller;
+        braft::AppendEntriesRequest* request = new braft::AppendEntriesRequest;
+        braft::AppendEntriesResponse* response = new braft::AppendEntriesResponse;
+        request->set_group_id("unittest");
+        request->set_server_id("127.0.0.1:5007:0");
+        request->set_peer_id(peer_id);
+        request->set_term(1);
+        request->set_prev_log_term(1);
+        request->set_prev_log_index(1);
+        request->set_committed_index(1);
+        for (int i = 0; i < nentries; ++i) {
+            braft::EntryMeta* em = request->add_entries();
+            em->set_term(1);
+            em->set_type(braft::ENTRY_TYPE_DATA);
+            em->set_data_len(4);
+            cntl->request_attachment().append("data");
+        }
+        cntl->set_timeout_ms(1000);
+        *error_code = -1;
+        return braft::AppendEntriesAggregator::get_instance()->add(
+                _addr, kind, cntl, request, response,
+                brpc::NewCallback(on_request_done, cntl, request, response,
+                                  error_code, cond));
+    }
+
+    int32_t _saved_heartbeat_window_ms;
+    int32_t _saved_entries_window_us;
+    butil::EndPoint _addr;
+    brpc::Server _server;
+};
+
+TEST_F(AppendEntriesAggregatorTest, split_responses) {
+    braft::FLAGS_raft_heartbeat_coalesce_window_ms = 20;
+    braft::FLAGS_raft_append_entries_coalesce_window_us = 20 * 1000;
+    int error_codes[6];
+    bthread::CountdownEvent cond(6);
+
+    // Heartbeats carrying entries are rejected alone
+    add(braft::AppendEntriesAggregator::HEARTBEAT, "127.0.0.1:5006:0", 0,
+        &error_codes[0], &cond);
+    add(braft::AppendEntriesAggregator::HEARTBEAT, "invalid", 0,
+        &error_codes[1], &cond);
+    add(braft::AppendEntriesAggregator::HEARTBEAT, "127.0.0.1:5006:0", 1,
+        &error_codes[2], &cond);
+
+    // The attachments are cut by request
+    add(braft::AppendEntriesAggregator::APPEND_ENTRIES, "127.0.0.1:5006:0", 2,
+        &error_codes[3], &cond);
+    add(braft::AppendEntriesAggregator::APPEND_ENTRIES, "invalid", 1,
+        &error_codes[4], &cond);
+    add(braft::AppendEntriesAggregator::APPEND_ENTRIES, "127.0.0.1:5006:0", 3,
+        &error_codes[5], &cond);
+    cond.wait();
+
+    ASSERT_EQ(ENOENT, error_codes[0]);
+    ASSERT_EQ(EINVAL, error_codes[1]);
+    ASSERT_EQ(EINVAL, error_codes[2]);
+    ASSERT_EQ(ENOENT, error_codes[3]);
+    ASSERT_EQ(EINVAL, error_codes[4]);
+    ASSERT_EQ(ENOENT, error_codes[5]);
+}
+
+TEST_F(AppendEntriesAggregatorTest, cancel) {
+    braft::FLAGS_raft_heartbeat_coalesce_window_ms = 1000;
+    braft::AppendEntriesAggregator* aggregator =
+            braft::AppendEntriesAggregator::get_instance();
+    int error_code1 = 0;
+    int error_code2 = 0;
+    bthread::CountdownEvent cond1(1);
+    bthread::CountdownEvent cond2(1);
+    const uint64_t id1 = add(braft::AppendEntriesAggregator::HEARTBEAT,
+                             "127.0.0.1:5006:0", 0, &error_code1, &cond1);
+    const uint64_t id2 = add(braft::AppendEntriesAggregator::HEARTBEAT,
+                             "127.0.0.1:5006:0", 0, &error_code2, &cond2);
+    ASSERT_NE(0u, id1);
+    ASSERT_NE(id1, id2);
+
+    // Done at once, long before the batch is sent
+    const int64_t start_ms = butil::monotonic_time_ms();
+    aggregator->cancel(id1);
+    cond1.wait();
+    ASSERT_EQ(ECANCELED, error_code1);
+    ASSERT_LT(butil::monotonic_time_ms() - start_ms, 500);
+    aggregator->cancel(id1);
+
+    // The other one goes on
+    cond2.wait();
+    ASSERT_EQ(ENOENT, error_code2);
+    aggregator->cancel(id2);
+}
+
+TEST_F(AppendEntriesAggregatorTest, free_idle_peers) {
+    braft::FLAGS_raft_heartbeat_coalesce_window_ms = 1;
+    braft::AppendEntriesAggregator* aggregator =
+            braft::AppendEntriesAggregator::get_instance();
+    int error_code = 0;
+    bthread::CountdownEvent cond(1);
+    add(braft::AppendEntriesAggregator::HEARTBEAT, "127.0.0.1:5006:0", 0,
+        &error_code, &cond);
+    cond.wait();
+    ASSERT_EQ(ENOENT, error_code);
+
+    // The batch releases the peer right after the closures run
+    for (int i = 0; ; ++i) {
+        ASSERT_LT(i, 100);
+        {
+            BAIDU_SCOPED_LOCK(aggregator->_mutex);
+            ASSERT_EQ(1u, aggregator->_peers.count(_addr));
+            if (aggregator->_peers[_addr]->nref == 0) {
+                break;
+            }
+        }
+        usleep(10 * 1000);
+    }
+    {
+        BAIDU_SCOPED_LOCK(aggregator->_mutex);
+        // Not idle for long enough
+        aggregator->sweep_idle_peers(butil::monotonic_time_ms());
+        ASSERT_EQ(1u, aggregator->_peers.count(_addr));
+        aggregator->_peers[_addr]->queues[
+                braft::AppendEntriesAggregator::HEARTBEAT].supported = false;
+        aggregator->sweep_idle_peers(butil::monotonic_time_ms() + 3600 * 1000);
+        aggregator->_last_sweep_ms = 0;
+        ASSERT_EQ(0u, aggregator->_peers.count(_addr));
+    }
+    // Tried again once freed
+    ASSERT_TRUE(aggregator->supported(
+                _addr, braft::AppendEntriesAggregator::HEARTBEAT));
+    {
+        BAIDU_SCOPED_LOCK(aggregator->_mutex);
+        ASSERT_EQ(0u, aggregator->_peers.count(_addr));
+    }
+}
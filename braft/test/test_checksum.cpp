@@ -34,8 +34,43 @@ TEST_F(ChecksumTest, benchmark) {
     timer.stop();
     const long crc_elp = timer.u_elapsed();
 
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        braft::crc32(data, sizeof(data));
+    }
+    timer.stop();
+    const long braft_crc_elp = timer.u_elapsed();
+
     LOG(INFO) << "murmurhash32_TP=" << sizeof(data) * N / (double)mur_elp << "MB/s"
-              << " base_crc32_TP=" << sizeof(data) * N / (double)crc_elp << "MB/s";
+              << " base_crc32_TP=" << sizeof(data) * N / (double)crc_elp << "MB/s"
+              << " braft_crc32_TP=" << sizeof(data) * N / (double)braft_crc_elp << "MB/s";
     LOG(INFO) << "base_is_fast_crc32_support=" << butil::crc32c::IsFastCrc32Supported();
 
 }
+
+static void noop_deleter(void*) {}
+
+TEST_F(ChecksumTest, crc32c_compatible) {
+    char data[16384];
+    for (size_t i = 0; i < ARRAY_SIZE(data); ++i) {
+        data[i] = butil::fast_rand_in(0, 255);
+    }
+    // cover unaligned heads and every path of the interleaved streams
+    for (size_t offset = 0; offset < 16; ++offset) {
+        for (size_t len = 0; len + offset <= sizeof(data);
+                len += (len < 1024 ? 1 : 97)) {
+            const uint32_t init = butil::fast_rand();
+            ASSERT_EQ(butil::crc32c::Extend(init, data + offset, len),
+                      braft::crc32c_extend(init, data + offset, len))
+                << "offset=" << offset << " len=" << len;
+        }
+    }
+
+    // IOBuf is checksummed block by block
+    butil::IOBuf buf;
+    for (size_t i = 0; i < 64; ++i) {
+        buf.append_user_data(data + i * 200, 200 + i, noop_deleter);
+    }
+    const std::string str = buf.to_string();
+    ASSERT_EQ(butil::crc32c::Value(str.data(), str.size()), braft::crc32(buf));
+}
@@ -0,0 +1,273 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <limits.h>
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include "braft/entry_codec.h"
+
+class EntryCodecTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(EntryCodecTest, encode_and_parse) {
+    braft::AppendEntriesRequest request;
+    request.set_prev_log_index(100);
+    request.set_prev_log_term(5);
+    butil::IOBuf attachment;
+    braft::CompactEntriesEncoder encoder(request.prev_log_term());
+    // Terms go up and down to cover negative deltas
+    const int64_t terms[] = { 5, 7, 7, 6, 7 };
+    for (int i = 0; i < 5; ++i) {
+        if (i == 2) {
+            braft::EntryMeta* em = request.add_compact_configurations();
+            em->set_term(terms[i]);
+            em->set_type(braft::ENTRY_TYPE_CONFIGURATION);
+            em->add_peers("127.0.0.1:8000");
+            em->add_peers("127.0.0.1:8001");
+            em->add_old_peers("127.0.0.1:8000");
+            encoder.add(terms[i], braft::ENTRY_TYPE_CONFIGURATION, 0, false, 0);
+            continue;
+        }
+        std::string data(i * 10, 'a' + i);
+        attachment.append(data);
+        encoder.add(terms[i], braft::ENTRY_TYPE_DATA, data.size(), true,
+                    braft::crc32(data.data(), data.size()));
+    }
+    ASSERT_EQ(5, encoder.count());
+    encoder.finish(&request, &attachment);
+    ASSERT_EQ(5, braft::append_entries_count(request));
+    // The configuration has no checksum, the other entries keep theirs
+    ASSERT_EQ(4, request.compact_data_checksums_size());
+
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(0, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_EQ(5u, entries.size());
+    ASSERT_TRUE(attachment.empty());
+    for (int i = 0; i < 5; ++i) {
+        braft::LogEntry* entry = entries[i];
+        ASSERT_EQ(101 + i, entry->id.index);
+        ASSERT_EQ(terms[i], entry->id.term);
+        if (i == 2) {
+            ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+            ASSERT_EQ(2u, entry->peers->size());
+            ASSERT_EQ(1u, entry->old_peers->size());
+            ASSERT_TRUE(entry->data.empty());
+            ASSERT_FALSE(entry->has_data_checksum);
+        } else {
+            const std::string data(i * 10, 'a' + i);
+            ASSERT_EQ(braft::ENTRY_TYPE_DATA, entry->type);
+            ASSERT_TRUE(entry->peers == NULL);
+            ASSERT_EQ(data, entry->data.to_string());
+            ASSERT_TRUE(entry->has_data_checksum);
+            ASSERT_EQ(braft::crc32(data.data(), data.size()),
+                      entry->data_checksum);
+        }
+        entry->Release();
+    }
+}
+
+TEST_F(EntryCodecTest, malformed) {
+    braft::AppendEntriesRequest request;
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    butil::IOBuf attachment;
+    braft::CompactEntriesEncoder encoder(request.prev_log_term());
+    attachment.append("hello");
+    encoder.add(1, braft::ENTRY_TYPE_DATA, 5, false, 0);
+    encoder.add(1, braft::ENTRY_TYPE_DATA, 5, false, 0);
+    encoder.finish(&request, &attachment);
+    std::vector<braft::LogEntry*> entries;
+    // The data of the second entry is missing
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+
+    // Configuration without EntryMeta
+    request.Clear();
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    attachment.clear();
+    braft::CompactEntriesEncoder conf_encoder(request.prev_log_term());
+    conf_encoder.add(1, braft::ENTRY_TYPE_CONFIGURATION, 0, false, 0);
+    conf_encoder.finish(&request, &attachment);
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+
+    // Headers are truncated
+    request.set_compact_entries_count(2);
+    attachment.clear();
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+
+    // Counts not backed by the attachment are rejected before allocating
+    request.set_compact_entries_count(INT_MAX);
+    attachment.append("hello");
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+    request.set_compact_entries_count(-1);
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+}
+
+TEST_F(EntryCodecTest, verify_checksum) {
+    butil::IOBuf data;
+    data.append("hello");
+    const uint32_t checksum = braft::crc32(data);
+
+    braft::AppendEntriesRequest request;
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    butil::IOBuf attachment;
+    for (int i = 0; i < 3; ++i) {
+        braft::EntryMeta* em = request.add_entries();
+        em->set_term(1);
+        em->set_type(braft::ENTRY_TYPE_DATA);
+        em->set_data_len(data.length());
+        if (i != 1) {
+            em->set_data_checksum(checksum);
+        }
+        attachment.append(data);
+    }
+    ASSERT_EQ(0, braft::verify_entries_checksum(request, attachment));
+    ASSERT_EQ(15u, attachment.length());
+    request.mutable_entries(2)->set_data_checksum(checksum + 1);
+    ASSERT_EQ(-1, braft::verify_entries_checksum(request, attachment));
+
+    // Compact format
+    request.Clear();
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    attachment.clear();
+    braft::CompactEntriesEncoder encoder(request.prev_log_term());
+    for (int i = 0; i < 3; ++i) {
+        encoder.add(1, braft::ENTRY_TYPE_DATA, data.length(), true, checksum);
+        attachment.append(data);
+    }
+    encoder.finish(&request, &attachment);
+    ASSERT_EQ(3, request.compact_data_checksums_size());
+    ASSERT_EQ(0, braft::verify_entries_checksum(request, attachment));
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(0, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_EQ(3u, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ASSERT_TRUE(entries[i]->has_data_checksum);
+        ASSERT_EQ(checksum, entries[i]->data_checksum);
+        entries[i]->Release();
+    }
+
+    // Corrupt the data of the last entry
+    attachment.clear();
+    braft::CompactEntriesEncoder corrupted_encoder(request.prev_log_term());
+    request.Clear();
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    for (int i = 0; i < 3; ++i) {
+        corrupted_encoder.add(1, braft::ENTRY_TYPE_DATA, data.length(),
+                              true, checksum);
+        attachment.append(i == 2 ? "hellO" : "hello");
+    }
+    corrupted_encoder.finish(&request, &attachment);
+    ASSERT_EQ(-1, braft::verify_entries_checksum(request, attachment));
+
+    // Entries without a checksum pass, the others are still verified
+    for (int corrupted = 1; corrupted <= 2; ++corrupted) {
+        attachment.clear();
+        braft::CompactEntriesEncoder mixed_encoder(request.prev_log_term());
+        request.Clear();
+        request.set_prev_log_index(10);
+        request.set_prev_log_term(1);
+        for (int i = 0; i < 3; ++i) {
+            mixed_encoder.add(1, braft::ENTRY_TYPE_DATA, data.length(),
+                              i != 1, checksum);
+            attachment.append(i == corrupted ? "hellO" : "hello");
+        }
+        mixed_encoder.finish(&request, &attachment);
+        ASSERT_EQ(2, request.compact_data_checksums_size());
+        if (corrupted == 1) {
+            ASSERT_EQ(0, braft::verify_entries_checksum(request, attachment));
+        } else {
+            ASSERT_EQ(-1, braft::verify_entries_checksum(request, attachment));
+        }
+    }
+
+    // Checksums not matching the headers are rejected
+    request.add_compact_data_checksums(checksum);
+    entries.clear();
+    ASSERT_EQ(-1, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_TRUE(entries.empty());
+}
+
+TEST_F(EntryCodecTest, encoded_entries_cache) {
+    braft::EncodedEntriesCache cache;
+    for (int64_t i = 1; i <= 4; ++i) {
+        scoped_refptr<braft::EncodedEntries> entries = new braft::EncodedEntries;
+        entries->term = 2;
+        entries->first_index = i * 10;
+        entries->count = 10;
+        entries->attachment.append("data");
+        cache.put(entries.get(), 3);
+    }
+    // The oldest one is dropped
+    ASSERT_TRUE(cache.get(2, 10, false) == NULL);
+    scoped_refptr<braft::EncodedEntries> entries = cache.get(2, 20, false);
+    ASSERT_TRUE(entries != NULL);
+    ASSERT_EQ(10, entries->count);
+    ASSERT_TRUE(cache.get(2, 20, true) == NULL);
+    ASSERT_TRUE(cache.get(3, 20, false) == NULL);
+
+    // Replaced by the one with the same key
+    scoped_refptr<braft::EncodedEntries> replaced = new braft::EncodedEntries;
+    replaced->term = 2;
+    replaced->first_index = 20;
+    replaced->count = 5;
+    cache.put(replaced.get(), 3);
+    ASSERT_EQ(5, cache.get(2, 20, false)->count);
+    ASSERT_TRUE(cache.get(2, 30, false) != NULL);
+    // The entries taken out stay valid
+    ASSERT_EQ(10, entries->count);
+    ASSERT_EQ("data", entries->attachment.to_string());
+
+    cache.clear();
+    ASSERT_TRUE(cache.get(2, 20, false) == NULL);
+}
+
+TEST_F(EntryCodecTest, strip_entries_data) {
+    braft::AppendEntriesRequest request;
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    butil::IOBuf attachment;
+    braft::CompactEntriesEncoder encoder(request.prev_log_term());
+    for (int i = 0; i < 3; ++i) {
+        encoder.add(2, braft::ENTRY_TYPE_DATA, 5, false, 0);
+        attachment.append("hello");
+    }
+    encoder.finish(&request, &attachment);
+    butil::IOBuf data;
+    data.append(attachment);
+    ASSERT_EQ(0, braft::strip_entries_data(request, &attachment));
+    ASSERT_EQ(data.length() - 15, attachment.length());
+    // The follower appends the data fetched from the relay
+    attachment.append("hellohellohello");
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(0, braft::parse_compact_entries(request, &attachment, &entries));
+    ASSERT_EQ(3u, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ASSERT_EQ(2, entries[i]->id.term);
+        ASSERT_EQ("hello", entries[i]->data.to_string());
+        entries[i]->Release();
+    }
+
+    // The data is all of the attachment with EntryMeta
+    request.Clear();
+    request.set_prev_log_index(10);
+    request.set_prev_log_term(1);
+    attachment.clear();
+    braft::EntryMeta* em = request.add_entries();
+    em->set_term(1);
+    em->set_type(braft::ENTRY_TYPE_DATA);
+    em->set_data_len(5);
+    attachment.append("hello");
+    ASSERT_EQ(0, braft::strip_entries_data(request, &attachment));
+    ASSERT_TRUE(attachment.empty());
+}
@@ -15,6 +15,7 @@
 #include <butil/files/dir_reader_posix.h>
 #include <butil/string_printf.h>
 #include <butil/logging.h>
+#include <bthread/countdown_event.h>
 #include "braft/util.h"
 #include "braft/log.h"
 #include "braft/storage.h"
@@ -22,6 +23,11 @@
 namespace braft {
 DECLARE_bool(raft_trace_append_entry_latency);
 DECLARE_bool(raft_recover_log_from_corrupt);
+DECLARE_bool(raft_mmap_closed_segments);
+DECLARE_bool(raft_log_io_uring);
+DECLARE_bool(raft_preallocate_segments);
+DECLARE_bool(raft_segment_index);
+DECLARE_int32(raft_max_segment_loaders);
 }
 
 class LogStorageTest : public testing::Test {
@@ -250,6 +256,81 @@ TEST_F(LogStorageTest, closed_segment) {
     delete configuration_manager;
 }
 
+TEST_F(LogStorageTest, mmap_closed_segment) {
+    ::system("rm -rf data");
+    ::system("mkdir data/");
+    braft::FLAGS_raft_mmap_closed_segments = true;
+    braft::Segment* seg1 = new braft::Segment("./data", 1L, 0);
+    seg1->AddRef();
+    ASSERT_EQ(0, seg1->create());
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = i + 1;
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        entry->data.append(data_buf);
+
+        ASSERT_EQ(0, seg1->append(entry));
+
+        entry->Release();
+    }
+    ASSERT_EQ(0, seg1->close());
+    ASSERT_FALSE(seg1->is_open());
+
+    // read through mapping
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = seg1->get(i+1);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(entry->id.term, 1);
+        ASSERT_EQ(entry->type, braft::ENTRY_TYPE_DATA);
+        ASSERT_EQ(entry->id.index, i+1);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entries.push_back(entry);
+    }
+    ASSERT_TRUE(seg1->_mapping != NULL);
+
+    // entries already read survive truncating and overwriting
+    ASSERT_EQ(0, seg1->truncate(5));
+    ASSERT_TRUE(seg1->_mapping == NULL);
+    ASSERT_TRUE(seg1->is_open());
+    for (int i = 0; i < 5; i++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 2;
+        entry->id.index = i + 6;
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "HELLO, WORLD: %d", i + 6);
+        entry->data.append(data_buf);
+
+        ASSERT_EQ(0, seg1->append(entry));
+
+        entry->Release();
+    }
+    for (int i = 0; i < 10; i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        ASSERT_EQ(data_buf, entries[i]->data.to_string());
+    }
+    ASSERT_EQ(0, seg1->unlink());
+    seg1->Release();
+    // mapping is still referenced by the entries after the segment is gone
+    for (int i = 0; i < 10; i++) {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        ASSERT_EQ(data_buf, entries[i]->data.to_string());
+        entries[i]->Release();
+    }
+    braft::FLAGS_raft_mmap_closed_segments = false;
+}
+
 TEST_F(LogStorageTest, multi_segment_and_segment_logstorage) {
     ::system("rm -rf data");
     braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
@@ -1373,3 +1454,690 @@ TEST_F(LogStorageTest, data_corrupt) {
     delete configuration_manager;
 }
 
+
+TEST_F(LogStorageTest, batch_append_across_segments) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    // every batch is larger than a segment, so it has to be split
+    for (int i = 0; i < 100; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 256; j++) {
+            int64_t index = 256*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+
+        ASSERT_EQ(256, storage->append_entries(entries, NULL));
+
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(256*100, storage->last_log_index());
+
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    ASSERT_LT(100ul, segments.size());
+    int64_t next_index = 1;
+    for (braft::SegmentLogStorage::SegmentMap::iterator it = segments.begin();
+            it != segments.end(); ++it) {
+        ASSERT_EQ(next_index, it->second->first_index());
+        next_index = it->second->last_index() + 1;
+    }
+    delete storage;
+    delete configuration_manager;
+
+    // reload and read
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(256*100, storage->last_log_index());
+    for (int i = 0; i < 256*100; i++) {
+        int64_t index = i + 1;
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_EQ(entry->id.term, 1);
+        ASSERT_EQ(entry->type, braft::ENTRY_TYPE_DATA);
+        ASSERT_EQ(entry->id.index, index);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+class CountdownAppendCallback : public braft::AppendEntriesCallback {
+public:
+    CountdownAppendCallback() : nappended(-1), _event(1) {}
+    void on_stable(int n) {
+        nappended = n;
+        _event.signal();
+    }
+    void wait() { _event.wait(); }
+    int nappended;
+private:
+    bthread::CountdownEvent _event;
+};
+
+TEST_F(LogStorageTest, append_entries_async) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::FLAGS_raft_log_io_uring = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    LOG_IF(WARNING, storage->_uring == NULL)
+            << "io_uring is unavailable, test the default implementation";
+
+    // batches span several segments
+    for (int i = 0; i < 50; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 64; j++) {
+            int64_t index = 64*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+
+        CountdownAppendCallback callback;
+        storage->append_entries_async(entries, NULL, &callback);
+        callback.wait();
+        ASSERT_EQ(64, callback.nappended);
+
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+    ASSERT_EQ(64*50, storage->last_log_index());
+    delete storage;
+    delete configuration_manager;
+
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(64*50, storage->last_log_index());
+    for (int i = 0; i < 64*50; i++) {
+        int64_t index = i + 1;
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_EQ(entry->id.index, index);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_log_io_uring = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, deferred_append) {
+    ::system("mkdir data/");
+    scoped_refptr<braft::Segment> seg = new braft::Segment("./data", 1L, 0);
+    ASSERT_EQ(0, seg->create());
+
+    braft::Segment::DeferredAppend* deferred[2];
+    butil::IOBuf bufs[2];
+    off_t offsets[2];
+    for (int i = 0; i < 2; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 5; j++) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = 5*i + j + 1;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %d", 5*i + j + 1);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(5, seg->append_deferred(entries, 0, &bufs[i], &offsets[i],
+                                          &deferred[i]));
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+    // Reserved one after the other but not visible before being written
+    ASSERT_EQ(0, offsets[0]);
+    ASSERT_EQ((off_t)bufs[0].length(), offsets[1]);
+    ASSERT_EQ((int64_t)(bufs[0].length() + bufs[1].length()), seg->bytes());
+    ASSERT_EQ(0, seg->last_index());
+
+    for (int i = 1; i >= 0; i--) {
+        off_t offset = offsets[i];
+        while (!bufs[i].empty()) {
+            ssize_t n = bufs[i].pcut_into_file_descriptor(seg->fd(), offset);
+            ASSERT_GT(n, 0);
+            offset += n;
+        }
+    }
+    // Committed in the order of the offsets
+    ASSERT_EQ(0, seg->commit_deferred(deferred[1], 0));
+    ASSERT_EQ(0, seg->last_index());
+    ASSERT_TRUE(seg->get(6) == NULL);
+    ASSERT_EQ(0, seg->commit_deferred(deferred[0], 0));
+    ASSERT_EQ(10, seg->last_index());
+    for (int i = 0; i < 10; i++) {
+        braft::LogEntry* entry = seg->get(i+1);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %d", i + 1);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    // A failed write drops the appends after it
+    std::vector<braft::LogEntry*> entries;
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id.term = 1;
+    entry->id.index = 11;
+    entry->data.append("hello");
+    entries.push_back(entry);
+    butil::IOBuf buf;
+    off_t offset = 0;
+    braft::Segment::DeferredAppend* failed = NULL;
+    ASSERT_EQ(1, seg->append_deferred(entries, 0, &buf, &offset, &failed));
+    ASSERT_EQ(-1, seg->commit_deferred(failed, EIO));
+    ASSERT_EQ(10, seg->last_index());
+    ASSERT_EQ(-1, seg->append_deferred(entries, 0, &buf, &offset, &failed));
+    entry->Release();
+
+    ASSERT_EQ(0, seg->close());
+    ASSERT_EQ(0, seg->unlink());
+}
+
+static int count_files(const char* path, const char* prefix) {
+    int count = 0;
+    butil::DirReaderPosix dir_reader(path);
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), prefix, strlen(prefix)) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+TEST_F(LogStorageTest, preallocate_and_recycle_segments) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 4096;
+    braft::FLAGS_raft_preallocate_segments = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    int64_t index = 0;
+    for (int i = 0; i < 100; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 16; j++) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = ++index;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(16, storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+        if (i == 50) {
+            // retire the closed segments, their files are recycled
+            ASSERT_EQ(0, storage->truncate_prefix(index - 10));
+            for (int k = 0; k < 100 && count_files("./data", "log_recycled_") < 4; k++) {
+                usleep(10 * 1000);
+            }
+            ASSERT_EQ(4, count_files("./data", "log_recycled_"));
+        }
+    }
+
+    // open segment is preallocated, closed segments are not
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    for (braft::SegmentLogStorage::SegmentMap::iterator it = segments.begin();
+            it != segments.end(); ++it) {
+        std::string path = "./data/" + it->second->file_name();
+        ASSERT_EQ(it->second->bytes(), file_size(path.c_str()));
+    }
+    std::string open_path = "./data/" + storage->_open_segment->file_name();
+    ASSERT_LE(braft::FLAGS_raft_max_segment_size, file_size(open_path.c_str()));
+    ASSERT_LT(storage->_open_segment->bytes(), file_size(open_path.c_str()));
+    const int64_t first_index = storage->first_log_index();
+    delete storage;
+    delete configuration_manager;
+
+    // the end of log is found in the preallocated open segment
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(first_index, storage->first_log_index());
+    ASSERT_EQ(index, storage->last_log_index());
+    for (int64_t i = first_index; i <= index; i++) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, i);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+    // the preallocated file is kept on load
+    ASSERT_LE(braft::FLAGS_raft_max_segment_size, file_size(open_path.c_str()));
+    const int64_t end = storage->_open_segment->bytes();
+    delete storage;
+    delete configuration_manager;
+
+    // a torn write leaves a header which can't be verified at the tail
+    char garbage[64];
+    memset(garbage, 0x5a, sizeof(garbage));
+    int fd = ::open(open_path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    // keep zeroed room after the torn write however full the segment is
+    ASSERT_EQ(0, ::ftruncate(fd, std::max((int64_t)file_size(open_path.c_str()),
+                                          (int64_t)(end + 4096))));
+    ASSERT_EQ((ssize_t)sizeof(garbage), ::pwrite(fd, garbage, sizeof(garbage), end));
+    ::close(fd);
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(index, storage->last_log_index());
+    ASSERT_EQ(end, storage->_open_segment->bytes());
+    // and it's zeroed
+    fd = ::open(open_path.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ((ssize_t)sizeof(garbage), ::pread(fd, garbage, sizeof(garbage), end));
+    ::close(fd);
+    for (size_t i = 0; i < sizeof(garbage); i++) {
+        ASSERT_EQ(0, garbage[i]);
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_preallocate_segments = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static void corrupt_index_files(const char* path) {
+    butil::DirReaderPosix dir_reader(path);
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), "index_", strlen("index_")) != 0) {
+            continue;
+        }
+        std::string index_path(path);
+        index_path.append("/");
+        index_path.append(dir_reader.name());
+        int fd = ::open(index_path.c_str(), O_RDWR);
+        ASSERT_LE(0, fd);
+        char c = 0;
+        ASSERT_EQ(1, pread(fd, &c, 1, file_size(index_path.c_str()) / 2));
+        c = ~c;
+        ASSERT_EQ(1, pwrite(fd, &c, 1, file_size(index_path.c_str()) / 2));
+        ::close(fd);
+    }
+}
+
+static void check_index_storage(int64_t last_index) {
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t i = 1; i <= last_index; i++) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(i, entry->id.index);
+        ASSERT_EQ((i - 1) / 50 + 1, entry->id.term);
+        ASSERT_EQ((i - 1) / 50 + 1, storage->get_term(i));
+        if (i % 100 == 0) {
+            ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+        } else {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, i);
+            ASSERT_EQ(data_buf, entry->data.to_string());
+        }
+        entry->Release();
+    }
+    braft::ConfigurationEntry conf;
+    configuration_manager->get(last_index, &conf);
+    ASSERT_EQ(last_index / 100 * 100, conf.id.index);
+    configuration_manager->get(150, &conf);
+    ASSERT_EQ(100, conf.id.index);
+    delete storage;
+    delete configuration_manager;
+}
+
+static void append_index_entries(braft::SegmentLogStorage* storage,
+                                 int64_t last_index) {
+    for (int64_t index = 1; index <= last_index; index++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->id.term = (index - 1) / 50 + 1;
+        entry->id.index = index;
+        if (index % 100 == 0) {
+            entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry->peers = new std::vector<braft::PeerId>;
+            entry->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+            entry->peers->push_back(braft::PeerId("1.1.1.1:2000:0"));
+        } else {
+            entry->type = braft::ENTRY_TYPE_DATA;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+        }
+        std::vector<braft::LogEntry*> entries(1, entry);
+        ASSERT_EQ(1, storage->append_entries(entries, NULL));
+        entry->Release();
+    }
+}
+
+TEST_F(LogStorageTest, segment_index) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    bool saved_segment_index = braft::FLAGS_raft_segment_index;
+    braft::FLAGS_raft_max_segment_size = 2048;
+    braft::FLAGS_raft_segment_index = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    const int64_t last_index = 1000;
+    append_index_entries(storage, last_index);
+    const int nsegments = storage->segments().size();
+    ASSERT_LT(1, nsegments);
+    ASSERT_EQ(nsegments, count_files("./data", "index_"));
+    delete storage;
+    delete configuration_manager;
+
+    // closed segments are loaded from the index
+    check_index_storage(last_index);
+    ASSERT_EQ(nsegments, count_files("./data", "index_"));
+
+    // corrupted index is ignored and the segments are scanned
+    corrupt_index_files("./data");
+    check_index_storage(last_index);
+
+    // the index of a truncated segment is removed
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(0, storage->truncate_suffix(last_index / 2));
+    ASSERT_GT(nsegments, count_files("./data", "index_"));
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_segment_index = false;
+    check_index_storage(last_index / 2);
+    braft::FLAGS_raft_segment_index = saved_segment_index;
+
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, load_segments_concurrently) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    int32_t saved_max_segment_loaders = braft::FLAGS_raft_max_segment_loaders;
+    bool saved_segment_index = braft::FLAGS_raft_segment_index;
+    braft::FLAGS_raft_max_segment_size = 1024;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    const int64_t last_index = 2000;
+    append_index_entries(storage, last_index);
+    ASSERT_LT(32, (int)storage->segments().size());
+    delete storage;
+    delete configuration_manager;
+
+    // configurations are merged in log order whatever the number of loaders
+    braft::FLAGS_raft_segment_index = false;
+    const int loaders[] = { 1, 4, 64 };
+    for (size_t i = 0; i < ARRAY_SIZE(loaders); i++) {
+        braft::FLAGS_raft_max_segment_loaders = loaders[i];
+        check_index_storage(last_index);
+    }
+
+    // a bad segment in the middle fails the init
+    braft::SegmentLogStorage::SegmentMap segments;
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    segments = storage->segments();
+    braft::SegmentLogStorage::SegmentMap::iterator it = segments.begin();
+    std::advance(it, segments.size() / 2);
+    std::string path = "./data/" + it->second->file_name();
+    segments.clear();
+    delete storage;
+    delete configuration_manager;
+    ASSERT_EQ(0, truncate_uninterrupted(path.c_str(), file_size(path.c_str()) - 1));
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_NE(0, storage->init(configuration_manager));
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_segment_index = saved_segment_index;
+    braft::FLAGS_raft_max_segment_loaders = saved_max_segment_loaders;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static void append_direct_io_entries(braft::SegmentLogStorage* storage,
+                                     int64_t first_index, int64_t last_index) {
+    for (int64_t index = first_index; index <= last_index; ) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 7 && index <= last_index; j++, index++) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(entries.size(), (size_t)storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            entries[j]->Release();
+        }
+    }
+}
+
+static void check_direct_io_entries(braft::SegmentLogStorage* storage,
+                                    int64_t last_index) {
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t i = storage->first_log_index(); i <= last_index; i++) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, i);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+}
+
+TEST_F(LogStorageTest, direct_io_segments) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 16 * 1024;
+    braft::LogStorage* log_storage =
+            braft::LogStorage::create("local://./data?direct_io=true");
+    ASSERT_TRUE(log_storage);
+    braft::SegmentLogStorage* storage = (braft::SegmentLogStorage*)log_storage;
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_TRUE(storage->_direct_io);
+    append_direct_io_entries(storage, 1, 1000);
+    check_direct_io_entries(storage, 1000);
+
+    // closed segments don't keep the padding
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    ASSERT_LT(1u, segments.size());
+    for (braft::SegmentLogStorage::SegmentMap::iterator it = segments.begin();
+            it != segments.end(); ++it) {
+        std::string path = "./data/" + it->second->file_name();
+        ASSERT_EQ(it->second->bytes(), file_size(path.c_str()));
+    }
+    segments.clear();
+
+    // truncate in the middle of a block and append again
+    ASSERT_EQ(0, storage->truncate_suffix(995));
+    append_direct_io_entries(storage, 996, 1100);
+    check_direct_io_entries(storage, 1100);
+    delete storage;
+    delete configuration_manager;
+
+    // the zero padding of the open segment is dropped on load
+    log_storage = braft::LogStorage::create("local://./data?direct_io=true");
+    storage = (braft::SegmentLogStorage*)log_storage;
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_direct_io_entries(storage, 1100);
+    append_direct_io_entries(storage, 1101, 1200);
+    check_direct_io_entries(storage, 1200);
+    delete storage;
+    delete configuration_manager;
+
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    check_direct_io_entries(storage, 1200);
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static void check_range_entries(braft::LogStorage* storage, int64_t first_index,
+                                int64_t last_index, size_t max_bytes) {
+    int64_t index = first_index;
+    while (index <= last_index) {
+        std::vector<braft::LogEntry*> entries;
+        const int n = storage->get_entries(index, last_index, max_bytes, &entries);
+        ASSERT_LT(0, n);
+        ASSERT_EQ((size_t)n, entries.size());
+        size_t bytes = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            ASSERT_EQ(index, entries[i]->id.index);
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            ASSERT_EQ(data_buf, entries[i]->data.to_string());
+            // The last entry is the only one over the budget
+            ASSERT_LT(bytes, max_bytes + 1);
+            bytes += entries[i]->data.length();
+            entries[i]->Release();
+            ++index;
+        }
+    }
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(0, storage->get_entries(last_index + 1, last_index + 10,
+                                      max_bytes, &entries));
+}
+
+TEST_F(LogStorageTest, get_entries) {
+    ::system("rm -rf data");
+    int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 16 * 1024;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    append_direct_io_entries(storage, 1, 1000);
+    ASSERT_LT(1u, storage->segments().size());
+
+    // Ranges across segments and the open segment, read by pread and mmap
+    for (int i = 0; i < 2; ++i) {
+        braft::FLAGS_raft_mmap_closed_segments = (i == 1);
+        check_range_entries(storage, 1, 1000, 1024 * 1024);
+        check_range_entries(storage, 1, 1000, 4096);
+        check_range_entries(storage, 333, 777, 1);
+    }
+    braft::FLAGS_raft_mmap_closed_segments = false;
+
+    ASSERT_EQ(0, storage->truncate_prefix(500));
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(0, storage->get_entries(499, 1000, 1024 * 1024, &entries));
+    check_range_entries(storage, 500, 1000, 4096);
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, segment_meta_index) {
+    braft::SegmentMetaIndex index;
+    ASSERT_EQ(0u, index.size());
+    int64_t offset = 0;
+    size_t length = 0;
+    int64_t term = 0;
+    ASSERT_EQ(-1, index.get(0, &offset, &length, &term));
+
+    // entry i takes 24 + i % 100 bytes, term changes every 1000 entries
+    const size_t n = 100000;
+    int64_t end = 0;
+    for (size_t i = 0; i < n; ++i) {
+        end += 24 + i % 100;
+        index.append(i / 1000 + 1, end);
+    }
+    ASSERT_EQ(n, index.size());
+    ASSERT_EQ(100u, index.nrun());
+    int64_t expected_offset = 0;
+    for (size_t i = 0; i < n; ++i) {
+        ASSERT_EQ(0, index.get(i, &offset, &length, &term));
+        ASSERT_EQ(expected_offset, offset);
+        ASSERT_EQ(24 + i % 100, length);
+        ASSERT_EQ((int64_t)(i / 1000 + 1), term);
+        ASSERT_EQ(offset, index.offset(i));
+        expected_offset += length;
+    }
+    ASSERT_EQ(end, index.offset(n));
+    ASSERT_EQ(-1, index.get(n, &offset, &length, &term));
+    // far less than a pair of int64_t per entry
+    ASSERT_LT(index.memory_usage(), n * 8);
+
+    // truncate in the middle of a run and append with a new term
+    index.truncate(1500);
+    ASSERT_EQ(1500u, index.size());
+    ASSERT_EQ(2u, index.nrun());
+    ASSERT_EQ(-1, index.get(1500, &offset, &length, &term));
+    end = index.offset(1500);
+    index.append(10, end + 50);
+    ASSERT_EQ(0, index.get(1499, &offset, &length, &term));
+    ASSERT_EQ(2, term);
+    ASSERT_EQ(0, index.get(1500, &offset, &length, &term));
+    ASSERT_EQ(end, offset);
+    ASSERT_EQ(50u, length);
+    ASSERT_EQ(10, term);
+    ASSERT_EQ(3u, index.nrun());
+
+    braft::SegmentMetaIndex other;
+    other.swap(index);
+    ASSERT_EQ(0u, index.size());
+    ASSERT_EQ(1501u, other.size());
+    ASSERT_EQ(0, other.get(1500, &offset, &length, &term));
+    ASSERT_EQ(10, term);
+}
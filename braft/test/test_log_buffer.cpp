@@ -0,0 +1,132 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include <bthread/bthread.h>
+#include "braft/log_buffer.h"
+
+class MemoryLogBufferTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+static braft::LogEntry* new_entry(int64_t index, int64_t term) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id = braft::LogId(index, term);
+    return entry;
+}
+
+static void release_all(std::vector<braft::LogEntry*>* entries) {
+    for (size_t i = 0; i < entries->size(); ++i) {
+        (*entries)[i]->Release();
+    }
+    entries->clear();
+}
+
+TEST_F(MemoryLogBufferTest, push_and_pop) {
+    braft::MemoryLogBuffer buf;
+    ASSERT_TRUE(buf.empty());
+    ASSERT_TRUE(buf.get(1) == NULL);
+    ASSERT_EQ(0, buf.get_term(1));
+
+    // Grows over the initial capacity of the ring
+    for (int64_t index = 10; index < 5000; ++index) {
+        buf.push_back(new_entry(index, index / 100 + 1));
+    }
+    ASSERT_EQ(4990u, buf.size());
+    ASSERT_EQ(10, buf.first_index());
+    ASSERT_EQ(4999, buf.last_index());
+    ASSERT_EQ(10, buf.front()->id.index);
+    ASSERT_EQ(4999, buf.back()->id.index);
+    for (int64_t index = 10; index < 5000; ++index) {
+        braft::LogEntry* entry = buf.get(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index, entry->id.index);
+        ASSERT_EQ(index / 100 + 1, buf.get_term(index));
+        entry->Release();
+    }
+    ASSERT_TRUE(buf.get(9) == NULL);
+    ASSERT_TRUE(buf.get(5000) == NULL);
+
+    std::vector<braft::LogEntry*> released;
+    buf.pop_front(90, &released);
+    ASSERT_EQ(100, buf.first_index());
+    ASSERT_TRUE(buf.get(99) == NULL);
+    buf.pop_back(1000, &released);
+    ASSERT_EQ(3999, buf.last_index());
+    ASSERT_TRUE(buf.at(4000) == NULL);
+
+    buf.push_back(new_entry(4000, 100));
+    ASSERT_EQ(100, buf.get_term(4000));
+    buf.clear(&released);
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(0u, buf.size());
+    // Nothing is reading, so everything removed is released after the
+    // writer has advanced twice
+    buf.clear(&released);
+    ASSERT_EQ(4991u, released.size());
+    release_all(&released);
+
+    buf.push_back(new_entry(1, 1));
+    ASSERT_EQ(1, buf.first_index());
+    ASSERT_EQ(1u, buf.size());
+}
+
+struct ReaderArg {
+    braft::MemoryLogBuffer* buf;
+    butil::atomic<bool>* stop;
+    butil::atomic<int64_t>* last_index;
+};
+
+static void* read_thread(void* arg) {
+    ReaderArg* ra = (ReaderArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t last_index = ra->last_index->load(butil::memory_order_acquire);
+        for (int64_t index = last_index; index > last_index - 100 && index > 0;
+                --index) {
+            braft::LogEntry* entry = ra->buf->get(index);
+            if (entry) {
+                EXPECT_EQ(index, entry->id.index);
+                EXPECT_EQ(index, entry->id.term);
+                entry->Release();
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(MemoryLogBufferTest, concurrent_read) {
+    braft::MemoryLogBuffer buf;
+    butil::atomic<bool> stop(false);
+    butil::atomic<int64_t> last_index(0);
+    ReaderArg arg = { &buf, &stop, &last_index };
+    bthread_t tids[4];
+    for (size_t i = 0; i < ARRAY_SIZE(tids); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&tids[i], NULL, read_thread, &arg));
+    }
+    std::vector<braft::LogEntry*> released;
+    for (int64_t index = 1; index <= 100000; ++index) {
+        buf.push_back(new_entry(index, index));
+        last_index.store(index, butil::memory_order_release);
+        if (index % 64 == 0) {
+            buf.pop_front(buf.size() / 2, &released);
+            release_all(&released);
+        }
+        if (index % 1000 == 0) {
+            buf.pop_back(10, &released);
+            release_all(&released);
+            for (int64_t i = buf.last_index() + 1; i <= index; ++i) {
+                buf.push_back(new_entry(i, i));
+            }
+        }
+    }
+    stop.store(true);
+    for (size_t i = 0; i < ARRAY_SIZE(tids); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    buf.clear(&released);
+    release_all(&released);
+}
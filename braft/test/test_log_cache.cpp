@@ -0,0 +1,105 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include "braft/log_cache.h"
+
+namespace braft {
+DECLARE_int32(raft_log_cache_max_bytes);
+DECLARE_int32(raft_log_cache_shards);
+}
+
+class LogEntryCacheTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_log_cache_max_bytes = 4 * 1024 * 1024;
+        braft::FLAGS_raft_log_cache_shards = 4;
+    }
+    void TearDown() {
+        braft::FLAGS_raft_log_cache_max_bytes = 8 * 1024 * 1024;
+        braft::FLAGS_raft_log_cache_shards = 16;
+    }
+};
+
+static braft::LogEntry* new_entry(int64_t index, size_t size) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id = braft::LogId(index, 1);
+    entry->data.resize(size, 'a');
+    return entry;
+}
+
+TEST_F(LogEntryCacheTest, get_and_put) {
+    braft::LogEntryCache cache;
+    for (int64_t index = 1; index <= 100; ++index) {
+        braft::LogEntry* entry = new_entry(index, 100);
+        cache.put(entry, cache.version());
+        entry->Release();
+    }
+    for (int64_t index = 1; index <= 100; ++index) {
+        braft::LogEntry* entry = cache.get(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index, entry->id.index);
+        ASSERT_EQ(100u, entry->data.length());
+        entry->Release();
+    }
+    ASSERT_TRUE(cache.get(101) == NULL);
+
+    cache.truncate_prefix(51);
+    ASSERT_TRUE(cache.get(50) == NULL);
+    braft::LogEntry* entry = cache.get(51);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+
+    // Entries read before truncate_suffix are not cached
+    const int64_t version = cache.version();
+    cache.truncate_suffix(80);
+    ASSERT_TRUE(cache.get(81) == NULL);
+    entry = cache.get(80);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+    entry = new_entry(90, 100);
+    cache.put(entry, version);
+    ASSERT_TRUE(cache.get(90) == NULL);
+    cache.put(entry, cache.version());
+    entry->Release();
+    entry = cache.get(90);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+
+    cache.clear();
+    ASSERT_TRUE(cache.get(51) == NULL);
+    ASSERT_TRUE(cache.get(90) == NULL);
+}
+
+TEST_F(LogEntryCacheTest, evict_lru) {
+    braft::FLAGS_raft_log_cache_max_bytes = 4 * 64 * 1024;
+    braft::LogEntryCache cache;
+    // Each shard holds less than 4 entries of 16K
+    for (int64_t index = 1; index <= 16; ++index) {
+        braft::LogEntry* entry = new_entry(index, 16 * 1024);
+        cache.put(entry, cache.version());
+        entry->Release();
+        if (index > 4) {
+            // Keep the first entry of the shard hot
+            braft::LogEntry* hot = cache.get(4);
+            ASSERT_TRUE(hot != NULL);
+            hot->Release();
+        }
+    }
+    braft::LogEntry* entry = cache.get(4);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+    entry = cache.get(16);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+    ASSERT_TRUE(cache.get(8) == NULL);
+    ASSERT_TRUE(cache.get(1) == NULL);
+
+    // Entries larger than a shard are never cached
+    entry = new_entry(17, 128 * 1024);
+    cache.put(entry, cache.version());
+    entry->Release();
+    ASSERT_TRUE(cache.get(17) == NULL);
+}
@@ -14,6 +14,11 @@
 #include "braft/configuration.h"
 #include "braft/log.h"
 
+namespace braft {
+DECLARE_int64(raft_max_memory_log_bytes);
+DECLARE_bool(raft_pipeline_log_sync);
+}
+
 class LogManagerTest : public testing::Test {
 protected:
     LogManagerTest() {}
@@ -681,3 +686,106 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+TEST_F(LogManagerTest, evict_memory_logs_over_budget) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    const size_t N = 100;
+    for (int round = 0; round < 2; ++round) {
+        // No limit in the first round
+        braft::FLAGS_raft_max_memory_log_bytes = round == 0 ? 0 : 10 * 1024;
+        std::vector<braft::LogEntry*> entries;
+        for (size_t i = 0; i < N; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->data.resize(1024, 'a');
+            entry->id = braft::LogId(round * N + i + 1, 1);
+            entries.push_back(entry);
+        }
+        SyncClosure sc;
+        lm->append_entries(&entries, &sc);
+        sc.join();
+        ASSERT_TRUE(sc.status().ok()) << sc.status();
+        // Wait set_disk_id to be called
+        usleep(100 * 1000l);
+        if (round == 0) {
+            ASSERT_EQ(N, lm->_logs_in_memory.size());
+            ASSERT_LT(N * 1024, (size_t)lm->_logs_in_memory.bytes());
+            // Entries kept in memory after they are on disk don't count
+            ASSERT_EQ(0, lm->_bytes_not_on_disk.load());
+            braft::FLAGS_raft_max_memory_log_bytes = 10 * 1024;
+            ASSERT_FALSE(lm->memory_log_full());
+        } else {
+            // Nothing is applied, the entries on disk are evicted anyway
+            ASSERT_EQ(0u, lm->_logs_in_memory.size());
+            ASSERT_EQ(0, lm->_logs_in_memory.bytes());
+            ASSERT_EQ(0, lm->_bytes_not_on_disk.load());
+            ASSERT_FALSE(lm->memory_log_full());
+        }
+    }
+    for (size_t i = 0; i < 2 * N; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i + 1);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(1024u, entry->data.length());
+        entry->Release();
+    }
+    braft::FLAGS_raft_max_memory_log_bytes = 0;
+}
+
+TEST_F(LogManagerTest, pipelined_sync) {
+    system("rm -rf ./data");
+    braft::FLAGS_raft_pipeline_log_sync = true;
+    {
+        scoped_ptr<braft::ConfigurationManager> cm(
+                                    new braft::ConfigurationManager);
+        scoped_ptr<braft::SegmentLogStorage> storage(
+                                    new braft::SegmentLogStorage("./data"));
+        scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+        braft::LogManagerOptions opt;
+        opt.log_storage = storage.get();
+        opt.configuration_manager = cm.get();
+        ASSERT_EQ(0, lm->init(opt));
+        const size_t N = 1000;
+        int64_t expected_next_log_index = 1;
+        for (size_t i = 0; i < N; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry;
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            std::string buf;
+            butil::string_printf(&buf, "hello_%lu", i + 1);
+            entry->data.append(buf);
+            entry->id = braft::LogId(i + 1, 1);
+            std::vector<braft::LogEntry*> entries;
+            entries.push_back(entry);
+            // Closures are run in order even though the batches are synced
+            // in another bthread
+            StuckClosure* c = new StuckClosure;
+            c->_expected_next_log_index = &expected_next_log_index;
+            lm->append_entries(&entries, c);
+        }
+        ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+        // Wait set_disk_id to be called
+        usleep(100 * 1000l);
+        ASSERT_EQ((int64_t)N + 1, expected_next_log_index);
+        lm->set_applied_id(braft::LogId(N, 1));
+        ASSERT_EQ(0u, lm->_logs_in_memory.size());
+        for (size_t i = 0; i < N; ++i) {
+            braft::LogEntry* entry = lm->get_entry(i + 1);
+            ASSERT_TRUE(entry != NULL);
+            std::string buf;
+            butil::string_printf(&buf, "hello_%lu", i + 1);
+            ASSERT_EQ(buf, entry->data.to_string());
+            entry->Release();
+        }
+    }
+    braft::FLAGS_raft_pipeline_log_sync = false;
+}
@@ -0,0 +1,213 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/file_util.h>
+#include <butil/files/dir_reader_posix.h>
+#include <butil/string_printf.h>
+#include <butil/logging.h>
+#include "braft/merged_log.h"
+#include "braft/configuration.h"
+
+namespace braft {
+extern void global_init_once_or_die();
+DECLARE_int32(raft_merged_log_file_size);
+}
+
+class MergedLogTest : public testing::Test {
+protected:
+    void SetUp() {
+        braft::FLAGS_raft_sync = false;
+        GFLAGS_NS::SetCommandLineOption("minloglevel", "3");
+        braft::global_init_once_or_die();
+    }
+    void TearDown() {
+        braft::FLAGS_raft_merged_log_file_size = 64 * 1024 * 1024;
+    }
+};
+
+static braft::LogEntry* new_entry(int64_t index, int64_t term, const char* group) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->id = braft::LogId(index, term);
+    if (index % 10 == 0) {
+        entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+        entry->peers = new std::vector<braft::PeerId>;
+        entry->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+        entry->peers->push_back(braft::PeerId("1.1.1.1:2000:0"));
+    } else {
+        entry->type = braft::ENTRY_TYPE_DATA;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "%s: hello, world: %" PRId64,
+                 group, index);
+        entry->data.append(data_buf);
+    }
+    return entry;
+}
+
+static void check_entry(braft::LogStorage* storage, int64_t index, int64_t term,
+                        const char* group) {
+    braft::LogEntry* entry = storage->get_entry(index);
+    ASSERT_TRUE(entry != NULL) << group << " index: " << index;
+    ASSERT_EQ(index, entry->id.index);
+    ASSERT_EQ(term, entry->id.term);
+    ASSERT_EQ(term, storage->get_term(index));
+    if (index % 10 == 0) {
+        ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+        ASSERT_EQ(2u, entry->peers->size());
+    } else {
+        ASSERT_EQ(braft::ENTRY_TYPE_DATA, entry->type);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "%s: hello, world: %" PRId64,
+                 group, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+    }
+    entry->Release();
+}
+
+static size_t count_merged_files(const std::string& path) {
+    size_t count = 0;
+    butil::DirReaderPosix dir_reader(path.c_str());
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), "merged_log_", 11) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+// Open the storages again on a new MergedLogImpl, which replays the merged
+// log as a restarted process does
+static void restart(braft::MergedLogStorage* storages[], size_t n,
+                    const std::string& path, braft::ConfigurationManager cms[]) {
+    scoped_refptr<braft::MergedLogImpl> impl = new braft::MergedLogImpl(path);
+    for (size_t i = 0; i < n; ++i) {
+        storages[i]->_impl = impl;
+        cms[i] = braft::ConfigurationManager();
+        ASSERT_EQ(0, storages[i]->init(&cms[i]));
+    }
+}
+
+TEST_F(MergedLogTest, append_and_restart) {
+    ::system("rm -rf data_merged_append");
+    const char* groups[] = { "group_a", "group_b" };
+    braft::MergedLogStorage* storages[2];
+    braft::ConfigurationManager cms[2];
+    for (size_t i = 0; i < 2; ++i) {
+        std::string uri("local-merged://data_merged_append?group=");
+        uri.append(groups[i]);
+        storages[i] = (braft::MergedLogStorage*)braft::LogStorage::create(uri);
+        ASSERT_TRUE(storages[i]);
+        ASSERT_EQ(0, storages[i]->init(&cms[i]));
+        ASSERT_EQ(1, storages[i]->first_log_index());
+        ASSERT_EQ(0, storages[i]->last_log_index());
+    }
+    ASSERT_FALSE(braft::LogStorage::create("local-merged://data_merged_append"));
+
+    // Interleave the appends of the groups, group_b has twice the entries
+    for (int64_t index = 1; index <= 200; ++index) {
+        for (size_t i = 0; i < 2; ++i) {
+            if (i == 0 && index > 100) {
+                continue;
+            }
+            braft::LogEntry* entry = new_entry(index, (index - 1) / 30 + 1, groups[i]);
+            ASSERT_EQ(0, storages[i]->append_entry(entry));
+            entry->Release();
+        }
+    }
+    // Append a batch
+    std::vector<braft::LogEntry*> entries;
+    for (int64_t index = 101; index <= 150; ++index) {
+        entries.push_back(new_entry(index, (index - 1) / 30 + 1, groups[0]));
+    }
+    ASSERT_EQ(50, storages[0]->append_entries(entries, NULL));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+
+    for (int round = 0; round < 2; ++round) {
+        ASSERT_EQ(150, storages[0]->last_log_index());
+        ASSERT_EQ(200, storages[1]->last_log_index());
+        for (size_t i = 0; i < 2; ++i) {
+            ASSERT_EQ(1, storages[i]->first_log_index());
+            for (int64_t index = 1; index <= storages[i]->last_log_index(); ++index) {
+                check_entry(storages[i], index, (index - 1) / 30 + 1, groups[i]);
+            }
+            ASSERT_TRUE(storages[i]->get_entry(storages[i]->last_log_index() + 1) == NULL);
+        }
+        ASSERT_EQ(150, cms[0].last_configuration().id.index);
+        ASSERT_EQ(200, cms[1].last_configuration().id.index);
+        restart(storages, 2, "data_merged_append", cms);
+    }
+
+    // Truncate and reset are replayed in order
+    ASSERT_EQ(0, storages[0]->truncate_suffix(120));
+    ASSERT_EQ(0, storages[1]->reset(500));
+    braft::LogEntry* entry = new_entry(121, 10, groups[0]);
+    ASSERT_EQ(0, storages[0]->append_entry(entry));
+    entry->Release();
+    restart(storages, 2, "data_merged_append", cms);
+    ASSERT_EQ(121, storages[0]->last_log_index());
+    check_entry(storages[0], 121, 10, groups[0]);
+    check_entry(storages[0], 120, 4, groups[0]);
+    ASSERT_EQ(120, cms[0].last_configuration().id.index);
+    ASSERT_EQ(500, storages[1]->first_log_index());
+    ASSERT_EQ(499, storages[1]->last_log_index());
+    ASSERT_TRUE(cms[1].last_configuration().empty());
+
+    for (size_t i = 0; i < 2; ++i) {
+        delete storages[i];
+    }
+}
+
+TEST_F(MergedLogTest, truncate_prefix_and_gc) {
+    ::system("rm -rf data_merged_gc");
+    braft::FLAGS_raft_merged_log_file_size = 4096;
+    const char* groups[] = { "group_a", "group_b" };
+    braft::MergedLogStorage* storages[2];
+    braft::ConfigurationManager cms[2];
+    for (size_t i = 0; i < 2; ++i) {
+        std::string uri("local-merged://data_merged_gc?group=");
+        uri.append(groups[i]);
+        storages[i] = (braft::MergedLogStorage*)braft::LogStorage::create(uri);
+        ASSERT_TRUE(storages[i]);
+        ASSERT_EQ(0, storages[i]->init(&cms[i]));
+    }
+    for (int64_t index = 1; index <= 500; ++index) {
+        for (size_t i = 0; i < 2; ++i) {
+            braft::LogEntry* entry = new_entry(index, 1, groups[i]);
+            ASSERT_EQ(0, storages[i]->append_entry(entry));
+            entry->Release();
+        }
+    }
+    const size_t nfiles = count_merged_files("data_merged_gc");
+    ASSERT_GT(nfiles, 10u);
+
+    // Files are kept while any of the groups needs them
+    ASSERT_EQ(0, storages[0]->truncate_prefix(400));
+    ASSERT_EQ(400, storages[0]->first_log_index());
+    ASSERT_TRUE(storages[0]->get_entry(399) == NULL);
+    ASSERT_EQ(nfiles, count_merged_files("data_merged_gc"));
+    ASSERT_EQ(0, storages[1]->truncate_prefix(400));
+    ASSERT_LT(count_merged_files("data_merged_gc"), nfiles / 2);
+
+    restart(storages, 2, "data_merged_gc", cms);
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ(400, storages[i]->first_log_index());
+        ASSERT_EQ(500, storages[i]->last_log_index());
+        for (int64_t index = 400; index <= 500; ++index) {
+            check_entry(storages[i], index, 1, groups[i]);
+        }
+    }
+
+    // A dropped group doesn't pin any file
+    ASSERT_EQ(0, storages[0]->_impl->drop_group("group_b"));
+    ASSERT_EQ(0, storages[0]->truncate_prefix(501));
+    ASSERT_EQ(1u, count_merged_files("data_merged_gc"));
+    restart(storages, 1, "data_merged_gc", cms);
+    ASSERT_EQ(501, storages[0]->first_log_index());
+    ASSERT_EQ(500, storages[0]->last_log_index());
+
+    for (size_t i = 0; i < 2; ++i) {
+        delete storages[i];
+    }
+}
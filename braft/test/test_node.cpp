@@ -16,6 +16,7 @@
 #include <brpc/closure_guard.h>
 #include <bthread/bthread.h>
 #include <bthread/countdown_event.h>
+#include <bvar/bvar.h>
 #include "../test/util.h"
 
 namespace braft {
@@ -3566,6 +3567,334 @@ TEST_P(NodeTest, readonly) {
     cluster.stop_all();
 }
 
+static int64_t exposed_value(const std::string& name) {
+    return strtoll(bvar::Variable::describe_exposed(name).c_str(), NULL, 10);
+}
+
+TEST_P(NodeTest, coalesced_heartbeats) {
+    GFLAGS_NS::SetCommandLineOption("raft_coalesce_heartbeats", "true");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // start cluster
+    Cluster cluster("unittest", peers, 1000);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_term = leader->_impl->_current_term;
+    const int64_t saved_rpc_count =
+            exposed_value("raft_coalesced_heartbeat_rpc_count");
+
+    // The batched heartbeats keep the leader for several election timeouts
+    usleep(3000 * 1000);
+    cluster.wait_leader();
+    ASSERT_EQ(leader, cluster.leader());
+    ASSERT_EQ(saved_term, leader->_impl->_current_term);
+    ASSERT_LT(saved_rpc_count,
+              exposed_value("raft_coalesced_heartbeat_rpc_count"));
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    // Stopping the replicator cancels its batched heartbeat
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    const braft::PeerId removed = followers[0]->node_id().peer_id;
+    cond.reset(1);
+    leader->remove_peer(removed, NEW_REMOVEPEERCLOSURE(&cond, 0));
+    cond.wait();
+    cluster.stop(removed.addr);
+
+    cond.reset(10);
+    for (int i = 10; i < 20; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    ASSERT_EQ(leader, cluster.leader());
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_coalesce_heartbeats", "false");
+}
+
+TEST_P(NodeTest, batched_append_entries) {
+    GFLAGS_NS::SetCommandLineOption("raft_batch_append_entries", "true");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_rpc_count =
+            exposed_value("raft_batch_append_entries_rpc_count");
+
+    bthread::CountdownEvent cond(100);
+    for (int i = 0; i < 100; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    ASSERT_LT(saved_rpc_count,
+              exposed_value("raft_batch_append_entries_rpc_count"));
+
+    // Batches responded before the requests in them are done are retried
+    GFLAGS_NS::SetCommandLineOption("raft_batch_append_entries_max_wait_ms", "1");
+    cond.reset(100);
+    for (int i = 100; i < 200; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    GFLAGS_NS::SetCommandLineOption("raft_batch_append_entries_max_wait_ms", "50");
+
+    // Stopping the replicator cancels its batched requests
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    const braft::PeerId removed = followers[0]->node_id().peer_id;
+    cond.reset(1);
+    leader->remove_peer(removed, NEW_REMOVEPEERCLOSURE(&cond, 0));
+    cond.wait();
+    cluster.stop(removed.addr);
+
+    cond.reset(10);
+    for (int i = 200; i < 210; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_batch_append_entries", "false");
+}
+
+TEST_P(NodeTest, relayed_replication_in_chain) {
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "1");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_relayed = exposed_value("raft_relayed_entries_count");
+    const int64_t saved_fetched =
+            exposed_value("raft_relayed_entries_fetched_bytes");
+
+    bthread::CountdownEvent cond(100);
+    for (int i = 0; i < 100; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    // Some of the followers got the data from the others
+    ASSERT_LT(saved_relayed, exposed_value("raft_relayed_entries_count"));
+    ASSERT_LT(saved_fetched,
+              exposed_value("raft_relayed_entries_fetched_bytes"));
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "0");
+}
+
+TEST_P(NodeTest, relayed_replication_in_tree) {
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "2");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 5; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+    const int64_t saved_relayed = exposed_value("raft_relayed_entries_count");
+    const int64_t saved_fetched =
+            exposed_value("raft_relayed_entries_fetched_bytes");
+
+    bthread::CountdownEvent cond(100);
+    for (int i = 0; i < 100; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    // Some of the followers got the data from the others
+    ASSERT_LT(saved_relayed, exposed_value("raft_relayed_entries_count"));
+    ASSERT_LT(saved_fetched,
+              exposed_value("raft_relayed_entries_fetched_bytes"));
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "0");
+}
+
+TEST_P(NodeTest, relayed_replication_with_failing_relay) {
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "1");
+    std::vector<braft::PeerId> peers;
+    for (int i = 0; i < 3; i++) {
+        braft::PeerId peer;
+        peer.addr.ip = butil::my_ip();
+        peer.addr.port = 5006 + i;
+        peer.idx = 0;
+        peers.push_back(peer);
+    }
+    // start cluster
+    Cluster cluster("unittest", peers);
+    for (size_t i = 0; i < peers.size(); i++) {
+        ASSERT_EQ(0, cluster.start(peers[i].addr));
+    }
+    cluster.wait_leader();
+    braft::Node* leader = cluster.leader();
+    ASSERT_TRUE(leader != NULL);
+
+    bthread::CountdownEvent cond(10);
+    for (int i = 0; i < 10; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    // In a chain the follower with the smaller id relays to the other one,
+    // which has to get the entries from the leader once the relay is down
+    std::vector<braft::Node*> followers;
+    cluster.followers(&followers);
+    ASSERT_EQ(2u, followers.size());
+    braft::PeerId relay = followers[0]->node_id().peer_id;
+    if (followers[1]->node_id().peer_id < relay) {
+        relay = followers[1]->node_id().peer_id;
+    }
+    cluster.stop(relay.addr);
+
+    // The other follower is needed for the quorum, these are committed only
+    // if it falls back to the leader
+    cond.reset(100);
+    for (int i = 10; i < 110; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+    ASSERT_EQ(leader, cluster.leader());
+
+    // The relay comes back and catches up
+    ASSERT_EQ(0, cluster.start(relay.addr));
+    cond.reset(10);
+    for (int i = 110; i < 120; i++) {
+        butil::IOBuf data;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello: %d", i + 1);
+        data.append(data_buf);
+        braft::Task task;
+        task.data = &data;
+        task.done = NEW_APPLYCLOSURE(&cond, 0);
+        leader->apply(task);
+    }
+    cond.wait();
+    cluster.ensure_same();
+
+    cluster.stop_all();
+    GFLAGS_NS::SetCommandLineOption("raft_replication_fanout", "0");
+}
+
 INSTANTIATE_TEST_CASE_P(NodeTestWithoutPipelineReplication,
                         NodeTest,
                         ::testing::Values("NoReplcation"));
@@ -0,0 +1,136 @@
+// Copyright (c) 2015 Baidu.com, Inc. All Rights Reserved
+
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include "braft/replicator.h"
+
+class CatchupTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(CatchupTest, scheduler_counts_healthy_followers) {
+    // Five peers, the leader and four followers
+    braft::CatchupScheduler scheduler;
+    for (int i = 0; i < 4; ++i) {
+        scheduler.add_replicator(false);
+    }
+    // Nobody answered yet
+    ASSERT_FALSE(scheduler.can_throttle());
+
+    // Two followers are up to date, the leader and them form the quorum
+    scheduler.remove_replicator(false);
+    scheduler.add_replicator(true);
+    ASSERT_FALSE(scheduler.can_throttle());
+    scheduler.remove_replicator(false);
+    scheduler.add_replicator(true);
+    ASSERT_TRUE(scheduler.can_throttle());
+
+    // One of them goes down while another one is catching up, throttling it
+    // would stall the commits
+    scheduler.remove_replicator(true);
+    scheduler.add_replicator(false);
+    ASSERT_FALSE(scheduler.can_throttle());
+
+    // It comes back
+    scheduler.remove_replicator(false);
+    scheduler.add_replicator(true);
+    ASSERT_TRUE(scheduler.can_throttle());
+
+    // The quorum follows the removed followers, a healthy one is removed
+    // and the leader and the other one don't form the quorum of four peers
+    scheduler.remove_replicator(true);
+    ASSERT_FALSE(scheduler.can_throttle());
+    // They do form the one of three peers once a follower catching up or down
+    // is removed
+    scheduler.remove_replicator(false);
+    ASSERT_TRUE(scheduler.can_throttle());
+}
+
+TEST_F(CatchupTest, bandwidth_token_bucket) {
+    braft::CatchupBandwidth bandwidth;
+    const int64_t rate = 1000;  // bytes per second
+    int64_t now_us = 1000000;
+
+    // No limit
+    ASSERT_EQ(0, bandwidth.acquire(0, now_us));
+
+    // Starts full, requests are sent as long as there are tokens left
+    ASSERT_EQ(0, bandwidth.acquire(rate, now_us));
+    bandwidth.consume(600);
+    ASSERT_EQ(0, bandwidth.acquire(rate, now_us));
+    // Running into debt
+    bandwidth.consume(1400);
+    // 1000 bytes in debt, wait for one second
+    ASSERT_EQ(1001, bandwidth.acquire(rate, now_us));
+
+    // Refilled by the elapsed time
+    now_us += 500 * 1000;
+    ASSERT_EQ(501, bandwidth.acquire(rate, now_us));
+    now_us += 501 * 1000;
+    ASSERT_EQ(0, bandwidth.acquire(rate, now_us));
+
+    // Bursts for one second at most
+    now_us += 10 * 1000 * 1000;
+    ASSERT_EQ(0, bandwidth.acquire(rate, now_us));
+    bandwidth.consume(rate);
+    ASSERT_EQ(1, bandwidth.acquire(rate, now_us));
+
+    // Time going backwards refills nothing
+    ASSERT_EQ(1, bandwidth.acquire(rate, now_us - 1000 * 1000));
+}
+
+class AppendEntriesWindowTest : public testing::Test {
+protected:
+    void SetUp() {}
+    void TearDown() {}
+};
+
+TEST_F(AppendEntriesWindowTest, grow_and_shrink) {
+    braft::AppendEntriesWindow window(1024, 16 * 1024);
+    ASSERT_EQ(1024, window.window());
+
+    // Responses without a valid RTT are ignored
+    window.on_acked(1024, 0);
+    ASSERT_EQ(1024, window.window());
+    ASSERT_EQ(0, window.min_rtt_us());
+
+    // Grows by the acknowledged bytes while the RTT stays low, up to the max
+    window.on_acked(1024, 1000);
+    ASSERT_EQ(1000, window.min_rtt_us());
+    ASSERT_EQ(2048, window.window());
+    window.on_acked(2048, 1500);
+    ASSERT_EQ(4096, window.window());
+    for (int i = 0; i < 100; ++i) {
+        window.on_acked(window.window(), 1000);
+    }
+    ASSERT_EQ(16 * 1024, window.window());
+
+    // Shrinks by a quarter once the RTT is beyond twice the minimum
+    window.on_acked(1024, 2500);
+    ASSERT_EQ(12 * 1024, window.window());
+    for (int i = 0; i < 20; ++i) {
+        window.on_acked(1024, 10000);
+    }
+    ASSERT_EQ(1024, window.window());
+    // The minimum RTT drifts up with the slow responses, and stays below them
+    ASSERT_LT(1000, window.min_rtt_us());
+    ASSERT_GT(10000, window.min_rtt_us());
+
+    // A faster response resets the minimum RTT
+    window.on_acked(1024, 500);
+    ASSERT_EQ(500, window.min_rtt_us());
+    ASSERT_EQ(2048, window.window());
+
+    // Halved on loss, not below the min
+    for (int i = 0; i < 100; ++i) {
+        window.on_acked(window.window(), 500);
+    }
+    window.on_lost();
+    ASSERT_EQ(8 * 1024, window.window());
+    for (int i = 0; i < 10; ++i) {
+        window.on_lost();
+    }
+    ASSERT_EQ(1024, window.window());
+}
@@ -5,6 +5,7 @@
 
 #include <gtest/gtest.h>
 #include "braft/storage.h"
+#include "braft/log.h"
 
 namespace braft {
 extern void global_init_once_or_die();
@@ -81,3 +82,81 @@ TEST_F(StorageTest, extra_space_should_be_trimmed) {
     entry->Release();
     entry = NULL;
 }
+
+TEST_F(StorageTest, log_storage_checksum_in_uri) {
+    braft::ConfigurationManager cm;
+    braft::LogStorage* log_storage =
+            braft::LogStorage::create("local://data/log?checksum=murmurhash32");
+    ASSERT_TRUE(log_storage);
+    ASSERT_EQ(0, log_storage->init(&cm));
+    ASSERT_EQ(0, ((braft::SegmentLogStorage*)log_storage)->_checksum_type);
+    ASSERT_EQ("data/log", ((braft::SegmentLogStorage*)log_storage)->_path);
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->data.append("hello world");
+    entry->id = braft::LogId(1, 1);
+    entry->type = braft::ENTRY_TYPE_DATA;
+    std::vector<braft::LogEntry*> entries;
+    entries.push_back(entry);
+    ASSERT_EQ(1u, log_storage->append_entries(entries, NULL));
+    entry->Release();
+    delete log_storage;
+
+    // entries written with the other type are still readable
+    log_storage = braft::LogStorage::create("local://data/log?checksum=crc32c");
+    ASSERT_TRUE(log_storage);
+    ASSERT_EQ(0, log_storage->init(&cm));
+    ASSERT_EQ(1, ((braft::SegmentLogStorage*)log_storage)->_checksum_type);
+    entry = log_storage->get_entry(1);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ("hello world", entry->data.to_string());
+    entry->Release();
+    delete log_storage;
+
+    ASSERT_FALSE(braft::LogStorage::create("local://data/log?checksum=md5"));
+    ASSERT_FALSE(braft::LogStorage::create("local://data/log?foo=bar"));
+}
+
+TEST_F(StorageTest, log_storage_compress_in_uri) {
+    ::system("rm -rf data");
+    braft::ConfigurationManager cm;
+    braft::LogStorage* log_storage =
+            braft::LogStorage::create("local://data/log?compress=snappy");
+    ASSERT_TRUE(log_storage);
+    ASSERT_EQ(0, log_storage->init(&cm));
+    const std::string large_data(64 * 1024, 'a');
+    std::vector<braft::LogEntry*> entries;
+    for (int i = 1; i <= 2; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->data.append(i == 1 ? large_data : "hello world");
+        entry->id = braft::LogId(i, 1);
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entries.push_back(entry);
+    }
+    ASSERT_EQ(2u, log_storage->append_entries(entries, NULL));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+    ASSERT_GT(large_data.size(),
+              (size_t)((braft::SegmentLogStorage*)log_storage)->_open_segment->bytes());
+    delete log_storage;
+
+    // compressed entries are readable whatever the codec of the storage is
+    log_storage = braft::LogStorage::create("local://data/log");
+    ASSERT_TRUE(log_storage);
+    ASSERT_EQ(0, log_storage->init(&cm));
+    braft::LogEntry* entry = log_storage->get_entry(1);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(large_data, entry->data.to_string());
+    entry->Release();
+    entry = log_storage->get_entry(2);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ("hello world", entry->data.to_string());
+    entry->Release();
+    delete log_storage;
+
+    log_storage = braft::LogStorage::create(
+                "local://data/log?checksum=crc32c&compress=zlib");
+    ASSERT_TRUE(log_storage);
+    delete log_storage;
+    ASSERT_FALSE(braft::LogStorage::create("local://data/log?compress=lz4"));
+}